@@ -0,0 +1,137 @@
+// cache contention benchmark: threads hammer cache_acquire() and
+// cache_release() on a shared key set, throughput is reported for every
+// thread count from 1 up to the limit
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_KEYS 64
+#define DEFAULT_OPS 1000000
+#define DEFAULT_MAX_THREADS 32
+#define BUCKETS_AMOUNT 100
+#define KEY_SIZE 128
+// big enough to never evict, so only lookups are measured
+#define CACHE_MAX_BYTES (1UL << 30)
+
+typedef struct {
+  cache_t *cache;
+  char **keys;
+  size_t keys_amount;
+  size_t ops;
+  unsigned int seed;
+} worker_arg_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_routine(void *arg) {
+  worker_arg_t *worker = (worker_arg_t *)arg;
+
+  for (size_t i = 0; i < worker->ops; i++) {
+    char *key = worker->keys[rand_r(&worker->seed) % worker->keys_amount];
+    cache_entry_t *entry = cache_acquire(worker->cache, key, strlen(key));
+    if (!entry) {
+      perror("cache_acquire");
+      return NULL;
+    }
+    cache_release(worker->cache, entry);
+  }
+
+  return NULL;
+}
+
+static double run(size_t threads_amount, char **keys, size_t keys_amount,
+                  size_t ops) {
+  cache_t *cache = cache_create(BUCKETS_AMOUNT, CACHE_MAX_BYTES, 0);
+  if (!cache) {
+    perror("cache_create");
+    exit(1);
+  }
+
+  pthread_t threads[threads_amount];
+  worker_arg_t args[threads_amount];
+
+  double start = now_seconds();
+  for (size_t i = 0; i < threads_amount; i++) {
+    args[i] = (worker_arg_t){cache, keys, keys_amount, ops, (unsigned int)i};
+    pthread_create(&threads[i], NULL, worker_routine, &args[i]);
+  }
+  for (size_t i = 0; i < threads_amount; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  cache_destroy(cache);
+
+  return threads_amount * ops / elapsed;
+}
+
+static void print_usage(const char *prog_name) {
+  printf("Usage: %s [-k KEYS] [-n OPS_PER_THREAD] [-t MAX_THREADS]\n",
+         prog_name);
+}
+
+int main(int argc, char *argv[]) {
+  size_t keys_amount = DEFAULT_KEYS;
+  size_t ops = DEFAULT_OPS;
+  size_t max_threads = DEFAULT_MAX_THREADS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:n:t:h")) != -1) {
+    switch (opt) {
+    case 'k':
+      keys_amount = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      ops = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      max_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!keys_amount || !ops || !max_threads) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  char **keys = malloc(keys_amount * sizeof(char *));
+  for (size_t i = 0; i < keys_amount; i++) {
+    keys[i] = malloc(KEY_SIZE);
+    snprintf(keys[i], KEY_SIZE, "http://example%zu.com/static/object/%zu.js",
+             i % 16, i);
+  }
+
+  printf("keys: %zu, ops per thread: %zu\n", keys_amount, ops);
+  printf("%8s %14s %10s\n", "threads", "ops/s", "speedup");
+
+  double base = 0;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    double throughput = run(threads, keys, keys_amount, ops);
+    if (!base) {
+      base = throughput;
+    }
+    printf("%8zu %14.0f %9.2fx\n", threads, throughput, throughput / base);
+  }
+
+  for (size_t i = 0; i < keys_amount; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+
+  return 0;
+}
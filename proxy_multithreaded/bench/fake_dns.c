@@ -0,0 +1,346 @@
+// fake nameserver for resolver tests: answers A queries over UDP, behavior
+// is chosen by the first label of queried name, so every resolver path can
+// be hit without real DNS:
+//   alias.NAME    CNAME to target.NAME with TTL -t and its A record with
+//                 twice of it, answer is cached for the shorter one
+//   missing.NAME  NXDOMAIN with SOA record of NAME in authority section,
+//                 SOA ttl is -t and its minimum -n
+//   slow.NAME     A record sent after -w milliseconds
+//   silent.NAME   no answer at all
+//   other names   A record
+// e.g. proxy -d 127.0.0.1:5353 fetching http://alias.test:8081/. every
+// query is printed, so cached and coalesced lookups can be counted
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 5353
+#define DEFAULT_TTL 60
+#define DEFAULT_NEGATIVE_TTL 30
+#define DEFAULT_DELAY_MS 500
+#define MAX_HOST_NAME 256
+#define DNS_MAX_PACKET 512
+// room for records appended after question
+#define ANSWER_RESERVE 128
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_AA 0x0400
+#define DNS_FLAG_RD 0x0100
+#define DNS_FLAG_RA 0x0080
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_POINTER 0xc000
+
+typedef struct {
+  struct in_addr addr;
+  uint32_t ttl;
+  uint32_t negative_ttl;
+  int delay_ms;
+} config_t;
+
+// slow answer is sent by its own thread, so other queries aren't held
+typedef struct {
+  int sock;
+  int delay_ms;
+  struct sockaddr_in peer;
+  unsigned char packet[DNS_MAX_PACKET];
+  size_t size;
+} delayed_t;
+
+static void put_u16(unsigned char *data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value & 0xff;
+}
+
+static void put_u32(unsigned char *data, uint32_t value) {
+  put_u16(data, value >> 16);
+  put_u16(data + 2, value & 0xffff);
+}
+
+static uint16_t get_u16(const unsigned char *data) {
+  return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+// decodes question name into dotted name. *first_size receives size of its
+// first label. returns offset after question or -1 if it's malformed
+static ssize_t parse_question(const unsigned char *packet, size_t size,
+                              char *name, size_t *first_size) {
+  size_t offset = DNS_HEADER_SIZE;
+  size_t name_size = 0;
+  *first_size = 0;
+  while (offset < size && packet[offset]) {
+    size_t label_size = packet[offset];
+    // queries carry no compression pointers
+    if (label_size > 63 || offset + 1 + label_size > size ||
+        name_size + label_size + 1 >= MAX_HOST_NAME) {
+      return -1;
+    }
+    if (name_size) {
+      name[name_size++] = '.';
+    } else {
+      *first_size = label_size;
+    }
+    memcpy(name + name_size, packet + offset + 1, label_size);
+    name_size += label_size;
+    offset += 1 + label_size;
+  }
+  name[name_size] = '\0';
+  if (offset + 5 > size) {
+    return -1;
+  }
+  return offset + 5;
+}
+
+static int is_first_label(const char *name, size_t first_size,
+                          const char *label) {
+  return first_size == strlen(label) && !strncasecmp(name, label, first_size);
+}
+
+// appends record header, its data of data_size bytes follows.
+// name is offset of already written name
+static size_t put_record(unsigned char *packet, size_t offset, size_t name,
+                         uint16_t type, uint32_t ttl, uint16_t data_size) {
+  put_u16(packet + offset, DNS_POINTER | name);
+  put_u16(packet + offset + 2, type);
+  put_u16(packet + offset + 4, DNS_CLASS_IN);
+  put_u32(packet + offset + 6, ttl);
+  put_u16(packet + offset + 10, data_size);
+  return offset + 12;
+}
+
+// appends name made of label and already written suffix
+static size_t put_name(unsigned char *packet, size_t offset,
+                       const char *label, size_t suffix) {
+  size_t label_size = strlen(label);
+  packet[offset] = (unsigned char)label_size;
+  memcpy(packet + offset + 1, label, label_size);
+  put_u16(packet + offset + 1 + label_size, DNS_POINTER | suffix);
+  return offset + 1 + label_size + 2;
+}
+
+static size_t put_a(unsigned char *packet, size_t offset, size_t name,
+                    uint32_t ttl, struct in_addr addr) {
+  offset = put_record(packet, offset, name, DNS_TYPE_A, ttl, 4);
+  memcpy(packet + offset, &addr.s_addr, 4);
+  return offset + 4;
+}
+
+static void *delayed_routine(void *arg) {
+  delayed_t *delayed = arg;
+  struct timespec delay = {.tv_sec = delayed->delay_ms / 1000,
+                           .tv_nsec = delayed->delay_ms % 1000 * 1000000L};
+  while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+  }
+  sendto(delayed->sock, delayed->packet, delayed->size, 0,
+         (struct sockaddr *)&delayed->peer, sizeof(delayed->peer));
+  free(delayed);
+  return NULL;
+}
+
+static void send_delayed(int sock, const config_t *config,
+                         const struct sockaddr_in *peer,
+                         const unsigned char *packet, size_t size) {
+  delayed_t *delayed = malloc(sizeof(delayed_t));
+  if (!delayed) {
+    return;
+  }
+  delayed->sock = sock;
+  delayed->delay_ms = config->delay_ms;
+  delayed->peer = *peer;
+  memcpy(delayed->packet, packet, size);
+  delayed->size = size;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, delayed_routine, delayed)) {
+    perror("pthread_create");
+    free(delayed);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// answers one query. returns 0 or -1 if query is malformed
+static int handle_query(int sock, const config_t *config,
+                        const unsigned char *query, size_t query_size,
+                        const struct sockaddr_in *peer) {
+  char name[MAX_HOST_NAME];
+  size_t first_size;
+  ssize_t question_end = parse_question(query, query_size, name, &first_size);
+  if (question_end < 0 || get_u16(query + 4) != 1 ||
+      question_end > DNS_MAX_PACKET - ANSWER_RESERVE) {
+    return -1;
+  }
+
+  unsigned char packet[DNS_MAX_PACKET];
+  memcpy(packet, query, question_end);
+  uint16_t flags = DNS_FLAG_QR | DNS_FLAG_AA | DNS_FLAG_RA |
+                   (get_u16(query + 2) & DNS_FLAG_RD);
+  uint16_t answers = 0;
+  uint16_t authorities = 0;
+  memset(packet + 6, 0, 6);
+
+  // name without its first label
+  size_t question = DNS_HEADER_SIZE;
+  size_t suffix = question + (first_size ? 1 + first_size : 0);
+  size_t offset = question_end;
+  const char *kind;
+  int is_slow = is_first_label(name, first_size, "slow");
+  uint16_t type = get_u16(query + question_end - 4);
+
+  if (is_first_label(name, first_size, "silent")) {
+    printf("silent %s\n", name);
+    fflush(stdout);
+    return 0;
+  } else if (is_first_label(name, first_size, "missing")) {
+    kind = "nxdomain";
+    flags |= DNS_RCODE_NXDOMAIN;
+    // mname and rname names, then 5 counters
+    offset = put_record(packet, offset, suffix, DNS_TYPE_SOA, config->ttl,
+                        (1 + 2 + 2) + (1 + 10 + 2) + 20);
+    offset = put_name(packet, offset, "ns", suffix);
+    offset = put_name(packet, offset, "hostmaster", suffix);
+    put_u32(packet + offset, 1);
+    put_u32(packet + offset + 4, 3600);
+    put_u32(packet + offset + 8, 600);
+    put_u32(packet + offset + 12, 86400);
+    put_u32(packet + offset + 16, config->negative_ttl);
+    offset += 20;
+    authorities = 1;
+  } else if (type != DNS_TYPE_A) {
+    kind = "empty";
+  } else if (is_first_label(name, first_size, "alias")) {
+    kind = "cname";
+    offset = put_record(packet, offset, question, DNS_TYPE_CNAME,
+                        config->ttl, 1 + 6 + 2);
+    size_t target = offset;
+    offset = put_name(packet, offset, "target", suffix);
+    offset = put_a(packet, offset, target, config->ttl * 2, config->addr);
+    answers = 2;
+  } else {
+    kind = is_slow ? "slow" : "a";
+    offset = put_a(packet, offset, question, config->ttl, config->addr);
+    answers = 1;
+  }
+
+  put_u16(packet + 2, flags);
+  put_u16(packet + 6, answers);
+  put_u16(packet + 8, authorities);
+
+  printf("%s %s\n", kind, name);
+  fflush(stdout);
+
+  if (is_slow) {
+    send_delayed(sock, config, peer, packet, offset);
+    return 0;
+  }
+  sendto(sock, packet, offset, 0, (struct sockaddr *)peer, sizeof(*peer));
+  return 0;
+}
+
+static void print_usage(const char *prog_name) {
+  printf("Usage: %s [-p PORT] [-a ADDR] [-t TTL] [-n TTL] [-w DELAY]\n",
+         prog_name);
+  printf("  -p PORT   UDP port to listen on at 127.0.0.1 (default %d)\n",
+         DEFAULT_PORT);
+  printf("  -a ADDR   address of A records (default 127.0.0.1)\n");
+  printf("  -t TTL    TTL of records (default %d)\n", DEFAULT_TTL);
+  printf("  -n TTL    SOA minimum of NXDOMAIN answers (default %d)\n",
+         DEFAULT_NEGATIVE_TTL);
+  printf("  -w DELAY  milliseconds before slow answers are sent (default %d)"
+         "\n",
+         DEFAULT_DELAY_MS);
+}
+
+int main(int argc, char *argv[]) {
+  int port = DEFAULT_PORT;
+  config_t config = {.ttl = DEFAULT_TTL,
+                     .negative_ttl = DEFAULT_NEGATIVE_TTL,
+                     .delay_ms = DEFAULT_DELAY_MS};
+  inet_pton(AF_INET, "127.0.0.1", &config.addr);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:a:t:n:w:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'a':
+      if (inet_pton(AF_INET, optarg, &config.addr) != 1) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 't':
+      config.ttl = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      config.negative_ttl = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      config.delay_ms = atoi(optarg);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (port <= 0 || port > 65535 || config.delay_ms < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(sock);
+    return 1;
+  }
+
+  printf("Fake DNS server listening on port %d\n", port);
+  fflush(stdout);
+
+  while (1) {
+    unsigned char query[DNS_MAX_PACKET];
+    struct sockaddr_in peer;
+    socklen_t peer_size = sizeof(peer);
+    ssize_t n = recvfrom(sock, query, sizeof(query), 0,
+                         (struct sockaddr *)&peer, &peer_size);
+    if (n < 0) {
+      if (errno != EINTR) {
+        perror("recvfrom");
+      }
+      continue;
+    }
+    if (n < DNS_HEADER_SIZE ||
+        handle_query(sock, &config, query, n, &peer) < 0) {
+      printf("malformed query\n");
+      fflush(stdout);
+    }
+  }
+}
@@ -0,0 +1,327 @@
+// cache key benchmark on URL corpus: generated one (CDN assets, API calls,
+// media segments over a few hundred hosts, some of them spelled with
+// uppercase host or explicit :80) or read from -f file, one URL per line.
+// compares legacy byte-by-byte djb2 with hash_bytes() by hashing speed and
+// chain lengths in tables laid out like cache stripes, then measures
+// normalize + cache_acquire() + cache_release() per lookup
+#include "cache.h"
+#include "hash.h"
+#include "http.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_URLS 100000
+#define DEFAULT_LOOKUPS 2000000
+#define HOSTS_AMOUNT 300
+// layout of cache: stripe by low bits, bucket by the next ones
+#define STRIPE_BITS 6
+#define STRIPES_AMOUNT (1 << STRIPE_BITS)
+// chains longer than that are counted together
+#define MAX_CHAIN_BUCKET 6
+// big enough to never evict, so only lookups are measured
+#define CACHE_MAX_BYTES (1UL << 34)
+
+typedef size_t (*hash_fn_t)(const void *data, size_t size);
+
+typedef struct {
+  char **urls;
+  size_t *sizes;
+  size_t amount;
+} corpus_t;
+
+// volatile sink, so compiler doesn't drop hashing results
+static volatile size_t sink;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// hash cache used before hash_bytes()
+static size_t legacy_djb2(const void *data, size_t size) {
+  const unsigned char *key = data;
+  uint64_t hash = 5381;
+  for (size_t i = 0; i < size; i++) {
+    hash = ((hash << 5) + hash) + key[i];
+  }
+  return (size_t)hash;
+}
+
+static int corpus_add(corpus_t *corpus, const char *url, size_t size) {
+  corpus->urls[corpus->amount] = strndup(url, size);
+  if (!corpus->urls[corpus->amount]) {
+    return -1;
+  }
+  corpus->sizes[corpus->amount] = size;
+  corpus->amount++;
+  return 0;
+}
+
+static int corpus_generate(corpus_t *corpus, size_t amount) {
+  static const char *hosts[] = {"www.%s%u.com", "cdn%u.%s.net",
+                                "img.%s%u.org", "api.%s%u.io"};
+  static const char *names[] = {"example", "shop", "news", "media", "video"};
+  unsigned int seed = 42;
+  char url[MAX_URL];
+  char host[MAX_HOST];
+
+  for (size_t i = 0; i < amount; i++) {
+    unsigned int host_id = rand_r(&seed) % HOSTS_AMOUNT;
+    const char *name = names[host_id % 5];
+    if (host_id % 4 == 1) {
+      snprintf(host, sizeof(host), hosts[1], host_id, name);
+    } else {
+      snprintf(host, sizeof(host), hosts[host_id % 4], name, host_id);
+    }
+
+    // every tenth URL names host differently, normalization merges them
+    const char *port = "";
+    if (rand_r(&seed) % 10 == 0) {
+      if (rand_r(&seed) % 2) {
+        host[0] = host[0] - 'a' + 'A';
+      } else {
+        port = ":80";
+      }
+    }
+
+    unsigned int id = rand_r(&seed);
+    switch (rand_r(&seed) % 5) {
+    case 0:
+      snprintf(url, sizeof(url), "http://%s%s/static/js/app.%08x.min.js", host,
+               port, id);
+      break;
+    case 1:
+      snprintf(url, sizeof(url),
+               "http://%s%s/images/%04u/%02u/photo_%u.jpg?w=%u&q=80", host,
+               port, 2015 + id % 10, 1 + id % 12, id % 100000,
+               320 << (id % 4));
+      break;
+    case 2:
+      snprintf(url, sizeof(url),
+               "http://%s%s/api/v2/users/%u/posts?page=%u&limit=20&sort=date",
+               host, port, id % 50000, id % 40);
+      break;
+    case 3:
+      snprintf(url, sizeof(url),
+               "http://%s%s/video/%u/1080p/segment_%05u.ts", host, port,
+               id % 2000, id % 3000);
+      break;
+    default:
+      snprintf(url, sizeof(url),
+               "http://%s%s/wp-content/uploads/%u/%02u/"
+               "summer-collection-%u-%ux%u.png",
+               host, port, 2015 + id % 10, 1 + id % 12, id % 5000,
+               100 * (1 + id % 8), 100 * (1 + id % 6));
+      break;
+    }
+    if (corpus_add(corpus, url, strlen(url)) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int corpus_read(corpus_t *corpus, const char *path, size_t amount) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+
+  char url[MAX_URL];
+  while (corpus->amount < amount && fgets(url, sizeof(url), file)) {
+    size_t size = strcspn(url, "\r\n");
+    if (size && corpus_add(corpus, url, size) < 0) {
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+static double hash_ns(hash_fn_t hash, const corpus_t *corpus,
+                      size_t lookups) {
+  size_t result = 0;
+  double start = now_seconds();
+  for (size_t i = 0; i < lookups; i++) {
+    size_t idx = i % corpus->amount;
+    result += hash(corpus->urls[idx], corpus->sizes[idx]);
+  }
+  double elapsed = now_seconds() - start;
+  sink += result;
+  return elapsed * 1e9 / lookups;
+}
+
+// lays keys out like cache does, every stripe with power-of-two table of
+// about one bucket per key, and prints chain length distribution
+static int print_chains(const char *name, hash_fn_t hash,
+                        const corpus_t *corpus) {
+  size_t stripe_size = 1;
+  while (stripe_size * STRIPES_AMOUNT < corpus->amount) {
+    stripe_size <<= 1;
+  }
+  size_t buckets_amount = stripe_size * STRIPES_AMOUNT;
+  uint32_t *chains = calloc(buckets_amount, sizeof(uint32_t));
+  if (!chains) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < corpus->amount; i++) {
+    size_t h = hash(corpus->urls[i], corpus->sizes[i]);
+    size_t stripe = h & (STRIPES_AMOUNT - 1);
+    size_t bucket = (h >> STRIPE_BITS) & (stripe_size - 1);
+    chains[bucket * STRIPES_AMOUNT + stripe]++;
+  }
+
+  size_t histogram[MAX_CHAIN_BUCKET + 1] = {0};
+  size_t max_chain = 0;
+  // keys compared by successful lookup, summed over all keys
+  double probes = 0;
+  for (size_t i = 0; i < buckets_amount; i++) {
+    size_t chain = chains[i];
+    histogram[chain < MAX_CHAIN_BUCKET ? chain : MAX_CHAIN_BUCKET]++;
+    if (chain > max_chain) {
+      max_chain = chain;
+    }
+    probes += chain * (chain + 1) / 2.0;
+  }
+
+  printf("%-12s", name);
+  for (size_t i = 0; i <= MAX_CHAIN_BUCKET; i++) {
+    printf(" %7.2f%%", 100.0 * histogram[i] / buckets_amount);
+  }
+  printf(" %6zu %8.3f\n", max_chain, probes / corpus->amount);
+
+  free(chains);
+  return 0;
+}
+
+// returns average time of normalize + lookup + release, keys of corpus are
+// visited in random order
+static double lookup_ns(cache_t *cache, const corpus_t *corpus,
+                        size_t lookups) {
+  unsigned int seed = 7;
+  char key[MAX_URL + 1];
+
+  double start = now_seconds();
+  for (size_t i = 0; i < lookups; i++) {
+    size_t idx = rand_r(&seed) % corpus->amount;
+    ssize_t key_size = http_normalize_url(corpus->urls[idx],
+                                          corpus->sizes[idx], key, sizeof(key));
+    cache_entry_t *entry =
+        key_size < 0 ? NULL : cache_acquire(cache, key, key_size);
+    if (!entry) {
+      perror("cache_acquire");
+      exit(1);
+    }
+    cache_release(cache, entry);
+  }
+  return (now_seconds() - start) * 1e9 / lookups;
+}
+
+static void print_usage(const char *prog_name) {
+  printf("Usage: %s [-n URLS] [-f FILE] [-l LOOKUPS]\n", prog_name);
+}
+
+int main(int argc, char *argv[]) {
+  size_t amount = DEFAULT_URLS;
+  size_t lookups = DEFAULT_LOOKUPS;
+  const char *path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:f:l:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      amount = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      path = optarg;
+      break;
+    case 'l':
+      lookups = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!amount || !lookups) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  corpus_t corpus = {0};
+  corpus.urls = malloc(amount * sizeof(char *));
+  corpus.sizes = malloc(amount * sizeof(size_t));
+  if (!corpus.urls || !corpus.sizes) {
+    perror("malloc");
+    return 1;
+  }
+  if ((path ? corpus_read(&corpus, path, amount)
+            : corpus_generate(&corpus, amount)) < 0) {
+    perror(path ? path : "corpus_generate");
+    return 1;
+  }
+  if (!corpus.amount) {
+    fprintf(stderr, "corpus is empty\n");
+    return 1;
+  }
+
+  size_t total_size = 0;
+  for (size_t i = 0; i < corpus.amount; i++) {
+    total_size += corpus.sizes[i];
+  }
+  printf("%zu urls, %.1f bytes on average\n", corpus.amount,
+         (double)total_size / corpus.amount);
+
+  double legacy = hash_ns(legacy_djb2, &corpus, lookups);
+  printf("%-12s %8.2f ns/hash\n", "legacy djb2", legacy);
+  double current = hash_ns(hash_bytes, &corpus, lookups);
+  printf("%-12s %8.2f ns/hash  x%.2f\n", "hash_bytes", current,
+         legacy / current);
+
+  printf("\nchains of %d stripes, share of buckets by chain length\n",
+         STRIPES_AMOUNT);
+  printf("%-12s", "");
+  for (size_t i = 0; i < MAX_CHAIN_BUCKET; i++) {
+    printf(" %8zu", i);
+  }
+  printf(" %7d+ %6s %8s\n", MAX_CHAIN_BUCKET, "max", "probes");
+  if (print_chains("legacy djb2", legacy_djb2, &corpus) < 0 ||
+      print_chains("hash_bytes", hash_bytes, &corpus) < 0) {
+    perror("print_chains");
+    return 1;
+  }
+
+  cache_t *cache = cache_create(corpus.amount, CACHE_MAX_BYTES, 0);
+  if (!cache) {
+    perror("cache_create");
+    return 1;
+  }
+  // the first pass creates entries, the second one only finds them
+  lookup_ns(cache, &corpus, corpus.amount);
+  double lookup = lookup_ns(cache, &corpus, lookups);
+
+  cache_stats_t stats;
+  cache_get_stats(cache, &stats);
+  printf("\n%zu distinct keys after normalization\n", stats.entries);
+  printf("normalize + lookup + release %8.2f ns/op\n", lookup);
+
+  cache_destroy(cache);
+  for (size_t i = 0; i < corpus.amount; i++) {
+    free(corpus.urls[i]);
+  }
+  free(corpus.urls);
+  free(corpus.sizes);
+  return 0;
+}
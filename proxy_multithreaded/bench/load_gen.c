@@ -0,0 +1,640 @@
+// HTTP load generator: keeps -c keep-alive connections to proxy, one thread
+// each, and sends GET requests for objects of origin_server through it.
+// object keys are drawn uniformly or from Zipf distribution, -m share of
+// requests goes to objects nobody asked before, so hit ratio is controlled.
+// reports throughput and p50/p99/p999 latency of whole responses. with -M
+// it also reads proxy /metrics before and after run and reports syscalls
+// proxy made per request, which compares its engines
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PROXY "127.0.0.1:8080"
+#define DEFAULT_ORIGIN "127.0.0.1:8081"
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_REQUESTS 100000
+#define DEFAULT_KEYS 10000
+#define DEFAULT_SIZE 16384
+#define RESPONSE_BUFFER_SIZE 65536
+#define MAX_REQUEST_SIZE 512
+#define MAX_ADDRESS 256
+#define RECONNECT_DELAY_US 10000
+// response not finished in time is counted as error instead of hanging run
+#define RESPONSE_TIMEOUT_S 10
+#define METRICS_BUFFER_SIZE 65536
+
+typedef struct {
+  struct sockaddr_in proxy_addr;
+  char origin[MAX_ADDRESS];
+  size_t connections;
+  // requests left to send, or duration if deadline is set
+  atomic_long requests_left;
+  double deadline;
+  size_t keys;
+  // cumulative Zipf distribution over keys, NULL for uniform one
+  double *zipf_cdf;
+  size_t min_size;
+  size_t max_size;
+  double miss_ratio;
+  // makes keys of missed objects unique between runs
+  unsigned long run_id;
+} config_t;
+
+typedef struct {
+  config_t *config;
+  size_t id;
+  unsigned int seed;
+  // latencies of successful responses in nanoseconds
+  uint64_t *latencies;
+  size_t latencies_amount;
+  size_t latencies_capacity;
+  size_t bytes;
+  size_t errors;
+  size_t bad_statuses;
+  size_t reconnects;
+  size_t unique_keys;
+} worker_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double random_unit(unsigned int *seed) {
+  return rand_r(seed) / ((double)RAND_MAX + 1);
+}
+
+// "HOST:PORT" to address, HOST must be IPv4 address
+static int parse_address(const char *text, struct sockaddr_in *addr) {
+  char host[MAX_ADDRESS];
+  const char *colon = strrchr(text, ':');
+  if (!colon || (size_t)(colon - text) >= sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, text, colon - text);
+  host[colon - text] = '\0';
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(atoi(colon + 1));
+  return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+// cumulative distribution of Zipf law with given exponent over keys
+static double *zipf_create(size_t keys, double exponent) {
+  double *cdf = malloc(keys * sizeof(double));
+  if (!cdf) {
+    return NULL;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < keys; i++) {
+    sum += 1.0 / pow(i + 1, exponent);
+    cdf[i] = sum;
+  }
+  for (size_t i = 0; i < keys; i++) {
+    cdf[i] /= sum;
+  }
+  return cdf;
+}
+
+static size_t zipf_sample(const double *cdf, size_t keys, unsigned int *seed) {
+  double u = random_unit(seed);
+  size_t low = 0;
+  size_t high = keys - 1;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (cdf[mid] < u) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// size of object is fixed by its key, so cached and fresh copies match
+static size_t key_size(const config_t *config, size_t key) {
+  if (config->max_size == config->min_size) {
+    return config->min_size;
+  }
+  uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+  return config->min_size +
+         (hash >> 16) % (config->max_size - config->min_size + 1);
+}
+
+static int format_request(worker_t *worker, char *request, size_t size) {
+  config_t *config = worker->config;
+
+  if (config->miss_ratio > 0 &&
+      random_unit(&worker->seed) < config->miss_ratio) {
+    size_t n = worker->unique_keys++;
+    return snprintf(request, size,
+                    "GET http://%s/miss/%lx-%zu-%zu?size=%zu HTTP/1.1\r\n"
+                    "Host: %s\r\n\r\n",
+                    config->origin, config->run_id, worker->id, n,
+                    key_size(config, n), config->origin);
+  }
+
+  size_t key = config->zipf_cdf
+                   ? zipf_sample(config->zipf_cdf, config->keys, &worker->seed)
+                   : (size_t)rand_r(&worker->seed) % config->keys;
+  return snprintf(request, size,
+                  "GET http://%s/obj/%zu?size=%zu HTTP/1.1\r\n"
+                  "Host: %s\r\n\r\n",
+                  config->origin, key, key_size(config, key), config->origin);
+}
+
+static int connect_proxy(const config_t *config) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)&config->proxy_addr,
+              sizeof(config->proxy_addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  struct timeval timeout = {.tv_sec = RESPONSE_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// finds value of header in block, NULL if there is none
+static const char *find_header(const char *headers, const char *name) {
+  size_t name_size = strlen(name);
+  const char *line = strstr(headers, "\r\n");
+  while (line && line[2] != '\r') {
+    line += 2;
+    if (!strncasecmp(line, name, name_size) && line[name_size] == ':') {
+      return line + name_size + 1;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+// reads one response. returns its status and size, sets is_close if
+// connection can't be reused. -1 if connection broke, -2 if it was closed
+// before response started (kept-alive connection closed by proxy)
+static int read_response(int fd, char *buffer, size_t *size, int *is_close) {
+  size_t used = 0;
+  char *headers_end = NULL;
+  while (!headers_end) {
+    if (used == RESPONSE_BUFFER_SIZE - 1) {
+      return -1;
+    }
+    ssize_t n = recv(fd, buffer + used, RESPONSE_BUFFER_SIZE - 1 - used, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return !used && (!n || errno == ECONNRESET) ? -2 : -1;
+    }
+    used += n;
+    buffer[used] = '\0';
+    headers_end = strstr(buffer, "\r\n\r\n");
+  }
+
+  int status = 0;
+  if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) {
+    return -1;
+  }
+  *headers_end = '\0';
+  size_t headers_size = headers_end + 4 - buffer;
+
+  const char *connection = find_header(buffer, "Connection");
+  *is_close = !strncmp(buffer, "HTTP/1.0", strlen("HTTP/1.0")) ||
+              (connection && strstr(connection, "close"));
+
+  const char *length = find_header(buffer, "Content-Length");
+  if (!length) {
+    // body ends with connection
+    *is_close = 1;
+    size_t body = used - headers_size;
+    ssize_t n;
+    while ((n = recv(fd, buffer, RESPONSE_BUFFER_SIZE, 0)) > 0) {
+      body += n;
+    }
+    *size = headers_size + body;
+    return status;
+  }
+
+  size_t body_size = strtoull(length, NULL, 10);
+  size_t received = used - headers_size;
+  while (received < body_size) {
+    size_t want = body_size - received;
+    ssize_t n = recv(fd, buffer,
+                     want < RESPONSE_BUFFER_SIZE ? want : RESPONSE_BUFFER_SIZE,
+                     0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    received += n;
+  }
+  *size = headers_size + body_size;
+  return status;
+}
+
+static int record_latency(worker_t *worker, uint64_t latency) {
+  if (worker->latencies_amount == worker->latencies_capacity) {
+    size_t capacity =
+        worker->latencies_capacity ? worker->latencies_capacity * 2 : 4096;
+    uint64_t *latencies =
+        realloc(worker->latencies, capacity * sizeof(uint64_t));
+    if (!latencies) {
+      return -1;
+    }
+    worker->latencies = latencies;
+    worker->latencies_capacity = capacity;
+  }
+  worker->latencies[worker->latencies_amount++] = latency;
+  return 0;
+}
+
+// takes next request, returns 0 when run is over
+static int take_request(config_t *config) {
+  if (config->deadline > 0) {
+    return now_seconds() < config->deadline;
+  }
+  return atomic_fetch_sub(&config->requests_left, 1) > 0;
+}
+
+static void *worker_routine(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  config_t *config = worker->config;
+
+  char *buffer = malloc(RESPONSE_BUFFER_SIZE);
+  if (!buffer) {
+    perror("malloc");
+    return NULL;
+  }
+
+  int fd = -1;
+  int is_reused = 0;
+  while (take_request(config)) {
+    if (fd < 0) {
+      fd = connect_proxy(config);
+      if (fd < 0) {
+        worker->errors++;
+        usleep(RECONNECT_DELAY_US);
+        continue;
+      }
+      worker->reconnects++;
+      is_reused = 0;
+    }
+
+    char request[MAX_REQUEST_SIZE];
+    int request_size = format_request(worker, request, sizeof(request));
+
+    uint64_t start = now_ns();
+    size_t size = 0;
+    int is_close = 0;
+    int status = -1;
+    if (send_all(fd, request, request_size) == 0) {
+      status = read_response(fd, buffer, &size, &is_close);
+    }
+    uint64_t latency = now_ns() - start;
+
+    // proxy may close idle kept-alive connection any time, request is
+    // repeated on new one
+    if (status == -2 && is_reused) {
+      close(fd);
+      fd = -1;
+      atomic_fetch_add(&config->requests_left, 1);
+      continue;
+    }
+    if (status < 0) {
+      worker->errors++;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    if (status != 200) {
+      worker->bad_statuses++;
+    } else {
+      worker->bytes += size;
+      record_latency(worker, latency);
+    }
+    if (is_close) {
+      close(fd);
+      fd = -1;
+    }
+    is_reused = 1;
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buffer);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_ms(const uint64_t *sorted, size_t amount,
+                            double percentile) {
+  if (!amount) {
+    return 0;
+  }
+  size_t idx = (size_t)(percentile / 100 * amount);
+  if (idx >= amount) {
+    idx = amount - 1;
+  }
+  return sorted[idx] / 1e6;
+}
+
+// "SIZE" or "MIN-MAX"
+static int parse_sizes(const char *text, size_t *min_size, size_t *max_size) {
+  char *end;
+  *min_size = strtoul(text, &end, 10);
+  *max_size = *min_size;
+  if (*end == '-') {
+    *max_size = strtoul(end + 1, &end, 10);
+  }
+  return *end || *max_size < *min_size ? -1 : 0;
+}
+
+// reads counters of proxy /metrics endpoint. returns 0 on success, -1 on
+// error
+static int scrape_metrics(const struct sockaddr_in *addr, double *syscalls,
+                          double *requests) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+  char *buffer = malloc(METRICS_BUFFER_SIZE);
+  if (!buffer || send_all(fd, request, strlen(request)) < 0) {
+    free(buffer);
+    close(fd);
+    return -1;
+  }
+
+  size_t size = 0;
+  ssize_t n;
+  while (size < METRICS_BUFFER_SIZE - 1 &&
+         (n = recv(fd, buffer + size, METRICS_BUFFER_SIZE - 1 - size, 0)) > 0) {
+    size += n;
+  }
+  buffer[size] = '\0';
+  close(fd);
+
+  const char *syscalls_line = strstr(buffer, "\nproxy_client_syscalls_total ");
+  const char *requests_line = strstr(buffer, "\nproxy_requests_total ");
+  if (!syscalls_line || !requests_line) {
+    free(buffer);
+    return -1;
+  }
+  *syscalls = strtod(strchr(syscalls_line + 1, ' '), NULL);
+  *requests = strtod(strchr(requests_line + 1, ' '), NULL);
+  free(buffer);
+  return 0;
+}
+
+static void print_usage(const char *prog_name) {
+  printf("Usage: %s [options]\n", prog_name);
+  printf("  -x HOST:PORT  proxy to load (default %s)\n", DEFAULT_PROXY);
+  printf("  -o HOST:PORT  origin put into request URLs (default %s)\n",
+         DEFAULT_ORIGIN);
+  printf("  -c CONNS      concurrent keep-alive connections (default %d)\n",
+         DEFAULT_CONNECTIONS);
+  printf("  -n REQUESTS   requests to send (default %d)\n", DEFAULT_REQUESTS);
+  printf("  -d SECONDS    run for that long instead of -n requests\n");
+  printf("  -k KEYS       amount of distinct objects (default %d)\n",
+         DEFAULT_KEYS);
+  printf("  -z EXPONENT   Zipf exponent of key popularity, 0 is uniform "
+         "(default 0)\n");
+  printf("  -s SIZE[-MAX] object size or range of sizes (default %d)\n",
+         DEFAULT_SIZE);
+  printf("  -m RATIO      share of requests for never requested objects, "
+         "they always miss (default 0)\n");
+  printf("  -M HOST:PORT  proxy metrics endpoint, reports proxy syscalls per "
+         "request\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *proxy = DEFAULT_PROXY;
+  const char *origin = DEFAULT_ORIGIN;
+  size_t connections = DEFAULT_CONNECTIONS;
+  long requests = DEFAULT_REQUESTS;
+  double duration = 0;
+  size_t keys = DEFAULT_KEYS;
+  double exponent = 0;
+  size_t min_size = DEFAULT_SIZE;
+  size_t max_size = DEFAULT_SIZE;
+  double miss_ratio = 0;
+  const char *metrics = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "x:o:c:n:d:k:z:s:m:M:h")) != -1) {
+    switch (opt) {
+    case 'x':
+      proxy = optarg;
+      break;
+    case 'o':
+      origin = optarg;
+      break;
+    case 'c':
+      connections = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      requests = strtol(optarg, NULL, 10);
+      break;
+    case 'd':
+      duration = strtod(optarg, NULL);
+      break;
+    case 'k':
+      keys = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      exponent = strtod(optarg, NULL);
+      break;
+    case 's':
+      if (parse_sizes(optarg, &min_size, &max_size) < 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      miss_ratio = strtod(optarg, NULL);
+      break;
+    case 'M':
+      metrics = optarg;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  config_t config = {0};
+  struct sockaddr_in metrics_addr;
+  if ((metrics && parse_address(metrics, &metrics_addr) < 0) ||
+      parse_address(proxy, &config.proxy_addr) < 0 ||
+      strlen(origin) >= sizeof(config.origin) || !connections ||
+      requests <= 0 || duration < 0 || !keys || exponent < 0 ||
+      miss_ratio < 0 || miss_ratio > 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  strcpy(config.origin, origin);
+  config.connections = connections;
+  config.requests_left = requests;
+  config.keys = keys;
+  config.min_size = min_size;
+  config.max_size = max_size;
+  config.miss_ratio = miss_ratio;
+  config.run_id = (unsigned long)time(NULL) ^ (unsigned long)getpid() << 32;
+  if (exponent > 0) {
+    config.zipf_cdf = zipf_create(keys, exponent);
+    if (!config.zipf_cdf) {
+      perror("zipf_create");
+      return 1;
+    }
+  }
+
+  worker_t *workers = calloc(connections, sizeof(worker_t));
+  pthread_t *threads = calloc(connections, sizeof(pthread_t));
+  if (!workers || !threads) {
+    perror("calloc");
+    return 1;
+  }
+
+  printf("%zu connections to %s, %zu keys %s, sizes %zu-%zu, miss ratio "
+         "%.2f\n",
+         connections, proxy, keys, exponent > 0 ? "zipf" : "uniform", min_size,
+         max_size, miss_ratio);
+
+  double syscalls_before = 0, requests_before = 0;
+  if (metrics &&
+      scrape_metrics(&metrics_addr, &syscalls_before, &requests_before) < 0) {
+    fprintf(stderr, "can't read metrics from %s\n", metrics);
+    metrics = NULL;
+  }
+
+  double start = now_seconds();
+  if (duration > 0) {
+    config.deadline = start + duration;
+  }
+
+  size_t started = 0;
+  for (; started < connections; started++) {
+    workers[started].config = &config;
+    workers[started].id = started;
+    workers[started].seed = (unsigned int)(config.run_id + started * 7919);
+    if (pthread_create(&threads[started], NULL, worker_routine,
+                       &workers[started])) {
+      perror("pthread_create");
+      break;
+    }
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  size_t responses = 0, bytes = 0, errors = 0, bad_statuses = 0,
+         reconnects = 0;
+  for (size_t i = 0; i < started; i++) {
+    responses += workers[i].latencies_amount;
+    bytes += workers[i].bytes;
+    errors += workers[i].errors;
+    bad_statuses += workers[i].bad_statuses;
+    reconnects += workers[i].reconnects;
+  }
+
+  uint64_t *latencies = malloc((responses ? responses : 1) * sizeof(uint64_t));
+  if (!latencies) {
+    perror("malloc");
+    return 1;
+  }
+  size_t amount = 0;
+  for (size_t i = 0; i < started; i++) {
+    memcpy(latencies + amount, workers[i].latencies,
+           workers[i].latencies_amount * sizeof(uint64_t));
+    amount += workers[i].latencies_amount;
+    free(workers[i].latencies);
+  }
+  qsort(latencies, amount, sizeof(uint64_t), compare_u64);
+
+  printf("%zu responses in %.2fs, %.0f req/s, %.1f MB/s\n", responses, elapsed,
+         responses / elapsed, bytes / elapsed / (1 << 20));
+  printf("%zu errors, %zu non-200 responses, %zu connections opened\n", errors,
+         bad_statuses, reconnects);
+  printf("latency p50 %.3fms p99 %.3fms p999 %.3fms max %.3fms\n",
+         percentile_ms(latencies, amount, 50),
+         percentile_ms(latencies, amount, 99),
+         percentile_ms(latencies, amount, 99.9),
+         amount ? latencies[amount - 1] / 1e6 : 0.0);
+
+  double syscalls_after, requests_after;
+  if (metrics) {
+    if (scrape_metrics(&metrics_addr, &syscalls_after, &requests_after) < 0) {
+      fprintf(stderr, "can't read metrics from %s\n", metrics);
+    } else if (requests_after > requests_before) {
+      printf("proxy syscalls %.0f, %.2f per request\n",
+             syscalls_after - syscalls_before,
+             (syscalls_after - syscalls_before) /
+                 (requests_after - requests_before));
+    }
+  }
+
+  free(latencies);
+  free(config.zipf_cdf);
+  free(workers);
+  free(threads);
+  return 0;
+}
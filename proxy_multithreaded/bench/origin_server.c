@@ -0,0 +1,226 @@
+// static origin stand-in for benchmarks: answers every GET with generated
+// body of requested size, so proxy can be measured without real servers.
+// object size comes from "size" query parameter, e.g. /obj/42?size=65536,
+// default size is set with -s. responses are keep-alive with Content-Length
+// and cacheable for -a seconds. one thread per connection
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 8081
+#define DEFAULT_SIZE 16384
+#define DEFAULT_MAX_AGE 3600
+#define REQUEST_BUFFER_SIZE 16384
+#define BODY_PATTERN_SIZE 65536
+
+typedef struct {
+  int fd;
+  size_t default_size;
+  int max_age;
+} client_arg_t;
+
+static char body_pattern[BODY_PATTERN_SIZE];
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// returns size of object requested by request line
+static size_t requested_size(const char *request, size_t default_size) {
+  const char *line_end = strstr(request, "\r\n");
+  const char *size = strstr(request, "size=");
+  if (!size || (line_end && size > line_end)) {
+    return default_size;
+  }
+  return strtoul(size + strlen("size="), NULL, 10);
+}
+
+static int wants_close(const char *request, size_t request_size) {
+  return memmem(request, request_size, "Connection: close",
+                strlen("Connection: close")) ||
+         memmem(request, request_size, "HTTP/1.0", strlen("HTTP/1.0"));
+}
+
+static int send_response(int fd, size_t size, int max_age, int is_close) {
+  char headers[256];
+  int headers_size =
+      snprintf(headers, sizeof(headers),
+               "HTTP/1.1 200 OK\r\n"
+               "Content-Type: application/octet-stream\r\n"
+               "Content-Length: %zu\r\n"
+               "Cache-Control: max-age=%d\r\n"
+               "Connection: %s\r\n"
+               "\r\n",
+               size, max_age, is_close ? "close" : "keep-alive");
+  if (send_all(fd, headers, headers_size) < 0) {
+    return -1;
+  }
+
+  while (size) {
+    size_t n = size < sizeof(body_pattern) ? size : sizeof(body_pattern);
+    if (send_all(fd, body_pattern, n) < 0) {
+      return -1;
+    }
+    size -= n;
+  }
+  return 0;
+}
+
+static void *client_routine(void *arg) {
+  client_arg_t client = *(client_arg_t *)arg;
+  free(arg);
+
+  char buffer[REQUEST_BUFFER_SIZE];
+  size_t used = 0;
+
+  while (1) {
+    char *end = memmem(buffer, used, "\r\n\r\n", 4);
+    if (!end) {
+      if (used == sizeof(buffer) - 1) {
+        break;
+      }
+      ssize_t n = recv(client.fd, buffer + used, sizeof(buffer) - 1 - used, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      used += n;
+      continue;
+    }
+
+    size_t request_size = end + 4 - buffer;
+    buffer[used] = '\0';
+    int is_close = wants_close(buffer, request_size);
+    size_t size = requested_size(buffer, client.default_size);
+    if (send_response(client.fd, size, client.max_age, is_close) < 0 ||
+        is_close) {
+      break;
+    }
+
+    used -= request_size;
+    memmove(buffer, buffer + request_size, used);
+  }
+
+  close(client.fd);
+  return NULL;
+}
+
+static void print_usage(const char *prog_name) {
+  printf("Usage: %s [-p PORT] [-s SIZE] [-a MAX_AGE]\n", prog_name);
+  printf("  -p PORT     port to listen on (default %d)\n", DEFAULT_PORT);
+  printf("  -s SIZE     body size when request has no size= parameter "
+         "(default %d)\n",
+         DEFAULT_SIZE);
+  printf("  -a MAX_AGE  Cache-Control max-age of responses (default %d)\n",
+         DEFAULT_MAX_AGE);
+}
+
+int main(int argc, char *argv[]) {
+  int port = DEFAULT_PORT;
+  size_t default_size = DEFAULT_SIZE;
+  int max_age = DEFAULT_MAX_AGE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:s:a:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 's':
+      default_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'a':
+      max_age = atoi(optarg);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (port <= 0 || port > 65535) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(body_pattern); i++) {
+    body_pattern[i] = 'a' + i % 26;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, SOMAXCONN) < 0) {
+    perror("bind/listen");
+    close(sock);
+    return 1;
+  }
+
+  printf("Origin server listening on port %d\n", port);
+  fflush(stdout);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while (1) {
+    int client_fd = accept(sock, NULL, NULL);
+    if (client_fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("accept");
+      }
+      continue;
+    }
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    client_arg_t *client = malloc(sizeof(client_arg_t));
+    if (!client) {
+      close(client_fd);
+      continue;
+    }
+    client->fd = client_fd;
+    client->default_size = default_size;
+    client->max_age = max_age;
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, client_routine, client)) {
+      perror("pthread_create");
+      close(client_fd);
+      free(client);
+    }
+  }
+}
@@ -0,0 +1,172 @@
+// request parser benchmark: parses typical browser request with the old
+// copying parser (request line copied into stack arrays, headers searched
+// with http_find_header()) and with incremental http_request_parse(), both
+// on the whole request and fed in small pieces like partial reads
+#include "http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_REQUESTS 1000000
+#define PARTIAL_READ_SIZE 64
+
+static const char request_text[] =
+    "GET http://example.com/static/js/app.min.js?v=20240101 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+    "Firefox/120.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://example.com/index.html\r\n"
+    "Cookie: session=4f2a9c1e7b3d; theme=dark; tracking=off\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "If-None-Match: \"5e1b-62a1f0c3\"\r\n"
+    "Range: bytes=0-1023\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n";
+
+// volatile sink, so compiler doesn't drop parsing results
+static volatile size_t sink;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// parser the proxy used before http_request_parse()
+static int legacy_parse_http_request(const char *buffer, char *method,
+                                     char *url, char *version) {
+  const char *space1 = strchr(buffer, ' ');
+  if (!space1)
+    return -1;
+
+  size_t method_len = space1 - buffer;
+  if (method_len >= MAX_METHOD)
+    return -1;
+  memcpy(method, buffer, method_len);
+  method[method_len] = '\0';
+
+  const char *space2 = strchr(space1 + 1, ' ');
+  if (!space2)
+    return -1;
+
+  size_t url_len = space2 - (space1 + 1);
+  if (url_len >= MAX_URL)
+    return -1;
+  memcpy(url, space1 + 1, url_len);
+  url[url_len] = '\0';
+
+  const char *end = strstr(space2 + 1, "\r\n");
+  if (!end)
+    end = strchr(space2 + 1, '\n');
+  if (!end)
+    return -1;
+
+  size_t version_len = end - (space2 + 1);
+  if (version_len >= MAX_VERSION)
+    return -1;
+  memcpy(version, space2 + 1, version_len);
+  version[version_len] = '\0';
+
+  return 0;
+}
+
+static double run_legacy(const char *buffer, size_t size, size_t requests) {
+  static const char *headers[] = {"Host", "Range", "Cache-Control",
+                                  "If-None-Match", "Connection",
+                                  "Proxy-Connection"};
+
+  double start = now_seconds();
+  for (size_t i = 0; i < requests; i++) {
+    if (!strstr(buffer, "\r\n\r\n")) {
+      exit(1);
+    }
+
+    char method[MAX_METHOD], url[MAX_URL], version[MAX_VERSION];
+    if (legacy_parse_http_request(buffer, method, url, version) < 0) {
+      exit(1);
+    }
+    sink += strlen(url);
+
+    for (size_t j = 0; j < sizeof(headers) / sizeof(headers[0]); j++) {
+      size_t value_size = 0;
+      http_find_header(buffer, size, headers[j], &value_size);
+      sink += value_size;
+    }
+  }
+  return requests / (now_seconds() - start);
+}
+
+static double run_incremental(const char *buffer, size_t size,
+                              size_t requests, size_t read_size) {
+  double start = now_seconds();
+  for (size_t i = 0; i < requests; i++) {
+    http_request_t request;
+    http_request_init(&request);
+
+    int result = 0;
+    for (size_t received = 0; !result && received < size;) {
+      received += read_size;
+      if (received > size) {
+        received = size;
+      }
+      result = http_request_parse(&request, buffer, received);
+    }
+    if (result != 1) {
+      exit(1);
+    }
+    sink += request.url.size + request.host.size + request.range.size +
+            request.cache_control.size + request.if_none_match.size;
+  }
+  return requests / (now_seconds() - start);
+}
+
+static void print_usage(const char *prog_name) {
+  printf("Usage: %s [-n REQUESTS]\n", prog_name);
+}
+
+int main(int argc, char *argv[]) {
+  size_t requests = DEFAULT_REQUESTS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      requests = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!requests) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  size_t size = sizeof(request_text) - 1;
+  printf("%zu requests of %zu bytes\n", requests, size);
+
+  double legacy = run_legacy(request_text, size, requests);
+  printf("%-28s %12.0f req/s\n", "legacy copying parser", legacy);
+
+  double whole = run_incremental(request_text, size, requests, size);
+  printf("%-28s %12.0f req/s  x%.2f\n", "http_request_parse", whole,
+         whole / legacy);
+
+  double partial =
+      run_incremental(request_text, size, requests, PARTIAL_READ_SIZE);
+  printf("%-28s %12.0f req/s  x%.2f\n",
+         "http_request_parse, 64B reads", partial, partial / legacy);
+
+  return 0;
+}
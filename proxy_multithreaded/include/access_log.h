@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// access log: every thread queues binary records of finished requests into
+// its own ring, writer thread drains rings, formats records and writes them
+// to log file in batches. queuing takes no locks and never blocks: when ring
+// is full, record is dropped and counted
+
+// url longer than that is truncated, record takes 256 bytes
+#define ACCESS_LOG_MAX_URL 224
+
+typedef struct {
+  // wall clock time when request was finished, in nanoseconds
+  uint64_t time_ns;
+  uint64_t duration_ns;
+  // bytes sent to client
+  uint64_t bytes;
+  // status of response, 0 if it isn't known (client left before origin
+  // answered)
+  uint32_t status;
+  // size of the whole url, only ACCESS_LOG_MAX_URL bytes of it are kept
+  uint32_t url_size;
+  char url[ACCESS_LOG_MAX_URL];
+} access_log_record_t;
+
+typedef struct {
+  size_t written;
+  size_t dropped;
+} access_log_stats_t;
+
+// opens log file at path ("-" is stdout) for appending and starts writer.
+// log isn't started by default, then access_log_write() does nothing.
+// returns 0 on success, -1 on error
+int access_log_start(const char *path);
+
+// writes out queued records, stops writer and closes log file. threads which
+// wrote to log must be finished
+void access_log_stop(void);
+
+// queues record of request which started at start_ns (metrics_now()) and is
+// finished now. url doesn't have to be null-terminated and may be NULL if
+// request wasn't parsed
+void access_log_write(const char *url, size_t url_size, int status,
+                      size_t bytes, uint64_t start_ns);
+
+// collects log counters
+void access_log_get_stats(access_log_stats_t *stats);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "proxy.h"
+
+#include <stdio.h>
+
+// admin endpoint thread: answers GET /metrics on proxy->admin_fd with proxy
+// metrics in Prometheus text format, one request per connection, till proxy
+// is stopped. arg is proxy
+void *admin_routine(void *arg);
+
+// writes metrics of proxy and its parts in Prometheus text format. returns 0
+// on success, -1 on error
+int admin_write_metrics(proxy_t *proxy, FILE *out);
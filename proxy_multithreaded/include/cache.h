@@ -3,6 +3,9 @@
 #define _GNU_SOURCE
 #include <pthread.h>
 #include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 typedef enum {
   REQUIRED,
@@ -11,38 +14,313 @@ typedef enum {
   ERROR,
 } cache_state_t;
 
+// waiter is notified on every state change of the entry it watches.
+// notify() is called with entry->lock held, so it must not block or touch
+// the entry.
+typedef struct cache_waiter {
+  void (*notify)(struct cache_waiter *waiter);
+  struct cache_waiter *prev;
+  struct cache_waiter *next;
+} cache_waiter_t;
+
+// client sending entry data. while entry is being loaded, its readers are
+// registered in it, so data all of them have sent can be dropped once entry
+// is streamed through instead of cached
+typedef struct cache_reader {
+  // bytes of entry data reader has sent
+  atomic_size_t offset;
+  int is_joined;
+  struct cache_reader *prev;
+  struct cache_reader *next;
+} cache_reader_t;
+
 typedef struct cache_entry {
   char *key;
-  char *data;
+  size_t key_size;
+  // full hash of key, chains are walked comparing hashes and sizes before
+  // keys
+  size_t hash;
+  // data in memory: chunks[i] holds chunk_size(dropped_chunks + i) bytes.
+  // chunks are never moved or rewritten below data_size, so they are sent
+  // without entry->lock
+  char **chunks;
+  // chunks allocated so far, dropped ones included
+  size_t chunks_amount;
+  size_t chunks_capacity;
   size_t data_size;
+  // bytes allocated for data: chunks or pages of memfd
   size_t data_capacity;
+  // readers sending straight from chunks, data isn't moved to memfd while
+  // there are any
+  atomic_size_t senders;
+  // memfd holding data once entry outgrew cache->memfd_threshold, -1 while
+  // data is in memory. it's set once and stays till entry is freed
+  int fd;
   cache_state_t state;
+  // size of response header block at the start of data, set by loader
+  // together with is_persistent before header block is appended
+  size_t header_size;
+  // status code of response, set together with header_size
+  int status;
+  // response end is known without closing connection (Content-Length,
+  // chunked or no body), so client connection can be kept alive after it
+  int is_persistent;
+  // wall clock time when DONE entry stops being fresh, set by loader with
+  // header_size. stale entry is replaced on the next lookup
+  time_t expires_at;
+  // stale entry this one revalidates, held till entry is finished
+  struct cache_entry *stale;
+  // entry was taken out of table (replaced or uncacheable) and is freed by
+  // its last release
+  atomic_int is_unlinked;
+  // entry was unlinked while loading (too large, uncacheable or not
+  // admitted): it only passes data from origin to its readers. data every
+  // reader has sent is dropped and loader doesn't run far ahead of the
+  // slowest reader
+  atomic_int is_streamed;
+  // entry wasn't admitted and is in rejected list of its stripe till it's
+  // finished, unlinked or released the last time. changed under stripe lock
+  atomic_int is_rejected;
+  // data below dropped_size is freed: dropped_chunks first chunks, which are
+  // taken out of chunks table, or punched pages of memfd
+  size_t dropped_size;
+  size_t dropped_chunks;
+  cache_reader_t *readers;
+  size_t readers_amount;
   pthread_mutex_t lock;
   pthread_cond_t cond;
+  cache_waiter_t *waiters;
   atomic_size_t ref_count;
+  // memory charged to cache budget for this entry
+  atomic_size_t charged_bytes;
+  // set on every hit, cleared by eviction hand (SIEVE)
+  atomic_int visited;
+  // bucket chain
   struct cache_entry *next;
+  // eviction queue of the stripe, qprev points to newer entries
+  struct cache_entry *qprev;
+  struct cache_entry *qnext;
 } cache_entry_t;
 
+// takes DONE entry leaving memory (evicted or left in destroyed cache),
+// already unlinked from cache. callback owns entry if it returns 0 and must
+// free it with cache_entry_free() later, otherwise cache frees it. can_wait
+// tells that callback may block (cache_destroy()), eviction passes 0
+typedef int (*cache_spill_t)(void *arg, cache_entry_t *entry, int can_wait);
+
+#define CACHE_LINE_SIZE 64
+// chunks passed to one send
+#define CACHE_SEND_IOV_MAX 16
+
+// span of entry data prepared to be sent by caller itself (io_uring engine):
+// chunks in iov or region of memfd when iov_amount is 0
+typedef struct {
+  struct iovec iov[CACHE_SEND_IOV_MAX];
+  size_t iov_amount;
+  int fd;
+  off_t offset;
+  size_t size;
+} cache_span_t;
+
+// independently locked part of cache: own hash table, which grows and
+// shrinks with its load, and eviction queue of its entries. stripes are cache
+// line aligned, so threads working with different stripes don't share cache
+// lines
 typedef struct {
-  cache_entry_t **buckets;
-  size_t buckets_amount;
-  atomic_size_t entry_amount;
   pthread_mutex_t lock;
+  // table[0] is the main table. while stripe is being resized, table[1] is
+  // the new one and buckets of table[0] before rehash_idx are already moved
+  cache_entry_t **table[2];
+  size_t table_size[2];
+  size_t rehash_idx;
+  int is_rehashing;
+  // newest entry is head, eviction hand walks from tail to head
+  cache_entry_t *head;
+  cache_entry_t *tail;
+  cache_entry_t *hand;
+  size_t entry_amount;
+  // loading entries not admitted into cache, chained by next. requests for
+  // their keys join them while nothing is dropped from their start, so a new
+  // key wanted by many clients at once is fetched once even in full cache
+  cache_entry_t *rejected;
+  atomic_size_t hits;
+  atomic_size_t misses;
+  atomic_size_t revalidations;
+  atomic_size_t evicted_entries;
+  atomic_size_t evicted_bytes;
+} __attribute__((aligned(CACHE_LINE_SIZE))) cache_stripe_t;
+
+typedef struct {
+  cache_stripe_t *stripes;
+  size_t stripes_amount;
+  atomic_size_t entry_amount;
+  // memory used by entries and limit for it
+  atomic_size_t bytes;
+  size_t max_bytes;
+  atomic_size_t evict_cursor;
+  atomic_int is_evicting;
+  // entries growing beyond that many bytes are moved to memfd and served
+  // with sendfile(), 0 keeps all entries in memory
+  size_t memfd_threshold;
+  atomic_size_t memfd_entries;
+  // lower tier taking entries which leave memory, NULL if there is none
+  cache_spill_t spill;
+  void *spill_arg;
+  // entries growing beyond that many bytes are streamed, 0 means no limit
+  size_t max_object_bytes;
+  // TinyLFU: new entry is admitted into full cache only if its key is used
+  // more often than key of entry eviction would take. NULL admits everything
+  struct sketch *sketch;
+  atomic_size_t rejected_entries;
+  atomic_size_t streamed_entries;
 } cache_t;
 
-// creates initialized cache
-cache_t *cache_create(size_t buckets_amount);
+typedef struct {
+  size_t hits;
+  size_t misses;
+  size_t revalidations;
+  size_t entries;
+  size_t buckets;
+  size_t bytes;
+  size_t max_bytes;
+  size_t evicted_entries;
+  size_t evicted_bytes;
+  size_t memfd_entries;
+  size_t rejected_entries;
+  size_t streamed_entries;
+} cache_stats_t;
+
+// creates initialized cache, which keeps its memory usage under max_bytes.
+// buckets_amount is only initial size of hash table, it's resized on demand.
+// entries larger than memfd_threshold are backed by memfd, 0 disables it
+cache_t *cache_create(size_t buckets_amount, size_t max_bytes,
+                      size_t memfd_threshold);
 
-// destroys cache with all it's content
+// destroys cache with all it's content, DONE entries go to spill callback
 void cache_destroy(cache_t *cache);
 
+// sets callback receiving DONE entries which leave memory. must be called
+// before cache is used
+void cache_set_spill(cache_t *cache, cache_spill_t spill, void *arg);
+
+// limits size of cached entries to max_object_bytes (0 means no limit),
+// larger ones are streamed to readers without being kept. is_tinylfu enables
+// admission by key frequency once cache is full. must be called before cache
+// is used. returns 0 on success, -1 on error
+int cache_set_admission(cache_t *cache, size_t max_object_bytes,
+                        int is_tinylfu);
+
+// frees entry taken by spill callback
+void cache_entry_free(cache_entry_t *entry);
+
 // takes ownership (reference) to cache entry, without removing it from table.
 // if you aquire node, it means that you use it(ref++).
 // however if you want to read/write data you need to lock entry(lock only
-// during that action!)
-cache_entry_t *cache_acquire(cache_t *cache, char *key);
+// during that action!). key doesn't have to be null-terminated.
+// stale DONE entry is replaced by new REQUIRED entry referencing it in
+// entry->stale, so loader can revalidate it
+cache_entry_t *cache_acquire(cache_t *cache, const char *key,
+                             size_t key_size);
+
+// replaces acquired DONE entry with new REQUIRED entry which revalidates it,
+// even if entry is still fresh. releases entry and returns acquired
+// replacement, or entry itself if it isn't DONE or is already replaced
+cache_entry_t *cache_revalidate(cache_t *cache, cache_entry_t *entry);
+
+// takes entry out of table, so following lookups don't find it. readers
+// which already hold it can finish, entry is freed by the last release.
+// caller must hold a reference
+void cache_entry_unlink(cache_t *cache, cache_entry_t *entry);
+
+// fills empty entry with data of DONE src, memfd is shared instead of
+// copying. entry->lock must not be held. returns 0 on success, -1 on error
+int cache_entry_copy(cache_t *cache, cache_entry_t *entry,
+                     cache_entry_t *src);
 
 // if you release node, it means that you will not longer use it(ref--).
-// in case of ref == 0 that entry will be removed.
+// in case of ref == 0 that entry can be evicted when cache runs out of memory.
 // cache_release() must be called only when entry->lock is not captured.
 void cache_release(cache_t *cache, cache_entry_t *entry);
+
+// appends size bytes of loaded data to entry and wakes up its readers.
+// appending to streamed entry waits while loader is too far ahead of its
+// readers. entry->lock must not be held. returns 0 on success, -1 on error
+// (ECANCELED if streamed entry has no readers left)
+int cache_entry_append(cache_t *cache, cache_entry_t *entry, const char *data,
+                       size_t size);
+
+// switches entry to its final state (DONE or ERROR) and wakes up its readers.
+// stale entry it revalidated is released. entry->lock must not be held.
+void cache_entry_finish(cache_t *cache, cache_entry_t *entry,
+                        cache_state_t state);
+
+// copies up to size bytes of entry data starting from offset into buffer.
+// readers don't have to wait for DONE: everything loader has appended so far
+// is readable. if wait is set and no data after offset is available yet,
+// blocks until loader appends more or finishes, but only for a fraction of a
+// second, so caller can check if it should give up. entry->lock must not be
+// held. returns amount of copied bytes, 0 when offset reached the end of DONE
+// entry and -1 with errno EAGAIN if data isn't loaded yet or EIO if loading
+// failed
+ssize_t cache_entry_read(cache_entry_t *entry, size_t offset, char *buffer,
+                         size_t size, int wait);
+
+// sends up to size bytes of entry data starting from offset to socket fd.
+// memfd-backed data goes with sendfile() straight from page cache, data in
+// memory goes with sendmsg() straight from its chunks. waits for loader like
+// cache_entry_read(). returns amount of sent bytes, 0 when offset reached the
+// end of DONE entry and -1 with errno ENODATA if data isn't loaded yet, EIO if
+// loading failed or errno of sendmsg()/sendfile()
+ssize_t cache_entry_send(cache_entry_t *entry, size_t offset, int fd,
+                         size_t size, int wait);
+
+// prepares up to size bytes of entry data starting from offset to be sent
+// by caller, without waiting for loader. chunks of span stay in place till
+// cache_span_release(), memfd stays open while entry is held. returns size
+// of span, 0 when offset reached the end of DONE entry and -1 with errno
+// ENODATA if data isn't loaded yet or EIO if loading failed
+ssize_t cache_entry_span(cache_entry_t *entry, size_t offset, size_t size,
+                         cache_span_t *span);
+
+// lets chunks of span sent by caller go
+void cache_span_release(cache_entry_t *entry, cache_span_t *span);
+
+// fills iov with spans of in-memory entry data covering up to size bytes
+// from offset, at most iov_max spans. entry->lock must be held unless entry
+// is DONE. returns amount of filled spans, 0 for memfd-backed entry
+size_t cache_entry_iov(cache_entry_t *entry, size_t offset, size_t size,
+                       struct iovec *iov, size_t iov_max);
+
+// registers reader of acquired entry starting from offset 0, so data isn't
+// dropped before reader sends it. finished entry needs no readers, then it's
+// a no-op. entry->lock must not be held
+void cache_entry_join(cache_entry_t *entry, cache_reader_t *reader);
+
+// moves reader to offset once data before it is sent. entry->lock must not be
+// held
+void cache_reader_advance(cache_entry_t *entry, cache_reader_t *reader,
+                          size_t offset);
+
+// unregisters reader, must be called before entry is released.
+// entry->lock must not be held
+void cache_entry_leave(cache_entry_t *entry, cache_reader_t *reader);
+
+// takes one more reference to entry that is already acquired by caller
+void cache_retain(cache_entry_t *entry);
+
+// returns status code of stored response, 0 if its headers aren't stored
+// yet. entry->lock must not be held
+int cache_entry_status(cache_entry_t *entry);
+
+// wakes up everyone waiting for entry: threads blocked on entry->cond and
+// registered waiters. entry->lock must be held.
+void cache_entry_notify(cache_entry_t *entry);
+
+// registers waiter for entry notifications. entry->lock must be held.
+void cache_entry_watch(cache_entry_t *entry, cache_waiter_t *waiter);
+
+// unregisters waiter. entry->lock must be held.
+void cache_entry_unwatch(cache_entry_t *entry, cache_waiter_t *waiter);
+
+// collects cache counters
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
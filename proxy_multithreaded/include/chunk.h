@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+
+// entry data is split into chunks which are never moved once allocated.
+// chunk sizes grow from CHUNK_MIN_SIZE twice per chunk up to CHUNK_SIZE, so
+// small responses take little memory and large ones are stored in CHUNK_SIZE
+// pieces
+#define CHUNK_MIN_SHIFT 12
+#define CHUNK_SHIFT 16
+#define CHUNK_MIN_SIZE ((size_t)1 << CHUNK_MIN_SHIFT)
+#define CHUNK_SIZE ((size_t)1 << CHUNK_SHIFT)
+#define CHUNK_CLASSES_AMOUNT (CHUNK_SHIFT - CHUNK_MIN_SHIFT + 1)
+// free chunks kept for reuse, the rest goes back to the system
+#define CHUNK_POOL_MAX_BYTES ((size_t)64 << 20)
+
+typedef struct {
+  // chunks handed out right now
+  size_t used_bytes;
+  // free chunks waiting for reuse
+  size_t pooled_bytes;
+  size_t allocations;
+  // allocations served from pool
+  size_t reuses;
+} chunk_stats_t;
+
+// size of chunk number idx of entry data
+size_t chunk_size(size_t idx);
+
+// returns number of chunk holding byte at offset of entry data and offset of
+// that byte inside chunk
+size_t chunk_locate(size_t offset, size_t *chunk_offset);
+
+// takes chunk of size returned by chunk_size() from shared pool, allocates
+// new one if pool has none. returns NULL on error
+char *chunk_alloc(size_t size);
+
+// returns chunk to shared pool, or to the system if pool is full
+void chunk_free(char *chunk, size_t size);
+
+// collects pool counters
+void chunk_get_stats(chunk_stats_t *stats);
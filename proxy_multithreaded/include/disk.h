@@ -0,0 +1,131 @@
+#pragma once
+
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// header of every record in segment file, followed by key and data
+typedef struct {
+  uint32_t magic;
+  uint32_t key_size;
+  uint64_t data_size;
+  uint64_t header_size;
+  // wall clock time when record stops being fresh
+  int64_t expires_at;
+  uint32_t flags;
+  // checksum of the fields above and the key, detects torn records
+  uint32_t checksum;
+} disk_record_t;
+
+// append-only segment file. segments are dropped whole, oldest first
+typedef struct disk_segment {
+  size_t id;
+  int fd;
+  size_t size;
+  // readers copying data out of segment, it's closed when the last one is
+  // done with dropped segment
+  size_t ref_count;
+  int is_dropped;
+  struct disk_segment *next;
+} disk_segment_t;
+
+// index entry: where the latest record of key lives
+typedef struct disk_entry {
+  char *key;
+  size_t key_size;
+  size_t hash;
+  disk_segment_t *segment;
+  // offset of data inside segment
+  off_t offset;
+  size_t data_size;
+  size_t header_size;
+  time_t expires_at;
+  int is_persistent;
+  struct disk_entry *next;
+} disk_entry_t;
+
+// entry evicted from memory and waiting for writer
+typedef struct disk_job {
+  cache_entry_t *entry;
+  struct disk_job *next;
+} disk_job_t;
+
+typedef struct {
+  size_t entries;
+  size_t bytes;
+  size_t max_bytes;
+  size_t segments;
+  size_t writes;
+  size_t loads;
+  size_t dropped;
+} disk_stats_t;
+
+// second cache tier: entries leaving memory are appended by writer thread to
+// log-structured segment files in dir, in-memory index maps keys to their
+// records. when store outgrows max_bytes, the oldest segment is deleted with
+// all its records. index is rebuilt from segment files on start, so cache
+// survives restarts. dir is locked by one process at a time: while previous
+// process still holds it (hot restart), store stays detached and is opened
+// by writer thread once lock is released
+typedef struct {
+  char *dir;
+  // holds flock of dir
+  int lock_fd;
+  // index is built and store is usable, guarded by lock
+  int is_ready;
+  size_t max_bytes;
+  size_t segment_max_size;
+  pthread_mutex_t lock;
+  disk_entry_t **buckets;
+  size_t buckets_amount;
+  size_t entry_amount;
+  // oldest segment is head, records are appended to tail
+  disk_segment_t *head;
+  disk_segment_t *tail;
+  size_t segment_amount;
+  size_t bytes;
+  // queue of writer thread
+  pthread_t writer;
+  int is_writer_running;
+  pthread_cond_t changed;
+  disk_job_t *jobs_head;
+  disk_job_t *jobs_tail;
+  size_t queued_bytes;
+  int is_stopping;
+  atomic_size_t writes;
+  atomic_size_t loads;
+  // evicted entries thrown away because writer was behind
+  atomic_size_t dropped;
+} disk_store_t;
+
+// opens store in dir (created if missing) and indexes records already there.
+// if dir is locked by another process, returns detached store which refuses
+// entries and finds nothing till that process releases it.
+// store never takes more than about max_bytes of disk
+disk_store_t *disk_store_create(const char *dir, size_t max_bytes);
+
+// writes out queued entries, syncs and closes segments. there must be no
+// loads in progress
+void disk_store_destroy(disk_store_t *store);
+
+// spill callback for cache_set_spill(): queues DONE entry for writing and
+// takes ownership of it. if writer is behind, entry is refused unless
+// can_wait is set, then it waits for room in queue. returns 0 if entry is
+// taken, -1 otherwise
+int disk_store_spill(void *store, cache_entry_t *entry, int can_wait);
+
+// tells if store has record for key which is still fresh. stale records are
+// left for origin to revalidate
+int disk_store_contains(disk_store_t *store, const char *key, size_t key_size);
+
+// fills entry from record of its key. entry must be LOADING and acquired by
+// caller. returns 0 on success, -1 with errno ENOENT if there is no record
+// (entry stays untouched) or errno of failed read or append (entry may be
+// partially filled)
+int disk_store_load(disk_store_t *store, cache_t *cache, cache_entry_t *entry);
+
+// collects store counters
+void disk_store_get_stats(disk_store_t *store, disk_stats_t *stats);
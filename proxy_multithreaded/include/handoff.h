@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+// hot restart: running proxy serves unix socket at handoff path. new process
+// connects to it and receives listening sockets of old one with SCM_RIGHTS,
+// so clients are accepted by new process without any gap while old one
+// drains its connections
+
+// listening sockets passed at once, admin listener included. kernel takes at
+// most 253 descriptors per message
+#define HANDOFF_MAX_FDS 253
+
+// takes listening sockets from process serving handoff socket at path. fills
+// fds with up to fds_max client listeners and sets *admin_fd to admin
+// listener or -1 if old process has none. returns amount of received client
+// listeners, 0 if nobody serves path, -1 on error
+int handoff_receive(const char *path, int *fds, size_t fds_max,
+                    int *admin_fd);
+
+// creates handoff socket at path, replacing the one left by previous process.
+// returns listening socket or -1 on error
+int handoff_listen(const char *path);
+
+// sends client listeners and admin listener (-1 if there is none) to process
+// connected to handoff socket over fd. returns 0 on success, -1 on error
+int handoff_send(int fd, const int *listen_fds, size_t amount, int admin_fd);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+// hash of cache and disk index keys. it reads key 8 bytes at a time and
+// mixes them with 64x64->128 bit multiplications (wyhash construction), so
+// long URLs cost a few cycles per word instead of a multiply-add per byte,
+// and all bits of result are well mixed, so tables can take any part of it
+// with a mask
+size_t hash_bytes(const void *data, size_t size);
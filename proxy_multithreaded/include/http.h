@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define DEFAULT_HTTP_PORT 80
+#define MAX_METHOD 16
+#define MAX_VERSION 16
+#define MAX_HOST 256
+#define MAX_URL 2048
+#define MAX_RESPONSE_HEADERS 16384
+#define HTTP_MAX_RANGES 16
+
+// part of buffer, it isn't null-terminated. empty slice has NULL data
+typedef struct {
+  const char *data;
+  size_t size;
+} http_slice_t;
+
+typedef enum {
+  HTTP_REQUEST_LINE,
+  HTTP_REQUEST_HEADERS,
+  HTTP_REQUEST_DONE,
+} http_request_state_t;
+
+// incremental request parser. it keeps slices into connection buffer instead
+// of copies, so buffer must not move or change while request is in use
+typedef struct {
+  http_request_state_t state;
+  // start of the line being parsed
+  size_t line_start;
+  // bytes of that line already searched for its end
+  size_t scanned;
+  // size of the whole header block once it's parsed
+  size_t size;
+  http_slice_t method;
+  http_slice_t url;
+  http_slice_t version;
+  http_slice_t host;
+  http_slice_t range;
+  http_slice_t if_range;
+  http_slice_t cache_control;
+  http_slice_t if_none_match;
+  http_slice_t connection;
+  http_slice_t proxy_connection;
+  http_slice_t content_length;
+  http_slice_t transfer_encoding;
+} http_request_t;
+
+// inclusive range of body bytes
+typedef struct {
+  size_t first;
+  size_t last;
+} http_range_t;
+
+typedef enum {
+  HTTP_RESPONSE_HEADERS,
+  HTTP_RESPONSE_BODY_LENGTH,
+  HTTP_RESPONSE_CHUNK_SIZE,
+  HTTP_RESPONSE_CHUNK_DATA,
+  HTTP_RESPONSE_CHUNK_END,
+  HTTP_RESPONSE_TRAILER,
+  HTTP_RESPONSE_BODY_UNTIL_CLOSE,
+  HTTP_RESPONSE_DONE,
+} http_response_state_t;
+
+// incremental parser of response framing: it finds where response received
+// from origin ends, so connection can be reused for the next request
+typedef struct {
+  http_response_state_t state;
+  // header block including status line and final empty line
+  char headers[MAX_RESPONSE_HEADERS];
+  size_t headers_size;
+  int status;
+  // Content-Length or -1 if response has none
+  ssize_t content_length;
+  int is_chunked;
+  // origin allows to send next request over the same connection
+  int keep_alive;
+  // bytes left in body or current chunk
+  size_t remaining;
+  // length of current chunk size or trailer line
+  size_t line_size;
+} http_response_t;
+
+// checks if slice equals to null-terminated str
+int http_slice_equals(http_slice_t slice, const char *str);
+
+void http_request_init(http_request_t *request);
+
+// continues parsing request from buffer, which holds everything received so
+// far (buffer may grow between calls, but its start must stay the same).
+// only new bytes are examined. returns 1 when header block is complete, 0 if
+// more data is needed and -1 on malformed request
+int http_request_parse(http_request_t *request, const char *buffer,
+                       size_t size);
+
+// checks if client connection can be kept open after response to request:
+// it's HTTP/1.1 without Connection: close and without body
+int http_request_keep_alive(const http_request_t *request);
+
+// tells if client demands revalidation of cached response: request has
+// Cache-Control: no-cache or max-age=0
+int http_request_no_cache(const http_request_t *request);
+
+// parses Range header value ("bytes=0-99,200-,-50") of request for body of
+// length bytes. ranges receive satisfiable ranges in request order. returns
+// their amount, 0 if none is satisfiable and -1 if header is malformed, uses
+// other unit or has more than max_ranges ranges, then it must be ignored
+int http_parse_range(http_slice_t range, size_t length, http_range_t *ranges,
+                     size_t max_ranges);
+
+// splits absolute url into host and path slices and port. port is
+// DEFAULT_HTTP_PORT if url has none. returns -1 if url has no host
+int http_split_url(const char *url, size_t size, http_slice_t *host,
+                   int *port, http_slice_t *path);
+
+// writes cache key of url into key: scheme and host of absolute http url are
+// lowercased, default port is dropped and empty path becomes "/", so
+// equivalent urls share one entry. other urls are copied as they are.
+// returns size of key (it's not null-terminated) or -1 if it doesn't fit
+// into capacity bytes
+ssize_t http_normalize_url(const char *url, size_t size, char *key,
+                           size_t capacity);
+
+// splits null-terminated url into host, port and path. host and path must be
+// at least MAX_HOST and MAX_URL bytes long, longer parts are truncated
+void extract_host_path(const char *url, char *host, int *port, char *path);
+
+// returns value of header name in header block (value isn't null-terminated)
+// or NULL if there is no such header. value_size receives value length
+const char *http_find_header(const char *headers, size_t size,
+                             const char *name, size_t *value_size);
+
+// removes every header named name from header block in place, returns new
+// size
+size_t http_remove_header(char *headers, size_t size, const char *name);
+
+// removes hop-by-hop headers (Connection, Keep-Alive, ...) from header block
+// in place, so it can be forwarded to another connection. returns new size
+size_t http_strip_hop_headers(char *headers, size_t size);
+
+// parses status code of status line at the start of header block of size
+// bytes, block needn't be null-terminated. returns 0 on success, -1 if there
+// is no valid "HTTP/1.x NNN" status line
+int http_parse_status(const char *headers, size_t size, int *status);
+
+void http_response_init(http_response_t *response);
+
+// feeds bytes received from origin to parser. parser stops after header
+// block and after the end of response, so caller can tell header, body and
+// excess bytes apart. returns amount of consumed bytes or -1 if response is
+// malformed
+ssize_t http_response_feed(http_response_t *response, const char *data,
+                           size_t size);
+
+// tells parser that origin closed connection. returns 0 if response is
+// complete and -1 if it's truncated
+int http_response_finish(http_response_t *response);
+
+// parses HTTP-date in IMF-fixdate format, returns -1 if date is malformed
+time_t http_parse_date(const char *value, size_t size);
+
+// freshness lifetime in seconds of response with status and header block
+// (RFC 9111): s-maxage or max-age of Cache-Control, then Expires minus Date,
+// then 10% of time since Last-Modified for status codes cacheable by
+// default. returns 0 if response must be revalidated before every use and
+// -1 if it must not be stored at all
+long http_freshness_lifetime(int status, const char *headers, size_t size);
+
+// age of response with header block received at now: time since its Date or
+// its Age header, whichever is larger
+long http_response_age(const char *headers, size_t size, time_t now);
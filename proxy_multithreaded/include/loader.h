@@ -0,0 +1,92 @@
+#pragma once
+
+#include "cache.h"
+#include "disk.h"
+#include "http.h"
+#include "resolver.h"
+#include "upstream.h"
+
+struct loader;
+
+// queued download of one entry
+typedef struct loader_job {
+  struct loader *loader;
+  cache_entry_t *entry;
+  char host[MAX_HOST];
+  int port;
+  // entry is read from disk tier, origin isn't contacted
+  int is_disk;
+  struct loader_job *next;
+} loader_job_t;
+
+// downloads running for one origin, exists only while there are any
+typedef struct loader_origin {
+  char *host;
+  int port;
+  size_t in_flight;
+  struct loader_origin *next;
+} loader_origin_t;
+
+typedef struct {
+  size_t fetches;
+  size_t coalesced;
+  size_t rejected;
+  size_t queued;
+} loader_stats_t;
+
+// fixed pool of worker threads downloading entries of cache over
+// connections from upstream pool. job which origin is being resolved is
+// parked without worker and requeued once resolver answers
+typedef struct loader {
+  cache_t *cache;
+  upstream_pool_t *upstream;
+  resolver_t *resolver;
+  // disk tier checked before origin, NULL if there is none
+  disk_store_t *disk;
+  pthread_t *workers;
+  size_t workers_amount;
+  pthread_mutex_t lock;
+  // signaled when job is queued, origin slot is freed or loader stops
+  pthread_cond_t changed;
+  loader_job_t *head;
+  loader_job_t *tail;
+  size_t queued;
+  // jobs waiting for resolver, they count against max_queued too
+  size_t parked;
+  size_t max_queued;
+  loader_origin_t **origins;
+  size_t origins_buckets_amount;
+  size_t max_per_origin;
+  int is_stopping;
+  // requests which started download
+  atomic_size_t fetches;
+  // requests which joined download already in flight
+  atomic_size_t coalesced;
+  // requests turned away because queue was full
+  atomic_size_t rejected;
+} loader_t;
+
+// creates loader with workers_amount worker threads. at most max_queued
+// downloads wait for a worker and at most max_per_origin downloads from one
+// origin run at once, the rest of them wait in queue. origins are looked up
+// with resolver. entries found in disk (may be NULL) are read from it and
+// don't count against origin limit
+loader_t *loader_create(cache_t *cache, upstream_pool_t *upstream,
+                        resolver_t *resolver, disk_store_t *disk,
+                        size_t workers_amount, size_t max_queued,
+                        size_t max_per_origin);
+
+// stops workers after their current downloads and fails queued entries,
+// parked ones are failed once resolver answers them. resolver must outlive
+// loader
+void loader_destroy(loader_t *loader);
+
+// makes sure that entry is loaded or being loaded: if nobody requested entry
+// yet, marks it as LOADING and queues its download.
+// entry must be acquired by caller, entry->lock must not be held.
+// returns 0 on success, -1 with errno EBUSY if queue is full (entry stays
+// REQUIRED, so request can be repeated later)
+int loader_ensure(loader_t *loader, cache_entry_t *entry);
+
+// collects loader counters
+void loader_get_stats(loader_t *loader, loader_stats_t *stats);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// every thread updates its own counters and histograms, nobody else writes
+// them, so updates take no locks and no atomic read-modify-write. they are
+// summed up only when somebody asks for them
+
+typedef enum {
+  // parsed client requests
+  METRIC_REQUESTS,
+  // error responses generated by proxy
+  METRIC_ERRORS,
+  // bytes received from and sent to clients
+  METRIC_CLIENT_BYTES_IN,
+  METRIC_CLIENT_BYTES_OUT,
+  // bytes received from origins
+  METRIC_ORIGIN_BYTES_IN,
+  // syscalls engine makes to accept clients, wait for them and talk to them,
+  // compares engines by syscalls per request
+  METRIC_CLIENT_SYSCALLS,
+  METRIC_COUNTERS_AMOUNT,
+} metrics_counter_t;
+
+typedef enum {
+  // http_request_parse() calls of request
+  METRIC_PHASE_PARSE,
+  // cache lookup and loader_ensure()
+  METRIC_PHASE_LOOKUP,
+  // upstream_connect(), including DNS and pooled connection check
+  METRIC_PHASE_ORIGIN_CONNECT,
+  // request sent to origin till the first byte of response
+  METRIC_PHASE_ORIGIN_TTFB,
+  // the first byte of response sent to client till the last one
+  METRIC_PHASE_SEND,
+  METRIC_PHASES_AMOUNT,
+} metrics_phase_t;
+
+// histogram buckets are log-linear like in HDR histogram: values below
+// 2^METRICS_SUB_BITS have a bucket each, every next power of two is split
+// into 2^METRICS_SUB_BITS buckets, so bucket width stays within 1/8 of its
+// value. durations are in nanoseconds, longer than 2^METRICS_MAX_SHIFT go
+// to the last bucket
+#define METRICS_SUB_BITS 3
+#define METRICS_MAX_SHIFT 40
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS_AMOUNT                                                 \
+  (METRICS_SUB_BUCKETS +                                                       \
+   (METRICS_MAX_SHIFT - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct {
+  size_t buckets[METRICS_BUCKETS_AMOUNT];
+  size_t count;
+  uint64_t sum_ns;
+} metrics_histogram_t;
+
+typedef struct {
+  size_t counters[METRIC_COUNTERS_AMOUNT];
+  metrics_histogram_t phases[METRIC_PHASES_AMOUNT];
+} metrics_snapshot_t;
+
+// monotonic clock in nanoseconds, start of measured phase
+uint64_t metrics_now(void);
+
+// adds value to counter of calling thread
+void metrics_add(metrics_counter_t counter, size_t value);
+
+// records phase which started at start_ns (metrics_now()) and ends now
+void metrics_record(metrics_phase_t phase, uint64_t start_ns);
+
+// records phase of known duration
+void metrics_record_duration(metrics_phase_t phase, uint64_t duration_ns);
+
+// sums up counters and histograms of all threads, finished ones included
+void metrics_collect(metrics_snapshot_t *snapshot);
+
+// returns duration in nanoseconds below which quantile (0..1) of histogram
+// values lie, upper bound of bucket holding it. 0 for empty histogram
+uint64_t metrics_quantile(const metrics_histogram_t *histogram,
+                          double quantile);
@@ -1,6 +1,12 @@
 #pragma once
 
 #include "cache.h"
+#include "disk.h"
+#include "loader.h"
+#include "resolver.h"
+#include "upstream.h"
+
+#include <stdint.h>
 
 enum {
   CONN_CREATED = 0,
@@ -8,22 +14,126 @@ enum {
   CONN_DONE = 2,
 };
 
-typedef struct {
+typedef struct proxy proxy_t;
+
+typedef struct proxy_conn {
   int client_fd;
   atomic_int state;
   pthread_t thread;
+  proxy_t *proxy;
+  // index of connection in proxy->connections
+  size_t slot;
+  // list of finished connections waiting for reaper
+  struct proxy_conn *next_finished;
 } proxy_conn_t;
 
+typedef enum {
+  // one thread per client connection
+  PROXY_ENGINE_THREADED,
+  // non-blocking connections driven by epoll reactor threads
+  PROXY_ENGINE_EPOLL,
+  // epoll reactors pinned to CPUs, each accepting from its own SO_REUSEPORT
+  // listener, so kernel spreads connections without shared accept queue
+  PROXY_ENGINE_SHARDED,
+  // reactor threads submitting client I/O to their own io_uring in batches
+  PROXY_ENGINE_URING,
+} proxy_engine_t;
+
 typedef struct {
   int port;
+  size_t connections_limit;
+  proxy_engine_t engine;
+  // amount of reactor threads for epoll, sharded and uring engines, 0 means
+  // one per core
+  size_t workers_amount;
+  // memory budget of cache in bytes
+  size_t cache_max_bytes;
+  // cached responses larger than that are served from memfd with
+  // sendfile(), 0 keeps them all in memory
+  size_t memfd_threshold;
+  // responses larger than that are streamed without being cached, 0 means no
+  // limit
+  size_t max_object_bytes;
+  // admit new entries into full cache by key frequency (TinyLFU) instead of
+  // admitting all of them
+  int is_tinylfu;
+  // directory of disk cache tier and its budget in bytes, NULL disables it
+  const char *disk_dir;
+  size_t disk_max_bytes;
+  // "IP[:PORT]" of DNS server, NULL means nameserver of /etc/resolv.conf
+  const char *nameserver;
+  // loader threads, downloads waiting for them and downloads running for one
+  // origin at once
+  size_t loader_workers;
+  size_t loader_queue;
+  size_t loader_per_origin;
+  // seconds client connection may stay idle waiting for next request
+  int idle_timeout;
+  // requests served over one client connection before it's closed
+  size_t max_requests;
+  // port of admin endpoint serving /metrics, 0 disables it
+  int admin_port;
+  // seconds stopped proxy lets responses in progress finish
+  int drain_timeout;
+  // unix socket for hot restart: listeners are taken from process serving it
+  // and handed to the next one, NULL disables it
+  const char *handoff_path;
+} proxy_config_t;
+
+struct proxy {
+  int port;
+  // cleared when proxy is stopped: listeners aren't accepted anymore and
+  // connections are drained
   atomic_int running;
+  // proxy is stopped once again, drain is cut short
+  atomic_int is_forced;
+  // drain deadline of threaded engine has passed, connections stop waiting
+  // for loader
+  atomic_int is_cut;
+  int drain_timeout;
+  // client listeners, taken over from previous process or created
+  int *listen_fds;
+  size_t listen_fds_amount;
+  // handoff socket and thread serving it, handoff_fd is -1 when disabled
+  const char *handoff_path;
+  int handoff_fd;
+  pthread_t handoff_thread;
+  // listeners went to the next process, it owns handoff socket now
+  atomic_int is_handed_off;
+  proxy_engine_t engine;
+  size_t workers_amount;
+  // threaded engine connections table. its free slots form lock-free stack:
+  // slot_next[i] links slot i, free_slots keeps top slot + 1 in low half and
+  // change counter in high half, so pop can't be fooled by slot taken and
+  // returned in between (ABA)
   proxy_conn_t **connections;
+  atomic_size_t *slot_next;
+  _Atomic uint64_t free_slots;
+  // reaper joins threads of finished connections and frees their slots,
+  // acceptor waits for slot_freed when table is full
+  pthread_t reaper;
+  pthread_mutex_t reaper_lock;
+  pthread_cond_t reaper_cond;
+  pthread_cond_t slot_freed;
+  proxy_conn_t *finished;
+  int is_reaper_stopping;
   size_t connections_limit;
+  atomic_size_t active_connections;
+  int idle_timeout;
+  size_t max_requests;
+  // admin endpoint listener and its thread, admin_fd is -1 when disabled
+  int admin_port;
+  int admin_fd;
+  pthread_t admin_thread;
   cache_t *cache;
-} proxy_t;
+  disk_store_t *disk;
+  resolver_t *resolver;
+  upstream_pool_t *upstream;
+  loader_t *loader;
+};
 
 // returns initialized and prepared for run proxy
-proxy_t *proxy_create(int port, size_t connections_limit);
+proxy_t *proxy_create(const proxy_config_t *config);
 
 // destroys proxy
 void proxy_destroy(proxy_t *proxy);
@@ -31,14 +141,24 @@ void proxy_destroy(proxy_t *proxy);
 // blocking function, starts proxy
 void proxy_run(proxy_t *proxy);
 
-// stops proxy
+// stops proxy: listeners aren't accepted anymore, idle connections are
+// closed and responses in progress get drain_timeout seconds to finish.
+// calling it again cuts drain short. only sets flags, so it's safe to call
+// from signal handler, engines notice them and finish their connections
+// themselves
 void proxy_stop(proxy_t *proxy);
 
 // returns initialized connection structure, ready for data streaming
 proxy_conn_t *proxy_conn_create(int client_fd);
 
-// releases connection resources and waits for it's ending
+// waits for connection thread to finish, closes client socket and releases
+// connection resources
 void proxy_conn_destroy(proxy_conn_t *connection);
 
-// starts data streaming between client and cache
-void proxy_conn_run(proxy_t *proxy, proxy_conn_t *connection);
+// starts thread streaming data between client and cache. returns 0 on
+// success, -1 on error
+int proxy_conn_run(proxy_t *proxy, proxy_conn_t *connection);
+
+// hands connection to reaper, called by connection thread right before it
+// exits
+void proxy_conn_finish(proxy_conn_t *connection);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "cache.h"
+#include "http.h"
+
+// piece of range response: generated text or span of entry data
+typedef struct {
+  int is_entry;
+  // offset in text or in entry data
+  size_t offset;
+  size_t size;
+} range_part_t;
+
+// response to Range request served from DONE entry: 206 with one range,
+// multipart/byteranges with several ranges or 416
+typedef struct {
+  // 206 or 416
+  int status;
+  // status line, headers and multipart delimiters
+  char *text;
+  size_t text_size;
+  size_t text_capacity;
+  range_part_t parts[2 * HTTP_MAX_RANGES + 2];
+  size_t parts_amount;
+  // size of the whole response
+  size_t size;
+} range_response_t;
+
+// prepares response to Range of request from entry. Range is ignored and
+// full entry has to be sent if entry isn't DONE yet, isn't 200 response with
+// Content-Length or request has If-Range. returns 1 if response is
+// prepared, 0 if Range is ignored and -1 on error
+int range_response_init(range_response_t *response, cache_entry_t *entry,
+                        const http_request_t *request);
+
+// sends response starting from position. returns amount of sent bytes, 0
+// when the whole response is sent and -1 with errno of send()
+ssize_t range_response_send(range_response_t *response, cache_entry_t *entry,
+                            size_t position, int fd);
+
+// finds part of response holding position and sets *skip to position inside
+// it, for callers sending response themselves. returns NULL when the whole
+// response is sent
+const range_part_t *range_response_locate(const range_response_t *response,
+                                          size_t position, size_t *skip);
+
+void range_response_destroy(range_response_t *response);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "proxy.h"
+
+// runs epoll engine: proxy->workers_amount reactor threads accept clients
+// and drive their connections without blocking. epoll engine reactors share
+// listen_fds[0]. in sharded engine reactor i accepts only from listen_fds[i]
+// and is pinned to its own CPU. returns when proxy is stopped and all
+// reactors are finished
+void reactor_run(proxy_t *proxy, const int *listen_fds,
+                 size_t listen_fds_amount);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef enum {
+  // query is in flight, other lookups wait for it instead of sending their
+  // own query
+  RESOLVER_PENDING,
+  RESOLVER_RESOLVED,
+  RESOLVER_FAILED,
+} resolver_state_t;
+
+// called from resolver thread once query of lookup which returned
+// EINPROGRESS is answered or times out
+typedef void (*resolver_callback_t)(void *arg);
+
+// lookup waiting for query in flight
+typedef struct resolver_waiter {
+  resolver_callback_t callback;
+  void *arg;
+  struct resolver_waiter *next;
+} resolver_waiter_t;
+
+// cached answer for one host name, positive or negative
+typedef struct resolver_entry {
+  char *host;
+  resolver_state_t state;
+  struct in_addr addr;
+  // errno of failed lookup
+  int error;
+  // monotonic time when answer expires, 0 for static entries (/etc/hosts)
+  time_t expires_at;
+  // lookups told when PENDING entry is answered
+  resolver_waiter_t *waiters;
+  struct resolver_entry *next;
+} resolver_entry_t;
+
+typedef struct {
+  size_t hits;
+  size_t queries;
+  size_t coalesced;
+  size_t failures;
+  size_t entries;
+} resolver_stats_t;
+
+struct resolver_query;
+
+// caching stub resolver: sends A queries over UDP to one nameserver and
+// keeps answers for their TTL. queries are sent, retried and answered by
+// resolver thread, so lookups never block
+typedef struct {
+  struct sockaddr_in nameserver;
+  resolver_entry_t **buckets;
+  size_t buckets_amount;
+  size_t entry_amount;
+  pthread_mutex_t lock;
+  pthread_t thread;
+  // wakes resolver thread when query is added or resolver stops
+  int wake_fd;
+  // queries in flight, only resolver thread removes them
+  struct resolver_query *in_flight;
+  int is_stopping;
+  atomic_size_t hits;
+  atomic_size_t queries;
+  atomic_size_t coalesced;
+  atomic_size_t failures;
+} resolver_t;
+
+// creates resolver which queries nameserver given as "IP[:PORT]". if it's
+// NULL, the first nameserver of /etc/resolv.conf is used. names from
+// /etc/hosts are resolved without queries
+resolver_t *resolver_create(const char *nameserver);
+
+// destroys resolver. queries in flight are dropped without telling their
+// waiters, so nobody may wait for them anymore
+void resolver_destroy(resolver_t *resolver);
+
+// resolves host to IPv4 address without blocking. numeric addresses are
+// parsed in place and cached answers are returned at once. otherwise query
+// is sent, or the one in flight for the same host is joined, and -1 with
+// errno EINPROGRESS is returned: callback(arg) is called once query is
+// answered or times out, then lookup is repeated to get its answer.
+// returns 0 on success, -1 with errno ENOENT if host has no address or
+// ETIMEDOUT if nameserver didn't answer
+int resolver_lookup(resolver_t *resolver, const char *host,
+                    struct in_addr *addr, resolver_callback_t callback,
+                    void *arg);
+
+// collects resolver counters
+void resolver_get_stats(resolver_t *resolver, resolver_stats_t *stats);
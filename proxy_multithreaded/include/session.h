@@ -0,0 +1,129 @@
+#pragma once
+
+#include "cache.h"
+#include "http.h"
+#include "proxy.h"
+#include "range.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct session_queue session_queue_t;
+
+// engine-neutral part of client connection: request being served, entry
+// answering it and its access log record. every engine embeds it into its
+// connection and keeps only its own I/O
+typedef struct session {
+  proxy_t *proxy;
+  // request buffer, owned by engine. it's kept between requests and holds
+  // pipelined requests after current one
+  char *buffer;
+  size_t buffer_used;
+  // request being parsed or served, it's at the start of buffer
+  http_request_t request;
+  // time spent parsing request so far, start of request and of response.
+  // request_start is reset once request is logged
+  uint64_t parse_ns;
+  uint64_t request_start;
+  uint64_t send_start;
+  // requests served over connection
+  size_t served;
+  int keep_alive;
+  cache_entry_t *entry;
+  // Range response sent instead of the whole entry, NULL if there is none
+  range_response_t *range;
+  const char *error_message;
+  // bytes of entry data or error message which are already sent
+  size_t sent;
+  // position of connection in entry it sends, see cache_entry_join()
+  cache_reader_t reader;
+
+  // the rest is used by reactors only, queue is NULL in threaded engine
+  session_queue_t *queue;
+  cache_waiter_t waiter;
+  int is_watching;
+  // guarded by queue->lock
+  int is_pending;
+  struct session *pending_next;
+  // sessions waiting for request are kept in idle list in order of
+  // idle_since, so expired ones are always at its head
+  time_t idle_since;
+  int is_idle;
+  struct session *idle_prev;
+  struct session *idle_next;
+} session_t;
+
+// sessions of one reactor which wait for loader or for request
+struct session_queue {
+  // loaders wake reactor through it when watched entries change
+  int event_fd;
+  // sessions which entries changed, filled by loader threads
+  pthread_mutex_t lock;
+  session_t *pending;
+  session_t *idle_head;
+  session_t *idle_tail;
+};
+
+// engine callback which drives or closes connection of session
+typedef void (*session_fn_t)(session_t *session);
+
+void session_init(session_t *session, proxy_t *proxy,
+                  session_queue_t *queue);
+
+// starts serving request parsed into session->request: counts it, acquires
+// its entry, makes sure loader runs for it and prepares Range response.
+// returns NULL when response is ready to be sent from session->entry, or
+// error response which is to be sent instead after session_fail()
+const char *session_start(session_t *session);
+
+// counts and logs error response, it's sent from session->error_message
+void session_fail(session_t *session, const char *error_message);
+
+// logs response which is sent completely
+void session_finish(session_t *session);
+
+// prepares session for the next request once response is finished. returns
+// 0 if connection has to be closed instead: request wasn't keep-alive,
+// response is close-delimited or proxy is stopping
+int session_next(session_t *session);
+
+// logs response cut short, takes session out of reactor lists and stops
+// its watch, so no loader can queue it anymore
+void session_close(session_t *session);
+
+// releases entry and Range response, once engine doesn't use them anymore
+void session_destroy(session_t *session);
+
+// returns status of response being sent, 0 if it isn't known yet
+int session_status(const session_t *session);
+
+time_t session_monotonic_seconds(void);
+
+// subscribes session to updates of its entry while loader is still running.
+// loader queues it then and wakes reactor through queue->event_fd
+void session_watch(session_t *session);
+
+// puts session waiting for request at the tail of idle list
+void session_idle_push(session_t *session);
+
+// takes ownership of event_fd, it's closed by session_queue_destroy()
+void session_queue_init(session_queue_t *queue, int event_fd);
+
+void session_queue_destroy(session_queue_t *queue);
+
+// advances every session loaders queued since the last call. reactor calls
+// it after the whole batch of events, otherwise session closed there could
+// still have its events in the batch
+void session_queue_process(session_queue_t *queue, session_fn_t advance);
+
+// closes sessions which waited for request longer than idle timeout
+void session_queue_expire(session_queue_t *queue, session_fn_t close_session);
+
+// serves requests which already arrived at idle sessions and closes the
+// ones which have nothing buffered, closing socket with unread data would
+// reset connection. sessions with part of request or response in flight
+// are left to finish
+void session_queue_drain(session_queue_t *queue, session_fn_t advance,
+                         session_fn_t close_session);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// frequency sketch of TinyLFU admission: count-min sketch with 4-bit
+// counters, every key is counted in SKETCH_DEPTH of them and its frequency is
+// the smallest one. after sample_size increments all counters are halved, so
+// frequencies follow recent popularity and old hits fade out. counters are
+// updated with atomics and without locks, lost update only makes estimate a
+// bit lower
+typedef struct sketch {
+  // every word holds 16 counters
+  _Atomic uint64_t *table;
+  size_t table_mask;
+  size_t sample_size;
+  atomic_size_t additions;
+  atomic_int is_resetting;
+} sketch_t;
+
+// creates sketch sized for about capacity distinct keys. returns NULL on
+// error
+sketch_t *sketch_create(size_t capacity);
+
+void sketch_destroy(sketch_t *sketch);
+
+// counts one more occurrence of key with hash
+void sketch_increment(sketch_t *sketch, size_t hash);
+
+// returns estimated recent frequency of key with hash, at most 15
+unsigned sketch_frequency(sketch_t *sketch, size_t hash);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+// idle connection kept open for next request to the same origin
+typedef struct upstream_idle {
+  int fd;
+  time_t idle_since;
+  struct upstream_idle *next;
+} upstream_idle_t;
+
+// origin is identified by host and port
+typedef struct upstream_origin {
+  char *host;
+  int port;
+  // most recently released connection first
+  upstream_idle_t *idle;
+  size_t idle_amount;
+  struct upstream_origin *next;
+} upstream_origin_t;
+
+typedef struct {
+  size_t connects;
+  size_t reuses;
+  size_t expired;
+  size_t idle;
+} upstream_stats_t;
+
+// pool of persistent connections to origins. sweeper thread closes expired
+// idle connections of all origins, origins are kept only while they have any
+typedef struct {
+  upstream_origin_t **buckets;
+  size_t buckets_amount;
+  pthread_mutex_t lock;
+  pthread_t sweeper;
+  // signaled when pool is destroyed
+  pthread_cond_t stopped;
+  int is_stopping;
+  size_t max_idle_per_origin;
+  int idle_timeout;
+  atomic_size_t connects;
+  atomic_size_t reuses;
+  atomic_size_t expired;
+  atomic_size_t idle_amount;
+} upstream_pool_t;
+
+// creates pool, which keeps at most max_idle_per_origin idle connections for
+// every origin and closes connections idle longer than idle_timeout seconds
+upstream_pool_t *upstream_pool_create(size_t max_idle_per_origin,
+                                      int idle_timeout);
+
+// closes all idle connections and destroys pool
+void upstream_pool_destroy(upstream_pool_t *pool);
+
+// returns socket connected to host:port, new connection goes to addr,
+// resolved address of host. if allow_reuse is set, live idle connection from
+// pool is returned when possible and *is_reused is set. returns -1 on error
+int upstream_connect(upstream_pool_t *pool, const char *host, int port,
+                     const struct in_addr *addr, int allow_reuse,
+                     int *is_reused);
+
+// gives connection back to pool for reuse. connection must be idle: previous
+// response must be read till its end
+void upstream_release(upstream_pool_t *pool, const char *host, int port,
+                      int fd);
+
+// collects pool counters
+void upstream_get_stats(upstream_pool_t *pool, upstream_stats_t *stats);
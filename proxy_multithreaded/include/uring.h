@@ -0,0 +1,77 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// minimal io_uring over raw syscalls: rings are mapped once, submissions and
+// completions are exchanged through shared memory and io_uring_enter() is
+// called only to submit a batch and wait for completions
+
+typedef struct {
+  int fd;
+  unsigned features;
+  // submission queue, sq_tail is local till it's published by submit
+  unsigned *sq_head;
+  unsigned *sq_tail_shared;
+  unsigned sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} uring_t;
+
+// ring of buffers registered with kernel (provided buffers): multishot recv
+// picks free buffer itself and reports its id in completion
+typedef struct {
+  struct io_uring_buf_ring *ring;
+  size_t ring_size;
+  char *data;
+  size_t buffer_size;
+  unsigned entries;
+  uint16_t group;
+  uint16_t tail;
+} uring_buffers_t;
+
+// creates ring with entries submission slots. returns 0 on success, -1 on
+// error
+int uring_init(uring_t *ring, unsigned entries);
+
+void uring_destroy(uring_t *ring);
+
+// returns cleared submission slot. when queue is full, queued submissions
+// are passed to kernel first. returns NULL on error
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+// passes queued submissions to kernel and waits till at least wait_amount
+// completions are ready. returns amount of submitted entries, -1 on error
+int uring_submit(uring_t *ring, unsigned wait_amount);
+
+// returns next completion or NULL if there is none ready
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+// frees slot of completion returned by uring_peek_cqe()
+void uring_cqe_seen(uring_t *ring);
+
+// registers entries buffers of buffer_size bytes as group. entries must be
+// power of two. returns 0 on success, -1 on error (e.g. kernel before 5.19)
+int uring_buffers_init(uring_t *ring, uring_buffers_t *buffers,
+                       uint16_t group, unsigned entries, size_t buffer_size);
+
+void uring_buffers_destroy(uring_t *ring, uring_buffers_t *buffers);
+
+// returns buffer with id picked by kernel
+char *uring_buffer(uring_buffers_t *buffers, unsigned id);
+
+// gives buffer back to kernel once its data is consumed
+void uring_buffer_recycle(uring_buffers_t *buffers, unsigned id);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "proxy.h"
+
+// runs io_uring engine: proxy->workers_amount threads, each with its own
+// ring, share listen_fds[0]. accepts, receives, sends and splices are
+// submitted to ring in batches and their completions are reaped with one
+// io_uring_enter() per batch, so syscalls per request don't grow with
+// amount of connections. returns 0 when proxy is stopped and all threads
+// are finished, -1 right away if kernel has no usable io_uring
+int uring_reactor_run(proxy_t *proxy, const int *listen_fds,
+                      size_t listen_fds_amount);
@@ -0,0 +1,330 @@
+#include "access_log.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE_SIZE 64
+// records of one ring, power of two
+#define RING_SIZE 512
+// writer drains rings that often
+#define DRAIN_INTERVAL_MS 20
+#define FILE_BUFFER_SIZE (1 << 16)
+
+// single producer single consumer ring: head is moved only by thread owning
+// ring, tail only by writer. ring outlives its thread and is handed to the
+// next thread which starts logging, so threaded engine doesn't allocate ring
+// per connection
+typedef struct log_ring {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+  atomic_size_t dropped;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+  // guarded by rings_lock
+  int is_owned;
+  struct log_ring *next;
+  access_log_record_t records[RING_SIZE];
+} log_ring_t;
+
+static atomic_int is_running = 0;
+static FILE *file = NULL;
+static char *file_buffer = NULL;
+static pthread_t writer;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread log_ring_t *thread_ring = NULL;
+// all rings, new ones are added by producers, writer walks them
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+// wakes writer when log is stopped or some ring is half full
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static int is_stopping = 0;
+static atomic_size_t written = 0;
+// dropped records of rings freed by access_log_stop()
+static atomic_size_t freed_dropped = 0;
+
+/* ===== utility functions ===== */
+
+// called at thread exit: ring is left for the next thread, writer still
+// drains what's queued in it
+static void ring_release(void *arg) {
+  log_ring_t *ring = (log_ring_t *)arg;
+
+  pthread_mutex_lock(&rings_lock);
+  ring->is_owned = 0;
+  pthread_mutex_unlock(&rings_lock);
+
+  thread_ring = NULL;
+}
+
+static void key_create(void) {
+  pthread_key_create(&ring_key, ring_release);
+}
+
+// returns ring of calling thread, takes free ring or creates new one on first
+// use. returns NULL if there is no memory, then records are lost
+static log_ring_t *get_ring(void) {
+  if (thread_ring) {
+    return thread_ring;
+  }
+
+  pthread_once(&key_once, key_create);
+
+  pthread_mutex_lock(&rings_lock);
+  log_ring_t *ring = rings;
+  while (ring && ring->is_owned) {
+    ring = ring->next;
+  }
+  if (!ring) {
+    ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(log_ring_t));
+    if (!ring) {
+      pthread_mutex_unlock(&rings_lock);
+      return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->tail, 0);
+    ring->next = rings;
+    rings = ring;
+  }
+  ring->is_owned = 1;
+  pthread_mutex_unlock(&rings_lock);
+
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+// writes url quoted, with quotes, backslashes and non-printable bytes escaped
+static void write_url(const access_log_record_t *record) {
+  size_t size = record->url_size < ACCESS_LOG_MAX_URL ? record->url_size
+                                                      : ACCESS_LOG_MAX_URL;
+  putc_unlocked('"', file);
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = record->url[i];
+    if (c == '"' || c == '\\') {
+      putc_unlocked('\\', file);
+      putc_unlocked(c, file);
+    } else if (c < 0x20 || c >= 0x7f) {
+      fprintf(file, "\\x%02x", c);
+    } else {
+      putc_unlocked(c, file);
+    }
+  }
+  if (size < record->url_size) {
+    fputs("...", file);
+  }
+  putc_unlocked('"', file);
+}
+
+static void write_record(const access_log_record_t *record) {
+  // formatting of seconds is cached, records come mostly in time order
+  static time_t last_second = -1;
+  static char time_text[32];
+
+  time_t second = record->time_ns / 1000000000ULL;
+  if (second != last_second) {
+    struct tm tm;
+    gmtime_r(&second, &tm);
+    strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%S", &tm);
+    last_second = second;
+  }
+
+  fprintf(file, "%s.%06lluZ ", time_text,
+          (unsigned long long)(record->time_ns % 1000000000ULL / 1000));
+  if (record->status) {
+    fprintf(file, "status=%u", record->status);
+  } else {
+    fputs("status=-", file);
+  }
+  fprintf(file, " bytes=%llu duration_us=%llu url=",
+          (unsigned long long)record->bytes,
+          (unsigned long long)(record->duration_ns / 1000));
+  write_url(record);
+  putc_unlocked('\n', file);
+}
+
+// writes out records queued in rings. returns amount of written records
+static size_t drain_rings(void) {
+  size_t amount = 0;
+
+  pthread_mutex_lock(&rings_lock);
+  log_ring_t *head = rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  // rings are only prepended and never freed while writer runs, so list
+  // after head can be walked without lock
+  flockfile(file);
+  for (log_ring_t *ring = head; ring; ring = ring->next) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (; tail != end; tail++) {
+      write_record(&ring->records[tail & (RING_SIZE - 1)]);
+      amount++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+  if (amount) {
+    fflush_unlocked(file);
+  }
+  funlockfile(file);
+
+  atomic_fetch_add(&written, amount);
+  return amount;
+}
+
+static void *writer_routine(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&rings_lock);
+  while (!is_stopping) {
+    pthread_mutex_unlock(&rings_lock);
+    drain_rings();
+    pthread_mutex_lock(&rings_lock);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DRAIN_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    if (!is_stopping) {
+      pthread_cond_timedwait(&drain_cond, &rings_lock, &deadline);
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  drain_rings();
+  return NULL;
+}
+
+/* ===== end of utility functions ===== */
+
+int access_log_start(const char *path) {
+  if (!path || atomic_load(&is_running)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (strcmp(path, "-") == 0) {
+    file = stdout;
+  } else {
+    file = fopen(path, "a");
+    if (!file) {
+      return -1;
+    }
+    // writer flushes after every batch, buffer only has to hold one
+    file_buffer = malloc(FILE_BUFFER_SIZE);
+    if (file_buffer) {
+      setvbuf(file, file_buffer, _IOFBF, FILE_BUFFER_SIZE);
+    }
+  }
+
+  is_stopping = 0;
+  int err = pthread_create(&writer, NULL, writer_routine, NULL);
+  if (err) {
+    if (file != stdout) {
+      fclose(file);
+    }
+    free(file_buffer);
+    file = NULL;
+    file_buffer = NULL;
+    errno = err;
+    return -1;
+  }
+
+  atomic_store(&is_running, 1);
+  return 0;
+}
+
+void access_log_stop(void) {
+  if (!atomic_load(&is_running)) {
+    return;
+  }
+  atomic_store(&is_running, 0);
+
+  pthread_mutex_lock(&rings_lock);
+  is_stopping = 1;
+  pthread_cond_signal(&drain_cond);
+  pthread_mutex_unlock(&rings_lock);
+  pthread_join(writer, NULL);
+
+  if (file != stdout) {
+    fclose(file);
+  }
+  free(file_buffer);
+  file = NULL;
+  file_buffer = NULL;
+
+  pthread_mutex_lock(&rings_lock);
+  while (rings) {
+    log_ring_t *next = rings->next;
+    atomic_fetch_add(&freed_dropped, atomic_load(&rings->dropped));
+    free(rings);
+    rings = next;
+  }
+  pthread_mutex_unlock(&rings_lock);
+}
+
+void access_log_write(const char *url, size_t url_size, int status,
+                      size_t bytes, uint64_t start_ns) {
+  if (!atomic_load_explicit(&is_running, memory_order_relaxed)) {
+    return;
+  }
+
+  log_ring_t *ring = get_ring();
+  if (!ring) {
+    return;
+  }
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail >= RING_SIZE) {
+    atomic_store_explicit(
+        &ring->dropped,
+        atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    return;
+  }
+
+  access_log_record_t *record = &ring->records[head & (RING_SIZE - 1)];
+  uint64_t now = metrics_now();
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  record->time_ns = (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+  record->duration_ns = now > start_ns ? now - start_ns : 0;
+  record->bytes = bytes;
+  record->status = status;
+  record->url_size = url ? url_size : 0;
+  if (url) {
+    memcpy(record->url, url,
+           url_size < ACCESS_LOG_MAX_URL ? url_size : ACCESS_LOG_MAX_URL);
+  }
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+  // burst fills ring faster than writer drains it on its own, so it's
+  // woken up early. that happens once per half of ring, hot path stays free
+  // of syscalls otherwise
+  if (head - tail + 1 == RING_SIZE / 2) {
+    pthread_cond_signal(&drain_cond);
+  }
+}
+
+void access_log_get_stats(access_log_stats_t *stats) {
+  if (!stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  stats->written = atomic_load(&written);
+  stats->dropped = atomic_load(&freed_dropped);
+  pthread_mutex_lock(&rings_lock);
+  for (log_ring_t *ring = rings; ring; ring = ring->next) {
+    stats->dropped += atomic_load(&ring->dropped);
+  }
+  pthread_mutex_unlock(&rings_lock);
+}
@@ -0,0 +1,309 @@
+#include "admin.h"
+#include "access_log.h"
+#include "chunk.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define REQUEST_BUFFER_SIZE 4096
+// admin client has that long to send its request
+#define REQUEST_TIMEOUT_S 2
+// blocked admin thread checks that often if proxy is stopped
+#define STOP_CHECK_INTERVAL_MS 200
+
+static const char *phase_names[METRIC_PHASES_AMOUNT] = {
+    [METRIC_PHASE_PARSE] = "parse",
+    [METRIC_PHASE_LOOKUP] = "lookup",
+    [METRIC_PHASE_ORIGIN_CONNECT] = "origin_connect",
+    [METRIC_PHASE_ORIGIN_TTFB] = "origin_ttfb",
+    [METRIC_PHASE_SEND] = "send",
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/* ===== utility functions ===== */
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static void write_value(FILE *out, const char *name, const char *type,
+                        const char *help, size_t value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %zu\n", name, help, name, type,
+          name, value);
+}
+
+static void write_counter(FILE *out, const char *name, const char *help,
+                          size_t value) {
+  write_value(out, name, "counter", help, value);
+}
+
+static void write_gauge(FILE *out, const char *name, const char *help,
+                        size_t value) {
+  write_value(out, name, "gauge", help, value);
+}
+
+static void write_phases(FILE *out, const metrics_snapshot_t *snapshot) {
+  const char *name = "proxy_phase_duration_seconds";
+  fprintf(out,
+          "# HELP %s Time spent in phases of request handling.\n"
+          "# TYPE %s summary\n",
+          name, name);
+
+  for (size_t i = 0; i < METRIC_PHASES_AMOUNT; i++) {
+    const metrics_histogram_t *histogram = &snapshot->phases[i];
+    for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++) {
+      fprintf(out, "%s{phase=\"%s\",quantile=\"%g\"} %.9f\n", name,
+              phase_names[i], quantiles[j],
+              metrics_quantile(histogram, quantiles[j]) / 1e9);
+    }
+    fprintf(out, "%s_sum{phase=\"%s\"} %.9f\n", name, phase_names[i],
+            histogram->sum_ns / 1e9);
+    fprintf(out, "%s_count{phase=\"%s\"} %zu\n", name, phase_names[i],
+            histogram->count);
+  }
+}
+
+// reads request of admin client and answers it
+static void serve_client(proxy_t *proxy, int fd) {
+  struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT_S, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char request[REQUEST_BUFFER_SIZE];
+  size_t used = 0;
+  while (used < sizeof(request) - 1) {
+    ssize_t n = recv(fd, request + used, sizeof(request) - 1 - used, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    used += n;
+    request[used] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+  request[used] = '\0';
+
+  const char *path = "GET /metrics";
+  size_t path_size = strlen(path);
+  if (strncmp(request, path, path_size) != 0 ||
+      (request[path_size] != ' ' && request[path_size] != '?')) {
+    const char *not_found = "HTTP/1.0 404 Not Found\r\n"
+                            "Content-Length: 0\r\n"
+                            "\r\n";
+    send_all(fd, not_found, strlen(not_found));
+    return;
+  }
+
+  char *body = NULL;
+  size_t body_size = 0;
+  FILE *out = open_memstream(&body, &body_size);
+  if (!out) {
+    perror("admin:open_memstream");
+    return;
+  }
+  int result = admin_write_metrics(proxy, out);
+  fclose(out);
+  if (result < 0) {
+    free(body);
+    const char *error = "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+    send_all(fd, error, strlen(error));
+    return;
+  }
+
+  char headers[256];
+  int headers_size =
+      snprintf(headers, sizeof(headers),
+               "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %zu\r\n"
+               "\r\n",
+               body_size);
+
+  if (send_all(fd, headers, headers_size) == 0) {
+    send_all(fd, body, body_size);
+  }
+
+  free(body);
+}
+
+/* ===== end of utility functions ===== */
+
+int admin_write_metrics(proxy_t *proxy, FILE *out) {
+  if (!proxy || !out) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  metrics_snapshot_t *snapshot = malloc(sizeof(metrics_snapshot_t));
+  if (!snapshot) {
+    return -1;
+  }
+  metrics_collect(snapshot);
+
+  write_counter(out, "proxy_requests_total", "Client requests parsed.",
+                snapshot->counters[METRIC_REQUESTS]);
+  write_counter(out, "proxy_error_responses_total",
+                "Error responses generated by proxy.",
+                snapshot->counters[METRIC_ERRORS]);
+  write_counter(out, "proxy_client_received_bytes_total",
+                "Bytes received from clients.",
+                snapshot->counters[METRIC_CLIENT_BYTES_IN]);
+  write_counter(out, "proxy_client_sent_bytes_total",
+                "Bytes sent to clients.",
+                snapshot->counters[METRIC_CLIENT_BYTES_OUT]);
+  write_counter(out, "proxy_origin_received_bytes_total",
+                "Bytes received from origins.",
+                snapshot->counters[METRIC_ORIGIN_BYTES_IN]);
+  write_counter(out, "proxy_client_syscalls_total",
+                "Syscalls made by engine for client connections.",
+                snapshot->counters[METRIC_CLIENT_SYSCALLS]);
+  write_gauge(out, "proxy_active_connections", "Open client connections.",
+              atomic_load(&proxy->active_connections));
+  write_phases(out, snapshot);
+  free(snapshot);
+
+  cache_stats_t cache;
+  cache_get_stats(proxy->cache, &cache);
+
+  write_counter(out, "proxy_cache_hits_total", "Lookups which found entry.",
+                cache.hits);
+  write_counter(out, "proxy_cache_misses_total",
+                "Lookups which created entry.", cache.misses);
+  write_counter(out, "proxy_cache_revalidations_total",
+                "Stale entries revalidated.", cache.revalidations);
+  write_gauge(out, "proxy_cache_entries", "Entries in cache.",
+              cache.entries);
+  write_gauge(out, "proxy_cache_bytes", "Memory used by cache entries.",
+              cache.bytes);
+  write_gauge(out, "proxy_cache_max_bytes", "Cache memory budget.",
+              cache.max_bytes);
+  write_counter(out, "proxy_cache_evicted_entries_total",
+                "Entries evicted from memory.", cache.evicted_entries);
+  write_counter(out, "proxy_cache_evicted_bytes_total",
+                "Bytes evicted from memory.", cache.evicted_bytes);
+  write_gauge(out, "proxy_cache_memfd_entries", "Entries backed by memfd.",
+              cache.memfd_entries);
+  write_counter(out, "proxy_cache_streamed_entries_total",
+                "Responses streamed to clients without being cached.",
+                cache.streamed_entries);
+  write_counter(out, "proxy_cache_rejected_entries_total",
+                "New entries rejected by admission policy.",
+                cache.rejected_entries);
+
+  chunk_stats_t chunks;
+  chunk_get_stats(&chunks);
+
+  write_gauge(out, "proxy_chunk_used_bytes", "Chunks holding entry data.",
+              chunks.used_bytes);
+  write_gauge(out, "proxy_chunk_pooled_bytes", "Free chunks kept for reuse.",
+              chunks.pooled_bytes);
+
+  loader_stats_t loader;
+  loader_get_stats(proxy->loader, &loader);
+
+  write_counter(out, "proxy_loader_fetches_total",
+                "Requests which started download.", loader.fetches);
+  write_counter(out, "proxy_loader_coalesced_total",
+                "Requests which joined download in flight.",
+                loader.coalesced);
+  write_counter(out, "proxy_loader_rejected_total",
+                "Requests turned away because loader queue was full.",
+                loader.rejected);
+  write_gauge(out, "proxy_loader_queue_depth",
+              "Downloads waiting for loader worker.", loader.queued);
+
+  upstream_stats_t upstream;
+  upstream_get_stats(proxy->upstream, &upstream);
+
+  write_counter(out, "proxy_upstream_connects_total",
+                "New connections to origins.", upstream.connects);
+  write_counter(out, "proxy_upstream_reuses_total",
+                "Pooled origin connections reused.", upstream.reuses);
+  write_gauge(out, "proxy_upstream_idle_connections",
+              "Idle origin connections in pool.", upstream.idle);
+
+  resolver_stats_t resolver;
+  resolver_get_stats(proxy->resolver, &resolver);
+
+  write_counter(out, "proxy_resolver_hits_total",
+                "Lookups answered from resolver cache.", resolver.hits);
+  write_counter(out, "proxy_resolver_queries_total", "DNS queries sent.",
+                resolver.queries);
+  write_counter(out, "proxy_resolver_failures_total", "Failed lookups.",
+                resolver.failures);
+
+  if (proxy->disk) {
+    disk_stats_t disk;
+    disk_store_get_stats(proxy->disk, &disk);
+
+    write_gauge(out, "proxy_disk_entries", "Entries in disk tier.",
+                disk.entries);
+    write_gauge(out, "proxy_disk_bytes", "Disk used by disk tier.",
+                disk.bytes);
+    write_counter(out, "proxy_disk_writes_total",
+                  "Entries written to disk tier.", disk.writes);
+    write_counter(out, "proxy_disk_loads_total",
+                  "Entries loaded from disk tier.", disk.loads);
+  }
+
+  access_log_stats_t log;
+  access_log_get_stats(&log);
+
+  write_counter(out, "proxy_access_log_written_total",
+                "Access log records written.", log.written);
+  write_counter(out, "proxy_access_log_dropped_total",
+                "Access log records dropped because writer was behind.",
+                log.dropped);
+
+  return ferror(out) ? -1 : 0;
+}
+
+void *admin_routine(void *arg) {
+  proxy_t *proxy = (proxy_t *)arg;
+
+  while (proxy->running) {
+    struct pollfd pfd = {.fd = proxy->admin_fd, .events = POLLIN};
+    int n = poll(&pfd, 1, STOP_CHECK_INTERVAL_MS);
+    if (n < 0 && errno != EINTR) {
+      perror("admin:poll");
+      break;
+    }
+    if (n <= 0) {
+      continue;
+    }
+
+    int client_fd = accept(proxy->admin_fd, NULL, NULL);
+    if (client_fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("admin:accept");
+      }
+      continue;
+    }
+
+    serve_client(proxy, client_fd);
+    close(client_fd);
+  }
+
+  return NULL;
+}
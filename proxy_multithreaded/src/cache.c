@@ -1,68 +1,753 @@
 #include "cache.h"
+#include "chunk.h"
+#include "hash.h"
+#include "sketch.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
-#define CACHE_CLEAN_UP_LIMIT 100
+#define CACHE_STRIPE_BITS 6
+#define CACHE_STRIPES_AMOUNT (1 << CACHE_STRIPE_BITS)
+#define STRIPE_MIN_TABLE_SIZE 4
+// stripe table grows when it has more entries per bucket than that
+#define MAX_LOAD_FACTOR 2
+// and shrinks when it has less than one entry per that amount of buckets
+#define MIN_LOAD_FACTOR_INVERSE 8
+// buckets moved to the new table by every operation on the stripe
+#define REHASH_STEP 4
+#define MIN_CHUNKS_CAPACITY 8
+// loader of streamed entry runs at most that far ahead of its slowest reader
+#define CACHE_STREAM_WINDOW (1 << 20)
+// expected average size of entry, sizes TinyLFU sketch by cache budget
+#define SKETCH_OBJECT_SIZE 8192
+#define SKETCH_MIN_CAPACITY 1024
+// admission kicks in once less than 1/ADMISSION_HEADROOM of budget is free
+#define ADMISSION_HEADROOM 16
+// reader waiting for loader gets control back that often, so it can give up,
+// and so does loader waiting for readers of streamed entry
+#define WAIT_INTERVAL_MS 200
 
 /* ===== utility functions ===== */
 
-static size_t hash(const char *key, size_t buckets_amount) {
-  unsigned long hash = 5381;
-  int c;
-  while ((c = *key++)) {
-    hash = ((hash << 5) + hash) + (unsigned char)c;
+// lower bits of hash select stripe, the rest select bucket inside stripe.
+// hash_bytes() mixes all bits, so masks work for both
+static cache_stripe_t *hash_stripe(cache_t *cache, size_t hash) {
+  return &cache->stripes[hash & (CACHE_STRIPES_AMOUNT - 1)];
+}
+
+static size_t hash_bucket(size_t hash, size_t table_size) {
+  return (hash >> CACHE_STRIPE_BITS) & (table_size - 1);
+}
+
+static size_t round_up_pow2(size_t n) {
+  size_t size = STRIPE_MIN_TABLE_SIZE;
+  while (size < n) {
+    size <<= 1;
   }
-  return (size_t)(hash % buckets_amount);
+  return size;
 }
 
-/*
-hash-cleaning strategy:
-removing entries with 0 references (no one uses them right now) in case amount
-of entries in hash table more than CACHE_CLEAN_UP_LIMIT
-*/
-static void cache_clean_up(cache_t *cache) {
-  pthread_mutex_lock(&cache->lock);
+// hands entry unlinked from cache to spill callback if it's DONE, frees it
+// otherwise or if callback refuses it
+static void entry_retire(cache_t *cache, cache_entry_t *entry, int can_wait) {
+  if (entry->fd >= 0) {
+    cache->memfd_entries--;
+  }
+  // evicted before its revalidation started
+  if (entry->stale) {
+    cache_release(cache, entry->stale);
+    entry->stale = NULL;
+  }
+  if (cache->spill && entry->state == DONE &&
+      cache->spill(cache->spill_arg, entry, can_wait) == 0) {
+    return;
+  }
+  cache_entry_free(entry);
+}
 
-  for (size_t i = 0; i < cache->buckets_amount; i++) {
-    cache_entry_t *prev = NULL;
-    cache_entry_t *curr = cache->buckets[i];
-    while (curr) {
-      if (atomic_load(&curr->ref_count) != 0) {
-        prev = curr;
-        curr = curr->next;
+static void entry_charge(cache_t *cache, cache_entry_t *entry, size_t bytes) {
+  entry->charged_bytes += bytes;
+  cache->bytes += bytes;
+}
+
+static void entry_uncharge(cache_t *cache, cache_entry_t *entry,
+                           size_t bytes) {
+  entry->charged_bytes -= bytes;
+  cache->bytes -= bytes;
+}
+
+static size_t round_up_page(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+static int write_all(int fd, const char *data, size_t size, off_t offset) {
+  while (size) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
         continue;
       }
+      return -1;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
 
-      cache_entry_t *next = curr->next;
+// waits till loader appends data after offset or finishes entry, but not
+// longer than WAIT_INTERVAL_MS. entry->lock must be held
+static void entry_wait_data(cache_entry_t *entry, size_t offset) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += WAIT_INTERVAL_MS * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+
+  while (offset >= entry->data_size &&
+         (entry->state == REQUIRED || entry->state == LOADING)) {
+    if (pthread_cond_timedwait(&entry->cond, &entry->lock, &deadline) ==
+        ETIMEDOUT) {
+      return;
+    }
+  }
+}
+
+// returns chunk number idx of entry data, it must not be dropped
+static char *entry_chunk(cache_entry_t *entry, size_t idx) {
+  return entry->chunks[idx - entry->dropped_chunks];
+}
+
+static void entry_free_chunks(cache_entry_t *entry) {
+  for (size_t i = entry->dropped_chunks; i < entry->chunks_amount; i++) {
+    chunk_free(entry_chunk(entry, i), chunk_size(i));
+  }
+  free(entry->chunks);
+  entry->chunks = NULL;
+  entry->chunks_amount = 0;
+  entry->chunks_capacity = 0;
+}
+
+// adds chunk to the end of entry data. entry->lock must be held
+static int entry_add_chunk(cache_t *cache, cache_entry_t *entry) {
+  size_t kept = entry->chunks_amount - entry->dropped_chunks;
+  if (kept == entry->chunks_capacity) {
+    size_t new_capacity = entry->chunks_capacity
+                              ? entry->chunks_capacity * 2
+                              : MIN_CHUNKS_CAPACITY;
+    char **chunks = realloc(entry->chunks, new_capacity * sizeof(char *));
+    if (!chunks) {
+      return -1;
+    }
+    entry->chunks = chunks;
+    entry->chunks_capacity = new_capacity;
+  }
+
+  size_t size = chunk_size(entry->chunks_amount);
+  char *chunk = chunk_alloc(size);
+  if (!chunk) {
+    return -1;
+  }
+  entry->chunks[kept] = chunk;
+  entry->chunks_amount++;
+  entry->data_capacity += size;
+  entry_charge(cache, entry, size);
+  return 0;
+}
 
-      if (prev) {
-        prev->next = next;
-      } else {
-        cache->buckets[i] = next;
+// copies data to the end of entry chunks, adding them as needed.
+// entry->lock must be held
+static int entry_append_chunks(cache_t *cache, cache_entry_t *entry,
+                               const char *data, size_t size) {
+  while (size) {
+    if (entry->data_size == entry->data_capacity &&
+        entry_add_chunk(cache, entry) < 0) {
+      return -1;
+    }
+
+    size_t chunk_offset;
+    size_t idx = chunk_locate(entry->data_size, &chunk_offset);
+    size_t n = chunk_size(idx) - chunk_offset;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(entry_chunk(entry, idx) + chunk_offset, data, n);
+    entry->data_size += n;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// moves entry data from memory to new memfd. on failure (e.g. out of file
+// descriptors) entry just stays in memory. entry->lock must be held
+static void entry_move_to_memfd(cache_t *cache, cache_entry_t *entry) {
+  // chunks being sent can't be freed, move is tried again by next append.
+  // streamed entry drops its chunks anyway
+  if (atomic_load(&entry->senders) || entry->is_streamed) {
+    return;
+  }
+
+  int fd = memfd_create("cache_entry", MFD_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  struct iovec iov[CACHE_SEND_IOV_MAX];
+  for (size_t done = 0; done < entry->data_size;) {
+    size_t spans = cache_entry_iov(entry, done, entry->data_size - done, iov,
+                                   CACHE_SEND_IOV_MAX);
+    for (size_t i = 0; i < spans; i++) {
+      if (write_all(fd, iov[i].iov_base, iov[i].iov_len, done) < 0) {
+        close(fd);
+        return;
       }
+      done += iov[i].iov_len;
+    }
+  }
 
-      pthread_mutex_destroy(&curr->lock);
-      pthread_cond_destroy(&curr->cond);
-      free(curr->data);
-      free(curr->key);
-      free(curr);
+  entry_free_chunks(entry);
+  entry_uncharge(cache, entry, entry->data_capacity);
+  entry->data_capacity = round_up_page(entry->data_size);
+  entry_charge(cache, entry, entry->data_capacity);
+  entry->fd = fd;
+  cache->memfd_entries++;
+}
+
+// appends data to memfd of entry, charging every new page. entry->lock must
+// be held
+static int entry_append_memfd(cache_t *cache, cache_entry_t *entry,
+                              const char *data, size_t size) {
+  if (write_all(entry->fd, data, size, entry->data_size) < 0) {
+    return -1;
+  }
 
-      cache->entry_amount--;
+  size_t new_capacity = round_up_page(entry->data_size + size);
+  if (new_capacity > entry->data_capacity) {
+    entry_charge(cache, entry, new_capacity - entry->data_capacity);
+    entry->data_capacity = new_capacity;
+  }
+  return 0;
+}
+
+// returns offset below which data of streamed entry isn't needed anymore.
+// holder which hasn't joined yet will read from the start, so nothing more
+// is dropped until it does. loader holds one reference. entry->lock must be
+// held
+static size_t entry_stream_floor(cache_entry_t *entry) {
+  if (entry->readers_amount + 1 < atomic_load(&entry->ref_count)) {
+    return entry->dropped_size;
+  }
 
+  size_t floor = entry->data_size;
+  for (cache_reader_t *reader = entry->readers; reader;
+       reader = reader->next) {
+    size_t offset = atomic_load(&reader->offset);
+    if (offset < floor) {
+      floor = offset;
+    }
+  }
+  return floor;
+}
+
+// frees data of streamed entry below floor: whole chunks or whole pages of
+// memfd. readers send only from their offsets, which are above floor, so
+// nothing being sent is freed. entry->lock must be held
+static void entry_drop(cache_t *cache, cache_entry_t *entry, size_t floor) {
+  if (entry->fd >= 0) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = floor / page * page;
+    if (end > entry->dropped_size &&
+        fallocate(entry->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)entry->dropped_size,
+                  (off_t)(end - entry->dropped_size)) == 0) {
+      entry_uncharge(cache, entry, end - entry->dropped_size);
+      entry->dropped_size = end;
+    }
+    return;
+  }
+
+  size_t dropped = 0;
+  while (entry->dropped_chunks < entry->chunks_amount &&
+         entry->dropped_size + chunk_size(entry->dropped_chunks) <= floor) {
+    size_t size = chunk_size(entry->dropped_chunks);
+    chunk_free(entry->chunks[dropped], size);
+    entry_uncharge(cache, entry, size);
+    entry->dropped_size += size;
+    entry->dropped_chunks++;
+    dropped++;
+  }
+
+  // kept chunks move to the front, so table holds only the window and
+  // freed chunks come back from pool for the next appends: streamed
+  // response of any length cycles through the same few chunks
+  if (dropped) {
+    memmove(entry->chunks, entry->chunks + dropped,
+            (entry->chunks_amount - entry->dropped_chunks) * sizeof(char *));
+  }
+}
+
+// drops data of streamed entry its readers have sent and waits while loader
+// is more than CACHE_STREAM_WINDOW ahead of them. returns -1 with errno
+// ECANCELED if nobody but loader holds entry. entry->lock must be held.
+// release of entry which wasn't streamed yet drops its reference without
+// entry->lock and broadcast, so ref_count is rechecked every
+// WAIT_INTERVAL_MS
+static int entry_stream_wait(cache_t *cache, cache_entry_t *entry) {
+  while (1) {
+    if (atomic_load(&entry->ref_count) <= 1) {
+      errno = ECANCELED;
+      return -1;
+    }
+
+    size_t floor = entry_stream_floor(entry);
+    entry_drop(cache, entry, floor);
+    if (entry->data_size - floor <= CACHE_STREAM_WINDOW) {
+      return 0;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WAIT_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&entry->cond, &entry->lock, &deadline);
+  }
+}
+
+static void queue_push(cache_stripe_t *stripe, cache_entry_t *entry) {
+  entry->qprev = NULL;
+  entry->qnext = stripe->head;
+  if (stripe->head) {
+    stripe->head->qprev = entry;
+  } else {
+    stripe->tail = entry;
+  }
+  stripe->head = entry;
+  stripe->entry_amount++;
+}
+
+static void queue_remove(cache_stripe_t *stripe, cache_entry_t *entry) {
+  if (stripe->hand == entry) {
+    stripe->hand = entry->qprev;
+  }
+  if (entry->qprev) {
+    entry->qprev->qnext = entry->qnext;
+  } else {
+    stripe->head = entry->qnext;
+  }
+  if (entry->qnext) {
+    entry->qnext->qprev = entry->qprev;
+  } else {
+    stripe->tail = entry->qprev;
+  }
+  stripe->entry_amount--;
+}
+
+/* ===== stripe hash table ===== */
+
+/*
+resizing strategy:
+stripe table is resized when load factor leaves [1/MIN_LOAD_FACTOR_INVERSE,
+MAX_LOAD_FACTOR]. new table is allocated at once, but entries are moved into
+it by REHASH_STEP buckets on every following operation on the stripe, so no
+single request pays for moving the whole table.
+*/
+static void table_start_resize(cache_stripe_t *stripe, size_t new_size) {
+  cache_entry_t **table = calloc(new_size, sizeof(cache_entry_t *));
+  if (!table) {
+    // old table keeps working, resize is tried again by next operation
+    return;
+  }
+
+  stripe->table[1] = table;
+  stripe->table_size[1] = new_size;
+  stripe->rehash_idx = 0;
+  stripe->is_rehashing = 1;
+}
+
+static void table_rehash_step(cache_stripe_t *stripe) {
+  if (!stripe->is_rehashing) {
+    return;
+  }
+
+  for (size_t step = 0;
+       step < REHASH_STEP && stripe->rehash_idx < stripe->table_size[0];
+       step++) {
+    cache_entry_t *curr = stripe->table[0][stripe->rehash_idx];
+    while (curr) {
+      cache_entry_t *next = curr->next;
+      size_t idx = hash_bucket(curr->hash, stripe->table_size[1]);
+      curr->next = stripe->table[1][idx];
+      stripe->table[1][idx] = curr;
       curr = next;
     }
+    stripe->table[0][stripe->rehash_idx] = NULL;
+    stripe->rehash_idx++;
+  }
+
+  if (stripe->rehash_idx < stripe->table_size[0]) {
+    return;
+  }
+
+  free(stripe->table[0]);
+  stripe->table[0] = stripe->table[1];
+  stripe->table_size[0] = stripe->table_size[1];
+  stripe->table[1] = NULL;
+  stripe->table_size[1] = 0;
+  stripe->is_rehashing = 0;
+}
+
+static void table_check_load(cache_stripe_t *stripe) {
+  if (stripe->is_rehashing) {
+    return;
+  }
+
+  size_t size = stripe->table_size[0];
+  if (stripe->entry_amount > size * MAX_LOAD_FACTOR) {
+    table_start_resize(stripe, size * 2);
+  } else if (size > STRIPE_MIN_TABLE_SIZE &&
+             stripe->entry_amount < size / MIN_LOAD_FACTOR_INVERSE) {
+    table_start_resize(stripe, size / 2);
+  }
+}
+
+// returns chain where entry with hash lives right now
+static cache_entry_t **table_bucket(cache_stripe_t *stripe, size_t hash) {
+  size_t idx = hash_bucket(hash, stripe->table_size[0]);
+  if (stripe->is_rehashing && idx < stripe->rehash_idx) {
+    return &stripe->table[1][hash_bucket(hash, stripe->table_size[1])];
+  }
+  return &stripe->table[0][idx];
+}
+
+static cache_entry_t *table_find(cache_stripe_t *stripe, size_t hash,
+                                 const char *key, size_t key_size) {
+  cache_entry_t *entry = *table_bucket(stripe, hash);
+  while (entry) {
+    if (entry->hash == hash && entry->key_size == key_size &&
+        !memcmp(entry->key, key, key_size)) {
+      return entry;
+    }
+    entry = entry->next;
+  }
+  return NULL;
+}
+
+static void table_insert(cache_stripe_t *stripe, cache_entry_t *entry) {
+  cache_entry_t **bucket = table_bucket(stripe, entry->hash);
+  entry->next = *bucket;
+  *bucket = entry;
+}
+
+static void table_remove(cache_stripe_t *stripe, cache_entry_t *entry) {
+  cache_entry_t **curr = table_bucket(stripe, entry->hash);
+  while (*curr != entry) {
+    curr = &(*curr)->next;
+  }
+  *curr = entry->next;
+}
+
+/* ===== end of stripe hash table ===== */
+
+static cache_entry_t *entry_create(const char *key, size_t key_size,
+                                   size_t key_hash) {
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  if (!entry) {
+    return NULL;
+  }
+
+  entry->key = strndup(key, key_size);
+  entry->key_size = key_size;
+  if (!entry->key) {
+    free(entry);
+    return NULL;
+  }
+  entry->hash = key_hash;
+  entry->chunks = NULL;
+  entry->chunks_amount = 0;
+  entry->chunks_capacity = 0;
+  entry->data_size = 0;
+  entry->data_capacity = 0;
+  entry->senders = 0;
+  entry->fd = -1;
+  entry->header_size = 0;
+  entry->status = 0;
+  entry->is_persistent = 0;
+  entry->expires_at = 0;
+  entry->stale = NULL;
+  entry->is_unlinked = 0;
+  entry->is_streamed = 0;
+  entry->is_rejected = 0;
+  entry->dropped_size = 0;
+  entry->dropped_chunks = 0;
+  entry->readers = NULL;
+  entry->readers_amount = 0;
+  entry->state = REQUIRED;
+  entry->waiters = NULL;
+  entry->ref_count = 1;
+  entry->charged_bytes = 0;
+  entry->visited = 0;
+  pthread_mutex_init(&entry->lock, NULL);
+  pthread_cond_init(&entry->cond, NULL);
+  return entry;
+}
+
+// stripe->lock must be held
+static void stripe_link(cache_t *cache, cache_stripe_t *stripe,
+                        cache_entry_t *entry) {
+  table_insert(stripe, entry);
+  queue_push(stripe, entry);
+  table_check_load(stripe);
+  entry_charge(cache, entry, sizeof(cache_entry_t) + entry->key_size + 1);
+  cache->entry_amount++;
+}
+
+// takes entry out of table and eviction queue, so it lives only till its
+// last release. stripe->lock must be held
+static void stripe_unlink(cache_t *cache, cache_stripe_t *stripe,
+                          cache_entry_t *entry) {
+  table_remove(stripe, entry);
+  queue_remove(stripe, entry);
+  table_check_load(stripe);
+  entry->is_unlinked = 1;
+  cache->entry_amount--;
+}
+
+// replaces DONE entry with new one which revalidates it. returns new entry
+// acquired once or NULL if it can't be created. stripe->lock must be held
+static cache_entry_t *stripe_replace(cache_t *cache, cache_stripe_t *stripe,
+                                     cache_entry_t *entry) {
+  cache_entry_t *replacement =
+      entry_create(entry->key, entry->key_size, entry->hash);
+  if (!replacement) {
+    return NULL;
+  }
+
+  // reference of replacement keeps stale entry alive after it's unlinked
+  entry->ref_count++;
+  replacement->stale = entry;
+  stripe_unlink(cache, stripe, entry);
+  stripe_link(cache, stripe, replacement);
+  atomic_fetch_add_explicit(&stripe->revalidations, 1, memory_order_relaxed);
+  return replacement;
+}
+
+// returns acquired rejected entry of key which new reader can still join:
+// it's loading and nothing is dropped from its start yet, so the reader gets
+// whole response. stripe->lock must be held
+static cache_entry_t *stripe_join_rejected(cache_stripe_t *stripe,
+                                           size_t hash, const char *key,
+                                           size_t key_size) {
+  for (cache_entry_t *entry = stripe->rejected; entry; entry = entry->next) {
+    if (entry->hash != hash || entry->key_size != key_size ||
+        memcmp(entry->key, key, key_size)) {
+      continue;
+    }
+
+    // data is dropped only under entry lock, while every holder has joined
+    pthread_mutex_lock(&entry->lock);
+    int is_joinable = !entry->dropped_size && (entry->state == REQUIRED ||
+                                               entry->state == LOADING);
+    if (is_joinable) {
+      entry->ref_count++;
+    }
+    pthread_mutex_unlock(&entry->lock);
+    if (is_joinable) {
+      return entry;
+    }
   }
+  return NULL;
+}
 
-  pthread_mutex_unlock(&cache->lock);
+// takes entry out of rejected list, so it isn't joined anymore.
+// stripe->lock must be held
+static void stripe_forget_rejected(cache_stripe_t *stripe,
+                                   cache_entry_t *entry) {
+  if (!entry->is_rejected) {
+    return;
+  }
+  cache_entry_t **curr = &stripe->rejected;
+  while (*curr != entry) {
+    curr = &(*curr)->next;
+  }
+  *curr = entry->next;
+  entry->next = NULL;
+  entry->is_rejected = 0;
+}
+
+// frees entry unlinked from table once nobody uses it
+static void entry_destroy(cache_t *cache, cache_entry_t *entry) {
+  cache->bytes -= entry->charged_bytes;
+  if (entry->fd >= 0) {
+    cache->memfd_entries--;
+  }
+  if (entry->stale) {
+    cache_release(cache, entry->stale);
+  }
+  cache_entry_free(entry);
+}
+
+/*
+eviction strategy (SIEVE):
+every stripe keeps its entries in insertion order and a hand, which walks
+from the oldest entry to the newest one. entries hit since the hand passed
+them last time are only unmarked, first unmarked entry nobody uses
+(ref == 0) is evicted. so hot entries stay resident no matter how old they
+are and only one entry is evicted per step.
+returns 1 if entry was evicted, 0 if stripe has nothing to evict
+*/
+static int stripe_evict_one(cache_t *cache, cache_stripe_t *stripe) {
+  cache_entry_t *victim = NULL;
+
+  pthread_mutex_lock(&stripe->lock);
+
+  cache_entry_t *curr = stripe->hand ? stripe->hand : stripe->tail;
+  // every entry may be passed twice: to unmark it and to evict it
+  size_t steps = 2 * stripe->entry_amount;
+  while (curr && steps--) {
+    cache_entry_t *newer = curr->qprev ? curr->qprev : stripe->tail;
+
+    if (!atomic_exchange(&curr->visited, 0) &&
+        atomic_load(&curr->ref_count) == 0) {
+      victim = curr;
+      stripe->hand = curr->qprev;
+      break;
+    }
+
+    curr = newer;
+  }
+
+  if (!victim) {
+    stripe->hand = curr;
+    pthread_mutex_unlock(&stripe->lock);
+    return 0;
+  }
+
+  table_remove(stripe, victim);
+  queue_remove(stripe, victim);
+  table_rehash_step(stripe);
+  table_check_load(stripe);
+  cache->entry_amount--;
+
+  size_t bytes = victim->charged_bytes;
+  cache->bytes -= bytes;
+  atomic_fetch_add_explicit(&stripe->evicted_entries, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stripe->evicted_bytes, bytes,
+                            memory_order_relaxed);
+
+  pthread_mutex_unlock(&stripe->lock);
+
+  // nobody references victim, so it's read without lock
+  entry_retire(cache, victim, 0);
+
+  return 1;
+}
+
+// evicts entries one by one, walking stripes round robin, until cache fits
+// into its budget or nothing can be evicted
+static void cache_evict(cache_t *cache) {
+  if (atomic_exchange(&cache->is_evicting, 1)) {
+    return;
+  }
+
+  size_t failed_stripes = 0;
+  while (atomic_load(&cache->bytes) > cache->max_bytes &&
+         failed_stripes < CACHE_STRIPES_AMOUNT) {
+    size_t idx = atomic_fetch_add(&cache->evict_cursor, 1);
+    cache_stripe_t *stripe = &cache->stripes[idx % CACHE_STRIPES_AMOUNT];
+    if (stripe_evict_one(cache, stripe)) {
+      failed_stripes = 0;
+    } else {
+      failed_stripes++;
+    }
+  }
+
+  cache->is_evicting = 0;
+}
+
+// fills span with up to size bytes of entry data from offset. chunks of
+// span are pinned by entry->senders. returns like cache_entry_span().
+// entry->lock must be held
+static ssize_t entry_prepare_span(cache_entry_t *entry, size_t offset,
+                                  size_t size, cache_span_t *span) {
+  span->iov_amount = 0;
+
+  if (entry->state == ERROR) {
+    errno = EIO;
+    return -1;
+  }
+
+  if (offset >= entry->data_size) {
+    if (entry->state == DONE) {
+      return 0;
+    }
+    errno = ENODATA;
+    return -1;
+  }
+
+  size_t available = entry->data_size - offset;
+  if (size > available) {
+    size = available;
+  }
+
+  if (entry->fd >= 0) {
+    span->fd = entry->fd;
+    span->offset = (off_t)offset;
+    span->size = size;
+    return (ssize_t)size;
+  }
+
+  span->iov_amount =
+      cache_entry_iov(entry, offset, size, span->iov, CACHE_SEND_IOV_MAX);
+  span->size = 0;
+  for (size_t i = 0; i < span->iov_amount; i++) {
+    span->size += span->iov[i].iov_len;
+  }
+  entry->senders++;
+  return (ssize_t)span->size;
+}
+
+/*
+admission strategy (TinyLFU):
+while cache has room every new entry is admitted. once it's nearly full, new
+entry would push out entry under eviction hand of its stripe, so it's
+admitted only if its key was requested more often recently than key of that
+victim. one-hit wonders are streamed to their readers then and don't wash
+out entries which are hit repeatedly.
+stripe->lock must be held
+*/
+static int entry_admit(cache_t *cache, cache_stripe_t *stripe,
+                       size_t key_hash) {
+  if (!cache->sketch ||
+      atomic_load(&cache->bytes) <=
+          cache->max_bytes - cache->max_bytes / ADMISSION_HEADROOM) {
+    return 1;
+  }
+
+  cache_entry_t *victim = stripe->hand ? stripe->hand : stripe->tail;
+  if (!victim) {
+    return 1;
+  }
+  return sketch_frequency(cache->sketch, key_hash) >
+         sketch_frequency(cache->sketch, victim->hash);
 }
 
 /* ===== end of utility functions ===== */
 
-cache_t *cache_create(size_t buckets_amount) {
-  if (!buckets_amount) {
+cache_t *cache_create(size_t buckets_amount, size_t max_bytes,
+                      size_t memfd_threshold) {
+  if (!buckets_amount || !max_bytes) {
     errno = EINVAL;
     return NULL;
   }
@@ -72,19 +757,47 @@ cache_t *cache_create(size_t buckets_amount) {
     return NULL;
   }
 
-  cache->buckets = calloc(buckets_amount, sizeof(cache_entry_t *));
-  if (!cache->buckets) {
+  cache->stripes_amount = CACHE_STRIPES_AMOUNT;
+  cache->entry_amount = 0;
+  cache->bytes = 0;
+  cache->max_bytes = max_bytes;
+  cache->evict_cursor = 0;
+  cache->is_evicting = 0;
+  cache->memfd_threshold = memfd_threshold;
+  cache->memfd_entries = 0;
+  cache->spill = NULL;
+  cache->spill_arg = NULL;
+  cache->max_object_bytes = 0;
+  cache->sketch = NULL;
+  cache->rejected_entries = 0;
+  cache->streamed_entries = 0;
+
+  cache->stripes = aligned_alloc(
+      CACHE_LINE_SIZE, cache->stripes_amount * sizeof(cache_stripe_t));
+  if (!cache->stripes) {
     free(cache);
     return NULL;
   }
+  memset(cache->stripes, 0, cache->stripes_amount * sizeof(cache_stripe_t));
 
-  cache->buckets_amount = buckets_amount;
-  cache->entry_amount = 0;
+  size_t table_size =
+      round_up_pow2((buckets_amount + CACHE_STRIPES_AMOUNT - 1) /
+                    CACHE_STRIPES_AMOUNT);
 
-  if (pthread_mutex_init(&cache->lock, NULL)) {
-    free(cache->buckets);
-    free(cache);
-    return NULL;
+  for (size_t i = 0; i < cache->stripes_amount; i++) {
+    cache_stripe_t *stripe = &cache->stripes[i];
+    stripe->table[0] = calloc(table_size, sizeof(cache_entry_t *));
+    stripe->table_size[0] = table_size;
+    if (!stripe->table[0] || pthread_mutex_init(&stripe->lock, NULL)) {
+      free(stripe->table[0]);
+      while (i--) {
+        pthread_mutex_destroy(&cache->stripes[i].lock);
+        free(cache->stripes[i].table[0]);
+      }
+      free(cache->stripes);
+      free(cache);
+      return NULL;
+    }
   }
 
   return cache;
@@ -96,93 +809,714 @@ void cache_destroy(cache_t *cache) {
     return;
   }
 
-  pthread_mutex_lock(&cache->lock);
+  for (size_t i = 0; i < cache->stripes_amount; i++) {
+    cache_stripe_t *stripe = &cache->stripes[i];
 
-  for (size_t i = 0; i < cache->buckets_amount; i++) {
-    cache_entry_t *curr = cache->buckets[i];
+    // every entry is in eviction queue, whichever table it is in
+    cache_entry_t *curr = stripe->head;
     while (curr) {
-      cache_entry_t *next = curr->next;
-      free(curr->key);
-      free(curr->data);
-      pthread_mutex_destroy(&curr->lock);
-      pthread_cond_destroy(&curr->cond);
-      free(curr);
+      cache_entry_t *next = curr->qnext;
+      entry_retire(cache, curr, 1);
       curr = next;
     }
+
+    free(stripe->table[0]);
+    free(stripe->table[1]);
+    pthread_mutex_destroy(&stripe->lock);
   }
-  free(cache->buckets);
+  free(cache->stripes);
+
+  sketch_destroy(cache->sketch);
+  free(cache);
+}
 
-  pthread_mutex_unlock(&cache->lock);
+void cache_set_spill(cache_t *cache, cache_spill_t spill, void *arg) {
+  if (!cache) {
+    errno = EINVAL;
+    return;
+  }
 
-  pthread_mutex_destroy(&cache->lock);
+  cache->spill = spill;
+  cache->spill_arg = arg;
+}
 
-  free(cache);
+int cache_set_admission(cache_t *cache, size_t max_object_bytes,
+                        int is_tinylfu) {
+  if (!cache) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cache->max_object_bytes = max_object_bytes;
+  if (!is_tinylfu) {
+    return 0;
+  }
+
+  size_t capacity = cache->max_bytes / SKETCH_OBJECT_SIZE;
+  if (capacity < SKETCH_MIN_CAPACITY) {
+    capacity = SKETCH_MIN_CAPACITY;
+  }
+  cache->sketch = sketch_create(capacity);
+  return cache->sketch ? 0 : -1;
 }
 
-cache_entry_t *cache_acquire(cache_t *cache, char *key) {
+void cache_entry_free(cache_entry_t *entry) {
+  if (!entry) {
+    errno = EINVAL;
+    return;
+  }
+
+  pthread_mutex_destroy(&entry->lock);
+  pthread_cond_destroy(&entry->cond);
+  if (entry->fd >= 0) {
+    close(entry->fd);
+  }
+  entry_free_chunks(entry);
+  free(entry->key);
+  free(entry);
+}
+
+cache_entry_t *cache_acquire(cache_t *cache, const char *key,
+                             size_t key_size) {
   if (!cache || !key) {
     errno = EINVAL;
     return NULL;
   }
 
-  size_t idx = hash(key, cache->buckets_amount);
+  size_t key_hash = hash_bytes(key, key_size);
+  cache_stripe_t *stripe = hash_stripe(cache, key_hash);
 
-  pthread_mutex_lock(&cache->lock);
+  // hashing is done before locking, so stripe is held only for chain walk
+  pthread_mutex_lock(&stripe->lock);
 
-  cache_entry_t *entry = cache->buckets[idx];
-  while (entry) {
-    if (strcmp(entry->key, key)) {
-      entry = entry->next;
-      continue;
+  table_rehash_step(stripe);
+
+  // every lookup counts, so frequency covers keys which aren't cached
+  sketch_increment(cache->sketch, key_hash);
+
+  cache_entry_t *entry = table_find(stripe, key_hash, key, key_size);
+  if (entry) {
+    // failed entry nobody uses is loaded once again instead of serving error
+    // until it's evicted. no one else can touch it while stripe is locked
+    if (atomic_load(&entry->ref_count) == 0 && entry->state == ERROR) {
+      entry_free_chunks(entry);
+      if (entry->fd >= 0) {
+        close(entry->fd);
+        entry->fd = -1;
+        cache->memfd_entries--;
+      }
+      entry_uncharge(cache, entry, entry->data_capacity);
+      entry->data_size = 0;
+      entry->data_capacity = 0;
+      entry->header_size = 0;
+      entry->status = 0;
+      entry->is_persistent = 0;
+      entry->expires_at = 0;
+      entry->state = REQUIRED;
+      atomic_fetch_add_explicit(&stripe->misses, 1, memory_order_relaxed);
+    } else if (entry->state == DONE && entry->expires_at <= time(NULL)) {
+      // if replacement can't be created, stale entry is served as is
+      cache_entry_t *replacement = stripe_replace(cache, stripe, entry);
+      if (replacement) {
+        pthread_mutex_unlock(&stripe->lock);
+        return replacement;
+      }
+      entry->visited = 1;
+    } else {
+      entry->visited = 1;
+      atomic_fetch_add_explicit(&stripe->hits, 1, memory_order_relaxed);
     }
+
     entry->ref_count++;
-    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&stripe->lock);
+    return entry;
+  }
+
+  // download of key cache didn't admit can still be shared
+  entry = stripe_join_rejected(stripe, key_hash, key, key_size);
+  if (entry) {
+    atomic_fetch_add_explicit(&stripe->hits, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&stripe->lock);
     return entry;
   }
 
   // not found — create new entry
-  entry = calloc(1, sizeof(cache_entry_t));
+  entry = entry_create(key, key_size, key_hash);
   if (!entry) {
-    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_unlock(&stripe->lock);
     return NULL;
   }
 
-  entry->key = strdup(key);
-  if (!entry->key) {
-    pthread_mutex_unlock(&cache->lock);
-    free(entry);
-    return NULL;
+  atomic_fetch_add_explicit(&stripe->misses, 1, memory_order_relaxed);
+
+  if (!entry_admit(cache, stripe, key_hash)) {
+    // rejected entry is never linked, it's only streamed to this request and
+    // to the ones joining it
+    entry->is_unlinked = 1;
+    entry->is_streamed = 1;
+    entry->is_rejected = 1;
+    entry->next = stripe->rejected;
+    stripe->rejected = entry;
+    cache->rejected_entries++;
+    cache->streamed_entries++;
+    pthread_mutex_unlock(&stripe->lock);
+    return entry;
   }
-  entry->data = NULL;
-  entry->data_size = 0;
-  entry->data_capacity = 0;
-  entry->state = REQUIRED;
-  entry->ref_count = 1;
-  pthread_mutex_init(&entry->lock, NULL);
-  pthread_cond_init(&entry->cond, NULL);
 
-  // insert into hash table
-  entry->next = cache->buckets[idx];
-  cache->buckets[idx] = entry;
+  stripe_link(cache, stripe, entry);
 
-  pthread_mutex_unlock(&cache->lock);
+  pthread_mutex_unlock(&stripe->lock);
 
-  cache->entry_amount++;
+  if (atomic_load(&cache->bytes) > cache->max_bytes) {
+    cache_evict(cache);
+  }
 
   return entry;
 }
 
+cache_entry_t *cache_revalidate(cache_t *cache, cache_entry_t *entry) {
+  if (!cache || !entry) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  cache_stripe_t *stripe = hash_stripe(cache, entry->hash);
+
+  pthread_mutex_lock(&stripe->lock);
+  cache_entry_t *replacement = NULL;
+  if (entry->state == DONE && !entry->is_unlinked) {
+    replacement = stripe_replace(cache, stripe, entry);
+  }
+  pthread_mutex_unlock(&stripe->lock);
+
+  if (!replacement) {
+    return entry;
+  }
+  cache_release(cache, entry);
+  return replacement;
+}
+
 void cache_release(cache_t *cache, cache_entry_t *entry) {
   if (!cache || !entry) {
     errno = EINVAL;
     return;
   }
 
-  entry->ref_count--;
+  // loader of streamed entry waits for its readers, so it's told when one
+  // of them is gone
+  if (atomic_load(&entry->is_streamed)) {
+    // rejected entry is joined under stripe lock, so it leaves rejected list
+    // with the last release under the same lock
+    cache_stripe_t *stripe = NULL;
+    if (atomic_load(&entry->is_rejected)) {
+      stripe = hash_stripe(cache, entry->hash);
+      pthread_mutex_lock(&stripe->lock);
+    }
+    pthread_mutex_lock(&entry->lock);
+    int is_last = atomic_fetch_sub(&entry->ref_count, 1) == 1;
+    pthread_cond_broadcast(&entry->cond);
+    pthread_mutex_unlock(&entry->lock);
+    if (stripe) {
+      if (is_last) {
+        stripe_forget_rejected(stripe, entry);
+      }
+      pthread_mutex_unlock(&stripe->lock);
+    }
+    if (is_last) {
+      entry_destroy(cache, entry);
+    }
+    return;
+  }
+
+  // release which isn't the last one can't race with eviction
+  size_t ref_count = atomic_load(&entry->ref_count);
+  while (ref_count > 1) {
+    if (atomic_compare_exchange_weak(&entry->ref_count, &ref_count,
+                                     ref_count - 1)) {
+      return;
+    }
+  }
+
+  // the last reference is dropped under stripe lock: linked entry may be
+  // evicted right after it, and unlinking happens under the same lock
+  cache_stripe_t *stripe = hash_stripe(cache, entry->hash);
+  pthread_mutex_lock(&stripe->lock);
+  int is_last = atomic_fetch_sub(&entry->ref_count, 1) == 1;
+  int is_unlinked = entry->is_unlinked;
+  pthread_mutex_unlock(&stripe->lock);
+
+  if (is_last && is_unlinked) {
+    entry_destroy(cache, entry);
+  }
+}
+
+void cache_entry_unlink(cache_t *cache, cache_entry_t *entry) {
+  if (!cache || !entry) {
+    errno = EINVAL;
+    return;
+  }
+
+  cache_stripe_t *stripe = hash_stripe(cache, entry->hash);
+
+  pthread_mutex_lock(&stripe->lock);
+  int is_unlinked = 0;
+  if (!entry->is_unlinked) {
+    stripe_unlink(cache, stripe, entry);
+    is_unlinked = 1;
+  }
+  // uncacheable response isn't shared with later requests either
+  stripe_forget_rejected(stripe, entry);
+  pthread_mutex_unlock(&stripe->lock);
+
+  // entry still being loaded is streamed to readers which wait for it
+  pthread_mutex_lock(&entry->lock);
+  if (is_unlinked && !entry->is_streamed &&
+      (entry->state == REQUIRED || entry->state == LOADING)) {
+    entry->is_streamed = 1;
+    cache->streamed_entries++;
+  }
+  pthread_mutex_unlock(&entry->lock);
+}
+
+int cache_entry_copy(cache_t *cache, cache_entry_t *entry,
+                     cache_entry_t *src) {
+  if (!cache || !entry || !src) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // DONE entry doesn't change anymore, so its data is used without lock
+  pthread_mutex_lock(&src->lock);
+  int is_done = src->state == DONE;
+  pthread_mutex_unlock(&src->lock);
+  if (!is_done) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (src->fd < 0) {
+    pthread_mutex_lock(&entry->lock);
+    entry->header_size = src->header_size;
+    entry->status = src->status;
+    entry->is_persistent = src->is_persistent;
+    pthread_mutex_unlock(&entry->lock);
+
+    struct iovec iov[CACHE_SEND_IOV_MAX];
+    for (size_t done = 0; done < src->data_size;) {
+      size_t spans = cache_entry_iov(src, done, src->data_size - done, iov,
+                                     CACHE_SEND_IOV_MAX);
+      for (size_t i = 0; i < spans; i++) {
+        if (cache_entry_append(cache, entry, iov[i].iov_base,
+                               iov[i].iov_len) < 0) {
+          return -1;
+        }
+        done += iov[i].iov_len;
+      }
+    }
+    return 0;
+  }
+
+  // pages of memfd below data_size are never rewritten, both entries read
+  // the same file
+  int fd = dup(src->fd);
+  if (fd < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&entry->lock);
+  entry->header_size = src->header_size;
+  entry->status = src->status;
+  entry->is_persistent = src->is_persistent;
+  entry->fd = fd;
+  entry->data_size = src->data_size;
+  entry->data_capacity = round_up_page(src->data_size);
+  entry_charge(cache, entry, entry->data_capacity);
+  cache->memfd_entries++;
+  cache_entry_notify(entry);
+  pthread_mutex_unlock(&entry->lock);
+
+  if (atomic_load(&cache->bytes) > cache->max_bytes) {
+    cache_evict(cache);
+  }
+  return 0;
+}
+
+int cache_entry_append(cache_t *cache, cache_entry_t *entry, const char *data,
+                       size_t size) {
+  if (!cache || !entry || (!data && size)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // only loader appends, so data_size is stable without lock
+  if (cache->max_object_bytes && !atomic_load(&entry->is_streamed) &&
+      entry->data_size + size > cache->max_object_bytes) {
+    cache_entry_unlink(cache, entry);
+  }
+
+  pthread_mutex_lock(&entry->lock);
+
+  if (entry->is_streamed && entry_stream_wait(cache, entry) < 0) {
+    pthread_mutex_unlock(&entry->lock);
+    return -1;
+  }
+
+  if (entry->fd < 0 && cache->memfd_threshold &&
+      entry->data_size + size > cache->memfd_threshold) {
+    entry_move_to_memfd(cache, entry);
+  }
+
+  int result;
+  if (entry->fd >= 0) {
+    result = entry_append_memfd(cache, entry, data, size);
+    if (!result) {
+      entry->data_size += size;
+    }
+  } else {
+    // whatever was copied before failure stays readable
+    result = entry_append_chunks(cache, entry, data, size);
+  }
+  cache_entry_notify(entry);
+
+  if (result < 0) {
+    pthread_mutex_unlock(&entry->lock);
+    return -1;
+  }
+
+  pthread_mutex_unlock(&entry->lock);
+
+  // loader holds entry, so it's never evicted here, only colder ones
+  if (atomic_load(&cache->bytes) > cache->max_bytes) {
+    cache_evict(cache);
+  }
+
+  return 0;
+}
+
+void cache_entry_finish(cache_t *cache, cache_entry_t *entry,
+                        cache_state_t state) {
+  if (!cache || !entry) {
+    errno = EINVAL;
+    return;
+  }
+
+  pthread_mutex_lock(&entry->lock);
+
+  // spare room of the last chunk stays charged: readers may be sending from
+  // it, so it can't be shrunk in place
+  entry->state = state;
+  cache_entry_notify(entry);
+  cache_entry_t *stale = entry->stale;
+  entry->stale = NULL;
+  pthread_mutex_unlock(&entry->lock);
+
+  // finished rejected entry can't be joined anymore
+  if (atomic_load(&entry->is_rejected)) {
+    cache_stripe_t *stripe = hash_stripe(cache, entry->hash);
+    pthread_mutex_lock(&stripe->lock);
+    stripe_forget_rejected(stripe, entry);
+    pthread_mutex_unlock(&stripe->lock);
+  }
+
+  if (stale) {
+    cache_release(cache, stale);
+  }
+}
+
+ssize_t cache_entry_read(cache_entry_t *entry, size_t offset, char *buffer,
+                         size_t size, int wait) {
+  if (!entry || !buffer) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&entry->lock);
+
+  if (wait) {
+    entry_wait_data(entry, offset);
+  }
+
+  if (entry->state == ERROR) {
+    pthread_mutex_unlock(&entry->lock);
+    errno = EIO;
+    return -1;
+  }
+
+  if (offset >= entry->data_size) {
+    int is_finished = entry->state == DONE;
+    pthread_mutex_unlock(&entry->lock);
+    if (is_finished) {
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  size_t available = entry->data_size - offset;
+  if (size > available) {
+    size = available;
+  }
+  if (entry->fd >= 0) {
+    ssize_t n = pread(entry->fd, buffer, size, offset);
+    pthread_mutex_unlock(&entry->lock);
+    return n;
+  }
+
+  // chunks can be moved to memfd by next append, so they're copied under lock
+  for (size_t done = 0; done < size;) {
+    size_t chunk_offset;
+    size_t idx = chunk_locate(offset + done, &chunk_offset);
+    size_t n = chunk_size(idx) - chunk_offset;
+    if (n > size - done) {
+      n = size - done;
+    }
+    memcpy(buffer + done, entry_chunk(entry, idx) + chunk_offset, n);
+    done += n;
+  }
+
+  pthread_mutex_unlock(&entry->lock);
+
+  return (ssize_t)size;
+}
+
+ssize_t cache_entry_send(cache_entry_t *entry, size_t offset, int fd,
+                         size_t size, int wait) {
+  if (!entry || fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&entry->lock);
+
+  if (wait) {
+    entry_wait_data(entry, offset);
+  }
+
+  cache_span_t span;
+  ssize_t prepared = entry_prepare_span(entry, offset, size, &span);
+
+  pthread_mutex_unlock(&entry->lock);
+
+  if (prepared <= 0) {
+    return prepared;
+  }
+
+  // memfd is never replaced and pages below data_size are never rewritten,
+  // so sendfile() doesn't need the lock
+  if (!span.iov_amount) {
+    return sendfile(fd, span.fd, &span.offset, span.size);
+  }
+
+  // filled part of chunks is never rewritten, and chunks aren't freed while
+  // entry has senders, so sendmsg() doesn't need the lock
+  struct msghdr message = {0};
+  message.msg_iov = span.iov;
+  message.msg_iovlen = span.iov_amount;
+  ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+  cache_span_release(entry, &span);
+  return n;
+}
+
+ssize_t cache_entry_span(cache_entry_t *entry, size_t offset, size_t size,
+                         cache_span_t *span) {
+  if (!entry || !span) {
+    errno = EINVAL;
+    return -1;
+  }
 
-  if (atomic_load(&cache->entry_amount) < CACHE_CLEAN_UP_LIMIT) {
+  pthread_mutex_lock(&entry->lock);
+  ssize_t prepared = entry_prepare_span(entry, offset, size, span);
+  pthread_mutex_unlock(&entry->lock);
+  return prepared;
+}
+
+void cache_span_release(cache_entry_t *entry, cache_span_t *span) {
+  if (!entry || !span) {
+    errno = EINVAL;
     return;
   }
 
-  cache_clean_up(cache);
+  if (span->iov_amount) {
+    entry->senders--;
+    span->iov_amount = 0;
+  }
+}
+
+size_t cache_entry_iov(cache_entry_t *entry, size_t offset, size_t size,
+                       struct iovec *iov, size_t iov_max) {
+  if (!entry || (!iov && iov_max)) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  if (entry->fd >= 0 || offset >= entry->data_size) {
+    return 0;
+  }
+  if (size > entry->data_size - offset) {
+    size = entry->data_size - offset;
+  }
+
+  size_t spans = 0;
+  while (size && spans < iov_max) {
+    size_t chunk_offset;
+    size_t idx = chunk_locate(offset, &chunk_offset);
+    size_t n = chunk_size(idx) - chunk_offset;
+    if (n > size) {
+      n = size;
+    }
+    iov[spans].iov_base = entry_chunk(entry, idx) + chunk_offset;
+    iov[spans].iov_len = n;
+    spans++;
+    offset += n;
+    size -= n;
+  }
+  return spans;
+}
+
+void cache_entry_join(cache_entry_t *entry, cache_reader_t *reader) {
+  if (!entry || !reader) {
+    errno = EINVAL;
+    return;
+  }
+
+  atomic_store(&reader->offset, 0);
+  reader->is_joined = 0;
+
+  pthread_mutex_lock(&entry->lock);
+  if (entry->state == REQUIRED || entry->state == LOADING) {
+    reader->prev = NULL;
+    reader->next = entry->readers;
+    if (entry->readers) {
+      entry->readers->prev = reader;
+    }
+    entry->readers = reader;
+    entry->readers_amount++;
+    reader->is_joined = 1;
+  }
+  pthread_mutex_unlock(&entry->lock);
+}
+
+void cache_reader_advance(cache_entry_t *entry, cache_reader_t *reader,
+                          size_t offset) {
+  if (!entry || !reader) {
+    errno = EINVAL;
+    return;
+  }
+
+  atomic_store(&reader->offset, offset);
+
+  // loader of cached entry never waits for readers
+  if (reader->is_joined && atomic_load(&entry->is_streamed)) {
+    pthread_mutex_lock(&entry->lock);
+    pthread_cond_broadcast(&entry->cond);
+    pthread_mutex_unlock(&entry->lock);
+  }
+}
+
+void cache_entry_leave(cache_entry_t *entry, cache_reader_t *reader) {
+  if (!entry || !reader) {
+    errno = EINVAL;
+    return;
+  }
+
+  if (!reader->is_joined) {
+    return;
+  }
+
+  pthread_mutex_lock(&entry->lock);
+  if (reader->prev) {
+    reader->prev->next = reader->next;
+  } else {
+    entry->readers = reader->next;
+  }
+  if (reader->next) {
+    reader->next->prev = reader->prev;
+  }
+  entry->readers_amount--;
+  pthread_cond_broadcast(&entry->cond);
+  pthread_mutex_unlock(&entry->lock);
+
+  reader->prev = NULL;
+  reader->next = NULL;
+  reader->is_joined = 0;
+}
+
+void cache_retain(cache_entry_t *entry) {
+  if (!entry) {
+    errno = EINVAL;
+    return;
+  }
+
+  entry->ref_count++;
+}
+
+int cache_entry_status(cache_entry_t *entry) {
+  pthread_mutex_lock(&entry->lock);
+  int status = entry->status;
+  pthread_mutex_unlock(&entry->lock);
+  return status;
+}
+
+void cache_entry_notify(cache_entry_t *entry) {
+  pthread_cond_broadcast(&entry->cond);
+
+  cache_waiter_t *waiter = entry->waiters;
+  while (waiter) {
+    cache_waiter_t *next = waiter->next;
+    waiter->notify(waiter);
+    waiter = next;
+  }
+}
+
+void cache_entry_watch(cache_entry_t *entry, cache_waiter_t *waiter) {
+  waiter->prev = NULL;
+  waiter->next = entry->waiters;
+  if (entry->waiters) {
+    entry->waiters->prev = waiter;
+  }
+  entry->waiters = waiter;
+}
+
+void cache_entry_unwatch(cache_entry_t *entry, cache_waiter_t *waiter) {
+  if (waiter->prev) {
+    waiter->prev->next = waiter->next;
+  } else {
+    entry->waiters = waiter->next;
+  }
+  if (waiter->next) {
+    waiter->next->prev = waiter->prev;
+  }
+  waiter->prev = NULL;
+  waiter->next = NULL;
+}
+
+void cache_get_stats(cache_t *cache, cache_stats_t *stats) {
+  if (!cache || !stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  memset(stats, 0, sizeof(cache_stats_t));
+  for (size_t i = 0; i < cache->stripes_amount; i++) {
+    cache_stripe_t *stripe = &cache->stripes[i];
+    stats->hits += atomic_load_explicit(&stripe->hits, memory_order_relaxed);
+    stats->misses +=
+        atomic_load_explicit(&stripe->misses, memory_order_relaxed);
+    stats->revalidations +=
+        atomic_load_explicit(&stripe->revalidations, memory_order_relaxed);
+    stats->evicted_entries +=
+        atomic_load_explicit(&stripe->evicted_entries, memory_order_relaxed);
+    stats->evicted_bytes +=
+        atomic_load_explicit(&stripe->evicted_bytes, memory_order_relaxed);
+
+    pthread_mutex_lock(&stripe->lock);
+    stats->buckets += stripe->table_size[0] + stripe->table_size[1];
+    pthread_mutex_unlock(&stripe->lock);
+  }
+  stats->entries = atomic_load(&cache->entry_amount);
+  stats->bytes = atomic_load(&cache->bytes);
+  stats->max_bytes = cache->max_bytes;
+  stats->memfd_entries = atomic_load(&cache->memfd_entries);
+  stats->rejected_entries = atomic_load(&cache->rejected_entries);
+  stats->streamed_entries = atomic_load(&cache->streamed_entries);
 }
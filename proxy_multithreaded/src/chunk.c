@@ -0,0 +1,128 @@
+#include "chunk.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define CACHE_LINE_SIZE 64
+// sum of sizes of chunks smaller than CHUNK_SIZE, they come first in entry
+#define SMALL_CHUNKS_BYTES (CHUNK_SIZE - CHUNK_MIN_SIZE)
+#define SMALL_CHUNKS_AMOUNT (CHUNK_CLASSES_AMOUNT - 1)
+
+// free chunk, list link lives in chunk memory itself
+typedef struct free_chunk {
+  struct free_chunk *next;
+} free_chunk_t;
+
+// free list of one chunk size. lists are locked independently and don't
+// share cache lines
+typedef struct {
+  pthread_mutex_t lock;
+  free_chunk_t *head;
+} __attribute__((aligned(CACHE_LINE_SIZE))) chunk_class_t;
+
+static chunk_class_t classes[CHUNK_CLASSES_AMOUNT] = {
+    [0 ... CHUNK_CLASSES_AMOUNT - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL}};
+
+static atomic_size_t used_bytes;
+static atomic_size_t pooled_bytes;
+static atomic_size_t allocations;
+static atomic_size_t reuses;
+
+/* ===== utility functions ===== */
+
+static size_t log2_floor(size_t n) {
+  return sizeof(unsigned long) * 8 - 1 - __builtin_clzl((unsigned long)n);
+}
+
+static chunk_class_t *size_class(size_t size) {
+  size_t idx = log2_floor(size) - CHUNK_MIN_SHIFT;
+  if (idx >= CHUNK_CLASSES_AMOUNT) {
+    idx = CHUNK_CLASSES_AMOUNT - 1;
+  }
+  return &classes[idx];
+}
+
+/* ===== end of utility functions ===== */
+
+size_t chunk_size(size_t idx) {
+  if (idx >= SMALL_CHUNKS_AMOUNT) {
+    return CHUNK_SIZE;
+  }
+  return CHUNK_MIN_SIZE << idx;
+}
+
+size_t chunk_locate(size_t offset, size_t *chunk_offset) {
+  if (offset >= SMALL_CHUNKS_BYTES) {
+    size_t rest = offset - SMALL_CHUNKS_BYTES;
+    *chunk_offset = rest & (CHUNK_SIZE - 1);
+    return SMALL_CHUNKS_AMOUNT + (rest >> CHUNK_SHIFT);
+  }
+
+  // chunk idx starts at CHUNK_MIN_SIZE * (2^idx - 1)
+  size_t idx = log2_floor((offset >> CHUNK_MIN_SHIFT) + 1);
+  *chunk_offset = offset - (CHUNK_MIN_SIZE << idx) + CHUNK_MIN_SIZE;
+  return idx;
+}
+
+char *chunk_alloc(size_t size) {
+  chunk_class_t *class = size_class(size);
+
+  pthread_mutex_lock(&class->lock);
+  free_chunk_t *chunk = class->head;
+  if (chunk) {
+    class->head = chunk->next;
+  }
+  pthread_mutex_unlock(&class->lock);
+
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  if (chunk) {
+    atomic_fetch_sub_explicit(&pooled_bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&reuses, 1, memory_order_relaxed);
+  } else {
+    chunk = malloc(size);
+    if (!chunk) {
+      return NULL;
+    }
+  }
+  atomic_fetch_add_explicit(&used_bytes, size, memory_order_relaxed);
+  return (char *)chunk;
+}
+
+void chunk_free(char *chunk, size_t size) {
+  if (!chunk) {
+    errno = EINVAL;
+    return;
+  }
+
+  atomic_fetch_sub_explicit(&used_bytes, size, memory_order_relaxed);
+
+  // pool may overshoot its limit a little under concurrent frees
+  if (atomic_load_explicit(&pooled_bytes, memory_order_relaxed) + size >
+      CHUNK_POOL_MAX_BYTES) {
+    free(chunk);
+    return;
+  }
+  atomic_fetch_add_explicit(&pooled_bytes, size, memory_order_relaxed);
+
+  chunk_class_t *class = size_class(size);
+  free_chunk_t *free_chunk = (free_chunk_t *)chunk;
+
+  pthread_mutex_lock(&class->lock);
+  free_chunk->next = class->head;
+  class->head = free_chunk;
+  pthread_mutex_unlock(&class->lock);
+}
+
+void chunk_get_stats(chunk_stats_t *stats) {
+  if (!stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  stats->used_bytes = atomic_load(&used_bytes);
+  stats->pooled_bytes = atomic_load(&pooled_bytes);
+  stats->allocations = atomic_load(&allocations);
+  stats->reuses = atomic_load(&reuses);
+}
@@ -0,0 +1,776 @@
+#include "disk.h"
+#include "hash.h"
+#include "http.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DISK_RECORD_MAGIC 0x32435250 // "PRC2"
+#define DISK_FLAG_PERSISTENT 1
+// power of two, index takes low bits of key hash
+#define DISK_BUCKETS_AMOUNT 65536
+#define DISK_SEGMENT_MAX_SIZE (64UL << 20)
+// store is split into at least that many segments, so dropping the oldest
+// one doesn't throw away too much of it
+#define DISK_MIN_SEGMENTS 8
+// evicted entries waiting for writer, the rest are dropped
+#define DISK_MAX_QUEUED_BYTES (64UL << 20)
+#define COPY_CHUNK_SIZE 65536
+// spans of in-memory entry data written per cache_entry_iov() call
+#define WRITE_IOV_MAX 16
+#define MAX_PATH 4096
+// detached store checks that often if dir lock is released
+#define LOCK_RETRY_INTERVAL_MS 100
+
+/* ===== utility functions ===== */
+
+// FNV-1a over record header (without checksum field) and key
+static uint32_t record_checksum(const disk_record_t *record, const char *key) {
+  uint32_t hash = 2166136261u;
+  const unsigned char *bytes = (const unsigned char *)record;
+  for (size_t i = 0; i < offsetof(disk_record_t, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  for (size_t i = 0; i < record->key_size; i++) {
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int pwrite_all(int fd, const char *data, size_t size, off_t offset) {
+  while (size) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// returns -1 with errno EIO if file ends before size bytes are read
+static int pread_all(int fd, char *data, size_t size, off_t offset) {
+  while (size) {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      errno = EIO;
+      return -1;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static void segment_path(disk_store_t *store, size_t id, char *path) {
+  snprintf(path, MAX_PATH, "%s/%08zu.seg", store->dir, id);
+}
+
+static disk_segment_t *segment_open(disk_store_t *store, size_t id,
+                                    int flags) {
+  disk_segment_t *segment = calloc(1, sizeof(disk_segment_t));
+  if (!segment) {
+    return NULL;
+  }
+
+  char path[MAX_PATH];
+  segment_path(store, id, path);
+  segment->fd = open(path, O_RDWR | O_CLOEXEC | flags, 0644);
+  if (segment->fd < 0) {
+    perror("disk_store:open");
+    free(segment);
+    return NULL;
+  }
+  segment->id = id;
+  return segment;
+}
+
+// store->lock must be held
+static disk_entry_t **index_find(disk_store_t *store, size_t hash,
+                                 const char *key, size_t key_size) {
+  disk_entry_t **curr = &store->buckets[hash & (store->buckets_amount - 1)];
+  while (*curr && ((*curr)->hash != hash || (*curr)->key_size != key_size ||
+                   memcmp((*curr)->key, key, key_size))) {
+    curr = &(*curr)->next;
+  }
+  return curr;
+}
+
+// points key to its newest record. store->lock must be held
+static int index_put(disk_store_t *store, const char *key, size_t key_size,
+                     disk_segment_t *segment, off_t offset,
+                     const disk_record_t *record) {
+  size_t hash = hash_bytes(key, key_size);
+  disk_entry_t **slot = index_find(store, hash, key, key_size);
+  disk_entry_t *entry = *slot;
+  if (!entry) {
+    entry = calloc(1, sizeof(disk_entry_t));
+    if (!entry) {
+      return -1;
+    }
+    entry->key = malloc(key_size);
+    if (!entry->key) {
+      free(entry);
+      return -1;
+    }
+    memcpy(entry->key, key, key_size);
+    entry->key_size = key_size;
+    entry->hash = hash;
+    *slot = entry;
+    store->entry_amount++;
+  }
+
+  entry->segment = segment;
+  entry->offset = offset;
+  entry->data_size = record->data_size;
+  entry->header_size = record->header_size;
+  entry->expires_at = (time_t)record->expires_at;
+  entry->is_persistent = record->flags & DISK_FLAG_PERSISTENT;
+  return 0;
+}
+
+static void segment_close(disk_segment_t *segment) {
+  close(segment->fd);
+  free(segment);
+}
+
+// deletes the oldest segment with all records in it. readers still copying
+// from it keep it open till they finish. store->lock must be held
+static void drop_oldest(disk_store_t *store) {
+  disk_segment_t *segment = store->head;
+
+  for (size_t i = 0; i < store->buckets_amount; i++) {
+    disk_entry_t **curr = &store->buckets[i];
+    while (*curr) {
+      disk_entry_t *entry = *curr;
+      if (entry->segment != segment) {
+        curr = &entry->next;
+        continue;
+      }
+      *curr = entry->next;
+      free(entry->key);
+      free(entry);
+      store->entry_amount--;
+    }
+  }
+
+  store->head = segment->next;
+  if (store->tail == segment) {
+    store->tail = NULL;
+  }
+  store->segment_amount--;
+  store->bytes -= segment->size;
+
+  char path[MAX_PATH];
+  segment_path(store, segment->id, path);
+  if (unlink(path) < 0) {
+    perror("disk_store:unlink");
+  }
+
+  if (segment->ref_count) {
+    segment->is_dropped = 1;
+  } else {
+    segment_close(segment);
+  }
+}
+
+// indexes records of segment read from disk. torn record left by crash and
+// everything after it is cut off
+static int segment_scan(disk_store_t *store, disk_segment_t *segment) {
+  struct stat st;
+  if (fstat(segment->fd, &st) < 0) {
+    perror("disk_store:fstat");
+    return -1;
+  }
+
+  char key[MAX_URL];
+  off_t offset = 0;
+  while (offset < st.st_size) {
+    disk_record_t record;
+    if (pread_all(segment->fd, (char *)&record, sizeof(record), offset) < 0 ||
+        record.magic != DISK_RECORD_MAGIC || record.key_size > sizeof(key) ||
+        pread_all(segment->fd, key, record.key_size,
+                  offset + sizeof(record)) < 0 ||
+        record.checksum != record_checksum(&record, key)) {
+      break;
+    }
+
+    off_t data_offset = offset + sizeof(record) + record.key_size;
+    if (record.data_size > (uint64_t)(st.st_size - data_offset)) {
+      break;
+    }
+
+    if (index_put(store, key, record.key_size, segment, data_offset,
+                  &record) < 0) {
+      return -1;
+    }
+    offset = data_offset + record.data_size;
+  }
+
+  if (offset < st.st_size) {
+    fprintf(stderr, "disk_store: segment %zu is cut at %lld of %lld bytes\n",
+            segment->id, (long long)offset, (long long)st.st_size);
+    if (ftruncate(segment->fd, offset) < 0) {
+      perror("disk_store:ftruncate");
+    }
+  }
+  segment->size = offset;
+  return 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+  size_t x = *(const size_t *)a;
+  size_t y = *(const size_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// opens segments left in store dir oldest first and rebuilds index from them
+static int store_load(disk_store_t *store) {
+  DIR *dir = opendir(store->dir);
+  if (!dir) {
+    perror("disk_store:opendir");
+    return -1;
+  }
+
+  size_t *ids = NULL;
+  size_t ids_amount = 0;
+  size_t ids_capacity = 0;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    size_t id;
+    int length = 0;
+    if (sscanf(dirent->d_name, "%zu.seg%n", &id, &length) != 1 || !length ||
+        dirent->d_name[length]) {
+      continue;
+    }
+    if (ids_amount == ids_capacity) {
+      ids_capacity = ids_capacity ? ids_capacity * 2 : 16;
+      size_t *new_ids = realloc(ids, ids_capacity * sizeof(size_t));
+      if (!new_ids) {
+        free(ids);
+        closedir(dir);
+        return -1;
+      }
+      ids = new_ids;
+    }
+    ids[ids_amount++] = id;
+  }
+  closedir(dir);
+
+  qsort(ids, ids_amount, sizeof(size_t), compare_ids);
+
+  for (size_t i = 0; i < ids_amount; i++) {
+    disk_segment_t *segment = segment_open(store, ids[i], 0);
+    if (!segment) {
+      free(ids);
+      return -1;
+    }
+    if (store->tail) {
+      store->tail->next = segment;
+    } else {
+      store->head = segment;
+    }
+    store->tail = segment;
+    store->segment_amount++;
+
+    if (segment_scan(store, segment) < 0) {
+      free(ids);
+      return -1;
+    }
+    store->bytes += segment->size;
+  }
+  free(ids);
+
+  // store could be reopened with smaller budget
+  while (store->bytes > store->max_bytes && store->head) {
+    drop_oldest(store);
+  }
+  return 0;
+}
+
+// makes room for record of record_size bytes at the end of the newest
+// segment. returns that segment or NULL. store->lock must be held
+static disk_segment_t *reserve_space(disk_store_t *store,
+                                     size_t record_size) {
+  if (!store->tail || (store->tail->size &&
+                       store->tail->size + record_size >
+                           store->segment_max_size)) {
+    size_t id = store->tail ? store->tail->id + 1 : 0;
+    disk_segment_t *segment = segment_open(store, id, O_CREAT | O_TRUNC);
+    if (!segment) {
+      return NULL;
+    }
+    if (store->tail) {
+      store->tail->next = segment;
+    } else {
+      store->head = segment;
+    }
+    store->tail = segment;
+    store->segment_amount++;
+  }
+
+  while (store->bytes + record_size > store->max_bytes &&
+         store->head != store->tail) {
+    drop_oldest(store);
+  }
+  return store->tail;
+}
+
+static int write_data(int fd, cache_entry_t *entry, off_t offset) {
+  if (entry->fd < 0) {
+    struct iovec iov[WRITE_IOV_MAX];
+    for (size_t done = 0; done < entry->data_size;) {
+      size_t spans = cache_entry_iov(entry, done, entry->data_size - done, iov,
+                                     WRITE_IOV_MAX);
+      for (size_t i = 0; i < spans; i++) {
+        if (pwrite_all(fd, iov[i].iov_base, iov[i].iov_len, offset + done) <
+            0) {
+          return -1;
+        }
+        done += iov[i].iov_len;
+      }
+    }
+    return 0;
+  }
+
+  char buffer[COPY_CHUNK_SIZE];
+  for (size_t done = 0; done < entry->data_size;) {
+    size_t size = entry->data_size - done;
+    if (size > sizeof(buffer)) {
+      size = sizeof(buffer);
+    }
+    if (pread_all(entry->fd, buffer, size, done) < 0 ||
+        pwrite_all(fd, buffer, size, offset + done) < 0) {
+      return -1;
+    }
+    done += size;
+  }
+  return 0;
+}
+
+// appends record of entry to the newest segment. only writer thread appends,
+// so record is written without lock and indexed once it's complete
+static void store_write(disk_store_t *store, cache_entry_t *entry) {
+  size_t key_size = entry->key_size;
+  disk_record_t record = {
+      .magic = DISK_RECORD_MAGIC,
+      .key_size = key_size,
+      .data_size = entry->data_size,
+      .header_size = entry->header_size,
+      .expires_at = entry->expires_at,
+      .flags = entry->is_persistent ? DISK_FLAG_PERSISTENT : 0,
+  };
+  record.checksum = record_checksum(&record, entry->key);
+  size_t record_size = sizeof(record) + key_size + entry->data_size;
+
+  pthread_mutex_lock(&store->lock);
+  // entry loaded from disk and evicted unchanged is there already
+  disk_entry_t *existing = *index_find(
+      store, hash_bytes(entry->key, key_size), entry->key, key_size);
+  if ((existing && existing->data_size == entry->data_size &&
+       existing->expires_at == entry->expires_at) ||
+      key_size > MAX_URL || record_size > store->max_bytes) {
+    pthread_mutex_unlock(&store->lock);
+    return;
+  }
+  disk_segment_t *segment = reserve_space(store, record_size);
+  pthread_mutex_unlock(&store->lock);
+  if (!segment) {
+    return;
+  }
+
+  off_t offset = segment->size;
+  off_t data_offset = offset + sizeof(record) + key_size;
+  if (pwrite_all(segment->fd, (const char *)&record, sizeof(record), offset) <
+          0 ||
+      pwrite_all(segment->fd, entry->key, key_size, offset + sizeof(record)) <
+          0 ||
+      write_data(segment->fd, entry, data_offset) < 0) {
+    // partial record is overwritten by the next one
+    perror("disk_store:write");
+    return;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  segment->size += record_size;
+  store->bytes += record_size;
+  index_put(store, entry->key, key_size, segment, data_offset, &record);
+  pthread_mutex_unlock(&store->lock);
+
+  store->writes++;
+}
+
+// waits till dir lock is released by other process and builds index. returns
+// 0 when store is ready, -1 if store is stopped meanwhile or index failed
+static int store_attach(disk_store_t *store) {
+  while (flock(store->lock_fd, LOCK_EX | LOCK_NB) < 0) {
+    if (errno != EWOULDBLOCK && errno != EINTR) {
+      perror("disk_store:flock");
+      return -1;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    int is_stopping = store->is_stopping;
+    pthread_mutex_unlock(&store->lock);
+    if (is_stopping) {
+      return -1;
+    }
+    usleep(LOCK_RETRY_INTERVAL_MS * 1000);
+  }
+
+  // nobody touches index till store is ready
+  if (store_load(store) < 0) {
+    fprintf(stderr, "disk_store: failed to index %s, disk tier is off\n",
+            store->dir);
+    return -1;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  store->is_ready = 1;
+  pthread_mutex_unlock(&store->lock);
+  printf("Disk cache %s attached\n", store->dir);
+  return 0;
+}
+
+static void *writer_routine(void *arg) {
+  disk_store_t *store = (disk_store_t *)arg;
+
+  if (!store->is_ready && store_attach(store) < 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  while (1) {
+    disk_job_t *job = store->jobs_head;
+    if (!job) {
+      if (store->is_stopping) {
+        break;
+      }
+      pthread_cond_wait(&store->changed, &store->lock);
+      continue;
+    }
+    store->jobs_head = job->next;
+    if (!store->jobs_head) {
+      store->jobs_tail = NULL;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    size_t size = job->entry->data_size;
+    store_write(store, job->entry);
+    cache_entry_free(job->entry);
+    free(job);
+
+    pthread_mutex_lock(&store->lock);
+    store->queued_bytes -= size;
+    // spilling thread may wait for room in queue
+    pthread_cond_broadcast(&store->changed);
+  }
+  pthread_mutex_unlock(&store->lock);
+
+  return NULL;
+}
+
+/* ===== end of utility functions ===== */
+
+disk_store_t *disk_store_create(const char *dir, size_t max_bytes) {
+  if (!dir || !max_bytes) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    perror("disk_store:mkdir");
+    return NULL;
+  }
+
+  disk_store_t *store = calloc(1, sizeof(disk_store_t));
+  if (!store) {
+    return NULL;
+  }
+
+  store->dir = strdup(dir);
+  store->max_bytes = max_bytes;
+  store->segment_max_size = max_bytes / DISK_MIN_SEGMENTS;
+  if (store->segment_max_size > DISK_SEGMENT_MAX_SIZE) {
+    store->segment_max_size = DISK_SEGMENT_MAX_SIZE;
+  }
+  store->lock_fd = -1;
+  store->buckets_amount = DISK_BUCKETS_AMOUNT;
+  store->buckets = calloc(store->buckets_amount, sizeof(disk_entry_t *));
+  if (!store->dir || !store->buckets) {
+    free(store->buckets);
+    free(store->dir);
+    free(store);
+    return NULL;
+  }
+
+  pthread_mutex_init(&store->lock, NULL);
+  pthread_cond_init(&store->changed, NULL);
+
+  char path[MAX_PATH];
+  snprintf(path, sizeof(path), "%s/lock", store->dir);
+  store->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (store->lock_fd < 0) {
+    perror("disk_store:open lock");
+    disk_store_destroy(store);
+    return NULL;
+  }
+
+  // previous process keeps dir while it drains and flushes its cache here,
+  // it's picked up by writer after that
+  if (flock(store->lock_fd, LOCK_EX | LOCK_NB) == 0) {
+    if (store_load(store) < 0) {
+      disk_store_destroy(store);
+      return NULL;
+    }
+    store->is_ready = 1;
+  } else if (errno == EWOULDBLOCK) {
+    printf("Disk cache %s is used by another process, waiting for it\n",
+           store->dir);
+  } else {
+    perror("disk_store:flock");
+    disk_store_destroy(store);
+    return NULL;
+  }
+
+  if (pthread_create(&store->writer, NULL, writer_routine, store)) {
+    perror("pthread_create");
+    disk_store_destroy(store);
+    return NULL;
+  }
+  store->is_writer_running = 1;
+
+  return store;
+}
+
+void disk_store_destroy(disk_store_t *store) {
+  if (!store) {
+    errno = EINVAL;
+    return;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  store->is_stopping = 1;
+  pthread_cond_broadcast(&store->changed);
+  pthread_mutex_unlock(&store->lock);
+
+  // writer drains its queue before it exits
+  if (store->is_writer_running) {
+    pthread_join(store->writer, NULL);
+  }
+
+  if (store->tail && fdatasync(store->tail->fd) < 0) {
+    perror("disk_store:fdatasync");
+  }
+
+  disk_segment_t *segment = store->head;
+  while (segment) {
+    disk_segment_t *next = segment->next;
+    segment_close(segment);
+    segment = next;
+  }
+
+  for (size_t i = 0; i < store->buckets_amount; i++) {
+    disk_entry_t *entry = store->buckets[i];
+    while (entry) {
+      disk_entry_t *next = entry->next;
+      free(entry->key);
+      free(entry);
+      entry = next;
+    }
+  }
+
+  // lock goes last, after everything is synced for the next process
+  if (store->lock_fd >= 0) {
+    close(store->lock_fd);
+  }
+
+  pthread_cond_destroy(&store->changed);
+  pthread_mutex_destroy(&store->lock);
+  free(store->buckets);
+  free(store->dir);
+  free(store);
+}
+
+int disk_store_spill(void *arg, cache_entry_t *entry, int can_wait) {
+  disk_store_t *store = (disk_store_t *)arg;
+  if (!store || !entry) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  disk_job_t *job = malloc(sizeof(disk_job_t));
+  if (!job) {
+    return -1;
+  }
+  job->entry = entry;
+  job->next = NULL;
+
+  pthread_mutex_lock(&store->lock);
+
+  if (!store->is_ready) {
+    pthread_mutex_unlock(&store->lock);
+    free(job);
+    store->dropped++;
+    return -1;
+  }
+
+  while (store->jobs_head &&
+         store->queued_bytes + entry->data_size > DISK_MAX_QUEUED_BYTES) {
+    if (!can_wait || store->is_stopping) {
+      pthread_mutex_unlock(&store->lock);
+      free(job);
+      store->dropped++;
+      return -1;
+    }
+    pthread_cond_wait(&store->changed, &store->lock);
+  }
+
+  if (store->jobs_tail) {
+    store->jobs_tail->next = job;
+  } else {
+    store->jobs_head = job;
+  }
+  store->jobs_tail = job;
+  store->queued_bytes += entry->data_size;
+  pthread_cond_broadcast(&store->changed);
+
+  pthread_mutex_unlock(&store->lock);
+
+  return 0;
+}
+
+int disk_store_contains(disk_store_t *store, const char *key,
+                        size_t key_size) {
+  if (!store || !key) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  if (!store->is_ready) {
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+  }
+  disk_entry_t *entry =
+      *index_find(store, hash_bytes(key, key_size), key, key_size);
+  int is_found = entry && entry->expires_at > time(NULL);
+  pthread_mutex_unlock(&store->lock);
+
+  return is_found;
+}
+
+int disk_store_load(disk_store_t *store, cache_t *cache,
+                    cache_entry_t *entry) {
+  if (!store || !cache || !entry) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t key_size = entry->key_size;
+
+  pthread_mutex_lock(&store->lock);
+  disk_entry_t *record =
+      store->is_ready ? *index_find(store, hash_bytes(entry->key, key_size),
+                                    entry->key, key_size)
+                      : NULL;
+  if (!record) {
+    pthread_mutex_unlock(&store->lock);
+    errno = ENOENT;
+    return -1;
+  }
+  // segment stays open while data is copied, even if it's dropped meanwhile
+  disk_segment_t *segment = record->segment;
+  segment->ref_count++;
+  off_t offset = record->offset;
+  size_t data_size = record->data_size;
+  size_t header_size = record->header_size;
+  time_t expires_at = record->expires_at;
+  int is_persistent = record->is_persistent;
+  pthread_mutex_unlock(&store->lock);
+
+  pthread_mutex_lock(&entry->lock);
+  entry->header_size = header_size;
+  entry->expires_at = expires_at;
+  entry->is_persistent = is_persistent;
+  pthread_mutex_unlock(&entry->lock);
+
+  int result = 0;
+  char buffer[COPY_CHUNK_SIZE];
+  for (size_t done = 0; done < data_size;) {
+    size_t size = data_size - done;
+    if (size > sizeof(buffer)) {
+      size = sizeof(buffer);
+    }
+    if (pread_all(segment->fd, buffer, size, offset + done) < 0) {
+      result = -1;
+      break;
+    }
+    // record keeps no status, it's read from stored header block
+    if (!done) {
+      int status = 0;
+      http_parse_status(buffer, size, &status);
+      pthread_mutex_lock(&entry->lock);
+      entry->status = status;
+      pthread_mutex_unlock(&entry->lock);
+    }
+    if (cache_entry_append(cache, entry, buffer, size) < 0) {
+      result = -1;
+      break;
+    }
+    done += size;
+  }
+  int saved_errno = errno;
+
+  pthread_mutex_lock(&store->lock);
+  if (--segment->ref_count == 0 && segment->is_dropped) {
+    segment_close(segment);
+  }
+  pthread_mutex_unlock(&store->lock);
+
+  if (result < 0) {
+    errno = saved_errno;
+    return -1;
+  }
+  store->loads++;
+  return 0;
+}
+
+void disk_store_get_stats(disk_store_t *store, disk_stats_t *stats) {
+  if (!store || !stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  stats->writes = atomic_load(&store->writes);
+  stats->loads = atomic_load(&store->loads);
+  stats->dropped = atomic_load(&store->dropped);
+
+  // index of detached store is being built without lock
+  pthread_mutex_lock(&store->lock);
+  int is_ready = store->is_ready;
+  stats->entries = is_ready ? store->entry_amount : 0;
+  stats->bytes = is_ready ? store->bytes : 0;
+  stats->max_bytes = store->max_bytes;
+  stats->segments = is_ready ? store->segment_amount : 0;
+  pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,190 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HANDOFF_MAGIC 0x46444f48 // "HODF"
+// old process has that long to answer
+#define HANDOFF_TIMEOUT_S 5
+
+// sent together with descriptors: client listeners go first, admin listener
+// is the last one if has_admin is set
+typedef struct {
+  uint32_t magic;
+  uint32_t listeners_amount;
+  uint32_t has_admin;
+} handoff_message_t;
+
+/* ===== utility functions ===== */
+
+static int fill_address(const char *path, struct sockaddr_un *addr) {
+  if (!path || strlen(path) >= sizeof(addr->sun_path)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/* ===== end of utility functions ===== */
+
+int handoff_receive(const char *path, int *fds, size_t fds_max,
+                    int *admin_fd) {
+  struct sockaddr_un addr;
+  if (!fds || !fds_max || !admin_fd || fill_address(path, &addr) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  *admin_fd = -1;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(sock);
+    // there is no running process, or it's gone leaving socket file behind
+    if (err == ENOENT || err == ECONNREFUSED) {
+      return 0;
+    }
+    errno = err;
+    return -1;
+  }
+
+  struct timeval timeout = {.tv_sec = HANDOFF_TIMEOUT_S, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  handoff_message_t message;
+  struct iovec iov = {&message, sizeof(message)};
+  union {
+    char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  close(sock);
+  if (n < 0) {
+    return -1;
+  }
+
+  int received[HANDOFF_MAX_FDS];
+  size_t received_amount = 0;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    received_amount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(received, CMSG_DATA(cmsg), received_amount * sizeof(int));
+  }
+
+  size_t expected = message.listeners_amount + (message.has_admin ? 1 : 0);
+  if ((size_t)n != sizeof(message) || message.magic != HANDOFF_MAGIC ||
+      (msg.msg_flags & MSG_CTRUNC) || received_amount != expected ||
+      !message.listeners_amount || message.listeners_amount > fds_max) {
+    for (size_t i = 0; i < received_amount; i++) {
+      close(received[i]);
+    }
+    errno = EPROTO;
+    return -1;
+  }
+
+  memcpy(fds, received, message.listeners_amount * sizeof(int));
+  if (message.has_admin) {
+    *admin_fd = received[message.listeners_amount];
+  }
+  return message.listeners_amount;
+}
+
+int handoff_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (fill_address(path, &addr) < 0) {
+    return -1;
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  // socket of previous process is taken over, it doesn't listen anymore
+  if (unlink(path) < 0 && errno != ENOENT) {
+    close(sock);
+    return -1;
+  }
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, 1) < 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+  return sock;
+}
+
+int handoff_send(int fd, const int *listen_fds, size_t amount, int admin_fd) {
+  size_t fds_amount = amount + (admin_fd >= 0 ? 1 : 0);
+  if (fd < 0 || !listen_fds || !amount || fds_amount > HANDOFF_MAX_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  handoff_message_t message = {
+      .magic = HANDOFF_MAGIC,
+      .listeners_amount = amount,
+      .has_admin = admin_fd >= 0,
+  };
+  struct iovec iov = {&message, sizeof(message)};
+
+  union {
+    char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = CMSG_SPACE(fds_amount * sizeof(int));
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fds_amount * sizeof(int));
+  int *data = (int *)CMSG_DATA(cmsg);
+  memcpy(data, listen_fds, amount * sizeof(int));
+  if (admin_fd >= 0) {
+    data[amount] = admin_fd;
+  }
+
+  ssize_t n;
+  do {
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return -1;
+  }
+  if ((size_t)n != sizeof(message)) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
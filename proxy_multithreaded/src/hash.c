@@ -0,0 +1,89 @@
+#include "hash.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// wyhash secret: odd 64-bit constants with balanced bits
+static const uint64_t secret[4] = {
+    0x2d358dccaa6c78a5ULL,
+    0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL,
+    0x4d5a2da51de1aa47ULL,
+};
+
+/* ===== utility functions ===== */
+
+// folds 128-bit product of a and b into 64 bits
+static uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// unaligned loads, memcpy compiles into single mov
+static uint64_t read64(const unsigned char *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// packs 1-3 bytes into word without branches on size
+static uint64_t read_small(const unsigned char *p, size_t size) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+}
+
+/* ===== end of utility functions ===== */
+
+size_t hash_bytes(const void *data, size_t size) {
+  const unsigned char *p = data;
+  uint64_t seed = mix(secret[0], secret[1]);
+  uint64_t a, b;
+
+  if (size <= 16) {
+    // two overlapping pairs of 4-byte reads cover 4..16 bytes
+    if (size >= 4) {
+      size_t shift = (size >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + shift);
+      b = (read32(p + size - 4) << 32) | read32(p + size - 4 - shift);
+    } else if (size > 0) {
+      a = read_small(p, size);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t left = size;
+    // three independent lanes keep multiplier busy on long keys
+    if (left > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+        seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+        seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+        p += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (left > 16) {
+      seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+    // the last 16 bytes, overlapping already hashed ones if key is shorter
+    a = read64(p + left - 16);
+    b = read64(p + left - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  __uint128_t product = (__uint128_t)a * b;
+  a = (uint64_t)product;
+  b = (uint64_t)(product >> 64);
+  return (size_t)mix(a ^ secret[0] ^ size, b ^ secret[1]);
+}
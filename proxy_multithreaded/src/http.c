@@ -0,0 +1,1019 @@
+#define _GNU_SOURCE
+#include "http.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// heuristic freshness never exceeds a day
+#define HEURISTIC_MAX_LIFETIME 86400
+#define MAX_DATE 64
+
+/* ===== header utilities ===== */
+
+// calls visit for every header line after status line until visit returns
+// nonzero. returns that value or 0
+static int for_each_header(const char *headers, size_t size,
+                           int (*visit)(const char *line, size_t line_size,
+                                        const char *colon, void *arg),
+                           void *arg) {
+  const char *end = headers + size;
+  const char *line = memchr(headers, '\n', size);
+  if (!line) {
+    return 0;
+  }
+  line++;
+
+  while (line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    if (!eol) {
+      eol = end;
+    }
+    size_t line_size = eol - line;
+    if (line_size && line[line_size - 1] == '\r') {
+      line_size--;
+    }
+
+    const char *colon = memchr(line, ':', line_size);
+    if (colon) {
+      int result = visit(line, line_size, colon, arg);
+      if (result) {
+        return result;
+      }
+    }
+
+    line = eol + 1;
+  }
+
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  size_t name_size;
+  const char *value;
+  size_t value_size;
+} find_arg_t;
+
+static int find_visit(const char *line, size_t line_size, const char *colon,
+                      void *arg) {
+  find_arg_t *find = (find_arg_t *)arg;
+  if ((size_t)(colon - line) != find->name_size ||
+      strncasecmp(line, find->name, find->name_size)) {
+    return 0;
+  }
+
+  const char *value = colon + 1;
+  const char *value_end = line + line_size;
+  while (value < value_end && (*value == ' ' || *value == '\t')) {
+    value++;
+  }
+  while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+    value_end--;
+  }
+
+  find->value = value;
+  find->value_size = value_end - value;
+  return 1;
+}
+
+const char *http_find_header(const char *headers, size_t size,
+                             const char *name, size_t *value_size) {
+  find_arg_t find = {name, strlen(name), NULL, 0};
+  if (!for_each_header(headers, size, find_visit, &find)) {
+    return NULL;
+  }
+  if (value_size) {
+    *value_size = find.value_size;
+  }
+  return find.value;
+}
+
+// checks if comma separated header value contains token
+static int has_token(const char *value, size_t value_size, const char *token) {
+  size_t token_size = strlen(token);
+  const char *end = value + value_size;
+
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == ',')) {
+      value++;
+    }
+    const char *item = value;
+    while (value < end && *value != ',') {
+      value++;
+    }
+    const char *item_end = value;
+    while (item_end > item && item_end[-1] == ' ') {
+      item_end--;
+    }
+    if ((size_t)(item_end - item) == token_size &&
+        !strncasecmp(item, token, token_size)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// finds directive in comma separated Cache-Control value. directive_value
+// receives its numeric argument (e.g. max-age=60) or -1 if it has none, may
+// be NULL
+static int find_directive(const char *value, size_t value_size,
+                          const char *name, long *directive_value) {
+  size_t name_size = strlen(name);
+  const char *end = value + value_size;
+
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == ',')) {
+      value++;
+    }
+    const char *item = value;
+    while (value < end && *value != ',' && *value != '=' && *value != ' ') {
+      value++;
+    }
+    int is_found = (size_t)(value - item) == name_size &&
+                   !strncasecmp(item, name, name_size);
+
+    long argument = -1;
+    while (value < end && *value == ' ') {
+      value++;
+    }
+    if (value < end && *value == '=') {
+      value++;
+      if (value < end && *value == '"') {
+        value++;
+      }
+      if (value < end && *value >= '0' && *value <= '9') {
+        argument = 0;
+        while (value < end && *value >= '0' && *value <= '9') {
+          // too large delta-seconds mean "forever", clamp to a year
+          argument = argument < 31536000 ? argument * 10 + (*value - '0')
+                                         : argument;
+          value++;
+        }
+      }
+      // skip the rest of argument, quoted string may hold commas
+      int is_quoted = 0;
+      while (value < end && (is_quoted || *value != ',')) {
+        if (*value == '"') {
+          is_quoted = !is_quoted;
+        }
+        value++;
+      }
+    }
+
+    if (is_found) {
+      if (directive_value) {
+        *directive_value = argument;
+      }
+      return 1;
+    }
+    while (value < end && *value != ',') {
+      value++;
+    }
+  }
+
+  return 0;
+}
+
+// removes header lines for which is_removed returns nonzero from header block
+// in place, status line is kept. returns new size
+static size_t remove_headers(char *headers, size_t size,
+                             int (*is_removed)(const char *name,
+                                               size_t name_size,
+                                               const void *arg),
+                             const void *arg) {
+  char *end = headers + size;
+  char *line = memchr(headers, '\n', size);
+  if (!line) {
+    return size;
+  }
+  line++;
+
+  while (line < end) {
+    char *eol = memchr(line, '\n', end - line);
+    char *next = eol ? eol + 1 : end;
+
+    char *colon = memchr(line, ':', next - line);
+    if (colon && is_removed(line, colon - line, arg)) {
+      memmove(line, next, end - next);
+      end -= next - line;
+      continue;
+    }
+
+    line = next;
+  }
+
+  return end - headers;
+}
+
+static int is_named(const char *name, size_t name_size, const void *arg) {
+  const char *wanted = (const char *)arg;
+  return strlen(wanted) == name_size && !strncasecmp(name, wanted, name_size);
+}
+
+size_t http_remove_header(char *headers, size_t size, const char *name) {
+  return remove_headers(headers, size, is_named, name);
+}
+
+static int is_hop_header(const char *name, size_t name_size,
+                         const void *arg) {
+  (void)arg;
+
+  static const char *hop_headers[] = {
+      "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+      "Upgrade",
+  };
+
+  for (size_t i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+    if (strlen(hop_headers[i]) == name_size &&
+        !strncasecmp(name, hop_headers[i], name_size)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+size_t http_strip_hop_headers(char *headers, size_t size) {
+  return remove_headers(headers, size, is_hop_header, NULL);
+}
+
+/* ===== end of header utilities ===== */
+
+/* ===== request parser ===== */
+
+#define REQUEST_HEADER(name, field)                                            \
+  { name, sizeof(name) - 1, offsetof(http_request_t, field) }
+
+// request headers parser keeps, others are skipped
+static const struct {
+  const char *name;
+  size_t name_size;
+  size_t offset;
+} request_headers[] = {
+    REQUEST_HEADER("Host", host),
+    REQUEST_HEADER("Range", range),
+    REQUEST_HEADER("If-Range", if_range),
+    REQUEST_HEADER("Cache-Control", cache_control),
+    REQUEST_HEADER("If-None-Match", if_none_match),
+    REQUEST_HEADER("Connection", connection),
+    REQUEST_HEADER("Proxy-Connection", proxy_connection),
+    REQUEST_HEADER("Content-Length", content_length),
+    REQUEST_HEADER("Transfer-Encoding", transfer_encoding),
+};
+
+static int is_token_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+// parses "METHOD SP URL SP VERSION"
+static int request_parse_line(http_request_t *request, const char *line,
+                              size_t size) {
+  const char *end = line + size;
+
+  const char *method_end = memchr(line, ' ', size);
+  if (!method_end || method_end == line || method_end - line >= MAX_METHOD) {
+    return -1;
+  }
+  for (const char *c = line; c < method_end; c++) {
+    if (!is_token_char(*c)) {
+      return -1;
+    }
+  }
+
+  const char *url = method_end + 1;
+  const char *url_end = memchr(url, ' ', end - url);
+  if (!url_end || url_end == url || url_end - url >= MAX_URL) {
+    return -1;
+  }
+
+  const char *version = url_end + 1;
+  size_t version_size = end - version;
+  if (version_size < 8 || version_size >= MAX_VERSION ||
+      memcmp(version, "HTTP/", 5)) {
+    return -1;
+  }
+
+  request->method = (http_slice_t){line, method_end - line};
+  request->url = (http_slice_t){url, url_end - url};
+  request->version = (http_slice_t){version, version_size};
+  return 0;
+}
+
+static int request_parse_header(http_request_t *request, const char *line,
+                                size_t size) {
+  // obsolete line folding isn't supported
+  if (*line == ' ' || *line == '\t') {
+    return -1;
+  }
+
+  const char *colon = memchr(line, ':', size);
+  if (!colon || colon == line || colon[-1] == ' ' || colon[-1] == '\t') {
+    return -1;
+  }
+  size_t name_size = colon - line;
+
+  const char *value = colon + 1;
+  const char *value_end = line + size;
+  while (value < value_end && (*value == ' ' || *value == '\t')) {
+    value++;
+  }
+  while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+    value_end--;
+  }
+
+  for (size_t i = 0; i < sizeof(request_headers) / sizeof(request_headers[0]);
+       i++) {
+    if (request_headers[i].name_size != name_size ||
+        strncasecmp(line, request_headers[i].name, name_size)) {
+      continue;
+    }
+    http_slice_t *slice =
+        (http_slice_t *)((char *)request + request_headers[i].offset);
+    // the first occurrence wins
+    if (!slice->data) {
+      *slice = (http_slice_t){value, value_end - value};
+    }
+    break;
+  }
+
+  return 0;
+}
+
+int http_slice_equals(http_slice_t slice, const char *str) {
+  size_t size = strlen(str);
+  return slice.size == size && !memcmp(slice.data, str, size);
+}
+
+void http_request_init(http_request_t *request) {
+  memset(request, 0, sizeof(http_request_t));
+  request->state = HTTP_REQUEST_LINE;
+}
+
+int http_request_parse(http_request_t *request, const char *buffer,
+                       size_t size) {
+  while (request->state != HTTP_REQUEST_DONE) {
+    size_t from = request->line_start + request->scanned;
+    if (from >= size) {
+      return 0;
+    }
+
+    const char *eol = memchr(buffer + from, '\n', size - from);
+    if (!eol) {
+      request->scanned = size - request->line_start;
+      return 0;
+    }
+
+    const char *line = buffer + request->line_start;
+    size_t line_size = eol - line;
+    if (line_size && line[line_size - 1] == '\r') {
+      line_size--;
+    }
+    request->line_start = eol - buffer + 1;
+    request->scanned = 0;
+
+    if (request->state == HTTP_REQUEST_LINE) {
+      // empty lines before request line are ignored
+      if (!line_size) {
+        continue;
+      }
+      if (request_parse_line(request, line, line_size) < 0) {
+        return -1;
+      }
+      request->state = HTTP_REQUEST_HEADERS;
+    } else if (!line_size) {
+      request->state = HTTP_REQUEST_DONE;
+      request->size = request->line_start;
+    } else if (request_parse_header(request, line, line_size) < 0) {
+      return -1;
+    }
+  }
+
+  return 1;
+}
+
+int http_request_keep_alive(const http_request_t *request) {
+  // HTTP/1.0 client would need Connection: keep-alive in response, which
+  // cached header block doesn't have
+  if (!http_slice_equals(request->version, "HTTP/1.1")) {
+    return 0;
+  }
+
+  // request body isn't read, so connection can't be used for next request
+  if (request->transfer_encoding.data) {
+    return 0;
+  }
+  for (size_t i = 0; i < request->content_length.size; i++) {
+    if (request->content_length.data[i] != '0') {
+      return 0;
+    }
+  }
+
+  if ((request->connection.data &&
+       has_token(request->connection.data, request->connection.size,
+                 "close")) ||
+      (request->proxy_connection.data &&
+       has_token(request->proxy_connection.data,
+                 request->proxy_connection.size, "close"))) {
+    return 0;
+  }
+
+  return 1;
+}
+
+// parses decimal number at *curr, advancing it. returns -1 if there are no
+// digits or number overflows
+static int parse_number(const char **curr, const char *end, size_t *number) {
+  const char *start = *curr;
+  size_t value = 0;
+  while (*curr < end && **curr >= '0' && **curr <= '9') {
+    if (value > ((size_t)-1 - 9) / 10) {
+      return -1;
+    }
+    value = value * 10 + (**curr - '0');
+    (*curr)++;
+  }
+  *number = value;
+  return *curr > start ? 0 : -1;
+}
+
+int http_parse_range(http_slice_t range, size_t length, http_range_t *ranges,
+                     size_t max_ranges) {
+  const char *curr = range.data;
+  const char *end = range.data + range.size;
+  if (range.size < 6 || strncasecmp(curr, "bytes=", 6)) {
+    return -1;
+  }
+  curr += 6;
+
+  size_t amount = 0;
+  size_t specs = 0;
+  while (curr < end) {
+    while (curr < end && (*curr == ' ' || *curr == '\t' || *curr == ',')) {
+      curr++;
+    }
+    if (curr == end) {
+      break;
+    }
+    specs++;
+
+    size_t first;
+    size_t last = length ? length - 1 : 0;
+    if (*curr == '-') {
+      // suffix range: the last bytes of body
+      curr++;
+      size_t suffix;
+      if (parse_number(&curr, end, &suffix) < 0) {
+        return -1;
+      }
+      if (!suffix || !length) {
+        goto next;
+      }
+      first = suffix < length ? length - suffix : 0;
+    } else {
+      if (parse_number(&curr, end, &first) < 0 || curr == end ||
+          *curr != '-') {
+        return -1;
+      }
+      curr++;
+      if (curr < end && *curr >= '0' && *curr <= '9') {
+        size_t range_last;
+        if (parse_number(&curr, end, &range_last) < 0 || range_last < first) {
+          return -1;
+        }
+        if (range_last < last) {
+          last = range_last;
+        }
+      }
+      if (first >= length) {
+        goto next;
+      }
+    }
+
+    if (amount == max_ranges) {
+      return -1;
+    }
+    ranges[amount].first = first;
+    ranges[amount].last = last;
+    amount++;
+
+  next:
+    while (curr < end && (*curr == ' ' || *curr == '\t')) {
+      curr++;
+    }
+    if (curr < end && *curr != ',') {
+      return -1;
+    }
+  }
+
+  return specs ? (int)amount : -1;
+}
+
+int http_split_url(const char *url, size_t size, http_slice_t *host,
+                   int *port, http_slice_t *path) {
+  const char *end = url + size;
+  if (size >= 7 && !strncasecmp(url, "http://", 7)) {
+    url += 7;
+  }
+
+  const char *slash = memchr(url, '/', end - url);
+  const char *host_end = slash ? slash : end;
+
+  *port = DEFAULT_HTTP_PORT;
+  const char *colon = memchr(url, ':', host_end - url);
+  if (colon) {
+    int parsed = 0;
+    for (const char *c = colon + 1; c < host_end && parsed <= 65535; c++) {
+      if (*c < '0' || *c > '9') {
+        parsed = 0;
+        break;
+      }
+      parsed = parsed * 10 + (*c - '0');
+    }
+    if (parsed > 0 && parsed <= 65535) {
+      *port = parsed;
+    }
+    host_end = colon;
+  }
+
+  *host = (http_slice_t){url, host_end - url};
+  *path = slash ? (http_slice_t){slash, end - slash} : (http_slice_t){"/", 1};
+  return host->size ? 0 : -1;
+}
+
+ssize_t http_normalize_url(const char *url, size_t size, char *key,
+                           size_t capacity) {
+  if (!url || !key) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (size < 7 || strncasecmp(url, "http://", 7)) {
+    if (size > capacity) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memcpy(key, url, size);
+    return (ssize_t)size;
+  }
+
+  // authority ends where path or query starts
+  const char *end = url + size;
+  const char *host = url + 7;
+  const char *path = host;
+  while (path < end && *path != '/' && *path != '?' && *path != '#') {
+    path++;
+  }
+
+  // the last colon outside of IPv6 brackets starts port
+  const char *host_end = path;
+  for (const char *c = path; c > host; c--) {
+    if (c[-1] == ']') {
+      break;
+    }
+    if (c[-1] == ':') {
+      host_end = c - 1;
+      break;
+    }
+  }
+  int port = 0;
+  for (const char *c = host_end + 1; c < path && port <= 65535; c++) {
+    port = *c >= '0' && *c <= '9' ? port * 10 + (*c - '0') : -1;
+    if (port < 0) {
+      break;
+    }
+  }
+  // empty port means default one too
+  int is_default_port = host_end < path && port == DEFAULT_HTTP_PORT;
+  is_default_port |= host_end + 1 == path;
+  const char *authority_end = is_default_port ? host_end : path;
+
+  int needs_slash = path == end || *path != '/';
+  size_t key_size = 7 + (authority_end - host) + needs_slash + (end - path);
+  if (key_size > capacity) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  char *out = key;
+  memcpy(out, "http://", 7);
+  out += 7;
+  for (const char *c = host; c < authority_end; c++) {
+    *out++ = *c >= 'A' && *c <= 'Z' ? *c + ('a' - 'A') : *c;
+  }
+  if (needs_slash) {
+    *out++ = '/';
+  }
+  memcpy(out, path, end - path);
+  return (ssize_t)key_size;
+}
+
+void extract_host_path(const char *url, char *host, int *port, char *path) {
+  http_slice_t host_slice, path_slice;
+  http_split_url(url, strlen(url), &host_slice, port, &path_slice);
+
+  size_t host_size =
+      host_slice.size < MAX_HOST ? host_slice.size : MAX_HOST - 1;
+  memcpy(host, host_slice.data, host_size);
+  host[host_size] = '\0';
+
+  size_t path_size = path_slice.size < MAX_URL ? path_slice.size : MAX_URL - 1;
+  memcpy(path, path_slice.data, path_size);
+  path[path_size] = '\0';
+}
+
+/* ===== end of request parser ===== */
+
+/* ===== response framing ===== */
+
+int http_parse_status(const char *headers, size_t size, int *status) {
+  static const char prefix[] = "HTTP/1.";
+  size_t prefix_size = sizeof(prefix) - 1;
+  // "HTTP/1.x NNN" is the shortest status line
+  if (size < prefix_size + 5 || memcmp(headers, prefix, prefix_size) ||
+      headers[prefix_size] < '0' || headers[prefix_size] > '9' ||
+      headers[prefix_size + 1] != ' ') {
+    return -1;
+  }
+
+  const char *code = headers + prefix_size + 2;
+  const char *end = headers + size;
+  int value = 0;
+  for (int i = 0; i < 3; i++) {
+    if (code[i] < '0' || code[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + code[i] - '0';
+  }
+  // code is followed by reason phrase or end of line
+  if (code + 3 < end && code[3] != ' ' && code[3] != '\r' &&
+      code[3] != '\n') {
+    return -1;
+  }
+  *status = value;
+  return 0;
+}
+
+// parses status line and framing headers once header block is complete
+static int response_parse_headers(http_response_t *response) {
+  const char *headers = response->headers;
+  size_t size = response->headers_size;
+
+  if (http_parse_status(headers, size, &response->status) < 0) {
+    return -1;
+  }
+  int minor = headers[strlen("HTTP/1.")] - '0';
+
+  size_t value_size;
+  const char *value =
+      http_find_header(headers, size, "Transfer-Encoding", &value_size);
+  response->is_chunked = value && has_token(value, value_size, "chunked");
+
+  value = http_find_header(headers, size, "Content-Length", &value_size);
+  response->content_length = value ? (ssize_t)strtoll(value, NULL, 10) : -1;
+  if (response->content_length < -1) {
+    return -1;
+  }
+
+  value = http_find_header(headers, size, "Connection", &value_size);
+  if (minor >= 1) {
+    response->keep_alive = !value || !has_token(value, value_size, "close");
+  } else {
+    response->keep_alive =
+        value && has_token(value, value_size, "keep-alive");
+  }
+
+  // responses which never have a body
+  if ((response->status >= 100 && response->status < 200) ||
+      response->status == 204 || response->status == 304) {
+    response->state = HTTP_RESPONSE_DONE;
+  } else if (response->is_chunked) {
+    response->state = HTTP_RESPONSE_CHUNK_SIZE;
+    response->remaining = 0;
+    response->line_size = 0;
+  } else if (response->content_length >= 0) {
+    response->remaining = response->content_length;
+    response->state = response->remaining ? HTTP_RESPONSE_BODY_LENGTH
+                                          : HTTP_RESPONSE_DONE;
+  } else {
+    // body ends with connection, so it can't be reused
+    response->state = HTTP_RESPONSE_BODY_UNTIL_CLOSE;
+    response->keep_alive = 0;
+  }
+
+  return 0;
+}
+
+static ssize_t response_feed_headers(http_response_t *response,
+                                     const char *data, size_t size) {
+  // header end can be split between reads, so search starts a bit earlier
+  size_t old_size = response->headers_size;
+  size_t search_from = old_size > 3 ? old_size - 3 : 0;
+
+  size_t copy = size;
+  if (copy > MAX_RESPONSE_HEADERS - old_size) {
+    copy = MAX_RESPONSE_HEADERS - old_size;
+  }
+  memcpy(response->headers + old_size, data, copy);
+  response->headers_size += copy;
+
+  const char *headers = response->headers;
+  for (size_t i = search_from; i < response->headers_size; i++) {
+    if (headers[i] != '\n') {
+      continue;
+    }
+    size_t end = 0;
+    if (i >= 1 && headers[i - 1] == '\n') {
+      end = i + 1;
+    } else if (i >= 2 && headers[i - 1] == '\r' && headers[i - 2] == '\n') {
+      end = i + 1;
+    }
+    if (!end) {
+      continue;
+    }
+
+    response->headers_size = end;
+    if (response_parse_headers(response) < 0) {
+      return -1;
+    }
+    return end - old_size;
+  }
+
+  if (response->headers_size == MAX_RESPONSE_HEADERS) {
+    return -1;
+  }
+  return copy;
+}
+
+// parses hex chunk size line, chunk extensions are ignored
+static ssize_t response_feed_chunk_size(http_response_t *response,
+                                        const char *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    char c = data[i];
+    if (c == '\n') {
+      if (!response->line_size) {
+        return -1;
+      }
+      response->line_size = 0;
+      response->state = response->remaining ? HTTP_RESPONSE_CHUNK_DATA
+                                            : HTTP_RESPONSE_TRAILER;
+      return i + 1;
+    }
+
+    // digits are counted in line_size until extension or line end
+    if (response->line_size != (size_t)-1) {
+      int digit = -1;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+      }
+
+      if (digit >= 0) {
+        if (response->remaining >> (sizeof(size_t) * 8 - 4)) {
+          return -1;
+        }
+        response->remaining = response->remaining * 16 + digit;
+        response->line_size++;
+        continue;
+      }
+      if (!response->line_size) {
+        return -1;
+      }
+      // the rest of line is chunk extension
+      response->line_size = (size_t)-1;
+    }
+  }
+  return size;
+}
+
+ssize_t http_response_feed(http_response_t *response, const char *data,
+                           size_t size) {
+  size_t consumed = 0;
+
+  while (consumed < size) {
+    const char *curr = data + consumed;
+    size_t left = size - consumed;
+    size_t n;
+    ssize_t used;
+
+    switch (response->state) {
+    case HTTP_RESPONSE_HEADERS:
+      // stop right after header block, caller handles it separately
+      used = response_feed_headers(response, curr, left);
+      if (used < 0) {
+        return -1;
+      }
+      return consumed + used;
+    case HTTP_RESPONSE_BODY_LENGTH:
+      n = left < response->remaining ? left : response->remaining;
+      response->remaining -= n;
+      consumed += n;
+      if (!response->remaining) {
+        response->state = HTTP_RESPONSE_DONE;
+      }
+      break;
+    case HTTP_RESPONSE_CHUNK_SIZE:
+      used = response_feed_chunk_size(response, curr, left);
+      if (used < 0) {
+        return -1;
+      }
+      consumed += used;
+      break;
+    case HTTP_RESPONSE_CHUNK_DATA:
+      n = left < response->remaining ? left : response->remaining;
+      response->remaining -= n;
+      consumed += n;
+      if (!response->remaining) {
+        response->state = HTTP_RESPONSE_CHUNK_END;
+      }
+      break;
+    case HTTP_RESPONSE_CHUNK_END:
+      // CRLF after chunk data
+      consumed++;
+      if (*curr == '\n') {
+        response->state = HTTP_RESPONSE_CHUNK_SIZE;
+        response->line_size = 0;
+      } else if (*curr != '\r') {
+        return -1;
+      }
+      break;
+    case HTTP_RESPONSE_TRAILER:
+      // trailer lines until empty one
+      consumed++;
+      if (*curr == '\n') {
+        if (!response->line_size) {
+          response->state = HTTP_RESPONSE_DONE;
+        }
+        response->line_size = 0;
+      } else if (*curr != '\r') {
+        response->line_size++;
+      }
+      break;
+    case HTTP_RESPONSE_BODY_UNTIL_CLOSE:
+      consumed = size;
+      break;
+    case HTTP_RESPONSE_DONE:
+      return consumed;
+    }
+  }
+
+  return consumed;
+}
+
+int http_response_finish(http_response_t *response) {
+  if (response->state == HTTP_RESPONSE_BODY_UNTIL_CLOSE) {
+    response->state = HTTP_RESPONSE_DONE;
+  }
+  return response->state == HTTP_RESPONSE_DONE ? 0 : -1;
+}
+
+void http_response_init(http_response_t *response) {
+  response->state = HTTP_RESPONSE_HEADERS;
+  response->headers_size = 0;
+  response->status = 0;
+  response->content_length = -1;
+  response->is_chunked = 0;
+  response->keep_alive = 0;
+  response->remaining = 0;
+  response->line_size = 0;
+}
+
+/* ===== end of response framing ===== */
+
+/* ===== freshness ===== */
+
+// status codes cacheable without explicit freshness (RFC 9110, 15.1)
+static int is_heuristically_cacheable(int status) {
+  static const int statuses[] = {200, 203, 204, 300, 301, 308,
+                                 404, 405, 410, 414, 501};
+
+  for (size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+    if (statuses[i] == status) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static time_t find_date(const char *headers, size_t size, const char *name) {
+  size_t value_size;
+  const char *value = http_find_header(headers, size, name, &value_size);
+  return value ? http_parse_date(value, value_size) : -1;
+}
+
+time_t http_parse_date(const char *value, size_t size) {
+  char date[MAX_DATE];
+  if (size >= sizeof(date)) {
+    return -1;
+  }
+  memcpy(date, value, size);
+  date[size] = '\0';
+
+  // only IMF-fixdate, obsolete formats are treated as invalid dates
+  struct tm tm = {0};
+  const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end) {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
+int http_request_no_cache(const http_request_t *request) {
+  const http_slice_t *cache_control = &request->cache_control;
+  if (!cache_control->data) {
+    return 0;
+  }
+
+  long max_age;
+  return find_directive(cache_control->data, cache_control->size,
+                        "no-cache", NULL) ||
+         (find_directive(cache_control->data, cache_control->size, "max-age",
+                         &max_age) &&
+          max_age == 0);
+}
+
+long http_freshness_lifetime(int status, const char *headers, size_t size) {
+  // partial and not modified responses can't be served as full ones
+  if (status == 206 || status == 304) {
+    return -1;
+  }
+
+  size_t value_size;
+  const char *value =
+      http_find_header(headers, size, "Cache-Control", &value_size);
+  if (value) {
+    long lifetime;
+    if (find_directive(value, value_size, "no-store", NULL) ||
+        find_directive(value, value_size, "private", NULL)) {
+      return -1;
+    }
+    // response may be stored, but every use needs revalidation
+    if (find_directive(value, value_size, "no-cache", NULL)) {
+      return 0;
+    }
+    if ((find_directive(value, value_size, "s-maxage", &lifetime) ||
+         find_directive(value, value_size, "max-age", &lifetime)) &&
+        lifetime >= 0) {
+      return lifetime;
+    }
+  }
+
+  value = http_find_header(headers, size, "Vary", &value_size);
+  if (value && has_token(value, value_size, "*")) {
+    return -1;
+  }
+
+  time_t date = find_date(headers, size, "Date");
+  if (date < 0) {
+    date = time(NULL);
+  }
+
+  if (http_find_header(headers, size, "Expires", &value_size)) {
+    // invalid Expires means already expired
+    time_t expires = find_date(headers, size, "Expires");
+    return expires > date ? (long)(expires - date) : 0;
+  }
+
+  if (!is_heuristically_cacheable(status)) {
+    return -1;
+  }
+
+  time_t last_modified = find_date(headers, size, "Last-Modified");
+  if (last_modified < 0 || last_modified >= date) {
+    return 0;
+  }
+  long lifetime = (long)(date - last_modified) / 10;
+  return lifetime < HEURISTIC_MAX_LIFETIME ? lifetime
+                                           : HEURISTIC_MAX_LIFETIME;
+}
+
+long http_response_age(const char *headers, size_t size, time_t now) {
+  long age = 0;
+
+  time_t date = find_date(headers, size, "Date");
+  if (date >= 0 && now > date) {
+    age = (long)(now - date);
+  }
+
+  // Age of response which passed through other caches
+  size_t value_size;
+  const char *value = http_find_header(headers, size, "Age", &value_size);
+  if (value) {
+    long age_value = strtol(value, NULL, 10);
+    if (age_value > age) {
+      age = age_value;
+    }
+  }
+
+  return age;
+}
+
+/* ===== end of freshness ===== */
@@ -0,0 +1,686 @@
+#include "loader.h"
+#include "hash.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 32768
+// power of two
+#define LOADER_ORIGIN_BUCKETS_AMOUNT 256
+
+typedef enum {
+  LOAD_DONE,
+  LOAD_FAILED,
+  // reused connection turned out to be closed by origin, request has to be
+  // sent once again over fresh connection
+  LOAD_RETRY,
+} load_result_t;
+
+/* ===== utility functions ===== */
+
+static int send_all(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// conditional holds extra header lines (validators), may be empty
+static int format_request(char *request, size_t size, const char *host,
+                          int port, const char *path,
+                          const char *conditional) {
+  if (port == DEFAULT_HTTP_PORT) {
+    return snprintf(request, size,
+                    "GET %s HTTP/1.1\r\n"
+                    "Host: %s\r\n"
+                    "Connection: keep-alive\r\n"
+                    "%s"
+                    "\r\n",
+                    path, host, conditional);
+  }
+  return snprintf(request, size,
+                  "GET %s HTTP/1.1\r\n"
+                  "Host: %s:%d\r\n"
+                  "Connection: keep-alive\r\n"
+                  "%s"
+                  "\r\n",
+                  path, host, port, conditional);
+}
+
+// reads header block of stale entry. returns its size or 0 if entry has none
+static size_t read_stale_headers(cache_entry_t *stale, char *headers) {
+  size_t size = stale->header_size;
+  if (size > MAX_RESPONSE_HEADERS) {
+    return 0;
+  }
+  for (size_t done = 0; done < size;) {
+    ssize_t n = cache_entry_read(stale, done, headers + done, size - done, 0);
+    if (n <= 0) {
+      return 0;
+    }
+    done += n;
+  }
+  return size;
+}
+
+// builds If-None-Match and If-Modified-Since lines from validators of stale
+// header block
+static void format_conditional(char *conditional, size_t size,
+                               const char *headers, size_t headers_size) {
+  conditional[0] = '\0';
+  if (!headers_size) {
+    return;
+  }
+
+  size_t used = 0;
+  size_t value_size;
+  const char *value =
+      http_find_header(headers, headers_size, "ETag", &value_size);
+  if (value && value_size < size / 2) {
+    used += snprintf(conditional, size, "If-None-Match: %.*s\r\n",
+                     (int)value_size, value);
+  }
+  value = http_find_header(headers, headers_size, "Last-Modified",
+                           &value_size);
+  if (value && value_size < size / 4) {
+    snprintf(conditional + used, size - used,
+             "If-Modified-Since: %.*s\r\n", (int)value_size, value);
+  }
+}
+
+// stores header block of response in entry together with its freshness.
+// response which must not be cached or is too large is unlinked, so it's
+// streamed only to requests waiting for it. 304 answer to revalidation fills
+// entry with stale one instead. returns 0 on success, -1 on error
+static int store_headers(loader_t *loader, cache_entry_t *entry,
+                         http_response_t *response, const char *stale_headers,
+                         size_t stale_headers_size) {
+  time_t now = time(NULL);
+  long age = http_response_age(response->headers, response->headers_size, now);
+
+  if (response->status == 304 && entry->stale && stale_headers_size) {
+    // 304 without own freshness information keeps that of stored response
+    const char *headers = response->headers;
+    size_t headers_size = response->headers_size;
+    size_t value_size;
+    if (!http_find_header(headers, headers_size, "Cache-Control",
+                          &value_size) &&
+        !http_find_header(headers, headers_size, "Expires", &value_size)) {
+      headers = stale_headers;
+      headers_size = stale_headers_size;
+    }
+    int status = 200;
+    http_parse_status(stale_headers, stale_headers_size, &status);
+    long lifetime = http_freshness_lifetime(status, headers, headers_size);
+
+    pthread_mutex_lock(&entry->lock);
+    entry->expires_at = lifetime > 0 ? now + lifetime - age : 0;
+    pthread_mutex_unlock(&entry->lock);
+
+    if (lifetime < 0) {
+      cache_entry_unlink(loader->cache, entry);
+    }
+    return cache_entry_copy(loader->cache, entry, entry->stale);
+  }
+
+  size_t headers_size =
+      http_strip_hop_headers(response->headers, response->headers_size);
+  long lifetime = http_freshness_lifetime(response->status, response->headers,
+                                          headers_size);
+  // response stale at once can only be reused after revalidation
+  size_t value_size;
+  int has_validator =
+      http_find_header(response->headers, headers_size, "ETag",
+                       &value_size) ||
+      http_find_header(response->headers, headers_size, "Last-Modified",
+                       &value_size);
+
+  pthread_mutex_lock(&entry->lock);
+  entry->header_size = headers_size;
+  entry->status = response->status;
+  entry->is_persistent = response->state != HTTP_RESPONSE_BODY_UNTIL_CLOSE;
+  entry->expires_at = lifetime > 0 ? now + lifetime - age : 0;
+  pthread_mutex_unlock(&entry->lock);
+
+  // response known to outgrow object limit is streamed from the start
+  size_t max_object_bytes = loader->cache->max_object_bytes;
+  int is_too_large = max_object_bytes && response->content_length >= 0 &&
+                     headers_size + (size_t)response->content_length >
+                         max_object_bytes;
+  if (lifetime < 0 || (entry->expires_at <= now && !has_validator) ||
+      is_too_large) {
+    cache_entry_unlink(loader->cache, entry);
+  }
+  return cache_entry_append(loader->cache, entry, response->headers,
+                            headers_size);
+}
+
+// sends request to origin at addr and appends response to entry. header
+// block is appended without hop-by-hop headers, body is appended as it is
+static load_result_t load_response(loader_t *loader, cache_entry_t *entry,
+                                   const char *host, int port,
+                                   const struct in_addr *addr,
+                                   const char *path,
+                                   const char *stale_headers,
+                                   size_t stale_headers_size,
+                                   int allow_reuse) {
+  int is_reused;
+  uint64_t connect_start = metrics_now();
+  int server_fd = upstream_connect(loader->upstream, host, port, addr,
+                                   allow_reuse, &is_reused);
+  if (server_fd < 0) {
+    return LOAD_FAILED;
+  }
+  metrics_record(METRIC_PHASE_ORIGIN_CONNECT, connect_start);
+
+  char conditional[MAX_URL];
+  format_conditional(conditional, sizeof(conditional), stale_headers,
+                     stale_headers_size);
+
+  char request[BUFFER_SIZE];
+  int request_size = format_request(request, sizeof(request), host, port,
+                                    path, conditional);
+  if (request_size < 0 || (size_t)request_size >= sizeof(request)) {
+    close(server_fd);
+    return LOAD_FAILED;
+  }
+
+  if (send_all(server_fd, request, request_size) < 0) {
+    perror("loader_routine:send");
+    close(server_fd);
+    return is_reused ? LOAD_RETRY : LOAD_FAILED;
+  }
+  uint64_t request_sent = metrics_now();
+
+  http_response_t response;
+  http_response_init(&response);
+
+  char buffer[BUFFER_SIZE];
+  size_t received = 0;
+  int has_excess = 0;
+
+  while (response.state != HTTP_RESPONSE_DONE) {
+    ssize_t n = recv(server_fd, buffer, sizeof(buffer), 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("loader_routine:recv");
+      break;
+    }
+    if (n == 0) {
+      http_response_finish(&response);
+      break;
+    }
+    if (!received) {
+      metrics_record(METRIC_PHASE_ORIGIN_TTFB, request_sent);
+    }
+    received += n;
+    metrics_add(METRIC_ORIGIN_BYTES_IN, n);
+
+    size_t offset = 0;
+    while (offset < (size_t)n && response.state != HTTP_RESPONSE_DONE) {
+      int is_headers = response.state == HTTP_RESPONSE_HEADERS;
+      ssize_t used =
+          http_response_feed(&response, buffer + offset, n - offset);
+      if (used < 0) {
+        fprintf(stderr, "loader_routine: malformed response from %s\n", host);
+        close(server_fd);
+        return LOAD_FAILED;
+      }
+
+      int append_result = 0;
+      if (!is_headers) {
+        append_result =
+            cache_entry_append(loader->cache, entry, buffer + offset, used);
+      } else if (response.state != HTTP_RESPONSE_HEADERS) {
+        append_result = store_headers(loader, entry, &response, stale_headers,
+                                      stale_headers_size);
+      }
+      if (append_result < 0) {
+        // streamed response nobody reads anymore
+        if (errno != ECANCELED) {
+          perror("loader_routine:cache_entry_append");
+        }
+        close(server_fd);
+        return LOAD_FAILED;
+      }
+
+      offset += used;
+    }
+    has_excess = offset < (size_t)n;
+  }
+
+  if (response.state == HTTP_RESPONSE_DONE) {
+    // connection is reusable only if response was read exactly till its end
+    if (response.keep_alive && !has_excess) {
+      upstream_release(loader->upstream, host, port, server_fd);
+    } else {
+      close(server_fd);
+    }
+    return LOAD_DONE;
+  }
+
+  close(server_fd);
+  return !received && is_reused ? LOAD_RETRY : LOAD_FAILED;
+}
+
+// buckets_amount is power of two, hash_bytes() mixes all bits of the host
+static size_t origin_hash(const char *host, int port, size_t buckets_amount) {
+  return (hash_bytes(host, strlen(host)) + (size_t)port) &
+         (buckets_amount - 1);
+}
+
+// returns slot of origin record in its bucket chain. loader->lock must be held
+static loader_origin_t **origin_find(loader_t *loader, const char *host,
+                                     int port) {
+  loader_origin_t **curr =
+      &loader->origins[origin_hash(host, port, loader->origins_buckets_amount)];
+  while (*curr && ((*curr)->port != port || strcmp((*curr)->host, host))) {
+    curr = &(*curr)->next;
+  }
+  return curr;
+}
+
+static size_t origin_in_flight(loader_t *loader, const char *host, int port) {
+  loader_origin_t *origin = *origin_find(loader, host, port);
+  return origin ? origin->in_flight : 0;
+}
+
+// loader->lock must be held
+static int origin_acquire(loader_t *loader, const char *host, int port) {
+  loader_origin_t **slot = origin_find(loader, host, port);
+  if (!*slot) {
+    loader_origin_t *origin = calloc(1, sizeof(loader_origin_t));
+    if (!origin) {
+      return -1;
+    }
+    origin->host = strdup(host);
+    if (!origin->host) {
+      free(origin);
+      return -1;
+    }
+    origin->port = port;
+    *slot = origin;
+  }
+  (*slot)->in_flight++;
+  return 0;
+}
+
+// loader->lock must be held
+static void origin_release(loader_t *loader, const char *host, int port) {
+  loader_origin_t **slot = origin_find(loader, host, port);
+  loader_origin_t *origin = *slot;
+  if (!origin) {
+    return;
+  }
+  if (--origin->in_flight == 0) {
+    *slot = origin->next;
+    free(origin->host);
+    free(origin);
+  }
+}
+
+// takes the oldest job which origin is below its limit. loader->lock must be
+// held
+static loader_job_t *queue_take(loader_t *loader) {
+  loader_job_t *prev = NULL;
+  for (loader_job_t *job = loader->head; job; prev = job, job = job->next) {
+    if (!job->is_disk) {
+      if (origin_in_flight(loader, job->host, job->port) >=
+          loader->max_per_origin) {
+        continue;
+      }
+      if (origin_acquire(loader, job->host, job->port) < 0) {
+        return NULL;
+      }
+    }
+
+    if (prev) {
+      prev->next = job->next;
+    } else {
+      loader->head = job->next;
+    }
+    if (loader->tail == job) {
+      loader->tail = prev;
+    }
+    loader->queued--;
+    return job;
+  }
+  return NULL;
+}
+
+// puts job back to the front of queue, it was the oldest one when it was
+// taken. loader->lock must be held
+static void queue_requeue(loader_t *loader, loader_job_t *job) {
+  job->next = loader->head;
+  loader->head = job;
+  if (!loader->tail) {
+    loader->tail = job;
+  }
+  loader->queued++;
+  pthread_cond_signal(&loader->changed);
+}
+
+// requeues job parked till resolver answered lookup of its origin
+static void job_resolved(void *arg) {
+  loader_job_t *job = (loader_job_t *)arg;
+  loader_t *loader = job->loader;
+
+  pthread_mutex_lock(&loader->lock);
+  loader->parked--;
+  queue_requeue(loader, job);
+  pthread_mutex_unlock(&loader->lock);
+}
+
+// downloads entry of job from its origin at addr, which is NULL if origin
+// couldn't be resolved. returns 0 if job went back to queue instead and
+// mustn't be touched anymore
+static int load_job(loader_t *loader, loader_job_t *job,
+                    const struct in_addr *addr) {
+  cache_entry_t *entry = job->entry;
+
+  if (job->is_disk) {
+    int result = disk_store_load(loader->disk, loader->cache, entry);
+    if (result == 0 || errno != ENOENT) {
+      if (result < 0) {
+        perror("loader_routine:disk_store_load");
+      }
+      cache_entry_finish(loader->cache, entry, result == 0 ? DONE : ERROR);
+      cache_release(loader->cache, entry);
+      return 1;
+    }
+
+    // record was dropped since job was queued, entry comes from origin
+    pthread_mutex_lock(&loader->lock);
+    job->is_disk = 0;
+    queue_requeue(loader, job);
+    pthread_mutex_unlock(&loader->lock);
+    return 0;
+  }
+
+  char host[MAX_HOST];
+  char path[MAX_URL];
+  int port;
+  extract_host_path(entry->key, host, &port, path);
+
+  // stale entry is revalidated with its validators
+  char stale_headers[MAX_RESPONSE_HEADERS];
+  size_t stale_headers_size =
+      entry->stale ? read_stale_headers(entry->stale, stale_headers) : 0;
+
+  load_result_t result = LOAD_FAILED;
+  if (addr) {
+    result = load_response(loader, entry, host, port, addr, path,
+                           stale_headers, stale_headers_size, 1);
+  }
+  if (result == LOAD_RETRY) {
+    result = load_response(loader, entry, host, port, addr, path,
+                           stale_headers, stale_headers_size, 0);
+  }
+
+  // origin is unreachable, stale response is better than none. it stays
+  // stale, so the next request tries origin again
+  if (result == LOAD_FAILED && entry->stale && !entry->data_size &&
+      cache_entry_copy(loader->cache, entry, entry->stale) == 0) {
+    result = LOAD_DONE;
+  }
+
+  cache_entry_finish(loader->cache, entry,
+                     result == LOAD_DONE ? DONE : ERROR);
+  cache_release(loader->cache, entry);
+  return 1;
+}
+
+static void *loader_worker(void *arg) {
+  loader_t *loader = (loader_t *)arg;
+
+  pthread_mutex_lock(&loader->lock);
+  while (1) {
+    loader_job_t *job = queue_take(loader);
+    if (!job) {
+      // parked jobs come back to be failed
+      if (loader->is_stopping && !loader->parked) {
+        break;
+      }
+      pthread_cond_wait(&loader->changed, &loader->lock);
+      continue;
+    }
+
+    // lookup runs under loader->lock, so job is counted as parked before
+    // resolver can requeue it
+    struct in_addr addr;
+    int lookup_error = 0;
+    if (!job->is_disk && !loader->is_stopping &&
+        resolver_lookup(loader->resolver, job->host, &addr, job_resolved,
+                        job) < 0) {
+      if (errno == EINPROGRESS) {
+        origin_release(loader, job->host, job->port);
+        loader->parked++;
+        // job of this origin may be waiting for freed slot
+        pthread_cond_broadcast(&loader->changed);
+        continue;
+      }
+      lookup_error = errno;
+    }
+    int is_stopping = loader->is_stopping;
+    pthread_mutex_unlock(&loader->lock);
+
+    int is_done = 1;
+    if (is_stopping) {
+      cache_entry_finish(loader->cache, job->entry, ERROR);
+      cache_release(loader->cache, job->entry);
+    } else {
+      if (lookup_error) {
+        fprintf(stderr, "resolver: %s: %s\n", job->host,
+                strerror(lookup_error));
+      }
+      is_done = load_job(loader, job, lookup_error ? NULL : &addr);
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    if (!is_done) {
+      continue;
+    }
+    if (!job->is_disk) {
+      origin_release(loader, job->host, job->port);
+    }
+    // job of this origin may be waiting for freed slot
+    pthread_cond_broadcast(&loader->changed);
+    free(job);
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  return NULL;
+}
+
+/* ===== end of utility functions ===== */
+
+loader_t *loader_create(cache_t *cache, upstream_pool_t *upstream,
+                        resolver_t *resolver, disk_store_t *disk,
+                        size_t workers_amount, size_t max_queued,
+                        size_t max_per_origin) {
+  if (!cache || !upstream || !resolver || !workers_amount || !max_queued ||
+      !max_per_origin) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  loader_t *loader = calloc(1, sizeof(loader_t));
+  if (!loader) {
+    return NULL;
+  }
+
+  loader->cache = cache;
+  loader->upstream = upstream;
+  loader->resolver = resolver;
+  loader->disk = disk;
+  loader->max_queued = max_queued;
+  loader->max_per_origin = max_per_origin;
+  loader->origins_buckets_amount = LOADER_ORIGIN_BUCKETS_AMOUNT;
+  loader->origins =
+      calloc(loader->origins_buckets_amount, sizeof(loader_origin_t *));
+  loader->workers = calloc(workers_amount, sizeof(pthread_t));
+  if (!loader->origins || !loader->workers) {
+    free(loader->origins);
+    free(loader->workers);
+    free(loader);
+    return NULL;
+  }
+
+  pthread_mutex_init(&loader->lock, NULL);
+  pthread_cond_init(&loader->changed, NULL);
+
+  for (; loader->workers_amount < workers_amount; loader->workers_amount++) {
+    if (pthread_create(&loader->workers[loader->workers_amount], NULL,
+                       loader_worker, loader)) {
+      perror("pthread_create");
+      loader_destroy(loader);
+      return NULL;
+    }
+  }
+
+  return loader;
+}
+
+void loader_destroy(loader_t *loader) {
+  if (!loader) {
+    errno = EINVAL;
+    return;
+  }
+
+  // queued entries are failed first, so workers only finish running jobs
+  pthread_mutex_lock(&loader->lock);
+  loader_job_t *job = loader->head;
+  loader->head = NULL;
+  loader->tail = NULL;
+  loader->queued = 0;
+  loader->is_stopping = 1;
+  pthread_cond_broadcast(&loader->changed);
+  pthread_mutex_unlock(&loader->lock);
+
+  while (job) {
+    loader_job_t *next = job->next;
+    cache_entry_finish(loader->cache, job->entry, ERROR);
+    cache_release(loader->cache, job->entry);
+    free(job);
+    job = next;
+  }
+
+  for (size_t i = 0; i < loader->workers_amount; i++) {
+    pthread_join(loader->workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&loader->changed);
+  pthread_mutex_destroy(&loader->lock);
+  free(loader->workers);
+  free(loader->origins);
+  free(loader);
+}
+
+int loader_ensure(loader_t *loader, cache_entry_t *entry) {
+  if (!loader || !entry) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // hits don't touch loader lock
+  pthread_mutex_lock(&entry->lock);
+  cache_state_t state = entry->state;
+  pthread_mutex_unlock(&entry->lock);
+  if (state == LOADING) {
+    loader->coalesced++;
+    return 0;
+  }
+  if (state != REQUIRED) {
+    return 0;
+  }
+
+  loader_job_t *job = malloc(sizeof(loader_job_t));
+  if (!job) {
+    return -1;
+  }
+  char path[MAX_URL];
+  extract_host_path(entry->key, job->host, &job->port, path);
+  // stale entry goes to origin for revalidation
+  job->is_disk = loader->disk && !entry->stale &&
+                 disk_store_contains(loader->disk, entry->key,
+                                     strlen(entry->key));
+  job->loader = loader;
+  job->entry = entry;
+  job->next = NULL;
+
+  pthread_mutex_lock(&loader->lock);
+  pthread_mutex_lock(&entry->lock);
+
+  // another request could start download in between
+  if (entry->state != REQUIRED) {
+    state = entry->state;
+    pthread_mutex_unlock(&entry->lock);
+    pthread_mutex_unlock(&loader->lock);
+    free(job);
+    if (state == LOADING) {
+      loader->coalesced++;
+    }
+    return 0;
+  }
+
+  if (loader->queued + loader->parked >= loader->max_queued ||
+      loader->is_stopping) {
+    pthread_mutex_unlock(&entry->lock);
+    pthread_mutex_unlock(&loader->lock);
+    free(job);
+    loader->rejected++;
+    errno = EBUSY;
+    return -1;
+  }
+
+  entry->state = LOADING;
+  pthread_mutex_unlock(&entry->lock);
+
+  // loader keeps its own reference, so entry can't be evicted while loading
+  cache_retain(entry);
+
+  if (loader->tail) {
+    loader->tail->next = job;
+  } else {
+    loader->head = job;
+  }
+  loader->tail = job;
+  loader->queued++;
+  pthread_cond_signal(&loader->changed);
+
+  pthread_mutex_unlock(&loader->lock);
+
+  loader->fetches++;
+  return 0;
+}
+
+void loader_get_stats(loader_t *loader, loader_stats_t *stats) {
+  if (!loader || !stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  stats->fetches = atomic_load(&loader->fetches);
+  stats->coalesced = atomic_load(&loader->coalesced);
+  stats->rejected = atomic_load(&loader->rejected);
+
+  pthread_mutex_lock(&loader->lock);
+  stats->queued = loader->queued + loader->parked;
+  pthread_mutex_unlock(&loader->lock);
+}
@@ -1,32 +1,325 @@
+#include "access_log.h"
+#include "chunk.h"
 #include "proxy.h"
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define CONNECTIONS_LIMIT 100
+#define CACHE_MAX_BYTES (256UL << 20)
+#define CLIENT_IDLE_TIMEOUT 15
+#define CLIENT_MAX_REQUESTS 100
+#define LOADER_WORKERS 32
+#define LOADER_QUEUE 1024
+#define LOADER_PER_ORIGIN 8
+#define DISK_MAX_BYTES (1UL << 30)
+#define DRAIN_TIMEOUT 10
+// responses larger than that part of cache budget are streamed, not cached
+#define MAX_OBJECT_FRACTION 8
 
 static proxy_t *global_proxy = NULL;
 
 static void signal_handler(int sig) {
-  printf("\nReceived signal %d, stopping proxy...\n", sig);
+  if (global_proxy && !global_proxy->running) {
+    printf("\nReceived signal %d, closing remaining connections...\n", sig);
+  } else {
+    printf("\nReceived signal %d, draining connections, send it again to "
+           "stop at once...\n",
+           sig);
+  }
   if (global_proxy) {
     proxy_stop(global_proxy);
   }
 }
 
 void print_usage(const char *prog_name) {
-  printf("Usage: %s [-p PORT]\n", prog_name);
+  printf("Usage: %s -p PORT [options]\n", prog_name);
+  printf("  -e threaded|epoll|sharded|uring\n");
+  printf("                     connection engine, threaded by default. sharded "
+         "is epoll with per-CPU reactors and SO_REUSEPORT listeners, uring "
+         "batches client I/O through io_uring\n");
+  printf("  -w WORKERS         reactor threads for epoll, sharded and uring "
+         "engines, one per core by default\n");
+  printf("  -l LIMIT           max simultaneous client connections "
+         "(default %d)\n",
+         CONNECTIONS_LIMIT);
+  printf("  -c SIZE[K|M|G]     cache memory budget (default %luM)\n",
+         CACHE_MAX_BYTES >> 20);
+  printf("  -z SIZE[K|M|G]     serve cached responses larger than SIZE from "
+         "memfd with sendfile (off by default)\n");
+  printf("  -O SIZE[K|M|G]     stream responses larger than SIZE without "
+         "caching them (default 1/%d of cache budget)\n",
+         MAX_OBJECT_FRACTION);
+  printf("  -a all|tinylfu     admission of new entries into full cache, "
+         "tinylfu admits only keys requested more often than evicted ones "
+         "(default tinylfu)\n");
+  printf("  -D DIR             keep entries evicted from memory in DIR, "
+         "they survive restart (off by default)\n");
+  printf("  -C SIZE[K|M|G]     disk cache budget (default %luM)\n",
+         DISK_MAX_BYTES >> 20);
+  printf("  -d IP[:PORT]       DNS server (default is nameserver of "
+         "/etc/resolv.conf)\n");
+  printf("  -j WORKERS         loader threads (default %d)\n", LOADER_WORKERS);
+  printf("  -q JOBS            downloads waiting for loader, requests beyond "
+         "get 503 (default %d)\n",
+         LOADER_QUEUE);
+  printf("  -o DOWNLOADS       downloads running for one origin at once "
+         "(default %d)\n",
+         LOADER_PER_ORIGIN);
+  printf("  -t SECONDS         idle timeout of client connections "
+         "(default %d)\n",
+         CLIENT_IDLE_TIMEOUT);
+  printf("  -r REQUESTS        max requests per client connection "
+         "(default %d)\n",
+         CLIENT_MAX_REQUESTS);
+  printf("  -m PORT            serve metrics in Prometheus format at "
+         "/metrics on PORT (off by default)\n");
+  printf("  -L FILE            append access log to FILE, - is stdout "
+         "(off by default)\n");
+  printf("  -g SECONDS         time given to open connections to finish on "
+         "stop (default %d)\n",
+         DRAIN_TIMEOUT);
+  printf("  -H PATH            hot restart socket: take listeners of proxy "
+         "serving PATH, then serve it for the next one (off by default)\n");
+}
+
+// parses size with optional K, M or G suffix, returns 0 on error
+static size_t parse_size(const char *str) {
+  char *end;
+  unsigned long long size = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'G':
+  case 'g':
+    size <<= 10;
+    /* fall through */
+  case 'M':
+  case 'm':
+    size <<= 10;
+    /* fall through */
+  case 'K':
+  case 'k':
+    size <<= 10;
+    end++;
+    break;
+  default:
+    break;
+  }
+  return *end ? 0 : (size_t)size;
+}
+
+static void print_stats(proxy_t *proxy) {
+  cache_stats_t stats;
+  cache_get_stats(proxy->cache, &stats);
+
+  size_t requests = stats.hits + stats.misses;
+  printf("Cache: %zu hits, %zu misses, hit ratio %.2f%%\n", stats.hits,
+         stats.misses, requests ? 100.0 * stats.hits / requests : 0.0);
+  printf("Cache: %zu stale entries revalidated\n", stats.revalidations);
+  printf("Cache: %zu entries in %zu buckets, %zu of %zu bytes used\n",
+         stats.entries, stats.buckets, stats.bytes, stats.max_bytes);
+  printf("Cache: %zu entries evicted, %zu bytes evicted\n",
+         stats.evicted_entries, stats.evicted_bytes);
+  printf("Cache: %zu entries backed by memfd\n", stats.memfd_entries);
+  printf("Cache: %zu entries streamed, %zu of them rejected by admission\n",
+         stats.streamed_entries, stats.rejected_entries);
+
+  chunk_stats_t chunks;
+  chunk_get_stats(&chunks);
+
+  printf("Chunks: %zu bytes used, %zu bytes pooled, %zu of %zu allocations "
+         "reused\n",
+         chunks.used_bytes, chunks.pooled_bytes, chunks.reuses,
+         chunks.allocations);
+
+  if (proxy->disk) {
+    disk_stats_t disk;
+    disk_store_get_stats(proxy->disk, &disk);
+
+    printf("Disk: %zu entries in %zu segments, %zu of %zu bytes used\n",
+           disk.entries, disk.segments, disk.bytes, disk.max_bytes);
+    printf("Disk: %zu writes, %zu loads, %zu dropped\n", disk.writes,
+           disk.loads, disk.dropped);
+  }
+
+  upstream_stats_t upstream;
+  upstream_get_stats(proxy->upstream, &upstream);
+
+  size_t uses = upstream.connects + upstream.reuses;
+  printf("Upstream: %zu connects, %zu reuses, reuse rate %.2f%%\n",
+         upstream.connects, upstream.reuses,
+         uses ? 100.0 * upstream.reuses / uses : 0.0);
+  printf("Upstream: %zu idle, %zu expired\n", upstream.idle,
+         upstream.expired);
+
+  loader_stats_t loader;
+  loader_get_stats(proxy->loader, &loader);
+
+  printf("Loader: %zu fetches, %zu coalesced, %zu rejected, %zu queued\n",
+         loader.fetches, loader.coalesced, loader.rejected, loader.queued);
+
+  resolver_stats_t resolver;
+  resolver_get_stats(proxy->resolver, &resolver);
+
+  printf("Resolver: %zu cache hits, %zu queries, %zu coalesced, %zu failed\n",
+         resolver.hits, resolver.queries, resolver.coalesced,
+         resolver.failures);
+
+  access_log_stats_t log;
+  access_log_get_stats(&log);
+
+  printf("Access log: %zu records written, %zu dropped\n", log.written,
+         log.dropped);
 }
 
 int main(int argc, char *argv[]) {
-  int port = 0;
+  proxy_config_t config = {
+      .port = 0,
+      .connections_limit = CONNECTIONS_LIMIT,
+      .engine = PROXY_ENGINE_THREADED,
+      .workers_amount = 0,
+      .cache_max_bytes = CACHE_MAX_BYTES,
+      .memfd_threshold = 0,
+      .max_object_bytes = 0,
+      .is_tinylfu = 1,
+      .disk_dir = NULL,
+      .disk_max_bytes = DISK_MAX_BYTES,
+      .nameserver = NULL,
+      .loader_workers = LOADER_WORKERS,
+      .loader_queue = LOADER_QUEUE,
+      .loader_per_origin = LOADER_PER_ORIGIN,
+      .idle_timeout = CLIENT_IDLE_TIMEOUT,
+      .max_requests = CLIENT_MAX_REQUESTS,
+      .admin_port = 0,
+      .drain_timeout = DRAIN_TIMEOUT,
+      .handoff_path = NULL,
+  };
+  const char *access_log_path = NULL;
   int opt;
 
-  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+  while ((opt = getopt(argc, argv,
+                       "p:e:w:l:c:z:O:a:D:C:d:j:q:o:t:r:m:L:g:H:h")) != -1) {
     switch (opt) {
     case 'p':
-      port = atoi(optarg);
+      config.port = atoi(optarg);
+      break;
+    case 'e':
+      if (strcmp(optarg, "threaded") == 0) {
+        config.engine = PROXY_ENGINE_THREADED;
+      } else if (strcmp(optarg, "epoll") == 0) {
+        config.engine = PROXY_ENGINE_EPOLL;
+      } else if (strcmp(optarg, "sharded") == 0) {
+        config.engine = PROXY_ENGINE_SHARDED;
+      } else if (strcmp(optarg, "uring") == 0) {
+        config.engine = PROXY_ENGINE_URING;
+      } else {
+        printf("Error: Unknown engine %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'w':
+      config.workers_amount = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      config.connections_limit = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      config.cache_max_bytes = parse_size(optarg);
+      if (!config.cache_max_bytes) {
+        printf("Error: Invalid cache size %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'z':
+      config.memfd_threshold = parse_size(optarg);
+      if (!config.memfd_threshold) {
+        printf("Error: Invalid memfd threshold %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'O':
+      config.max_object_bytes = parse_size(optarg);
+      if (!config.max_object_bytes) {
+        printf("Error: Invalid object size limit %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'a':
+      if (strcmp(optarg, "all") == 0) {
+        config.is_tinylfu = 0;
+      } else if (strcmp(optarg, "tinylfu") == 0) {
+        config.is_tinylfu = 1;
+      } else {
+        printf("Error: Unknown admission policy %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'D':
+      config.disk_dir = optarg;
+      break;
+    case 'C':
+      config.disk_max_bytes = parse_size(optarg);
+      if (!config.disk_max_bytes) {
+        printf("Error: Invalid disk cache size %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'd':
+      config.nameserver = optarg;
+      break;
+    case 'j':
+      config.loader_workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'q':
+      config.loader_queue = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      config.loader_per_origin = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      config.idle_timeout = atoi(optarg);
+      if (config.idle_timeout <= 0) {
+        printf("Error: Invalid idle timeout %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'r':
+      config.max_requests = strtoul(optarg, NULL, 10);
+      if (!config.max_requests) {
+        printf("Error: Invalid requests limit %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      config.admin_port = atoi(optarg);
+      if (config.admin_port <= 0 || config.admin_port > 65535) {
+        printf("Error: Invalid metrics port %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'L':
+      access_log_path = optarg;
+      break;
+    case 'g':
+      config.drain_timeout = atoi(optarg);
+      if (config.drain_timeout < 0) {
+        printf("Error: Invalid drain timeout %s\n", optarg);
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'H':
+      config.handoff_path = optarg;
       break;
     case 'h':
       print_usage(argv[0]);
@@ -38,18 +331,28 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (port == 0) {
+  if (config.port == 0) {
     printf("Error: Port number required\n");
     print_usage(argv[0]);
     return 1;
   }
 
-  proxy_t *proxy = proxy_create(port, CONNECTIONS_LIMIT);
+  if (!config.max_object_bytes) {
+    config.max_object_bytes = config.cache_max_bytes / MAX_OBJECT_FRACTION;
+  }
+
+  proxy_t *proxy = proxy_create(&config);
   if (!proxy) {
     printf("Failed to create proxy\n");
     return 1;
   }
 
+  if (access_log_path && access_log_start(access_log_path) < 0) {
+    perror("access_log_start");
+    proxy_destroy(proxy);
+    return 1;
+  }
+
   global_proxy = proxy;
 
   struct sigaction sa;
@@ -59,12 +362,14 @@ int main(int argc, char *argv[]) {
 
   if (sigaction(SIGINT, &sa, NULL) == -1) {
     perror("sigaction SIGINT");
+    access_log_stop();
     proxy_destroy(proxy);
     return 1;
   }
 
   if (sigaction(SIGTERM, &sa, NULL) == -1) {
     perror("sigaction SIGTERM");
+    access_log_stop();
     proxy_destroy(proxy);
     return 1;
   }
@@ -75,6 +380,11 @@ int main(int argc, char *argv[]) {
 
   proxy_run(proxy);
 
+  // connections are finished, so every record is queued by now
+  access_log_stop();
+
+  print_stats(proxy);
+
   proxy_destroy(proxy);
 
   printf("Proxy server stopped\n");
@@ -0,0 +1,230 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  atomic_size_t buckets[METRICS_BUCKETS_AMOUNT];
+  atomic_size_t count;
+  _Atomic uint64_t sum_ns;
+} histogram_t;
+
+// metrics of one thread. only owner writes them, collector reads them
+// concurrently, so fields are atomic but updated with plain load and store
+typedef struct shard {
+  atomic_size_t counters[METRIC_COUNTERS_AMOUNT];
+  histogram_t phases[METRIC_PHASES_AMOUNT];
+  struct shard *prev;
+  struct shard *next;
+} shard_t;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+// shards of running threads and sum of finished ones
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static shard_t *shards = NULL;
+static metrics_snapshot_t retired;
+static __thread shard_t *thread_shard = NULL;
+
+/* ===== utility functions ===== */
+
+static void relaxed_add(atomic_size_t *value, size_t n) {
+  atomic_store_explicit(
+      value, atomic_load_explicit(value, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static size_t bucket_idx(uint64_t value) {
+  if (value < METRICS_SUB_BUCKETS) {
+    return value;
+  }
+
+  size_t shift = 63 - __builtin_clzll(value);
+  if (shift > METRICS_MAX_SHIFT) {
+    return METRICS_BUCKETS_AMOUNT - 1;
+  }
+  size_t sub =
+      (value >> (shift - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+  return METRICS_SUB_BUCKETS +
+         (shift - METRICS_SUB_BITS) * METRICS_SUB_BUCKETS + sub;
+}
+
+// returns the largest value of bucket
+static uint64_t bucket_max(size_t idx) {
+  if (idx < METRICS_SUB_BUCKETS) {
+    return idx;
+  }
+
+  size_t shift = (idx - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS;
+  uint64_t sub = (idx - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+  return ((METRICS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+// adds shard to snapshot. shards_lock must be held
+static void shard_sum(shard_t *shard, metrics_snapshot_t *snapshot) {
+  for (size_t i = 0; i < METRIC_COUNTERS_AMOUNT; i++) {
+    snapshot->counters[i] +=
+        atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+  }
+
+  for (size_t i = 0; i < METRIC_PHASES_AMOUNT; i++) {
+    histogram_t *src = &shard->phases[i];
+    metrics_histogram_t *dst = &snapshot->phases[i];
+    for (size_t j = 0; j < METRICS_BUCKETS_AMOUNT; j++) {
+      dst->buckets[j] +=
+          atomic_load_explicit(&src->buckets[j], memory_order_relaxed);
+    }
+    dst->count += atomic_load_explicit(&src->count, memory_order_relaxed);
+    dst->sum_ns += atomic_load_explicit(&src->sum_ns, memory_order_relaxed);
+  }
+}
+
+// called at thread exit: moves shard into sum of finished threads
+static void shard_retire(void *arg) {
+  shard_t *shard = (shard_t *)arg;
+
+  pthread_mutex_lock(&shards_lock);
+  shard_sum(shard, &retired);
+  if (shard->prev) {
+    shard->prev->next = shard->next;
+  } else {
+    shards = shard->next;
+  }
+  if (shard->next) {
+    shard->next->prev = shard->prev;
+  }
+  pthread_mutex_unlock(&shards_lock);
+
+  thread_shard = NULL;
+  free(shard);
+}
+
+static void key_create(void) {
+  pthread_key_create(&shard_key, shard_retire);
+}
+
+// returns shard of calling thread, registers it on first use. returns NULL
+// if there is no memory for it, then update is lost
+static shard_t *get_shard(void) {
+  if (thread_shard) {
+    return thread_shard;
+  }
+
+  pthread_once(&key_once, key_create);
+
+  shard_t *shard = calloc(1, sizeof(shard_t));
+  if (!shard) {
+    return NULL;
+  }
+  if (pthread_setspecific(shard_key, shard)) {
+    free(shard);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&shards_lock);
+  shard->next = shards;
+  if (shards) {
+    shards->prev = shard;
+  }
+  shards = shard;
+  pthread_mutex_unlock(&shards_lock);
+
+  thread_shard = shard;
+  return shard;
+}
+
+/* ===== end of utility functions ===== */
+
+uint64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_add(metrics_counter_t counter, size_t value) {
+  if (counter >= METRIC_COUNTERS_AMOUNT) {
+    errno = EINVAL;
+    return;
+  }
+
+  shard_t *shard = get_shard();
+  if (shard) {
+    relaxed_add(&shard->counters[counter], value);
+  }
+}
+
+void metrics_record_duration(metrics_phase_t phase, uint64_t duration_ns) {
+  if (phase >= METRIC_PHASES_AMOUNT) {
+    errno = EINVAL;
+    return;
+  }
+
+  shard_t *shard = get_shard();
+  if (!shard) {
+    return;
+  }
+
+  histogram_t *histogram = &shard->phases[phase];
+  relaxed_add(&histogram->buckets[bucket_idx(duration_ns)], 1);
+  relaxed_add(&histogram->count, 1);
+  atomic_store_explicit(
+      &histogram->sum_ns,
+      atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed) +
+          duration_ns,
+      memory_order_relaxed);
+}
+
+void metrics_record(metrics_phase_t phase, uint64_t start_ns) {
+  uint64_t now = metrics_now();
+  metrics_record_duration(phase, now > start_ns ? now - start_ns : 0);
+}
+
+void metrics_collect(metrics_snapshot_t *snapshot) {
+  if (!snapshot) {
+    errno = EINVAL;
+    return;
+  }
+
+  pthread_mutex_lock(&shards_lock);
+  memcpy(snapshot, &retired, sizeof(metrics_snapshot_t));
+  for (shard_t *shard = shards; shard; shard = shard->next) {
+    shard_sum(shard, snapshot);
+  }
+  pthread_mutex_unlock(&shards_lock);
+}
+
+uint64_t metrics_quantile(const metrics_histogram_t *histogram,
+                          double quantile) {
+  if (!histogram) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  // bucket counts are read while threads update them, so their sum may
+  // differ from count a little
+  size_t total = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS_AMOUNT; i++) {
+    total += histogram->buckets[i];
+  }
+  if (!total) {
+    return 0;
+  }
+
+  size_t rank = (size_t)(quantile * total);
+  if (rank >= total) {
+    rank = total - 1;
+  }
+
+  size_t seen = 0;
+  for (size_t i = 0; i < METRICS_BUCKETS_AMOUNT; i++) {
+    seen += histogram->buckets[i];
+    if (seen > rank) {
+      return bucket_max(i);
+    }
+  }
+  return bucket_max(METRICS_BUCKETS_AMOUNT - 1);
+}
@@ -1,18 +1,342 @@
 #include "proxy.h"
+#include "admin.h"
 #include "cache.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "uring_reactor.h"
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define CACHE_BUCKETS_AMOUNT 100
+#define UPSTREAM_MAX_IDLE_PER_ORIGIN 8
+#define UPSTREAM_IDLE_TIMEOUT 30
 #define DEFAULT_PORT 8080
+#define ADMIN_BACKLOG 16
+// blocked acceptor checks that often if proxy is stopped
+#define STOP_CHECK_INTERVAL_MS 200
+// low half of proxy->free_slots
+#define SLOT_MASK 0xffffffffULL
 
-proxy_t *proxy_create(int port, size_t connections_limit) {
-  if (port <= 0 || port > 65535 || !connections_limit) {
+/* ===== utility functions ===== */
+
+// reuse_port lets several sockets listen on the same port, kernel spreads
+// incoming connections between them
+static int create_listen_socket(int port, int backlog, int reuse_port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+    perror("setsockopt");
+    close(sock);
+    return -1;
+  }
+
+  if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1},
+                               sizeof(int)) < 0) {
+    perror("setsockopt SO_REUSEPORT");
+    close(sock);
+    return -1;
+  }
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(sock);
+    return -1;
+  }
+
+  if (listen(sock, backlog) < 0) {
+    perror("listen");
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+static void slot_push(proxy_t *proxy, size_t slot) {
+  uint64_t head = atomic_load(&proxy->free_slots);
+  uint64_t new_head;
+  do {
+    atomic_store(&proxy->slot_next[slot], head & SLOT_MASK);
+    new_head = (((head >> 32) + 1) << 32) | (slot + 1);
+  } while (!atomic_compare_exchange_weak(&proxy->free_slots, &head, new_head));
+}
+
+// returns 0 and free slot, -1 if table is full
+static int slot_pop(proxy_t *proxy, size_t *slot) {
+  uint64_t head = atomic_load(&proxy->free_slots);
+  uint64_t new_head;
+  do {
+    size_t top = head & SLOT_MASK;
+    if (!top) {
+      return -1;
+    }
+    new_head = (((head >> 32) + 1) << 32) |
+               atomic_load(&proxy->slot_next[top - 1]);
+  } while (!atomic_compare_exchange_weak(&proxy->free_slots, &head, new_head));
+
+  *slot = (head & SLOT_MASK) - 1;
+  return 0;
+}
+
+// waits till reaper frees slot if table is full. returns -1 if proxy is
+// stopped meanwhile
+static int slot_wait(proxy_t *proxy, size_t *slot) {
+  if (!proxy->running) {
+    return -1;
+  }
+  if (slot_pop(proxy, slot) == 0) {
+    return 0;
+  }
+
+  int is_found = 0;
+  pthread_mutex_lock(&proxy->reaper_lock);
+  while (proxy->running && !(is_found = slot_pop(proxy, slot) == 0)) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += STOP_CHECK_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&proxy->slot_freed, &proxy->reaper_lock,
+                           &deadline);
+  }
+  pthread_mutex_unlock(&proxy->reaper_lock);
+  return is_found ? 0 : -1;
+}
+
+// joins threads of finished connections and returns their slots
+static void *reaper_routine(void *arg) {
+  proxy_t *proxy = (proxy_t *)arg;
+
+  pthread_mutex_lock(&proxy->reaper_lock);
+  while (1) {
+    while (!proxy->finished && !proxy->is_reaper_stopping) {
+      pthread_cond_wait(&proxy->reaper_cond, &proxy->reaper_lock);
+    }
+    proxy_conn_t *finished = proxy->finished;
+    proxy->finished = NULL;
+    if (!finished) {
+      break;
+    }
+    // drain walks table under reaper_lock, so connections leave it before
+    // they are freed
+    for (proxy_conn_t *conn = finished; conn; conn = conn->next_finished) {
+      proxy->connections[conn->slot] = NULL;
+    }
+    pthread_mutex_unlock(&proxy->reaper_lock);
+
+    while (finished) {
+      proxy_conn_t *next = finished->next_finished;
+      size_t slot = finished->slot;
+      proxy_conn_destroy(finished);
+      proxy->active_connections--;
+      slot_push(proxy, slot);
+      finished = next;
+    }
+
+    pthread_mutex_lock(&proxy->reaper_lock);
+    pthread_cond_signal(&proxy->slot_freed);
+  }
+  pthread_mutex_unlock(&proxy->reaper_lock);
+
+  return NULL;
+}
+
+// waits for client, checking from time to time if proxy is stopped. returns
+// client socket or -1
+static int accept_client(proxy_t *proxy, int sock) {
+  while (proxy->running) {
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int n = poll(&pfd, 1, STOP_CHECK_INTERVAL_MS);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (n < 0 && errno != EINTR) {
+      perror("poll");
+      return -1;
+    }
+    if (n <= 0) {
+      continue;
+    }
+
+    int client_fd = accept(sock, NULL, NULL);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (client_fd >= 0) {
+      // response is sent in pieces as loader appends it, Nagle would hold
+      // the last small one back till client's delayed ACK
+      int one = 1;
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+      return client_fd;
+    }
+    // listener taken over from or handed to another process is shared with
+    // it, connection can be taken there first
+    if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN &&
+        errno != EWOULDBLOCK) {
+      perror("accept");
+    }
+  }
+  return -1;
+}
+
+static time_t monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+// shuts client sockets of all running connections down. reaper_lock must be
+// held
+static void shutdown_connections(proxy_t *proxy, int how) {
+  for (size_t i = 0; i < proxy->connections_limit; i++) {
+    if (proxy->connections[i]) {
+      shutdown(proxy->connections[i]->client_fd, how);
+    }
+  }
+}
+
+// waits till connections of stopped threaded engine are finished. clients
+// waiting for request get EOF right away, responses in progress are sent
+// till drain deadline, then their sockets are shut down too
+static void drain_threaded(proxy_t *proxy) {
+  time_t deadline = monotonic_seconds() + proxy->drain_timeout;
+
+  pthread_mutex_lock(&proxy->reaper_lock);
+  if (proxy->active_connections) {
+    printf("Draining %zu connections\n",
+           atomic_load(&proxy->active_connections));
+  }
+  shutdown_connections(proxy, SHUT_RD);
+
+  while (proxy->active_connections) {
+    // connection waiting for loader checks is_cut every time its wait for
+    // data times out
+    if (!proxy->is_cut &&
+        (proxy->is_forced || monotonic_seconds() >= deadline)) {
+      proxy->is_cut = 1;
+      shutdown_connections(proxy, SHUT_RDWR);
+    }
+
+    struct timespec wait_deadline;
+    clock_gettime(CLOCK_REALTIME, &wait_deadline);
+    wait_deadline.tv_nsec += STOP_CHECK_INTERVAL_MS * 1000000L;
+    wait_deadline.tv_sec += wait_deadline.tv_nsec / 1000000000L;
+    wait_deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&proxy->slot_freed, &proxy->reaper_lock,
+                           &wait_deadline);
+  }
+  pthread_mutex_unlock(&proxy->reaper_lock);
+}
+
+// hands listeners to new process connecting to handoff socket and drains
+// this one
+static void *handoff_routine(void *arg) {
+  proxy_t *proxy = (proxy_t *)arg;
+
+  while (proxy->running) {
+    struct pollfd pfd = {.fd = proxy->handoff_fd, .events = POLLIN};
+    int n = poll(&pfd, 1, STOP_CHECK_INTERVAL_MS);
+    if (n < 0 && errno != EINTR) {
+      perror("handoff:poll");
+      break;
+    }
+    if (n <= 0) {
+      continue;
+    }
+
+    int fd = accept(proxy->handoff_fd, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    int result = handoff_send(fd, proxy->listen_fds, proxy->listen_fds_amount,
+                              proxy->admin_fd);
+    close(fd);
+    if (result < 0) {
+      perror("handoff_send");
+      continue;
+    }
+
+    printf("Listeners handed over to new process, draining connections\n");
+    proxy->is_handed_off = 1;
+    proxy_stop(proxy);
+  }
+
+  return NULL;
+}
+
+// accept loop of threaded engine: every client gets its own thread. slot is
+// taken before accept, so clients beyond the limit wait in listen backlog
+static void run_threaded(proxy_t *proxy, int sock) {
+  proxy->is_reaper_stopping = 0;
+  if (pthread_create(&proxy->reaper, NULL, reaper_routine, proxy)) {
+    perror("pthread_create reaper");
+    return;
+  }
+
+  size_t slot;
+  while (slot_wait(proxy, &slot) == 0) {
+    int client_fd = accept_client(proxy, sock);
+    if (client_fd < 0) {
+      slot_push(proxy, slot);
+      continue;
+    }
+
+    proxy_conn_t *conn = proxy_conn_create(client_fd);
+    if (!conn) {
+      perror("connection_create");
+      close(client_fd);
+      slot_push(proxy, slot);
+      continue;
+    }
+
+    conn->slot = slot;
+    proxy->connections[slot] = conn;
+    proxy->active_connections++;
+    if (proxy_conn_run(proxy, conn) < 0) {
+      perror("proxy_conn_run");
+      proxy->active_connections--;
+      proxy->connections[slot] = NULL;
+      close(client_fd);
+      free(conn);
+      slot_push(proxy, slot);
+    }
+  }
+
+  // reaper frees every connection before it stops
+  drain_threaded(proxy);
+
+  pthread_mutex_lock(&proxy->reaper_lock);
+  proxy->is_reaper_stopping = 1;
+  pthread_cond_signal(&proxy->reaper_cond);
+  pthread_mutex_unlock(&proxy->reaper_lock);
+  pthread_join(proxy->reaper, NULL);
+}
+
+/* ===== end of utility functions ===== */
+
+proxy_t *proxy_create(const proxy_config_t *config) {
+  if (!config || config->port <= 0 || config->port > 65535 ||
+      !config->connections_limit || !config->cache_max_bytes ||
+      config->idle_timeout <= 0 || !config->max_requests ||
+      !config->loader_workers || !config->loader_queue ||
+      !config->loader_per_origin || config->connections_limit >= SLOT_MASK ||
+      config->admin_port < 0 || config->admin_port > 65535 ||
+      config->drain_timeout < 0) {
     errno = EINVAL;
     return NULL;
   }
@@ -23,18 +347,117 @@ proxy_t *proxy_create(int port, size_t connections_limit) {
   }
 
   proxy->running = 0;
-  proxy->port = port;
-  proxy->connections_limit = connections_limit;
+  proxy->is_forced = 0;
+  proxy->is_cut = 0;
+  proxy->drain_timeout = config->drain_timeout;
+  proxy->listen_fds = NULL;
+  proxy->listen_fds_amount = 0;
+  proxy->handoff_path = config->handoff_path;
+  proxy->handoff_fd = -1;
+  proxy->is_handed_off = 0;
+  proxy->port = config->port;
+  proxy->engine = config->engine;
+  proxy->workers_amount = config->workers_amount;
+  if (!proxy->workers_amount) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    proxy->workers_amount = cores > 0 ? (size_t)cores : 1;
+  }
+  proxy->connections_limit = config->connections_limit;
+  proxy->active_connections = 0;
+  proxy->idle_timeout = config->idle_timeout;
+  proxy->max_requests = config->max_requests;
+  proxy->admin_port = config->admin_port;
+  proxy->admin_fd = -1;
+
+  // epoll engine doesn't keep connections table, reactors own connections
+  proxy->connections = NULL;
+  proxy->slot_next = NULL;
+  proxy->free_slots = 0;
+  proxy->finished = NULL;
+  proxy->is_reaper_stopping = 0;
+  pthread_mutex_init(&proxy->reaper_lock, NULL);
+  pthread_cond_init(&proxy->reaper_cond, NULL);
+  pthread_cond_init(&proxy->slot_freed, NULL);
+  if (proxy->engine == PROXY_ENGINE_THREADED) {
+    proxy->connections =
+        calloc(proxy->connections_limit, sizeof(proxy_conn_t *));
+    proxy->slot_next =
+        malloc(proxy->connections_limit * sizeof(atomic_size_t));
+    if (!proxy->connections || !proxy->slot_next) {
+      free(proxy->connections);
+      free(proxy->slot_next);
+      free(proxy);
+      return NULL;
+    }
+    // slot 0 ends up on top
+    for (size_t i = proxy->connections_limit; i--;) {
+      slot_push(proxy, i);
+    }
+  }
 
-  proxy->connections = calloc(proxy->connections_limit, sizeof(proxy_conn_t *));
-  if (!proxy->connections) {
+  proxy->cache = cache_create(CACHE_BUCKETS_AMOUNT, config->cache_max_bytes,
+                              config->memfd_threshold);
+  if (!proxy->cache) {
+    free(proxy->connections);
+    free(proxy->slot_next);
+    free(proxy);
+    return NULL;
+  }
+  if (cache_set_admission(proxy->cache, config->max_object_bytes,
+                          config->is_tinylfu) < 0) {
+    cache_destroy(proxy->cache);
+    free(proxy->connections);
+    free(proxy->slot_next);
     free(proxy);
     return NULL;
   }
 
-  proxy->cache = cache_create(CACHE_BUCKETS_AMOUNT);
-  if (!proxy->cache) {
+  proxy->disk = NULL;
+  if (config->disk_dir) {
+    proxy->disk = disk_store_create(config->disk_dir, config->disk_max_bytes);
+    if (!proxy->disk) {
+      cache_destroy(proxy->cache);
+      free(proxy->connections);
+      free(proxy->slot_next);
+      free(proxy);
+      return NULL;
+    }
+    cache_set_spill(proxy->cache, disk_store_spill, proxy->disk);
+  }
+
+  proxy->resolver = resolver_create(config->nameserver);
+  if (!proxy->resolver) {
+    cache_destroy(proxy->cache);
+    disk_store_destroy(proxy->disk);
+    free(proxy->connections);
+    free(proxy->slot_next);
+    free(proxy);
+    return NULL;
+  }
+
+  proxy->upstream =
+      upstream_pool_create(UPSTREAM_MAX_IDLE_PER_ORIGIN, UPSTREAM_IDLE_TIMEOUT);
+  if (!proxy->upstream) {
+    resolver_destroy(proxy->resolver);
+    cache_destroy(proxy->cache);
+    disk_store_destroy(proxy->disk);
+    free(proxy->connections);
+    free(proxy->slot_next);
+    free(proxy);
+    return NULL;
+  }
+
+  proxy->loader = loader_create(proxy->cache, proxy->upstream,
+                                proxy->resolver, proxy->disk,
+                                config->loader_workers, config->loader_queue,
+                                config->loader_per_origin);
+  if (!proxy->loader) {
+    upstream_pool_destroy(proxy->upstream);
+    resolver_destroy(proxy->resolver);
+    cache_destroy(proxy->cache);
+    disk_store_destroy(proxy->disk);
     free(proxy->connections);
+    free(proxy->slot_next);
     free(proxy);
     return NULL;
   }
@@ -52,100 +475,195 @@ void proxy_destroy(proxy_t *proxy) {
 
   if (proxy->connections) {
     free(proxy->connections);
+    free(proxy->slot_next);
+  }
+  pthread_mutex_destroy(&proxy->reaper_lock);
+  pthread_cond_destroy(&proxy->reaper_cond);
+  pthread_cond_destroy(&proxy->slot_freed);
+
+  if (proxy->loader) {
+    loader_destroy(proxy->loader);
+  }
+
+  if (proxy->upstream) {
+    upstream_pool_destroy(proxy->upstream);
+  }
+
+  if (proxy->resolver) {
+    resolver_destroy(proxy->resolver);
   }
 
+  // cache hands its entries to disk tier, so it goes first
   if (proxy->cache) {
     cache_destroy(proxy->cache);
   }
 
+  if (proxy->disk) {
+    disk_store_destroy(proxy->disk);
+  }
+
   free(proxy);
 }
 
-void proxy_run(proxy_t *proxy) {
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0) {
-    perror("socket");
-    return;
+// takes listeners of previous process if handoff socket is served. returns
+// amount of them put to socks (at most socks_amount, which is changed for
+// sharded engine), 0 if there is no previous process, -1 on error
+static int take_listeners(proxy_t *proxy, int *socks, size_t *socks_amount) {
+  int inherited[HANDOFF_MAX_FDS];
+  int admin_fd;
+  int amount = handoff_receive(proxy->handoff_path, inherited,
+                               HANDOFF_MAX_FDS, &admin_fd);
+  if (amount <= 0) {
+    return amount;
   }
+  printf("Took over %d listeners from previous process\n", amount);
 
-  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-    perror("setsockopt");
-    close(sock);
-    return;
+  // sharded engine runs reactor per inherited listener, the others need
+  // one. connections waiting in backlog of closed extra listener are lost
+  if (proxy->engine == PROXY_ENGINE_SHARDED) {
+    proxy->workers_amount = amount;
+    *socks_amount = amount;
+  }
+  for (int i = 0; i < amount; i++) {
+    if ((size_t)i < *socks_amount) {
+      socks[i] = inherited[i];
+    } else {
+      close(inherited[i]);
+    }
   }
 
-  struct sockaddr_in addr = {0};
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(proxy->port);
+  if (admin_fd >= 0 && proxy->admin_port) {
+    proxy->admin_fd = admin_fd;
+  } else if (admin_fd >= 0) {
+    close(admin_fd);
+  }
 
-  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("bind");
-    close(sock);
+  return (size_t)amount < *socks_amount ? amount : (int)*socks_amount;
+}
+
+void proxy_run(proxy_t *proxy) {
+  // sharded engine gives every reactor its own listener
+  int is_sharded = proxy->engine == PROXY_ENGINE_SHARDED;
+  size_t socks_amount = is_sharded ? proxy->workers_amount : 1;
+  size_t socks_capacity =
+      socks_amount > HANDOFF_MAX_FDS ? socks_amount : HANDOFF_MAX_FDS;
+  int *socks = malloc(socks_capacity * sizeof(int));
+  if (!socks) {
+    perror("proxy_run:malloc");
     return;
   }
 
-  if (listen(sock, proxy->connections_limit) < 0) {
-    perror("listen");
-    close(sock);
-    return;
+  size_t opened = 0;
+  if (proxy->handoff_path) {
+    int taken = take_listeners(proxy, socks, &socks_amount);
+    if (taken < 0) {
+      perror("handoff_receive");
+      free(socks);
+      return;
+    }
+    opened = taken;
   }
 
-  printf("Proxy server listening on port %d\n", proxy->port);
+  for (; opened < socks_amount; opened++) {
+    socks[opened] =
+        create_listen_socket(proxy->port, proxy->connections_limit, is_sharded);
+    if (socks[opened] < 0) {
+      break;
+    }
+  }
 
-  proxy->running = 1;
+  if (opened == socks_amount && proxy->admin_port && proxy->admin_fd < 0) {
+    proxy->admin_fd = create_listen_socket(proxy->admin_port, ADMIN_BACKLOG, 0);
+  }
 
-  while (proxy->running) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+  if (opened == socks_amount && (!proxy->admin_port || proxy->admin_fd >= 0)) {
+    printf("Proxy server listening on port %d\n", proxy->port);
 
-    int client_fd = accept(sock, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd < 0) {
-      perror("accept");
-      continue;
+    proxy->running = 1;
+    proxy->listen_fds = socks;
+    proxy->listen_fds_amount = socks_amount;
+
+    int is_admin_running = 0;
+    if (proxy->admin_fd >= 0) {
+      is_admin_running =
+          !pthread_create(&proxy->admin_thread, NULL, admin_routine, proxy);
+      if (is_admin_running) {
+        printf("Metrics available on port %d at /metrics\n",
+               proxy->admin_port);
+      } else {
+        perror("pthread_create admin");
+      }
     }
 
-    proxy_conn_t *conn = proxy_conn_create(client_fd);
-    if (!conn) {
-      perror("connection_create");
-      close(client_fd);
-      continue;
+    // proxy works without hot restart if handoff socket can't be served
+    int is_handoff_running = 0;
+    if (proxy->handoff_path) {
+      proxy->handoff_fd = handoff_listen(proxy->handoff_path);
+      if (proxy->handoff_fd < 0) {
+        perror("handoff_listen");
+      } else if (pthread_create(&proxy->handoff_thread, NULL, handoff_routine,
+                                proxy)) {
+        perror("pthread_create handoff");
+      } else {
+        is_handoff_running = 1;
+      }
     }
 
-    int is_cell_found = 0;
-    while (proxy->running && !is_cell_found) {
-      for (size_t i = 0; i < proxy->connections_limit; i++) {
-        proxy_conn_t *curr_conn = proxy->connections[i];
+    switch (proxy->engine) {
+    case PROXY_ENGINE_THREADED:
+      run_threaded(proxy, socks[0]);
+      break;
+    case PROXY_ENGINE_EPOLL:
+    case PROXY_ENGINE_SHARDED:
+      reactor_run(proxy, socks, socks_amount);
+      break;
+    case PROXY_ENGINE_URING:
+      // io_uring may be disabled or missing, epoll engine serves instead
+      if (uring_reactor_run(proxy, socks, socks_amount) < 0) {
+        perror("io_uring engine");
+        fprintf(stderr, "Falling back to epoll engine\n");
+        proxy->engine = PROXY_ENGINE_EPOLL;
+        reactor_run(proxy, socks, socks_amount);
+      }
+      break;
+    }
 
-        if (!curr_conn) {
-          proxy->connections[i] = conn;
-          is_cell_found = 1;
-          break;
-        }
+    // engine may also stop on its own, admin and handoff threads have to
+    // notice it
+    proxy->running = 0;
+    if (is_admin_running) {
+      pthread_join(proxy->admin_thread, NULL);
+    }
+    if (is_handoff_running) {
+      pthread_join(proxy->handoff_thread, NULL);
+    }
+  }
 
-        if (atomic_load(&curr_conn->state) == CONN_DONE) {
-          proxy_conn_destroy(curr_conn);
-          proxy->connections[i] = conn;
-          is_cell_found = 1;
-          break;
-        }
-      }
+  // socket file belongs to the next process after handoff
+  if (proxy->handoff_fd >= 0) {
+    close(proxy->handoff_fd);
+    proxy->handoff_fd = -1;
+    if (!proxy->is_handed_off) {
+      unlink(proxy->handoff_path);
     }
+  }
 
-    proxy_conn_run(proxy, conn);
+  if (proxy->admin_fd >= 0) {
+    close(proxy->admin_fd);
+    proxy->admin_fd = -1;
   }
 
-  close(sock);
+  for (size_t i = 0; i < opened; i++) {
+    close(socks[i]);
+  }
+  free(socks);
+  proxy->listen_fds = NULL;
+  proxy->listen_fds_amount = 0;
 }
 
 void proxy_stop(proxy_t *proxy) {
-  proxy->running = 0;
-
-  for (size_t i = 0; i < proxy->connections_limit; i++) {
-    proxy_conn_t *conn = proxy->connections[i];
-    if (!conn) {
-      continue;
-    }
-    proxy_conn_destroy(conn);
+  if (!proxy->running) {
+    proxy->is_forced = 1;
   }
+  proxy->running = 0;
 }
@@ -0,0 +1,293 @@
+#include "range.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// delimiter and headers of one part of multipart response
+#define PART_HEADERS_SIZE 512
+#define MAX_CONTENT_TYPE 256
+#define HEAD_EXTRA_SIZE 256
+
+/* ===== utility functions ===== */
+
+static void add_part(range_response_t *response, int is_entry, size_t offset,
+                     size_t size) {
+  range_part_t *part = &response->parts[response->parts_amount++];
+  part->is_entry = is_entry;
+  part->offset = offset;
+  part->size = size;
+  response->size += size;
+}
+
+// appends formatted text to response text. returns its size, text which
+// doesn't fit is truncated
+static size_t vappend_text(range_response_t *response, const char *format,
+                           va_list args) {
+  size_t left = response->text_capacity - response->text_size;
+  int n = vsnprintf(response->text + response->text_size, left, format, args);
+
+  size_t size = n < 0 ? 0 : (size_t)n;
+  if (size >= left) {
+    size = left ? left - 1 : 0;
+  }
+  response->text_size += size;
+  return size;
+}
+
+static size_t append_text(range_response_t *response, const char *format,
+                          ...) {
+  va_list args;
+  va_start(args, format);
+  size_t size = vappend_text(response, format, args);
+  va_end(args);
+  return size;
+}
+
+// appends formatted text as the next part of response
+static void add_text_part(range_response_t *response, const char *format,
+                          ...) {
+  size_t offset = response->text_size;
+
+  va_list args;
+  va_start(args, format);
+  size_t size = vappend_text(response, format, args);
+  va_end(args);
+
+  add_part(response, 0, offset, size);
+}
+
+// reads header block of DONE entry. returns its size or 0 if entry has none
+static size_t read_headers(cache_entry_t *entry, size_t header_size,
+                           char *headers) {
+  if (!header_size || header_size > MAX_RESPONSE_HEADERS) {
+    return 0;
+  }
+  for (size_t done = 0; done < header_size;) {
+    ssize_t n =
+        cache_entry_read(entry, done, headers + done, header_size - done, 0);
+    if (n <= 0) {
+      return 0;
+    }
+    done += n;
+  }
+  return header_size;
+}
+
+// returns header lines of block without status line and final empty line
+static const char *header_lines(const char *headers, size_t size,
+                                size_t *lines_size) {
+  const char *lines = memchr(headers, '\n', size);
+  if (!lines) {
+    *lines_size = 0;
+    return headers;
+  }
+  lines++;
+
+  size_t n = size - (lines - headers);
+  if (n >= 2 && lines[n - 1] == '\n' && lines[n - 2] == '\r') {
+    n -= 2;
+  } else if (n >= 1 && lines[n - 1] == '\n') {
+    n -= 1;
+  }
+  *lines_size = n;
+  return lines;
+}
+
+/* ===== end of utility functions ===== */
+
+int range_response_init(range_response_t *response, cache_entry_t *entry,
+                        const http_request_t *request) {
+  if (!response || !entry || !request) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // If-Range validator isn't checked, so whole entry is the safe answer
+  if (!request->range.data || request->if_range.data) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&entry->lock);
+  cache_state_t state = entry->state;
+  size_t header_size = entry->header_size;
+  size_t data_size = entry->data_size;
+  pthread_mutex_unlock(&entry->lock);
+  if (state != DONE) {
+    return 0;
+  }
+
+  char headers[MAX_RESPONSE_HEADERS];
+  size_t headers_size = read_headers(entry, header_size, headers);
+  if (!headers_size) {
+    return 0;
+  }
+
+  // only identity body is stored as it is sent, so offsets map to it
+  int status = 0;
+  size_t value_size;
+  const char *value;
+  if (http_parse_status(headers, headers_size, &status) < 0 || status != 200 ||
+      http_find_header(headers, headers_size, "Transfer-Encoding",
+                       &value_size)) {
+    return 0;
+  }
+  size_t length = data_size - header_size;
+  value = http_find_header(headers, headers_size, "Content-Length",
+                           &value_size);
+  if (!value || strtoull(value, NULL, 10) != length) {
+    return 0;
+  }
+
+  http_range_t ranges[HTTP_MAX_RANGES];
+  int ranges_amount =
+      http_parse_range(request->range, length, ranges, HTTP_MAX_RANGES);
+  if (ranges_amount < 0) {
+    return 0;
+  }
+
+  memset(response, 0, sizeof(range_response_t));
+  response->text_capacity = headers_size + HEAD_EXTRA_SIZE +
+                            (ranges_amount + 1) * PART_HEADERS_SIZE;
+  response->text = malloc(response->text_capacity);
+  if (!response->text) {
+    return -1;
+  }
+
+  if (ranges_amount == 0) {
+    response->status = 416;
+    add_text_part(response,
+                  "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                  "Content-Range: bytes */%zu\r\n"
+                  "Content-Length: 0\r\n"
+                  "\r\n",
+                  length);
+    return 1;
+  }
+
+  char content_type[MAX_CONTENT_TYPE] = "";
+  value = http_find_header(headers, headers_size, "Content-Type", &value_size);
+  if (value && value_size < sizeof(content_type)) {
+    memcpy(content_type, value, value_size);
+    content_type[value_size] = '\0';
+  }
+
+  headers_size = http_remove_header(headers, headers_size, "Content-Length");
+  if (ranges_amount > 1) {
+    headers_size = http_remove_header(headers, headers_size, "Content-Type");
+  }
+
+  // head goes first, but its Content-Length is known only after parts
+  response->status = 206;
+  response->parts_amount = 1;
+
+  char boundary[40];
+  snprintf(boundary, sizeof(boundary), "%016zx%08lx", entry->hash,
+           (unsigned long)time(NULL));
+
+  if (ranges_amount == 1) {
+    add_part(response, 1, header_size + ranges[0].first,
+             ranges[0].last - ranges[0].first + 1);
+  } else {
+    for (int i = 0; i < ranges_amount; i++) {
+      if (content_type[0]) {
+        add_text_part(response,
+                      "\r\n--%s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Range: bytes %zu-%zu/%zu\r\n"
+                      "\r\n",
+                      boundary, content_type, ranges[i].first, ranges[i].last,
+                      length);
+      } else {
+        add_text_part(response,
+                      "\r\n--%s\r\n"
+                      "Content-Range: bytes %zu-%zu/%zu\r\n"
+                      "\r\n",
+                      boundary, ranges[i].first, ranges[i].last, length);
+      }
+      add_part(response, 1, header_size + ranges[i].first,
+               ranges[i].last - ranges[i].first + 1);
+    }
+    add_text_part(response, "\r\n--%s--\r\n", boundary);
+  }
+  size_t body_size = response->size;
+
+  size_t lines_size;
+  const char *lines = header_lines(headers, headers_size, &lines_size);
+
+  size_t head_offset = response->text_size;
+  size_t head_size =
+      append_text(response, "HTTP/1.1 206 Partial Content\r\n%.*s",
+                  (int)lines_size, lines);
+  if (ranges_amount == 1) {
+    head_size += append_text(response, "Content-Range: bytes %zu-%zu/%zu\r\n",
+                             ranges[0].first, ranges[0].last, length);
+  } else {
+    head_size += append_text(
+        response, "Content-Type: multipart/byteranges; boundary=%s\r\n",
+        boundary);
+  }
+  head_size +=
+      append_text(response, "Content-Length: %zu\r\n\r\n", body_size);
+
+  response->parts[0].is_entry = 0;
+  response->parts[0].offset = head_offset;
+  response->parts[0].size = head_size;
+  response->size += head_size;
+
+  return 1;
+}
+
+ssize_t range_response_send(range_response_t *response, cache_entry_t *entry,
+                            size_t position, int fd) {
+  if (!response || !entry || fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t skip;
+  const range_part_t *part = range_response_locate(response, position, &skip);
+  if (!part) {
+    return 0;
+  }
+  if (part->is_entry) {
+    return cache_entry_send(entry, part->offset + skip, fd, part->size - skip,
+                            0);
+  }
+  return send(fd, response->text + part->offset + skip, part->size - skip,
+              MSG_NOSIGNAL);
+}
+
+const range_part_t *range_response_locate(const range_response_t *response,
+                                          size_t position, size_t *skip) {
+  if (!response || !skip) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  size_t part_start = 0;
+  for (size_t i = 0; i < response->parts_amount; i++) {
+    const range_part_t *part = &response->parts[i];
+    if (position < part_start + part->size) {
+      *skip = position - part_start;
+      return part;
+    }
+    part_start += part->size;
+  }
+  return NULL;
+}
+
+void range_response_destroy(range_response_t *response) {
+  if (!response) {
+    errno = EINVAL;
+    return;
+  }
+
+  free(response->text);
+  response->text = NULL;
+}
@@ -0,0 +1,609 @@
+#include "reactor.h"
+#include "http.h"
+#include "metrics.h"
+#include "range.h"
+#include "session.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EVENTS_BATCH 256
+#define WAIT_TIMEOUT_MS 500
+#define REQUEST_BUFFER_SIZE 8192
+// bytes of entry passed to one cache_entry_send() call
+#define SEND_CHUNK_SIZE (1 << 20)
+
+typedef enum {
+  RCONN_READ_REQUEST,
+  RCONN_SEND_ENTRY,
+  RCONN_SEND_ERROR,
+} rconn_state_t;
+
+typedef struct reactor reactor_t;
+
+// client connection of epoll engine. it replaces thread stack of threaded
+// engine, so everything client_routine() keeps in locals lives here
+typedef struct rconn {
+  int fd;
+  rconn_state_t state;
+  // events connection is currently registered for in epoll
+  uint32_t events;
+  reactor_t *reactor;
+  // request buffer is allocated on first read, so idle clients stay cheap
+  session_t session;
+  // list of all reactor connections
+  struct rconn *prev;
+  struct rconn *next;
+} rconn_t;
+
+struct reactor {
+  proxy_t *proxy;
+  int listen_fd;
+  int epoll_fd;
+  pthread_t thread;
+  // its event_fd is registered in epoll
+  session_queue_t queue;
+  rconn_t *connections;
+};
+
+/* ===== utility functions ===== */
+
+static rconn_t *session_conn(session_t *session) {
+  return (rconn_t *)((char *)session - offsetof(rconn_t, session));
+}
+
+static int epoll_set(reactor_t *reactor, rconn_t *conn, uint32_t events) {
+  if (conn->events == events) {
+    return 0;
+  }
+  conn->events = events;
+
+  struct epoll_event ev = {0};
+  ev.events = events;
+  ev.data.ptr = conn;
+  metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+  return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void conn_close(rconn_t *conn) {
+  reactor_t *reactor = conn->reactor;
+
+  session_close(&conn->session);
+  session_destroy(&conn->session);
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    reactor->connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  metrics_add(METRIC_CLIENT_SYSCALLS, 2);
+  free(conn->session.buffer);
+  free(conn);
+
+  reactor->proxy->active_connections--;
+}
+
+static void session_close_conn(session_t *session) {
+  conn_close(session_conn(session));
+}
+
+/* ===== end of utility functions ===== */
+
+/* ===== connection state machine ===== */
+
+// every step drives connection until it has to wait or changes its state
+typedef enum {
+  // connection waits for socket or loader
+  STEP_WAIT,
+  // connection moved to another state, which has to be driven right away
+  STEP_NEXT,
+  // connection is finished and has to be closed
+  STEP_CLOSE,
+} step_t;
+
+static step_t conn_fail(rconn_t *conn, const char *error_message) {
+  session_fail(&conn->session, error_message);
+  conn->state = RCONN_SEND_ERROR;
+  return STEP_NEXT;
+}
+
+static step_t conn_handle_request(rconn_t *conn) {
+  const char *error_message = session_start(&conn->session);
+  if (error_message) {
+    return conn_fail(conn, error_message);
+  }
+
+  conn->state = RCONN_SEND_ENTRY;
+  return STEP_NEXT;
+}
+
+static step_t conn_read_request(rconn_t *conn) {
+  session_t *session = &conn->session;
+
+  if (!session->buffer) {
+    session->buffer = malloc(REQUEST_BUFFER_SIZE);
+    if (!session->buffer) {
+      return STEP_CLOSE;
+    }
+    session->buffer_used = 0;
+  }
+
+  while (1) {
+    // pipelined request could be received together with previous one
+    uint64_t parse_start = metrics_now();
+    int parse_result = http_request_parse(&session->request, session->buffer,
+                                          session->buffer_used);
+    session->parse_ns += metrics_now() - parse_start;
+    if (parse_result < 0) {
+      return conn_fail(conn, "HTTP/1.0 400 Bad Request\r\n\r\n");
+    }
+    if (parse_result) {
+      return conn_handle_request(conn);
+    }
+
+    size_t space = REQUEST_BUFFER_SIZE - session->buffer_used;
+    if (!space) {
+      return conn_fail(conn, "HTTP/1.0 400 Bad Request\r\n\r\n");
+    }
+
+    ssize_t n =
+        recv(conn->fd, session->buffer + session->buffer_used, space, 0);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        epoll_set(conn->reactor, conn, EPOLLIN);
+        return STEP_WAIT;
+      }
+      return STEP_CLOSE;
+    }
+    if (n == 0) {
+      return STEP_CLOSE;
+    }
+
+    session->buffer_used += n;
+    metrics_add(METRIC_CLIENT_BYTES_IN, n);
+  }
+}
+
+// finishes response and prepares connection for the next request
+static step_t conn_finish_entry(rconn_t *conn) {
+  session_finish(&conn->session);
+  if (!session_next(&conn->session)) {
+    return STEP_CLOSE;
+  }
+
+  conn->state = RCONN_READ_REQUEST;
+  return STEP_NEXT;
+}
+
+// streams entry to client while loader is still appending to it
+static step_t conn_send_entry(rconn_t *conn) {
+  session_t *session = &conn->session;
+
+  while (1) {
+    ssize_t n =
+        session->range
+            ? range_response_send(session->range, session->entry,
+                                  session->sent, conn->fd)
+            : cache_entry_send(session->entry, session->sent, conn->fd,
+                               SEND_CHUNK_SIZE, 0);
+    // end of entry, missing data and failed download need no syscall
+    if (n > 0 || (n < 0 && errno != ENODATA && errno != EIO)) {
+      metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    }
+    if (n < 0 && errno == ENODATA) {
+      // watch before waiting and read again, so append that happened in
+      // between is not missed
+      if (!session->is_watching) {
+        session_watch(session);
+        continue;
+      }
+      epoll_set(conn->reactor, conn, 0);
+      return STEP_WAIT;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      epoll_set(conn->reactor, conn, EPOLLOUT);
+      return STEP_WAIT;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EIO) {
+      // nothing is sent yet, so client still can get proper error
+      if (!session->sent) {
+        return conn_fail(conn, "HTTP/1.0 502 Bad Gateway\r\n\r\n");
+      }
+      return STEP_CLOSE;
+    }
+    if (n < 0) {
+      return STEP_CLOSE;
+    }
+    if (n == 0) {
+      return conn_finish_entry(conn);
+    }
+
+    session->sent += n;
+    metrics_add(METRIC_CLIENT_BYTES_OUT, n);
+    if (!session->range) {
+      cache_reader_advance(session->entry, &session->reader, session->sent);
+    }
+  }
+}
+
+static step_t conn_send_error(rconn_t *conn) {
+  session_t *session = &conn->session;
+  size_t size = strlen(session->error_message);
+
+  while (session->sent < size) {
+    ssize_t n = send(conn->fd, session->error_message + session->sent,
+                     size - session->sent, MSG_NOSIGNAL);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        epoll_set(conn->reactor, conn, EPOLLOUT);
+        return STEP_WAIT;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return STEP_CLOSE;
+    }
+    session->sent += n;
+    metrics_add(METRIC_CLIENT_BYTES_OUT, n);
+  }
+
+  return STEP_CLOSE;
+}
+
+// drives connection as far as it can go without blocking
+static void conn_advance(rconn_t *conn) {
+  step_t step;
+
+  do {
+    switch (conn->state) {
+    case RCONN_READ_REQUEST:
+      step = conn_read_request(conn);
+      break;
+    case RCONN_SEND_ENTRY:
+      step = conn_send_entry(conn);
+      break;
+    case RCONN_SEND_ERROR:
+      step = conn_send_error(conn);
+      break;
+    default:
+      step = STEP_CLOSE;
+      break;
+    }
+  } while (step == STEP_NEXT);
+
+  if (step == STEP_CLOSE) {
+    conn_close(conn);
+  }
+}
+
+static void session_advance(session_t *session) {
+  conn_advance(session_conn(session));
+}
+
+/* ===== end of connection state machine ===== */
+
+static void reactor_accept(reactor_t *reactor) {
+  proxy_t *proxy = reactor->proxy;
+
+  while (1) {
+    int client_fd = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (client_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("reactor:accept");
+      }
+      return;
+    }
+    // response goes out in pieces, none of them waits for delayed ACK
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+
+    if (atomic_fetch_add(&proxy->active_connections, 1) >=
+        proxy->connections_limit) {
+      proxy->active_connections--;
+      metrics_add(METRIC_ERRORS, 1);
+      const char *busy = "HTTP/1.0 503 Service Unavailable\r\n\r\n";
+      send(client_fd, busy, strlen(busy), MSG_NOSIGNAL);
+      close(client_fd);
+      continue;
+    }
+
+    rconn_t *conn = calloc(1, sizeof(rconn_t));
+    if (!conn) {
+      perror("reactor:calloc");
+      close(client_fd);
+      proxy->active_connections--;
+      continue;
+    }
+    conn->fd = client_fd;
+    conn->state = RCONN_READ_REQUEST;
+    conn->events = EPOLLIN;
+    conn->reactor = reactor;
+    session_init(&conn->session, proxy, &reactor->queue);
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+      perror("reactor:epoll_ctl");
+      close(client_fd);
+      free(conn);
+      proxy->active_connections--;
+      continue;
+    }
+
+    conn->next = reactor->connections;
+    if (reactor->connections) {
+      reactor->connections->prev = conn;
+    }
+    reactor->connections = conn;
+
+    session_idle_push(&conn->session);
+  }
+}
+
+static void reactor_process_pending(reactor_t *reactor) {
+  uint64_t counter;
+  metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+  if (read(reactor->queue.event_fd, &counter, sizeof(counter)) < 0 &&
+      errno != EAGAIN) {
+    perror("reactor:eventfd read");
+  }
+
+  session_queue_process(&reactor->queue, session_advance);
+}
+
+// stops accepting and closes connections which wait for request, see
+// session_queue_drain()
+static void reactor_start_drain(reactor_t *reactor) {
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL) <
+      0) {
+    perror("epoll_ctl del listen");
+  }
+
+  session_queue_drain(&reactor->queue, session_advance, session_close_conn);
+}
+
+static void *reactor_routine(void *arg) {
+  reactor_t *reactor = (reactor_t *)arg;
+  proxy_t *proxy = reactor->proxy;
+  struct epoll_event events[EVENTS_BATCH];
+  int is_draining = 0;
+  time_t drain_deadline = 0;
+
+  for (;;) {
+    if (!proxy->running && !is_draining) {
+      is_draining = 1;
+      drain_deadline = session_monotonic_seconds() + proxy->drain_timeout;
+      reactor_start_drain(reactor);
+    }
+    // connections left after deadline are closed by reactor_destroy()
+    if (is_draining &&
+        (!reactor->connections || proxy->is_forced ||
+         session_monotonic_seconds() >= drain_deadline)) {
+      break;
+    }
+
+    int n = epoll_wait(reactor->epoll_fd, events, EVENTS_BATCH,
+                       WAIT_TIMEOUT_MS);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("reactor:epoll_wait");
+      break;
+    }
+
+    // pending connections are processed after the whole batch, otherwise
+    // connection closed there could still have its events in the batch
+    int has_pending = 0;
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &reactor->listen_fd) {
+        if (!is_draining) {
+          reactor_accept(reactor);
+        }
+        continue;
+      }
+      if (ptr == &reactor->queue.event_fd) {
+        has_pending = 1;
+        continue;
+      }
+
+      rconn_t *conn = (rconn_t *)ptr;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(conn);
+        continue;
+      }
+      conn_advance(conn);
+    }
+
+    if (has_pending) {
+      reactor_process_pending(reactor);
+    }
+
+    session_queue_expire(&reactor->queue, session_close_conn);
+  }
+
+  return NULL;
+}
+
+// is_shared tells that other reactors wait on listen_fd too
+static int reactor_init(reactor_t *reactor, proxy_t *proxy, int listen_fd,
+                        int is_shared) {
+  reactor->proxy = proxy;
+  reactor->listen_fd = listen_fd;
+  reactor->connections = NULL;
+
+  reactor->epoll_fd = epoll_create1(0);
+  if (reactor->epoll_fd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  int event_fd = eventfd(0, EFD_NONBLOCK);
+  if (event_fd < 0) {
+    perror("eventfd");
+    close(reactor->epoll_fd);
+    return -1;
+  }
+  session_queue_init(&reactor->queue, event_fd);
+
+  // every reactor waits on shared listen socket, EPOLLEXCLUSIVE wakes only
+  // one of them per incoming connection
+  struct epoll_event ev = {0};
+  ev.events = is_shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+  ev.data.ptr = &reactor->listen_fd;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+    perror("epoll_ctl listen");
+    session_queue_destroy(&reactor->queue);
+    close(reactor->epoll_fd);
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &reactor->queue.event_fd;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) < 0) {
+    perror("epoll_ctl eventfd");
+    session_queue_destroy(&reactor->queue);
+    close(reactor->epoll_fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+// closes every connection left in reactor, reactor thread must be finished
+static void reactor_destroy(reactor_t *reactor) {
+  while (reactor->connections) {
+    conn_close(reactor->connections);
+  }
+
+  session_queue_destroy(&reactor->queue);
+  close(reactor->epoll_fd);
+}
+
+// pins thread to idx-th of CPUs process is allowed to run on
+static void pin_to_cpu(pthread_t thread, size_t idx) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    perror("sched_getaffinity");
+    return;
+  }
+
+  size_t cpus = CPU_COUNT(&allowed);
+  if (!cpus) {
+    return;
+  }
+  idx %= cpus;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || idx--) {
+      continue;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err) {
+      fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+    }
+    return;
+  }
+}
+
+void reactor_run(proxy_t *proxy, const int *listen_fds,
+                 size_t listen_fds_amount) {
+  int is_sharded = proxy && proxy->engine == PROXY_ENGINE_SHARDED;
+  if (!proxy || !listen_fds || !listen_fds_amount ||
+      (is_sharded && listen_fds_amount < proxy->workers_amount)) {
+    errno = EINVAL;
+    return;
+  }
+
+  for (size_t i = 0; i < listen_fds_amount; i++) {
+    int flags = fcntl(listen_fds[i], F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+      perror("fcntl");
+      return;
+    }
+  }
+
+  reactor_t *reactors = calloc(proxy->workers_amount, sizeof(reactor_t));
+  if (!reactors) {
+    perror("reactor_run:calloc");
+    return;
+  }
+
+  size_t started = 0;
+  for (; started < proxy->workers_amount; started++) {
+    reactor_t *reactor = &reactors[started];
+    int listen_fd = is_sharded ? listen_fds[started] : listen_fds[0];
+    if (reactor_init(reactor, proxy, listen_fd, !is_sharded) < 0) {
+      break;
+    }
+    if (pthread_create(&reactor->thread, NULL, reactor_routine, reactor)) {
+      perror("pthread_create");
+      reactor_destroy(reactor);
+      break;
+    }
+    if (is_sharded) {
+      pin_to_cpu(reactor->thread, started);
+    }
+  }
+
+  // kernel keeps sending connections to listener of missing shard, nobody
+  // would accept them
+  if (is_sharded && started < proxy->workers_amount) {
+    fprintf(stderr, "reactor_run: only %zu of %zu shards started\n", started,
+            proxy->workers_amount);
+    proxy->running = 0;
+  } else if (started) {
+    printf("%s engine started with %zu reactors\n",
+           is_sharded ? "Sharded" : "Epoll", started);
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(reactors[i].thread, NULL);
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    reactor_destroy(&reactors[i]);
+  }
+
+  free(reactors);
+}
@@ -0,0 +1,846 @@
+#include "resolver.h"
+#include "hash.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// power of two
+#define RESOLVER_BUCKETS_AMOUNT 256
+// expired answers are swept when cache grows that large
+#define RESOLVER_MAX_ENTRIES 4096
+#define MAX_HOST_NAME 256
+#define DNS_PORT 53
+#define DNS_MAX_PACKET 512
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_RD 0x0100
+#define DNS_FLAG_TC 0x0200
+#define DNS_RCODE_NXDOMAIN 3
+#define QUERY_TIMEOUT_MS 1000
+#define QUERY_ATTEMPTS 2
+#define MAX_TTL 86400
+// NXDOMAIN or empty answer without SOA record
+#define NEGATIVE_TTL 30
+// timeouts and server failures are cached briefly, so dead nameserver costs
+// one timeout per host instead of one per cache miss
+#define FAILURE_TTL 5
+
+/* ===== utility functions ===== */
+
+static time_t monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+// buckets_amount is power of two, hash_bytes() mixes all bits
+static size_t host_hash(const char *host, size_t buckets_amount) {
+  return hash_bytes(host, strlen(host)) & (buckets_amount - 1);
+}
+
+// lowercases host into key, host names are case insensitive. returns -1 if
+// host is too long
+static int host_key(const char *host, char *key) {
+  size_t size = strlen(host);
+  if (!size || size >= MAX_HOST_NAME) {
+    return -1;
+  }
+  for (size_t i = 0; i <= size; i++) {
+    key[i] = (char)tolower((unsigned char)host[i]);
+  }
+  return 0;
+}
+
+// resolver->lock must be held
+static resolver_entry_t *entry_find(resolver_t *resolver, const char *key) {
+  resolver_entry_t *entry =
+      resolver->buckets[host_hash(key, resolver->buckets_amount)];
+  while (entry && strcmp(entry->host, key)) {
+    entry = entry->next;
+  }
+  return entry;
+}
+
+// removes expired answers. resolver->lock must be held
+static void sweep_expired(resolver_t *resolver, time_t now) {
+  for (size_t i = 0; i < resolver->buckets_amount; i++) {
+    resolver_entry_t **curr = &resolver->buckets[i];
+    while (*curr) {
+      resolver_entry_t *entry = *curr;
+      if (entry->state == RESOLVER_PENDING || !entry->expires_at ||
+          entry->expires_at > now) {
+        curr = &entry->next;
+        continue;
+      }
+      *curr = entry->next;
+      free(entry->host);
+      free(entry);
+      resolver->entry_amount--;
+    }
+  }
+}
+
+// resolver->lock must be held
+static resolver_entry_t *entry_add(resolver_t *resolver, const char *key) {
+  if (resolver->entry_amount >= RESOLVER_MAX_ENTRIES) {
+    sweep_expired(resolver, monotonic_seconds());
+  }
+
+  resolver_entry_t *entry = calloc(1, sizeof(resolver_entry_t));
+  if (!entry) {
+    return NULL;
+  }
+  entry->host = strdup(key);
+  if (!entry->host) {
+    free(entry);
+    return NULL;
+  }
+
+  size_t idx = host_hash(key, resolver->buckets_amount);
+  entry->next = resolver->buckets[idx];
+  resolver->buckets[idx] = entry;
+  resolver->entry_amount++;
+
+  return entry;
+}
+
+// frees entries with their waiters and bucket table
+static void free_entries(resolver_t *resolver) {
+  for (size_t i = 0; i < resolver->buckets_amount; i++) {
+    resolver_entry_t *entry = resolver->buckets[i];
+    while (entry) {
+      resolver_entry_t *next = entry->next;
+      while (entry->waiters) {
+        resolver_waiter_t *waiter = entry->waiters;
+        entry->waiters = waiter->next;
+        free(waiter);
+      }
+      free(entry->host);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(resolver->buckets);
+}
+
+// parses "IP[:PORT]"
+static int parse_nameserver(const char *str, struct sockaddr_in *addr) {
+  char ip[INET_ADDRSTRLEN];
+  int port = DNS_PORT;
+
+  const char *colon = strchr(str, ':');
+  size_t ip_size = colon ? (size_t)(colon - str) : strlen(str);
+  if (ip_size >= sizeof(ip)) {
+    return -1;
+  }
+  memcpy(ip, str, ip_size);
+  ip[ip_size] = '\0';
+
+  if (colon) {
+    port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) {
+      return -1;
+    }
+  }
+
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+// takes first IPv4 nameserver of /etc/resolv.conf, falls back to localhost
+static void load_resolv_conf(struct sockaddr_in *addr) {
+  parse_nameserver("127.0.0.1", addr);
+
+  FILE *file = fopen("/etc/resolv.conf", "r");
+  if (!file) {
+    return;
+  }
+
+  char line[256];
+  char ip[64];
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, " nameserver %63s", ip) == 1 &&
+        !parse_nameserver(ip, addr)) {
+      break;
+    }
+  }
+
+  fclose(file);
+}
+
+// adds IPv4 names of /etc/hosts as entries that never expire
+static void load_hosts(resolver_t *resolver) {
+  FILE *file = fopen("/etc/hosts", "r");
+  if (!file) {
+    return;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), file)) {
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    char *save;
+    char *token = strtok_r(line, " \t\r\n", &save);
+    struct in_addr addr;
+    if (!token || inet_pton(AF_INET, token, &addr) != 1) {
+      continue;
+    }
+
+    char key[MAX_HOST_NAME];
+    while ((token = strtok_r(NULL, " \t\r\n", &save))) {
+      // the first line with the name wins, like in libc
+      if (host_key(token, key) < 0 || entry_find(resolver, key)) {
+        continue;
+      }
+      resolver_entry_t *entry = entry_add(resolver, key);
+      if (!entry) {
+        break;
+      }
+      entry->state = RESOLVER_RESOLVED;
+      entry->addr = addr;
+      entry->expires_at = 0;
+    }
+  }
+
+  fclose(file);
+}
+
+/* ===== end of utility functions ===== */
+
+/* ===== DNS messages ===== */
+
+static void put_u16(unsigned char *data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value & 0xff;
+}
+
+static uint16_t get_u16(const unsigned char *data) {
+  return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+static uint32_t get_u32(const unsigned char *data) {
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+         (uint32_t)data[2] << 8 | data[3];
+}
+
+// builds A query for host. returns its size or -1 if host isn't valid name
+static ssize_t dns_build_query(unsigned char *packet, uint16_t id,
+                               const char *host) {
+  memset(packet, 0, DNS_HEADER_SIZE);
+  put_u16(packet, id);
+  put_u16(packet + 2, DNS_FLAG_RD);
+  put_u16(packet + 4, 1);
+
+  size_t offset = DNS_HEADER_SIZE;
+  const char *label = host;
+  while (*label) {
+    const char *dot = strchr(label, '.');
+    size_t label_size = dot ? (size_t)(dot - label) : strlen(label);
+    if (!label_size || label_size > 63 ||
+        offset + label_size + 1 + 5 > DNS_MAX_PACKET) {
+      return -1;
+    }
+    packet[offset++] = (unsigned char)label_size;
+    memcpy(packet + offset, label, label_size);
+    offset += label_size;
+    label += label_size;
+    if (*label == '.') {
+      label++;
+    }
+  }
+  packet[offset++] = 0;
+
+  put_u16(packet + offset, DNS_TYPE_A);
+  put_u16(packet + offset + 2, DNS_CLASS_IN);
+  return offset + 4;
+}
+
+// returns offset after (possibly compressed) name or -1 if it's malformed
+static ssize_t dns_skip_name(const unsigned char *packet, size_t size,
+                             size_t offset) {
+  while (offset < size) {
+    unsigned char label_size = packet[offset];
+    if (!label_size) {
+      return offset + 1;
+    }
+    // compression pointer ends the name
+    if ((label_size & 0xc0) == 0xc0) {
+      return offset + 2 <= size ? (ssize_t)(offset + 2) : -1;
+    }
+    if (label_size & 0xc0) {
+      return -1;
+    }
+    offset += label_size + 1;
+  }
+  return -1;
+}
+
+// extracts first A record of response. *ttl receives how long the answer
+// (positive or negative) may be cached. returns 0 on success, -1 with errno
+// ENOENT if host has no address or EIO if nameserver failed
+static int dns_parse_response(const unsigned char *packet, size_t size,
+                              struct in_addr *addr, uint32_t *ttl) {
+  *ttl = FAILURE_TTL;
+  if (size < DNS_HEADER_SIZE) {
+    errno = EIO;
+    return -1;
+  }
+
+  uint16_t flags = get_u16(packet + 2);
+  uint16_t questions = get_u16(packet + 4);
+  uint16_t answers = get_u16(packet + 6);
+  uint16_t authorities = get_u16(packet + 8);
+  int rcode = flags & 0xf;
+  if (!(flags & DNS_FLAG_QR) || (flags & DNS_FLAG_TC) ||
+      (rcode && rcode != DNS_RCODE_NXDOMAIN)) {
+    errno = EIO;
+    return -1;
+  }
+
+  ssize_t offset = DNS_HEADER_SIZE;
+  for (uint16_t i = 0; i < questions; i++) {
+    offset = dns_skip_name(packet, size, offset);
+    if (offset < 0 || (size_t)offset + 4 > size) {
+      errno = EIO;
+      return -1;
+    }
+    offset += 4;
+  }
+
+  // answer lives as long as the shortest record of CNAME chain
+  uint32_t min_ttl = MAX_TTL;
+  int is_found = 0;
+  for (uint32_t i = 0; i < (uint32_t)answers + authorities; i++) {
+    offset = dns_skip_name(packet, size, offset);
+    if (offset < 0 || (size_t)offset + 10 > size) {
+      errno = EIO;
+      return -1;
+    }
+    uint16_t type = get_u16(packet + offset);
+    uint16_t class = get_u16(packet + offset + 2);
+    uint32_t record_ttl = get_u32(packet + offset + 4);
+    uint16_t data_size = get_u16(packet + offset + 8);
+    offset += 10;
+    if ((size_t)offset + data_size > size) {
+      errno = EIO;
+      return -1;
+    }
+
+    if (i < answers) {
+      if (record_ttl < min_ttl) {
+        min_ttl = record_ttl;
+      }
+      if (!is_found && type == DNS_TYPE_A && class == DNS_CLASS_IN &&
+          data_size == 4) {
+        memcpy(&addr->s_addr, packet + offset, 4);
+        is_found = 1;
+      }
+    } else if (!is_found && type == DNS_TYPE_SOA) {
+      // negative answer is cached for min(SOA ttl, SOA minimum)
+      ssize_t soa = dns_skip_name(packet, size, offset);
+      soa = soa < 0 ? -1 : dns_skip_name(packet, size, soa);
+      if (soa >= 0 && (size_t)soa + 20 <= (size_t)offset + data_size) {
+        uint32_t minimum = get_u32(packet + soa + 16);
+        *ttl = record_ttl < minimum ? record_ttl : minimum;
+        if (*ttl > MAX_TTL) {
+          *ttl = MAX_TTL;
+        }
+        errno = ENOENT;
+        return -1;
+      }
+    }
+
+    offset += data_size;
+  }
+
+  if (!is_found) {
+    *ttl = NEGATIVE_TTL;
+    errno = ENOENT;
+    return -1;
+  }
+
+  *ttl = min_ttl;
+  return 0;
+}
+
+/* ===== end of DNS messages ===== */
+
+/* ===== queries ===== */
+
+// query in flight for PENDING entry. its socket is connected, so datagrams
+// from other peers are dropped
+typedef struct resolver_query {
+  resolver_entry_t *entry;
+  int sock;
+  int attempts;
+  // monotonic time in ms when current attempt times out, 0 before the first
+  uint64_t deadline;
+  unsigned char packet[DNS_MAX_PACKET];
+  size_t size;
+  struct resolver_query *next;
+} resolver_query_t;
+
+static uint64_t monotonic_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// builds query for host of entry. returns NULL with errno ENOENT if host
+// isn't valid name
+static resolver_query_t *query_create(resolver_entry_t *entry) {
+  resolver_query_t *query = malloc(sizeof(resolver_query_t));
+  if (!query) {
+    return NULL;
+  }
+
+  uint16_t id;
+  if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id)) {
+    id = (uint16_t)(rand() ^ (uintptr_t)&id);
+  }
+  ssize_t size = dns_build_query(query->packet, id, entry->host);
+  if (size < 0) {
+    free(query);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  query->entry = entry;
+  query->sock = -1;
+  query->attempts = 0;
+  query->deadline = 0;
+  query->size = size;
+  query->next = NULL;
+  return query;
+}
+
+// sends next attempt of query, socket is opened on the first one. returns
+// -1 if query can't be sent
+static int query_send(resolver_t *resolver, resolver_query_t *query,
+                      uint64_t now) {
+  if (query->sock < 0) {
+    query->sock =
+        socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (query->sock < 0) {
+      perror("resolver:socket");
+      return -1;
+    }
+    if (connect(query->sock, (struct sockaddr *)&resolver->nameserver,
+                sizeof(resolver->nameserver)) < 0) {
+      perror("resolver:connect");
+      return -1;
+    }
+  }
+
+  query->attempts++;
+  query->deadline = now + QUERY_TIMEOUT_MS;
+  return send(query->sock, query->packet, query->size, 0) < 0 ? -1 : 0;
+}
+
+// reads datagrams which came for query. returns 1 once answer is among
+// them, its result is stored like dns_parse_response() does and *error
+// receives errno of failure. returns 0 if query still waits
+static int query_receive(resolver_query_t *query, int *result, int *error,
+                         struct in_addr *addr, uint32_t *ttl) {
+  while (1) {
+    unsigned char response[DNS_MAX_PACKET];
+    ssize_t n = recv(query->sock, response, sizeof(response), 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      // e.g. ECONNREFUSED when nothing listens on nameserver port
+      *result = -1;
+      *error = ETIMEDOUT;
+      *ttl = FAILURE_TTL;
+      return 1;
+    }
+    // late answer to previous attempt has the same id and is fine
+    if (n < DNS_HEADER_SIZE || get_u16(response) != get_u16(query->packet)) {
+      continue;
+    }
+
+    *result = dns_parse_response(response, n, addr, ttl);
+    *error = *result < 0 ? errno : 0;
+    return 1;
+  }
+}
+
+// stores answer of query, which caller has unlinked, in its entry and
+// frees query. waiters of entry are moved to *ready, they are called once
+// resolver->lock is released. resolver->lock must be held
+static void query_finish(resolver_t *resolver, resolver_query_t *query,
+                         int result, int error, struct in_addr addr,
+                         uint32_t ttl, resolver_waiter_t **ready) {
+  resolver_entry_t *entry = query->entry;
+  if (result < 0) {
+    resolver->failures++;
+  }
+
+  entry->state = result < 0 ? RESOLVER_FAILED : RESOLVER_RESOLVED;
+  entry->addr = addr;
+  entry->error = error;
+  // zero TTL answer is still shared with lookups that waited for it
+  entry->expires_at = monotonic_seconds() + (ttl ? ttl : 1);
+
+  resolver_waiter_t **tail = &entry->waiters;
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = *ready;
+  *ready = entry->waiters;
+  entry->waiters = NULL;
+
+  if (query->sock >= 0) {
+    close(query->sock);
+  }
+  free(query);
+}
+
+// unlinks query from queries in flight. resolver->lock must be held
+static void query_unlink(resolver_t *resolver, resolver_query_t *query) {
+  resolver_query_t **curr = &resolver->in_flight;
+  while (*curr != query) {
+    curr = &(*curr)->next;
+  }
+  *curr = query->next;
+}
+
+static void call_waiters(resolver_waiter_t *waiter) {
+  while (waiter) {
+    resolver_waiter_t *next = waiter->next;
+    waiter->callback(waiter->arg);
+    free(waiter);
+    waiter = next;
+  }
+}
+
+// sends queries, retries them on timeout and hands answers to waiters.
+// sockets of queries are polled together with wake_fd
+static void *resolver_routine(void *arg) {
+  resolver_t *resolver = (resolver_t *)arg;
+  struct pollfd *pfds = NULL;
+  resolver_query_t **polled = NULL;
+  size_t capacity = 0;
+  resolver_waiter_t *ready = NULL;
+
+  pthread_mutex_lock(&resolver->lock);
+  while (!resolver->is_stopping) {
+    uint64_t now = monotonic_ms();
+    int timeout = -1;
+    size_t amount = 0;
+
+    // sends due attempts and gives up queries which used all of them
+    resolver_query_t **curr = &resolver->in_flight;
+    while (*curr) {
+      resolver_query_t *query = *curr;
+      if (now >= query->deadline &&
+          (query->attempts == QUERY_ATTEMPTS ||
+           query_send(resolver, query, now) < 0)) {
+        *curr = query->next;
+        query_finish(resolver, query, -1, ETIMEDOUT, (struct in_addr){0},
+                     FAILURE_TTL, &ready);
+        continue;
+      }
+      int left = (int)(query->deadline - now);
+      if (timeout < 0 || left < timeout) {
+        timeout = left;
+      }
+      amount++;
+      curr = &query->next;
+    }
+
+    if (amount + 1 > capacity) {
+      size_t new_capacity = (amount + 1) * 2;
+      struct pollfd *new_pfds =
+          realloc(pfds, new_capacity * sizeof(struct pollfd));
+      if (new_pfds) {
+        pfds = new_pfds;
+      }
+      resolver_query_t **new_polled =
+          realloc(polled, new_capacity * sizeof(resolver_query_t *));
+      if (new_polled) {
+        polled = new_polled;
+      }
+      if (new_pfds && new_polled) {
+        capacity = new_capacity;
+      } else {
+        perror("resolver:realloc");
+      }
+    }
+
+    // without memory queries are left to time out
+    size_t polled_amount = 0;
+    if (capacity) {
+      pfds[0].fd = resolver->wake_fd;
+      pfds[0].events = POLLIN;
+      for (resolver_query_t *query = resolver->in_flight;
+           query && polled_amount + 1 < capacity; query = query->next) {
+        polled_amount++;
+        pfds[polled_amount].fd = query->sock;
+        pfds[polled_amount].events = POLLIN;
+        polled[polled_amount] = query;
+      }
+    }
+    pthread_mutex_unlock(&resolver->lock);
+
+    call_waiters(ready);
+    ready = NULL;
+
+    if (capacity) {
+      poll(pfds, polled_amount + 1, timeout);
+      if (pfds[0].revents & POLLIN) {
+        uint64_t value;
+        if (read(resolver->wake_fd, &value, sizeof(value)) < 0 &&
+            errno != EAGAIN) {
+          perror("resolver:eventfd read");
+        }
+      }
+    } else {
+      poll(NULL, 0, timeout < 0 || timeout > QUERY_TIMEOUT_MS
+                        ? QUERY_TIMEOUT_MS
+                        : timeout);
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    // queries leave the list only here, so polled ones are still there
+    for (size_t i = 1; i <= polled_amount; i++) {
+      if (!pfds[i].revents) {
+        continue;
+      }
+      resolver_query_t *query = polled[i];
+      int result;
+      int error;
+      struct in_addr addr = {0};
+      uint32_t ttl;
+      if (query_receive(query, &result, &error, &addr, &ttl)) {
+        query_unlink(resolver, query);
+        query_finish(resolver, query, result, error, addr, ttl, &ready);
+      }
+    }
+  }
+  pthread_mutex_unlock(&resolver->lock);
+
+  call_waiters(ready);
+  free(pfds);
+  free(polled);
+  return NULL;
+}
+
+/* ===== end of queries ===== */
+
+resolver_t *resolver_create(const char *nameserver) {
+  resolver_t *resolver = malloc(sizeof(resolver_t));
+  if (!resolver) {
+    return NULL;
+  }
+
+  if (nameserver) {
+    if (parse_nameserver(nameserver, &resolver->nameserver) < 0) {
+      free(resolver);
+      errno = EINVAL;
+      return NULL;
+    }
+  } else {
+    load_resolv_conf(&resolver->nameserver);
+  }
+
+  resolver->buckets_amount = RESOLVER_BUCKETS_AMOUNT;
+  resolver->buckets =
+      calloc(resolver->buckets_amount, sizeof(resolver_entry_t *));
+  if (!resolver->buckets) {
+    free(resolver);
+    return NULL;
+  }
+  resolver->entry_amount = 0;
+
+  resolver->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (resolver->wake_fd < 0) {
+    perror("eventfd");
+    free(resolver->buckets);
+    free(resolver);
+    return NULL;
+  }
+
+  pthread_mutex_init(&resolver->lock, NULL);
+  resolver->in_flight = NULL;
+  resolver->is_stopping = 0;
+
+  resolver->hits = 0;
+  resolver->queries = 0;
+  resolver->coalesced = 0;
+  resolver->failures = 0;
+
+  load_hosts(resolver);
+
+  if (pthread_create(&resolver->thread, NULL, resolver_routine, resolver)) {
+    perror("pthread_create");
+    free_entries(resolver);
+    close(resolver->wake_fd);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver);
+    return NULL;
+  }
+
+  return resolver;
+}
+
+void resolver_destroy(resolver_t *resolver) {
+  if (!resolver) {
+    errno = EINVAL;
+    return;
+  }
+
+  pthread_mutex_lock(&resolver->lock);
+  resolver->is_stopping = 1;
+  pthread_mutex_unlock(&resolver->lock);
+  uint64_t value = 1;
+  if (write(resolver->wake_fd, &value, sizeof(value)) < 0) {
+    perror("resolver:eventfd write");
+  }
+  pthread_join(resolver->thread, NULL);
+
+  resolver_query_t *query = resolver->in_flight;
+  while (query) {
+    resolver_query_t *next = query->next;
+    if (query->sock >= 0) {
+      close(query->sock);
+    }
+    free(query);
+    query = next;
+  }
+
+  free_entries(resolver);
+  close(resolver->wake_fd);
+  pthread_mutex_destroy(&resolver->lock);
+
+  free(resolver);
+}
+
+int resolver_lookup(resolver_t *resolver, const char *host,
+                    struct in_addr *addr, resolver_callback_t callback,
+                    void *arg) {
+  if (!resolver || !host || !addr) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (inet_pton(AF_INET, host, addr) == 1) {
+    return 0;
+  }
+
+  char key[MAX_HOST_NAME];
+  if (host_key(host, key) < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  pthread_mutex_lock(&resolver->lock);
+
+  resolver_entry_t *entry = entry_find(resolver, key);
+  if (entry && entry->state != RESOLVER_PENDING &&
+      (!entry->expires_at || entry->expires_at > monotonic_seconds())) {
+    int result = entry->state == RESOLVER_RESOLVED ? 0 : -1;
+    int error = entry->error;
+    *addr = entry->addr;
+    pthread_mutex_unlock(&resolver->lock);
+    resolver->hits++;
+    errno = error;
+    return result;
+  }
+
+  int is_sent = 0;
+  if (entry && entry->state == RESOLVER_PENDING) {
+    resolver->coalesced++;
+  } else {
+    if (!entry) {
+      entry = entry_add(resolver, key);
+      if (!entry) {
+        pthread_mutex_unlock(&resolver->lock);
+        return -1;
+      }
+    }
+    resolver_query_t *query = query_create(entry);
+    if (!query) {
+      // new entry mustn't stay PENDING without query
+      int error = errno;
+      entry->state = RESOLVER_FAILED;
+      entry->error = error;
+      entry->expires_at =
+          monotonic_seconds() + (error == ENOENT ? NEGATIVE_TTL : FAILURE_TTL);
+      pthread_mutex_unlock(&resolver->lock);
+      resolver->failures++;
+      errno = error;
+      return -1;
+    }
+    // pending entry is never swept, so it stays valid while query is in
+    // flight
+    entry->state = RESOLVER_PENDING;
+    query->next = resolver->in_flight;
+    resolver->in_flight = query;
+    resolver->queries++;
+    is_sent = 1;
+  }
+
+  int is_waiting = 1;
+  if (callback) {
+    resolver_waiter_t *waiter = malloc(sizeof(resolver_waiter_t));
+    if (waiter) {
+      waiter->callback = callback;
+      waiter->arg = arg;
+      waiter->next = entry->waiters;
+      entry->waiters = waiter;
+    } else {
+      is_waiting = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&resolver->lock);
+
+  if (is_sent) {
+    uint64_t value = 1;
+    if (write(resolver->wake_fd, &value, sizeof(value)) < 0) {
+      perror("resolver:eventfd write");
+    }
+  }
+
+  errno = is_waiting ? EINPROGRESS : ENOMEM;
+  return -1;
+}
+
+void resolver_get_stats(resolver_t *resolver, resolver_stats_t *stats) {
+  if (!resolver || !stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  stats->hits = atomic_load(&resolver->hits);
+  stats->queries = atomic_load(&resolver->queries);
+  stats->coalesced = atomic_load(&resolver->coalesced);
+  stats->failures = atomic_load(&resolver->failures);
+
+  pthread_mutex_lock(&resolver->lock);
+  stats->entries = resolver->entry_amount;
+  pthread_mutex_unlock(&resolver->lock);
+}
@@ -0,0 +1,333 @@
+#include "session.h"
+#include "access_log.h"
+#include "loader.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* ===== utility functions ===== */
+
+static session_t *waiter_session(cache_waiter_t *waiter) {
+  return (session_t *)((char *)waiter - offsetof(session_t, waiter));
+}
+
+// writes access log record of request, if it's not logged yet. request
+// which failed to parse is logged without url
+static void session_log(session_t *session, int status, size_t bytes) {
+  int is_parsed = session->request_start != 0;
+  access_log_write(is_parsed ? session->request.url.data : NULL,
+                   session->request.url.size, status, bytes,
+                   is_parsed ? session->request_start : metrics_now());
+  session->request_start = 0;
+}
+
+static void session_drop_range(session_t *session) {
+  if (session->range) {
+    range_response_destroy(session->range);
+    free(session->range);
+    session->range = NULL;
+  }
+}
+
+// called by loader under entry->lock: queues session and wakes reactor
+static void session_notify(cache_waiter_t *waiter) {
+  session_t *session = waiter_session(waiter);
+  session_queue_t *queue = session->queue;
+
+  pthread_mutex_lock(&queue->lock);
+  if (!session->is_pending) {
+    session->is_pending = 1;
+    session->pending_next = queue->pending;
+    queue->pending = session;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  uint64_t one = 1;
+  if (write(queue->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("session:eventfd write");
+  }
+}
+
+static void session_unwatch(session_t *session) {
+  if (!session->is_watching) {
+    return;
+  }
+
+  pthread_mutex_lock(&session->entry->lock);
+  cache_entry_unwatch(session->entry, &session->waiter);
+  pthread_mutex_unlock(&session->entry->lock);
+  session->is_watching = 0;
+}
+
+static void session_idle_remove(session_t *session) {
+  session_queue_t *queue = session->queue;
+
+  if (!session->is_idle) {
+    return;
+  }
+  session->is_idle = 0;
+
+  if (session->idle_prev) {
+    session->idle_prev->idle_next = session->idle_next;
+  } else {
+    queue->idle_head = session->idle_next;
+  }
+  if (session->idle_next) {
+    session->idle_next->idle_prev = session->idle_prev;
+  } else {
+    queue->idle_tail = session->idle_prev;
+  }
+}
+
+/* ===== end of utility functions ===== */
+
+void session_init(session_t *session, proxy_t *proxy,
+                  session_queue_t *queue) {
+  memset(session, 0, sizeof(session_t));
+  session->proxy = proxy;
+  session->queue = queue;
+  http_request_init(&session->request);
+}
+
+const char *session_start(session_t *session) {
+  proxy_t *proxy = session->proxy;
+  http_request_t *request = &session->request;
+
+  session_idle_remove(session);
+
+  session->request_start = metrics_now();
+  metrics_add(METRIC_REQUESTS, 1);
+  metrics_record_duration(METRIC_PHASE_PARSE, session->parse_ns);
+
+  // only GET supported
+  if (!http_slice_equals(request->method, "GET")) {
+    return "HTTP/1.0 405 Method Not Allowed\r\n\r\n";
+  }
+
+  session->served++;
+  session->keep_alive = session->served < proxy->max_requests &&
+                        http_request_keep_alive(request);
+
+  uint64_t lookup_start = metrics_now();
+  // equivalent urls share one entry
+  char key[MAX_URL + 1];
+  ssize_t key_size =
+      http_normalize_url(request->url.data, request->url.size, key,
+                         sizeof(key));
+  session->entry =
+      key_size < 0 ? NULL : cache_acquire(proxy->cache, key, key_size);
+  if (!session->entry) {
+    return "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+  }
+  if (http_request_no_cache(request)) {
+    session->entry = cache_revalidate(proxy->cache, session->entry);
+  }
+  cache_entry_join(session->entry, &session->reader);
+
+  if (loader_ensure(proxy->loader, session->entry) < 0) {
+    // loader queue is full
+    if (errno == EBUSY) {
+      return "HTTP/1.0 503 Service Unavailable\r\n\r\n";
+    }
+    return "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+  }
+  metrics_record(METRIC_PHASE_LOOKUP, lookup_start);
+
+  // Range is served only from cached entries, loading one is sent whole
+  if (request->range.data) {
+    session->range = malloc(sizeof(range_response_t));
+    if (!session->range) {
+      return "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+    }
+    int result = range_response_init(session->range, session->entry, request);
+    if (result <= 0) {
+      free(session->range);
+      session->range = NULL;
+    }
+    if (result < 0) {
+      return "HTTP/1.0 500 Internal Server Error\r\n\r\n";
+    }
+  }
+
+  session->sent = 0;
+  session->send_start = metrics_now();
+  return NULL;
+}
+
+void session_fail(session_t *session, const char *error_message) {
+  metrics_add(METRIC_ERRORS, 1);
+  session_log(session, atoi(error_message + strlen("HTTP/1.0 ")),
+              strlen(error_message));
+  session->error_message = error_message;
+  session->sent = 0;
+}
+
+void session_finish(session_t *session) {
+  metrics_record(METRIC_PHASE_SEND, session->send_start);
+  session_log(session, session_status(session), session->sent);
+}
+
+int session_next(session_t *session) {
+  // close-delimited response can be ended only by closing connection.
+  // draining proxy doesn't wait for next requests
+  if (!session->keep_alive || !session->entry->is_persistent ||
+      !session->proxy->running) {
+    return 0;
+  }
+
+  session_unwatch(session);
+  session_destroy(session);
+
+  session->buffer_used -= session->request.size;
+  memmove(session->buffer, session->buffer + session->request.size,
+          session->buffer_used);
+  http_request_init(&session->request);
+  session->parse_ns = 0;
+
+  if (session->queue) {
+    session_idle_push(session);
+  }
+  return 1;
+}
+
+void session_close(session_t *session) {
+  // response is cut short
+  if (session->request_start) {
+    session_log(session, session_status(session), session->sent);
+  }
+
+  if (!session->queue) {
+    return;
+  }
+
+  session_idle_remove(session);
+
+  // after unwatch no loader can queue session again
+  session_unwatch(session);
+
+  session_queue_t *queue = session->queue;
+  pthread_mutex_lock(&queue->lock);
+  if (session->is_pending) {
+    session_t **curr = &queue->pending;
+    while (*curr != session) {
+      curr = &(*curr)->pending_next;
+    }
+    *curr = session->pending_next;
+    session->is_pending = 0;
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void session_destroy(session_t *session) {
+  session_drop_range(session);
+  if (session->entry) {
+    cache_entry_leave(session->entry, &session->reader);
+    cache_release(session->proxy->cache, session->entry);
+    session->entry = NULL;
+  }
+}
+
+int session_status(const session_t *session) {
+  if (session->range) {
+    return session->range->status;
+  }
+  return session->entry ? cache_entry_status(session->entry) : 0;
+}
+
+time_t session_monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+void session_watch(session_t *session) {
+  cache_entry_t *entry = session->entry;
+
+  pthread_mutex_lock(&entry->lock);
+  if (entry->state == LOADING || entry->state == REQUIRED) {
+    session->waiter.notify = session_notify;
+    cache_entry_watch(entry, &session->waiter);
+    session->is_watching = 1;
+  }
+  pthread_mutex_unlock(&entry->lock);
+}
+
+void session_idle_push(session_t *session) {
+  session_queue_t *queue = session->queue;
+
+  session->idle_since = session_monotonic_seconds();
+  session->is_idle = 1;
+  session->idle_next = NULL;
+  session->idle_prev = queue->idle_tail;
+  if (queue->idle_tail) {
+    queue->idle_tail->idle_next = session;
+  } else {
+    queue->idle_head = session;
+  }
+  queue->idle_tail = session;
+}
+
+void session_queue_init(session_queue_t *queue, int event_fd) {
+  queue->event_fd = event_fd;
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->pending = NULL;
+  queue->idle_head = NULL;
+  queue->idle_tail = NULL;
+}
+
+void session_queue_destroy(session_queue_t *queue) {
+  close(queue->event_fd);
+  pthread_mutex_destroy(&queue->lock);
+}
+
+void session_queue_process(session_queue_t *queue, session_fn_t advance) {
+  pthread_mutex_lock(&queue->lock);
+  session_t *pending = queue->pending;
+  queue->pending = NULL;
+  pthread_mutex_unlock(&queue->lock);
+
+  // session stays marked till it's advanced: loader queuing it again
+  // earlier would relink pending_next and cut the rest of the batch off
+  while (pending) {
+    pthread_mutex_lock(&queue->lock);
+    session_t *next = pending->pending_next;
+    pending->is_pending = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    advance(pending);
+    pending = next;
+  }
+}
+
+void session_queue_expire(session_queue_t *queue, session_fn_t close_session) {
+  time_t now = session_monotonic_seconds();
+
+  while (queue->idle_head &&
+         now - queue->idle_head->idle_since >=
+             queue->idle_head->proxy->idle_timeout) {
+    close_session(queue->idle_head);
+  }
+}
+
+void session_queue_drain(session_queue_t *queue, session_fn_t advance,
+                         session_fn_t close_session) {
+  session_t *session = queue->idle_head;
+  while (session) {
+    session_t *next = session->idle_next;
+    advance(session);
+    session = next;
+  }
+
+  session = queue->idle_head;
+  while (session) {
+    session_t *next = session->idle_next;
+    if (!session->buffer_used) {
+      close_session(session);
+    }
+    session = next;
+  }
+}
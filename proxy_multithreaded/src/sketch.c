@@ -0,0 +1,152 @@
+#include "sketch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+// counters every key is counted in
+#define SKETCH_DEPTH 4
+#define COUNTER_MAX 15
+// counters per key of capacity, keeps collisions rare enough
+#define COUNTERS_PER_KEY 4
+// sketch is aged after that many increments per key of capacity
+#define SAMPLE_FACTOR 10
+// clears the bit shifted into every counter from its neighbour on halving
+#define HALVE_MASK 0x7777777777777777ULL
+
+static const uint64_t seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127ULL,
+    0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL,
+    0xcbf29ce484222325ULL,
+};
+
+/* ===== utility functions ===== */
+
+// splitmix64 finalizer, spreads seeded hash over all bits
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// picks word and counter in it for key in row. low bits choose word, top
+// four bits choose counter
+static _Atomic uint64_t *locate(sketch_t *sketch, size_t hash, size_t row,
+                                unsigned *shift) {
+  uint64_t h = mix((uint64_t)hash + seeds[row]);
+  *shift = (unsigned)(h >> 60) * 4;
+  return &sketch->table[h & sketch->table_mask];
+}
+
+// halves all counters. only one thread ages sketch, others keep counting
+// meanwhile
+static void sketch_reset(sketch_t *sketch) {
+  int expected = 0;
+  if (!atomic_compare_exchange_strong(&sketch->is_resetting, &expected, 1)) {
+    return;
+  }
+
+  for (size_t i = 0; i <= sketch->table_mask; i++) {
+    uint64_t word = atomic_load_explicit(&sketch->table[i],
+                                         memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &sketch->table[i], &word, (word >> 1) & HALVE_MASK,
+        memory_order_relaxed, memory_order_relaxed)) {
+    }
+  }
+  atomic_store(&sketch->additions, 0);
+  atomic_store(&sketch->is_resetting, 0);
+}
+
+/* ===== end of utility functions ===== */
+
+sketch_t *sketch_create(size_t capacity) {
+  if (!capacity) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sketch_t *sketch = malloc(sizeof(sketch_t));
+  if (!sketch) {
+    return NULL;
+  }
+
+  // 16 counters per word, table size is power of two
+  size_t words = 1;
+  while (words * 16 < capacity * COUNTERS_PER_KEY) {
+    words <<= 1;
+  }
+
+  sketch->table = calloc(words, sizeof(uint64_t));
+  if (!sketch->table) {
+    free(sketch);
+    return NULL;
+  }
+  sketch->table_mask = words - 1;
+  sketch->sample_size = capacity * SAMPLE_FACTOR;
+  atomic_init(&sketch->additions, 0);
+  atomic_init(&sketch->is_resetting, 0);
+
+  return sketch;
+}
+
+void sketch_destroy(sketch_t *sketch) {
+  if (!sketch) {
+    return;
+  }
+
+  free(sketch->table);
+  free(sketch);
+}
+
+void sketch_increment(sketch_t *sketch, size_t hash) {
+  if (!sketch) {
+    return;
+  }
+
+  int is_added = 0;
+  for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+    unsigned shift;
+    _Atomic uint64_t *word = locate(sketch, hash, row, &shift);
+    uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+    while (((value >> shift) & COUNTER_MAX) < COUNTER_MAX) {
+      if (atomic_compare_exchange_weak_explicit(word, &value,
+                                                value + (1ULL << shift),
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        is_added = 1;
+        break;
+      }
+    }
+  }
+
+  // saturated keys don't advance aging
+  if (is_added &&
+      atomic_fetch_add_explicit(&sketch->additions, 1, memory_order_relaxed) +
+              1 >=
+          sketch->sample_size) {
+    sketch_reset(sketch);
+  }
+}
+
+unsigned sketch_frequency(sketch_t *sketch, size_t hash) {
+  if (!sketch) {
+    return 0;
+  }
+
+  unsigned frequency = COUNTER_MAX;
+  for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+    unsigned shift;
+    _Atomic uint64_t *word = locate(sketch, hash, row, &shift);
+    unsigned counter =
+        (atomic_load_explicit(word, memory_order_relaxed) >> shift) &
+        COUNTER_MAX;
+    if (counter < frequency) {
+      frequency = counter;
+    }
+  }
+  return frequency;
+}
@@ -0,0 +1,378 @@
+#include "upstream.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// power of two
+#define UPSTREAM_BUCKETS_AMOUNT 256
+// origin that doesn't answer that long is treated as failed
+#define UPSTREAM_IO_TIMEOUT 30
+#define UPSTREAM_CONNECT_TIMEOUT_MS 5000
+// idle connections of all origins are checked that often
+#define UPSTREAM_SWEEP_INTERVAL 1
+
+/* ===== utility functions ===== */
+
+// buckets_amount is power of two, hash_bytes() mixes all bits of the host
+static size_t origin_hash(const char *host, int port, size_t buckets_amount) {
+  return (hash_bytes(host, strlen(host)) + (size_t)port) &
+         (buckets_amount - 1);
+}
+
+// returns origin for host:port or NULL if it has no idle connections.
+// pool->lock must be held
+static upstream_origin_t *origin_find(upstream_pool_t *pool, const char *host,
+                                      int port) {
+  upstream_origin_t *origin =
+      pool->buckets[origin_hash(host, port, pool->buckets_amount)];
+  while (origin && (origin->port != port || strcmp(origin->host, host))) {
+    origin = origin->next;
+  }
+  return origin;
+}
+
+// returns origin for host:port, creates it if needed. pool->lock must be held
+static upstream_origin_t *origin_get(upstream_pool_t *pool, const char *host,
+                                     int port) {
+  upstream_origin_t *origin = origin_find(pool, host, port);
+  if (origin) {
+    return origin;
+  }
+
+  size_t idx = origin_hash(host, port, pool->buckets_amount);
+  origin = calloc(1, sizeof(upstream_origin_t));
+  if (!origin) {
+    return NULL;
+  }
+  origin->host = strdup(host);
+  if (!origin->host) {
+    free(origin);
+    return NULL;
+  }
+  origin->port = port;
+  origin->next = pool->buckets[idx];
+  pool->buckets[idx] = origin;
+
+  return origin;
+}
+
+// idle connection is alive if origin neither closed it nor sent anything
+static int is_alive(int fd) {
+  char byte;
+  ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// removes connections idle longer than timeout. pool->lock must be held
+static void origin_expire(upstream_pool_t *pool, upstream_origin_t *origin,
+                          time_t now) {
+  upstream_idle_t **curr = &origin->idle;
+  while (*curr) {
+    upstream_idle_t *idle = *curr;
+    if (now - idle->idle_since < pool->idle_timeout) {
+      curr = &idle->next;
+      continue;
+    }
+
+    *curr = idle->next;
+    close(idle->fd);
+    free(idle);
+    origin->idle_amount--;
+    pool->idle_amount--;
+    pool->expired++;
+  }
+}
+
+// expires idle connections of every origin and frees origins left without
+// any, so hosts which aren't requested anymore don't keep memory.
+// pool->lock must be held
+static void pool_expire(upstream_pool_t *pool, time_t now) {
+  for (size_t i = 0; i < pool->buckets_amount; i++) {
+    upstream_origin_t **curr = &pool->buckets[i];
+    while (*curr) {
+      upstream_origin_t *origin = *curr;
+      origin_expire(pool, origin, now);
+      if (origin->idle) {
+        curr = &origin->next;
+        continue;
+      }
+      *curr = origin->next;
+      free(origin->host);
+      free(origin);
+    }
+  }
+}
+
+static void *sweeper_routine(void *arg) {
+  upstream_pool_t *pool = (upstream_pool_t *)arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->is_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += UPSTREAM_SWEEP_INTERVAL;
+    pthread_cond_timedwait(&pool->stopped, &pool->lock, &deadline);
+    pool_expire(pool, time(NULL));
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+// connects without blocking longer than UPSTREAM_CONNECT_TIMEOUT_MS, so
+// origin which drops SYNs doesn't hold loader for kernel retries.
+// returns 0 on success, -1 with errno set
+static int connect_timed(int sock, const struct sockaddr_in *addr) {
+  int flags = fcntl(sock, F_GETFL);
+  if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return -1;
+  }
+
+  if (connect(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    if (errno != EINPROGRESS) {
+      return -1;
+    }
+    struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+    int ready;
+    while ((ready = poll(&pfd, 1, UPSTREAM_CONNECT_TIMEOUT_MS)) < 0 &&
+           errno == EINTR) {
+    }
+    if (ready <= 0) {
+      errno = ready ? errno : ETIMEDOUT;
+      return -1;
+    }
+    int error;
+    socklen_t error_size = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_size) < 0) {
+      return -1;
+    }
+    if (error) {
+      errno = error;
+      return -1;
+    }
+  }
+
+  return fcntl(sock, F_SETFL, flags);
+}
+
+static int connect_to_server(const struct in_addr *host_addr, int port) {
+  struct sockaddr_in addr = {0};
+  addr.sin_addr = *host_addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  if (connect_timed(sock, &addr) < 0) {
+    perror("connect");
+    close(sock);
+    return -1;
+  }
+
+  struct timeval timeout = {.tv_sec = UPSTREAM_IO_TIMEOUT, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  return sock;
+}
+
+/* ===== end of utility functions ===== */
+
+upstream_pool_t *upstream_pool_create(size_t max_idle_per_origin,
+                                      int idle_timeout) {
+  if (idle_timeout < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  upstream_pool_t *pool = malloc(sizeof(upstream_pool_t));
+  if (!pool) {
+    return NULL;
+  }
+
+  pool->buckets_amount = UPSTREAM_BUCKETS_AMOUNT;
+  pool->buckets = calloc(pool->buckets_amount, sizeof(upstream_origin_t *));
+  if (!pool->buckets) {
+    free(pool);
+    return NULL;
+  }
+
+  if (pthread_mutex_init(&pool->lock, NULL)) {
+    free(pool->buckets);
+    free(pool);
+    return NULL;
+  }
+  pthread_cond_init(&pool->stopped, NULL);
+
+  pool->max_idle_per_origin = max_idle_per_origin;
+  pool->idle_timeout = idle_timeout;
+  pool->connects = 0;
+  pool->reuses = 0;
+  pool->expired = 0;
+  pool->idle_amount = 0;
+  pool->is_stopping = 0;
+
+  if (pthread_create(&pool->sweeper, NULL, sweeper_routine, pool)) {
+    perror("pthread_create");
+    pthread_cond_destroy(&pool->stopped);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->buckets);
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void upstream_pool_destroy(upstream_pool_t *pool) {
+  if (!pool) {
+    errno = EINVAL;
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->is_stopping = 1;
+  pthread_cond_signal(&pool->stopped);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_join(pool->sweeper, NULL);
+
+  for (size_t i = 0; i < pool->buckets_amount; i++) {
+    upstream_origin_t *origin = pool->buckets[i];
+    while (origin) {
+      upstream_origin_t *next_origin = origin->next;
+
+      upstream_idle_t *idle = origin->idle;
+      while (idle) {
+        upstream_idle_t *next = idle->next;
+        close(idle->fd);
+        free(idle);
+        idle = next;
+      }
+
+      free(origin->host);
+      free(origin);
+      origin = next_origin;
+    }
+  }
+  free(pool->buckets);
+
+  pthread_cond_destroy(&pool->stopped);
+  pthread_mutex_destroy(&pool->lock);
+
+  free(pool);
+}
+
+int upstream_connect(upstream_pool_t *pool, const char *host, int port,
+                     const struct in_addr *addr, int allow_reuse,
+                     int *is_reused) {
+  if (!pool || !host || !addr || !is_reused) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *is_reused = 0;
+
+  while (allow_reuse) {
+    pthread_mutex_lock(&pool->lock);
+
+    upstream_origin_t *origin = origin_find(pool, host, port);
+    if (!origin) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    origin_expire(pool, origin, time(NULL));
+
+    upstream_idle_t *idle = origin->idle;
+    if (!idle) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    origin->idle = idle->next;
+    origin->idle_amount--;
+    pool->idle_amount--;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    int fd = idle->fd;
+    free(idle);
+
+    // origin could close connection while it was idle
+    if (!is_alive(fd)) {
+      close(fd);
+      pool->expired++;
+      continue;
+    }
+
+    pool->reuses++;
+    *is_reused = 1;
+    return fd;
+  }
+
+  int fd = connect_to_server(addr, port);
+  if (fd >= 0) {
+    pool->connects++;
+  }
+  return fd;
+}
+
+void upstream_release(upstream_pool_t *pool, const char *host, int port,
+                      int fd) {
+  if (!pool || !host || fd < 0) {
+    errno = EINVAL;
+    return;
+  }
+
+  upstream_idle_t *idle = malloc(sizeof(upstream_idle_t));
+  if (!idle) {
+    close(fd);
+    return;
+  }
+  idle->fd = fd;
+  idle->idle_since = time(NULL);
+
+  pthread_mutex_lock(&pool->lock);
+
+  upstream_origin_t *origin = origin_get(pool, host, port);
+  // stale connections give their places to fresh one
+  if (origin) {
+    origin_expire(pool, origin, idle->idle_since);
+  }
+  if (!origin || origin->idle_amount >= pool->max_idle_per_origin) {
+    pthread_mutex_unlock(&pool->lock);
+    close(fd);
+    free(idle);
+    return;
+  }
+
+  idle->next = origin->idle;
+  origin->idle = idle;
+  origin->idle_amount++;
+  pool->idle_amount++;
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void upstream_get_stats(upstream_pool_t *pool, upstream_stats_t *stats) {
+  if (!pool || !stats) {
+    errno = EINVAL;
+    return;
+  }
+
+  stats->connects = atomic_load(&pool->connects);
+  stats->reuses = atomic_load(&pool->reuses);
+  stats->expired = atomic_load(&pool->expired);
+  stats->idle = atomic_load(&pool->idle_amount);
+}
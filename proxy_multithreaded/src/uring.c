@@ -0,0 +1,258 @@
+#include "uring.h"
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* ===== utility functions ===== */
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned amount) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, amount);
+}
+
+static unsigned load_acquire(unsigned *p) {
+  return atomic_load_explicit((_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void store_release(unsigned *p, unsigned value) {
+  atomic_store_explicit((_Atomic unsigned *)p, value, memory_order_release);
+}
+
+static void unmap(uring_t *ring) {
+  if (ring->sqes && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+      ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+}
+
+/* ===== end of utility functions ===== */
+
+int uring_init(uring_t *ring, unsigned entries) {
+  memset(ring, 0, sizeof(uring_t));
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // completion queue holds 4 entries per slot, multishot operations post
+  // many completions per submission
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  ring->fd = sys_setup(entries, &params);
+  if (ring->fd == -1) {
+    return -1;
+  }
+  ring->features = params.features;
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // with single mmap both rings share one mapping
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    goto fail;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring =
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      goto fail;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail_shared = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_tail = *ring->sq_tail_shared;
+
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return 0;
+
+fail:;
+  int saved_errno = errno;
+  unmap(ring);
+  close(ring->fd);
+  errno = saved_errno;
+  return -1;
+}
+
+void uring_destroy(uring_t *ring) {
+  unmap(ring);
+  close(ring->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  unsigned head = load_acquire(ring->sq_head);
+  if (ring->sq_tail - head >= ring->sq_entries) {
+    if (uring_submit(ring, 0) == -1) {
+      return NULL;
+    }
+    head = load_acquire(ring->sq_head);
+    if (ring->sq_tail - head >= ring->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+
+  unsigned index = ring->sq_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[index] = index;
+  ring->sq_tail++;
+  return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_amount) {
+  // entries kernel didn't consume on interrupted call are passed again
+  store_release(ring->sq_tail_shared, ring->sq_tail);
+  unsigned submitted = ring->sq_tail - load_acquire(ring->sq_head);
+  if (!submitted && !wait_amount) {
+    return 0;
+  }
+
+  unsigned flags = wait_amount ? IORING_ENTER_GETEVENTS : 0;
+  int result;
+  do {
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    result = sys_enter(ring->fd, submitted, wait_amount, flags);
+  } while (result == -1 && errno == EINTR && !wait_amount);
+  return result;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == load_acquire(ring->cq_tail)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+  store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int uring_buffers_init(uring_t *ring, uring_buffers_t *buffers,
+                       uint16_t group, unsigned entries, size_t buffer_size) {
+  memset(buffers, 0, sizeof(uring_buffers_t));
+  if (!entries || (entries & (entries - 1)) || entries > 32768) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  buffers->ring_size = entries * sizeof(struct io_uring_buf);
+  buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers->ring == MAP_FAILED) {
+    buffers->ring = NULL;
+    return -1;
+  }
+
+  buffers->data = malloc(entries * buffer_size);
+  if (!buffers->data) {
+    munmap(buffers->ring, buffers->ring_size);
+    buffers->ring = NULL;
+    return -1;
+  }
+  buffers->buffer_size = buffer_size;
+  buffers->entries = entries;
+  buffers->group = group;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buffers->ring;
+  reg.ring_entries = entries;
+  reg.bgid = group;
+  if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    int saved_errno = errno;
+    free(buffers->data);
+    munmap(buffers->ring, buffers->ring_size);
+    buffers->ring = NULL;
+    buffers->data = NULL;
+    errno = saved_errno;
+    return -1;
+  }
+
+  for (unsigned id = 0; id < entries; id++) {
+    uring_buffer_recycle(buffers, id);
+  }
+  return 0;
+}
+
+void uring_buffers_destroy(uring_t *ring, uring_buffers_t *buffers) {
+  if (!buffers->ring) {
+    return;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = buffers->group;
+  sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  free(buffers->data);
+  munmap(buffers->ring, buffers->ring_size);
+  buffers->ring = NULL;
+  buffers->data = NULL;
+}
+
+char *uring_buffer(uring_buffers_t *buffers, unsigned id) {
+  return buffers->data + (size_t)id * buffers->buffer_size;
+}
+
+void uring_buffer_recycle(uring_buffers_t *buffers, unsigned id) {
+  struct io_uring_buf *buf =
+      &buffers->ring->bufs[buffers->tail & (buffers->entries - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, id);
+  buf->len = (uint32_t)buffers->buffer_size;
+  buf->bid = (uint16_t)id;
+  buffers->tail++;
+  // tail overlays resv field of the first buffer, kernel reads it with
+  // acquire
+  atomic_store_explicit((_Atomic uint16_t *)&buffers->ring->tail,
+                        buffers->tail, memory_order_release);
+}
@@ -0,0 +1,1068 @@
+#include "uring_reactor.h"
+#include "http.h"
+#include "metrics.h"
+#include "range.h"
+#include "session.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/time_types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// submission slots per ring, completion queue is 4 times larger
+#define URING_ENTRIES 1024
+#define WAIT_TIMEOUT_MS 500
+#define REQUEST_BUFFER_SIZE 8192
+// multishot recv keeps receiving while response is sent, till pipelined
+// requests after the current one fill REQUEST_BUFFER_SIZE. the rest of
+// buffer takes data of completions posted before recv is cancelled
+#define REQUEST_BUFFER_CAPACITY (4 * REQUEST_BUFFER_SIZE)
+// bytes of entry passed to one send
+#define SEND_CHUNK_SIZE (1 << 20)
+// provided buffers of every ring multishot recv puts data in
+#define RECV_BUFFERS 256
+#define RECV_BUFFER_SIZE 4096
+#define RECV_BUFFER_GROUP 0
+// memfd data is spliced through pipe of that size, if pipe-max-size allows
+#define PIPE_SIZE (1 << 20)
+
+// operation completion belongs to, kept in low bits of user_data. the rest
+// is connection pointer, NULL for operations of reactor itself
+typedef enum {
+  OP_ACCEPT,
+  OP_EVENT,
+  OP_TIMEOUT,
+  OP_CANCEL,
+  OP_RECV,
+  OP_SEND,
+  OP_SPLICE_IN,
+  OP_SPLICE_OUT,
+} op_t;
+#define OP_MASK 7
+
+_Static_assert(_Alignof(max_align_t) > OP_MASK,
+               "connection pointer has no room for operation");
+
+typedef enum {
+  UCONN_READ_REQUEST,
+  UCONN_SEND_ENTRY,
+  UCONN_SEND_ERROR,
+} uconn_state_t;
+
+typedef struct ureactor ureactor_t;
+
+// client connection of io_uring engine, counterpart of rconn of epoll
+// engine. kernel uses its buffers while operations are in flight, so it's
+// freed only after all of them complete
+typedef struct uconn {
+  int fd;
+  uconn_state_t state;
+  ureactor_t *reactor;
+  // request buffer is allocated on first data, so idle clients stay cheap
+  session_t session;
+  size_t buffer_capacity;
+  // data which didn't fit into request buffer. request being served points
+  // into that buffer, so it grows only once response is finished
+  char *overflow;
+  size_t overflow_size;
+  // operations submitted and not completed yet. multishot recv counts till
+  // its last completion
+  int in_flight;
+  int is_receiving;
+  // multishot recv is cancelled once buffer is full and rearmed after
+  // response
+  int is_recv_cancelled;
+  // operations of current send in flight, two for linked splices
+  int sending;
+  int is_send_failed;
+  // client finished sending
+  int is_eof;
+  int is_closing;
+  // entry data sent by sendmsg in flight
+  cache_span_t span;
+  struct msghdr message;
+  // pipe memfd data is spliced through, bytes left in it by short splice
+  int pipe_fds[2];
+  size_t pipe_size;
+  size_t pipe_pending;
+  // list of all reactor connections
+  struct uconn *prev;
+  struct uconn *next;
+} uconn_t;
+
+struct ureactor {
+  proxy_t *proxy;
+  int listen_fd;
+  uring_t ring;
+  // registered buffers of multishot recv, single-shot recv into request
+  // buffer is used when kernel doesn't support them
+  uring_buffers_t buffers;
+  int has_buffers;
+  int is_multishot_accept;
+  int is_accepting;
+  int is_draining;
+  // connections are only closed once reactor thread is finished
+  int is_stopped;
+  // read of its event_fd is always in flight
+  session_queue_t queue;
+  uint64_t event_value;
+  // wakes reactor to expire idle connections and check drain
+  struct __kernel_timespec timeout;
+  pthread_t thread;
+  uconn_t *connections;
+};
+
+/* ===== utility functions ===== */
+
+static uint64_t op_data(void *ptr, op_t op) {
+  return (uint64_t)(uintptr_t)ptr | op;
+}
+
+// returns submission slot of reactor operation, NULL on error
+static struct io_uring_sqe *reactor_sqe(ureactor_t *reactor, op_t op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+  if (!sqe) {
+    perror("uring_reactor:get_sqe");
+    return NULL;
+  }
+  sqe->user_data = op_data(NULL, op);
+  return sqe;
+}
+
+// returns submission slot of connection operation, NULL on error
+static struct io_uring_sqe *conn_sqe(uconn_t *conn, op_t op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&conn->reactor->ring);
+  if (!sqe) {
+    perror("uring_reactor:get_sqe");
+    return NULL;
+  }
+  sqe->user_data = op_data(conn, op);
+  conn->in_flight++;
+  return sqe;
+}
+
+static uconn_t *session_conn(session_t *session) {
+  return (uconn_t *)((char *)session - offsetof(uconn_t, session));
+}
+
+static int conn_alloc_buffer(uconn_t *conn) {
+  if (conn->session.buffer) {
+    return 0;
+  }
+  conn->session.buffer = malloc(REQUEST_BUFFER_CAPACITY);
+  if (!conn->session.buffer) {
+    return -1;
+  }
+  conn->buffer_capacity = REQUEST_BUFFER_CAPACITY;
+  return 0;
+}
+
+// appends data of multishot recv to request buffer, or to overflow if it
+// doesn't fit. returns -1 if there is no memory for it
+static int conn_store(uconn_t *conn, const char *data, size_t size) {
+  session_t *session = &conn->session;
+
+  if (conn_alloc_buffer(conn) < 0) {
+    return -1;
+  }
+  if (!conn->overflow_size &&
+      session->buffer_used + size <= conn->buffer_capacity) {
+    memcpy(session->buffer + session->buffer_used, data, size);
+    session->buffer_used += size;
+    return 0;
+  }
+
+  char *overflow = realloc(conn->overflow, conn->overflow_size + size);
+  if (!overflow) {
+    return -1;
+  }
+  memcpy(overflow + conn->overflow_size, data, size);
+  conn->overflow = overflow;
+  conn->overflow_size += size;
+  return 0;
+}
+
+// moves overflow into request buffer once nothing points into it. returns
+// -1 if there is no memory for it
+static int conn_merge_overflow(uconn_t *conn) {
+  session_t *session = &conn->session;
+
+  if (!conn->overflow_size) {
+    return 0;
+  }
+
+  size_t size = session->buffer_used + conn->overflow_size;
+  if (size > conn->buffer_capacity) {
+    char *buffer = realloc(session->buffer, size);
+    if (!buffer) {
+      return -1;
+    }
+    session->buffer = buffer;
+    conn->buffer_capacity = size;
+  }
+  memcpy(session->buffer + session->buffer_used, conn->overflow,
+         conn->overflow_size);
+  session->buffer_used = size;
+  free(conn->overflow);
+  conn->overflow = NULL;
+  conn->overflow_size = 0;
+  return 0;
+}
+
+// arms recv of client data: multishot one into provided buffers, or single
+// request buffer read
+static int conn_recv(uconn_t *conn) {
+  ureactor_t *reactor = conn->reactor;
+  session_t *session = &conn->session;
+
+  if (!reactor->has_buffers && conn_alloc_buffer(conn) < 0) {
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe = conn_sqe(conn, OP_RECV);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  if (reactor->has_buffers) {
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = reactor->buffers.group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  } else {
+    sqe->addr = (uint64_t)(uintptr_t)(session->buffer + session->buffer_used);
+    sqe->len = REQUEST_BUFFER_SIZE - session->buffer_used;
+  }
+  conn->is_receiving = 1;
+  conn->is_recv_cancelled = 0;
+  return 0;
+}
+
+// stops multishot recv while response is sent and buffer already holds
+// REQUEST_BUFFER_SIZE of pipelined requests, the rest waits in socket.
+// conn_read_request() arms recv again after response
+static void conn_pause_recv(uconn_t *conn) {
+  if (!conn->is_receiving || conn->is_recv_cancelled ||
+      conn->session.buffer_used < REQUEST_BUFFER_SIZE) {
+    return;
+  }
+
+  struct io_uring_sqe *sqe = conn_sqe(conn, OP_CANCEL);
+  if (!sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = op_data(conn, OP_RECV);
+  conn->is_recv_cancelled = 1;
+}
+
+// submits send of error message or generated part of range response
+static int conn_send_text(uconn_t *conn, const char *text, size_t size) {
+  struct io_uring_sqe *sqe = conn_sqe(conn, OP_SEND);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)text;
+  sqe->len = size;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  conn->sending = 1;
+  return 0;
+}
+
+// submits sendmsg of chunks in conn->span, they stay pinned till it
+// completes
+static int conn_send_span(uconn_t *conn) {
+  struct io_uring_sqe *sqe = conn_sqe(conn, OP_SEND);
+  if (!sqe) {
+    cache_span_release(conn->session.entry, &conn->span);
+    return -1;
+  }
+  memset(&conn->message, 0, sizeof(conn->message));
+  conn->message.msg_iov = conn->span.iov;
+  conn->message.msg_iovlen = conn->span.iov_amount;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->message;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  conn->sending = 1;
+  return 0;
+}
+
+static int conn_open_pipe(uconn_t *conn) {
+  if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+    perror("uring_reactor:pipe2");
+    conn->pipe_fds[0] = -1;
+    return -1;
+  }
+
+  // larger pipe moves more per splice, pipe-max-size may forbid it
+  fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+  int size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+  conn->pipe_size = size > 0 ? (size_t)size : 65536;
+  metrics_add(METRIC_CLIENT_SYSCALLS, 3);
+  return 0;
+}
+
+// submits splice out of pipe to client, prepended with linked splice of
+// memfd region in conn->span into pipe unless pipe still has bytes left by
+// previous short splice. splice out is cancelled if splice in is short
+static int conn_splice(uconn_t *conn) {
+  if (conn->pipe_fds[0] < 0 && conn_open_pipe(conn) < 0) {
+    return -1;
+  }
+
+  size_t size = conn->pipe_pending;
+  if (!size) {
+    size = conn->span.size < conn->pipe_size ? conn->span.size
+                                             : conn->pipe_size;
+    struct io_uring_sqe *sqe = conn_sqe(conn, OP_SPLICE_IN);
+    if (!sqe) {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = conn->pipe_fds[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = conn->span.fd;
+    sqe->splice_off_in = (uint64_t)conn->span.offset;
+    sqe->len = size;
+    conn->sending++;
+  }
+
+  struct io_uring_sqe *sqe = conn_sqe(conn, OP_SPLICE_OUT);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->fd = conn->fd;
+  sqe->off = (uint64_t)-1;
+  sqe->splice_fd_in = conn->pipe_fds[0];
+  sqe->splice_off_in = (uint64_t)-1;
+  sqe->len = size;
+  conn->sending++;
+  return 0;
+}
+
+static void conn_free(uconn_t *conn) {
+  ureactor_t *reactor = conn->reactor;
+
+  session_destroy(&conn->session);
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    reactor->connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+
+  close(conn->fd);
+  metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+  if (conn->pipe_fds[0] >= 0) {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 2);
+  }
+  free(conn->session.buffer);
+  free(conn->overflow);
+  free(conn);
+
+  reactor->proxy->active_connections--;
+}
+
+// finishes connection. it's freed once its operations in flight complete,
+// they are cancelled meanwhile
+static void conn_close(uconn_t *conn) {
+  if (conn->is_closing) {
+    return;
+  }
+  conn->is_closing = 1;
+
+  session_close(&conn->session);
+
+  if (!conn->in_flight) {
+    conn_free(conn);
+    return;
+  }
+
+  // splice runs in kernel worker and can't be cancelled, failing socket
+  // ends it
+  struct io_uring_sqe *sqe = conn->sending ? NULL : conn_sqe(conn, OP_CANCEL);
+  if (!sqe) {
+    shutdown(conn->fd, SHUT_RDWR);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = conn->fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+/* ===== end of utility functions ===== */
+
+/* ===== connection state machine ===== */
+
+// every step drives connection until it has to wait or changes its state
+typedef enum {
+  // connection waits for completion or loader
+  STEP_WAIT,
+  // connection moved to another state, which has to be driven right away
+  STEP_NEXT,
+  // connection is finished and has to be closed
+  STEP_CLOSE,
+} step_t;
+
+static step_t conn_fail(uconn_t *conn, const char *error_message) {
+  session_fail(&conn->session, error_message);
+  conn->state = UCONN_SEND_ERROR;
+  return STEP_NEXT;
+}
+
+static step_t conn_handle_request(uconn_t *conn) {
+  const char *error_message = session_start(&conn->session);
+  if (error_message) {
+    return conn_fail(conn, error_message);
+  }
+
+  conn->state = UCONN_SEND_ENTRY;
+  return STEP_NEXT;
+}
+
+static step_t conn_read_request(uconn_t *conn) {
+  session_t *session = &conn->session;
+
+  // pipelined request could be received together with previous one
+  if (session->buffer_used) {
+    uint64_t parse_start = metrics_now();
+    int parse_result = http_request_parse(&session->request, session->buffer,
+                                          session->buffer_used);
+    session->parse_ns += metrics_now() - parse_start;
+    if (parse_result < 0) {
+      return conn_fail(conn, "HTTP/1.0 400 Bad Request\r\n\r\n");
+    }
+    if (parse_result) {
+      return conn_handle_request(conn);
+    }
+  }
+
+  if (session->buffer_used >= REQUEST_BUFFER_SIZE) {
+    return conn_fail(conn, "HTTP/1.0 400 Bad Request\r\n\r\n");
+  }
+  if (conn->is_eof) {
+    return STEP_CLOSE;
+  }
+  if (!conn->is_receiving && conn_recv(conn) < 0) {
+    return STEP_CLOSE;
+  }
+  return STEP_WAIT;
+}
+
+// finishes response and prepares connection for the next request
+static step_t conn_finish_entry(uconn_t *conn) {
+  session_finish(&conn->session);
+  if (!session_next(&conn->session) || conn_merge_overflow(conn) < 0) {
+    return STEP_CLOSE;
+  }
+
+  conn->state = UCONN_READ_REQUEST;
+  return STEP_NEXT;
+}
+
+// submits next piece of entry or range response while loader may still be
+// appending to entry. completion of send drives connection further
+static step_t conn_send_entry(uconn_t *conn) {
+  session_t *session = &conn->session;
+
+  if (conn->sending) {
+    return STEP_WAIT;
+  }
+  if (conn->is_send_failed) {
+    return STEP_CLOSE;
+  }
+  // bytes left in pipe go before the rest of entry
+  if (conn->pipe_pending) {
+    return conn_splice(conn) < 0 ? STEP_CLOSE : STEP_WAIT;
+  }
+
+  while (1) {
+    size_t offset = session->sent;
+    size_t size = SEND_CHUNK_SIZE;
+    if (session->range) {
+      size_t skip;
+      const range_part_t *part =
+          range_response_locate(session->range, session->sent, &skip);
+      if (!part) {
+        return conn_finish_entry(conn);
+      }
+      if (!part->is_entry) {
+        return conn_send_text(conn, session->range->text + part->offset + skip,
+                              part->size - skip) < 0
+                   ? STEP_CLOSE
+                   : STEP_WAIT;
+      }
+      offset = part->offset + skip;
+      if (part->size - skip < size) {
+        size = part->size - skip;
+      }
+    }
+
+    ssize_t n = cache_entry_span(session->entry, offset, size, &conn->span);
+    if (n < 0 && errno == ENODATA) {
+      // watch before waiting and read again, so append that happened in
+      // between is not missed
+      if (!session->is_watching) {
+        session_watch(session);
+        continue;
+      }
+      return STEP_WAIT;
+    }
+    if (n < 0 && errno == EIO) {
+      // nothing is sent yet, so client still can get proper error
+      if (!session->sent) {
+        return conn_fail(conn, "HTTP/1.0 502 Bad Gateway\r\n\r\n");
+      }
+      return STEP_CLOSE;
+    }
+    if (n < 0) {
+      return STEP_CLOSE;
+    }
+    if (n == 0) {
+      return conn_finish_entry(conn);
+    }
+
+    int result =
+        conn->span.iov_amount ? conn_send_span(conn) : conn_splice(conn);
+    return result < 0 ? STEP_CLOSE : STEP_WAIT;
+  }
+}
+
+static step_t conn_send_error(uconn_t *conn) {
+  session_t *session = &conn->session;
+
+  if (conn->sending) {
+    return STEP_WAIT;
+  }
+
+  size_t size = strlen(session->error_message);
+  if (conn->is_send_failed || session->sent >= size) {
+    return STEP_CLOSE;
+  }
+  if (conn_send_text(conn, session->error_message + session->sent,
+                     size - session->sent) < 0) {
+    return STEP_CLOSE;
+  }
+  return STEP_WAIT;
+}
+
+// drives connection as far as it can go without waiting for completion
+static void conn_advance(uconn_t *conn) {
+  step_t step;
+
+  do {
+    switch (conn->state) {
+    case UCONN_READ_REQUEST:
+      step = conn_read_request(conn);
+      break;
+    case UCONN_SEND_ENTRY:
+      step = conn_send_entry(conn);
+      break;
+    case UCONN_SEND_ERROR:
+      step = conn_send_error(conn);
+      break;
+    default:
+      step = STEP_CLOSE;
+      break;
+    }
+  } while (step == STEP_NEXT);
+
+  if (step == STEP_CLOSE) {
+    conn_close(conn);
+  }
+}
+
+static void session_advance(session_t *session) {
+  conn_advance(session_conn(session));
+}
+
+static void session_close_conn(session_t *session) {
+  conn_close(session_conn(session));
+}
+
+/* ===== end of connection state machine ===== */
+
+/* ===== reactor operations ===== */
+
+static void reactor_arm_accept(ureactor_t *reactor) {
+  struct io_uring_sqe *sqe = reactor_sqe(reactor, OP_ACCEPT);
+  if (!sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = reactor->listen_fd;
+  if (reactor->is_multishot_accept) {
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  }
+  reactor->is_accepting = 1;
+}
+
+static void reactor_arm_event(ureactor_t *reactor) {
+  struct io_uring_sqe *sqe = reactor_sqe(reactor, OP_EVENT);
+  if (!sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = reactor->queue.event_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&reactor->event_value;
+  sqe->len = sizeof(reactor->event_value);
+}
+
+static void reactor_arm_timeout(ureactor_t *reactor) {
+  struct io_uring_sqe *sqe = reactor_sqe(reactor, OP_TIMEOUT);
+  if (!sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&reactor->timeout;
+  sqe->len = 1;
+}
+
+static void reactor_add_client(ureactor_t *reactor, int client_fd) {
+  proxy_t *proxy = reactor->proxy;
+
+  // connection accepted while reactor stops has nobody to serve it
+  if (reactor->is_stopped) {
+    close(client_fd);
+    return;
+  }
+
+  // response goes out in pieces, none of them waits for delayed ACK
+  int one = 1;
+  setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+
+  if (atomic_fetch_add(&proxy->active_connections, 1) >=
+      proxy->connections_limit) {
+    proxy->active_connections--;
+    metrics_add(METRIC_ERRORS, 1);
+    const char *busy = "HTTP/1.0 503 Service Unavailable\r\n\r\n";
+    send(client_fd, busy, strlen(busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_fd);
+    return;
+  }
+
+  uconn_t *conn = calloc(1, sizeof(uconn_t));
+  if (!conn) {
+    perror("uring_reactor:calloc");
+    close(client_fd);
+    proxy->active_connections--;
+    return;
+  }
+  conn->fd = client_fd;
+  conn->state = UCONN_READ_REQUEST;
+  conn->reactor = reactor;
+  conn->pipe_fds[0] = -1;
+  conn->pipe_fds[1] = -1;
+  session_init(&conn->session, proxy, &reactor->queue);
+
+  conn->next = reactor->connections;
+  if (reactor->connections) {
+    reactor->connections->prev = conn;
+  }
+  reactor->connections = conn;
+
+  session_idle_push(&conn->session);
+  if (conn_recv(conn) < 0) {
+    conn_close(conn);
+  }
+}
+
+/* ===== end of reactor operations ===== */
+
+/* ===== completions ===== */
+
+static void reactor_complete_accept(ureactor_t *reactor,
+                                    const struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    reactor->is_accepting = 0;
+  }
+
+  int res = cqe->res;
+  if (res >= 0) {
+    reactor_add_client(reactor, res);
+  } else if (res == -EINVAL && reactor->is_multishot_accept) {
+    // kernel before 5.19 has no multishot accept
+    reactor->is_multishot_accept = 0;
+  } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED &&
+             res != -ECANCELED) {
+    errno = -res;
+    perror("uring_reactor:accept");
+  }
+
+  if (!reactor->is_accepting && !reactor->is_draining) {
+    reactor_arm_accept(reactor);
+  }
+}
+
+static void conn_complete_recv(uconn_t *conn, const struct io_uring_cqe *cqe) {
+  ureactor_t *reactor = conn->reactor;
+  int res = cqe->res;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    conn->is_receiving = 0;
+  }
+
+  // data of multishot recv is in provided buffer, single recv put it right
+  // into request buffer
+  int is_failed = 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0 &&
+        conn_store(conn, uring_buffer(&reactor->buffers, id), res) < 0) {
+      is_failed = 1;
+    }
+    uring_buffer_recycle(&reactor->buffers, id);
+  } else if (res > 0) {
+    conn->session.buffer_used += res;
+  }
+
+  if (res > 0 && !is_failed) {
+    metrics_add(METRIC_CLIENT_BYTES_IN, res);
+  } else if (res == 0) {
+    conn->is_eof = 1;
+  } else if (res == -EINVAL && reactor->has_buffers) {
+    // kernel before 6.0 has no multishot recv
+    reactor->has_buffers = 0;
+  } else if (res < 0 && res != -ENOBUFS && res != -EINTR && res != -EAGAIN &&
+             res != -ECANCELED) {
+    is_failed = 1;
+  }
+
+  if (is_failed) {
+    conn_close(conn);
+    return;
+  }
+  // recv stays armed while response is sent, pipelined requests wait in
+  // buffer till then or till it's full
+  if (conn->state == UCONN_READ_REQUEST) {
+    conn_advance(conn);
+    return;
+  }
+  conn_pause_recv(conn);
+}
+
+static void conn_complete_send(uconn_t *conn, int res) {
+  session_t *session = &conn->session;
+
+  if (conn->span.iov_amount) {
+    cache_span_release(session->entry, &conn->span);
+  }
+  conn->sending = 0;
+
+  if (res > 0) {
+    session->sent += res;
+    metrics_add(METRIC_CLIENT_BYTES_OUT, res);
+    if (conn->state == UCONN_SEND_ENTRY && !session->range) {
+      cache_reader_advance(session->entry, &session->reader, session->sent);
+    }
+  } else if (res != -EINTR && res != -EAGAIN) {
+    conn->is_send_failed = 1;
+  }
+  conn_advance(conn);
+}
+
+static void conn_complete_splice(uconn_t *conn, op_t op, int res) {
+  session_t *session = &conn->session;
+
+  conn->sending--;
+
+  if (op == OP_SPLICE_IN && res > 0) {
+    conn->pipe_pending += res;
+  } else if (op == OP_SPLICE_OUT && res > 0) {
+    conn->pipe_pending -= res;
+    session->sent += res;
+    metrics_add(METRIC_CLIENT_BYTES_OUT, res);
+    if (!session->range) {
+      cache_reader_advance(session->entry, &session->reader, session->sent);
+    }
+  } else if (res != -ECANCELED) {
+    // short splice in cancels splice out, bytes it moved stay in pipe
+    conn->is_send_failed = 1;
+  }
+
+  if (!conn->sending) {
+    conn_advance(conn);
+  }
+}
+
+// completion of connection which is already closed only gives back what
+// operation held
+static void conn_complete_closed(uconn_t *conn, op_t op,
+                                 const struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uring_buffer_recycle(&conn->reactor->buffers,
+                         cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  }
+  if (op == OP_SEND && conn->span.iov_amount) {
+    cache_span_release(conn->session.entry, &conn->span);
+  }
+  // kernel before 5.19 can't cancel by fd
+  if (op == OP_CANCEL && cqe->res < 0 && conn->in_flight) {
+    shutdown(conn->fd, SHUT_RDWR);
+    metrics_add(METRIC_CLIENT_SYSCALLS, 1);
+  }
+
+  if (!conn->in_flight) {
+    conn_free(conn);
+  }
+}
+
+// dispatches completion to its connection or to reactor. returns 1 if
+// loaders queued pending connections
+static int reactor_complete(ureactor_t *reactor,
+                            const struct io_uring_cqe *cqe) {
+  uconn_t *conn =
+      (uconn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+  op_t op = (op_t)(cqe->user_data & OP_MASK);
+
+  if (!conn) {
+    switch (op) {
+    case OP_ACCEPT:
+      reactor_complete_accept(reactor, cqe);
+      return 0;
+    case OP_EVENT:
+      if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        perror("uring_reactor:eventfd read");
+      }
+      reactor_arm_event(reactor);
+      return 1;
+    case OP_TIMEOUT:
+      reactor_arm_timeout(reactor);
+      return 0;
+    default:
+      return 0;
+    }
+  }
+
+  if (op != OP_RECV || !(cqe->flags & IORING_CQE_F_MORE)) {
+    conn->in_flight--;
+  }
+
+  if (conn->is_closing) {
+    conn_complete_closed(conn, op, cqe);
+    return 0;
+  }
+
+  switch (op) {
+  case OP_RECV:
+    conn_complete_recv(conn, cqe);
+    break;
+  case OP_SEND:
+    conn_complete_send(conn, cqe->res);
+    break;
+  case OP_SPLICE_IN:
+  case OP_SPLICE_OUT:
+    conn_complete_splice(conn, op, cqe->res);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+// handles every ready completion. returns 1 if loaders queued pending
+// connections
+static int reactor_reap(ureactor_t *reactor) {
+  int has_pending = 0;
+  struct io_uring_cqe *slot;
+
+  // completion is copied out, handlers may queue submissions which kernel
+  // completes into freed slot
+  while ((slot = uring_peek_cqe(&reactor->ring))) {
+    struct io_uring_cqe cqe = *slot;
+    uring_cqe_seen(&reactor->ring);
+    has_pending |= reactor_complete(reactor, &cqe);
+  }
+  return has_pending;
+}
+
+/* ===== end of completions ===== */
+
+// stops accepting and closes connections which wait for request, see
+// session_queue_drain()
+static void reactor_start_drain(ureactor_t *reactor) {
+  reactor->is_draining = 1;
+  if (reactor->is_accepting) {
+    struct io_uring_sqe *sqe = reactor_sqe(reactor, OP_CANCEL);
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = op_data(NULL, OP_ACCEPT);
+    }
+  }
+
+  session_queue_drain(&reactor->queue, session_advance, session_close_conn);
+}
+
+static void *reactor_routine(void *arg) {
+  ureactor_t *reactor = (ureactor_t *)arg;
+  proxy_t *proxy = reactor->proxy;
+  time_t drain_deadline = 0;
+
+  reactor_arm_accept(reactor);
+  reactor_arm_event(reactor);
+  reactor_arm_timeout(reactor);
+
+  for (;;) {
+    if (!proxy->running && !reactor->is_draining) {
+      drain_deadline = session_monotonic_seconds() + proxy->drain_timeout;
+      reactor_start_drain(reactor);
+    }
+    // connections left after deadline are closed by reactor_destroy()
+    if (reactor->is_draining &&
+        (!reactor->connections || proxy->is_forced ||
+         session_monotonic_seconds() >= drain_deadline)) {
+      break;
+    }
+
+    // submissions queued by previous batch go with the wait. full
+    // completion queue (EBUSY) and kernel short of memory (EAGAIN) are
+    // relieved by reaping what is already completed
+    if (uring_submit(&reactor->ring, 1) < 0 && errno != EINTR &&
+        errno != EBUSY && errno != EAGAIN) {
+      perror("uring_reactor:io_uring_enter");
+      break;
+    }
+
+    // pending connections are processed after the whole batch, otherwise
+    // connection closed there could still have its completions in the batch
+    if (reactor_reap(reactor)) {
+      session_queue_process(&reactor->queue, session_advance);
+    }
+
+    session_queue_expire(&reactor->queue, session_close_conn);
+  }
+
+  return NULL;
+}
+
+static int reactor_init(ureactor_t *reactor, proxy_t *proxy, int listen_fd) {
+  reactor->proxy = proxy;
+  reactor->listen_fd = listen_fd;
+  reactor->is_multishot_accept = 1;
+  reactor->timeout.tv_sec = WAIT_TIMEOUT_MS / 1000;
+  reactor->timeout.tv_nsec = (WAIT_TIMEOUT_MS % 1000) * 1000000L;
+
+  if (uring_init(&reactor->ring, URING_ENTRIES) < 0) {
+    return -1;
+  }
+
+  // read of eventfd waits in ring, so it's left blocking
+  int event_fd = eventfd(0, EFD_CLOEXEC);
+  if (event_fd < 0) {
+    int saved_errno = errno;
+    uring_destroy(&reactor->ring);
+    errno = saved_errno;
+    return -1;
+  }
+
+  // kernel before 5.19 has no provided buffer rings
+  reactor->has_buffers =
+      uring_buffers_init(&reactor->ring, &reactor->buffers, RECV_BUFFER_GROUP,
+                         RECV_BUFFERS, RECV_BUFFER_SIZE) == 0;
+
+  session_queue_init(&reactor->queue, event_fd);
+  return 0;
+}
+
+// closes every connection left in reactor, reactor thread must be finished
+static void reactor_destroy(ureactor_t *reactor) {
+  reactor->is_stopped = 1;
+  reactor->is_draining = 1;
+
+  uconn_t *conn = reactor->connections;
+  while (conn) {
+    uconn_t *next = conn->next;
+    conn_close(conn);
+    conn = next;
+  }
+
+  // kernel still uses buffers of closed connections till their operations
+  // complete
+  while (reactor->connections) {
+    if (uring_submit(&reactor->ring, 1) < 0 && errno != EINTR &&
+        errno != EBUSY && errno != EAGAIN) {
+      perror("uring_reactor:io_uring_enter");
+      break;
+    }
+    reactor_reap(reactor);
+  }
+
+  uring_buffers_destroy(&reactor->ring, &reactor->buffers);
+  uring_destroy(&reactor->ring);
+  session_queue_destroy(&reactor->queue);
+}
+
+int uring_reactor_run(proxy_t *proxy, const int *listen_fds,
+                      size_t listen_fds_amount) {
+  if (!proxy || !listen_fds || !listen_fds_amount) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ureactor_t *reactors = calloc(proxy->workers_amount, sizeof(ureactor_t));
+  if (!reactors) {
+    return -1;
+  }
+
+  size_t started = 0;
+  for (; started < proxy->workers_amount; started++) {
+    ureactor_t *reactor = &reactors[started];
+    if (reactor_init(reactor, proxy, listen_fds[0]) < 0) {
+      // the first ring tells that kernel has no io_uring for us
+      if (!started) {
+        int saved_errno = errno;
+        free(reactors);
+        errno = saved_errno;
+        return -1;
+      }
+      perror("uring_reactor:init");
+      break;
+    }
+    if (pthread_create(&reactor->thread, NULL, reactor_routine, reactor)) {
+      perror("pthread_create");
+      reactor_destroy(reactor);
+      break;
+    }
+  }
+
+  if (started) {
+    printf("Io_uring engine started with %zu rings, %s recv\n", started,
+           reactors[0].has_buffers ? "multishot" : "single-shot");
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(reactors[i].thread, NULL);
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    reactor_destroy(&reactors[i]);
+  }
+
+  free(reactors);
+  return 0;
+}